@@ -12,13 +12,12 @@ namespace NvPipeUnity {
         NvPipeUnity.Encoder encoder;
         public event System.Action<NativeArray<byte>, ulong> onCompressedComplete;
         RenderTexture intermediateRt;
-        FileStream fs;
 
         private void Awake() {
             camera = GetComponent<Camera>();
             intermediateRt = new RenderTexture(500, 500, 24);
             encoder = new NvPipeUnity.Encoder(NvPipeUnity.Codec.H264, NvPipeUnity.Format.RGBA32, NvPipeUnity.Compression.LOSSY, 10.0f, 30, 500, 500);
-            fs = File.OpenWrite("ExampleRawStream.bin");
+            encoder.StartRecording("ExampleRecording.mp4");
         }
 
         private void OnRenderImage(RenderTexture source, RenderTexture destination) {
@@ -30,15 +29,18 @@ namespace NvPipeUnity {
         private void onReadback(AsyncGPUReadbackRequest obj) {
             if (encoder != null) {
                 var output = new NativeArray<byte>(500 * 500 * 4, Allocator.Temp);  //Allocate output buffer. 500 * 500 * 4 is just for safe. most time the encoded size will be much smaller.
-                var encodeLength = encoder.Encode(obj.GetData<byte>(), output);
-                fs.Write(output.ToArray(), 0, (int)encodeLength);
+                encoder.Encode(obj.GetData<byte>(), output);  //Encoded frames are also written to the recording.
             }
         }
 
         private void OnDestroy() {
+            if (encoder != null) {
+                var stats = encoder.GetRecordingStats();
+                Debug.Log("Recorded " + stats.writtenBytes + " bytes via " + stats.backend + ", buffer high-water mark " + stats.highWaterMark + " / " + stats.bufferSize + ", dropped frames " + stats.droppedFrames);
+            }
+            encoder?.StopRecording();
             encoder?.Dispose();
             encoder = null;
-            fs.Close();
         }
     }
 }
\ No newline at end of file
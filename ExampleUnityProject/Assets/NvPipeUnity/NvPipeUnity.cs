@@ -1,4 +1,5 @@
 ﻿using System.Collections.Generic;
+using System.Collections.Concurrent;
 using UnityEngine;
 using System.Runtime.InteropServices;
 using System;
@@ -27,6 +28,21 @@ namespace NvPipeUnity {
                 return ptr;
             }
         }
+
+        /// <summary>
+        /// Forget the texture and drop its native CUDA registrations, before it's destroyed and its GL name reused.
+        /// </summary>
+        public void Release(RenderTexture rt) {
+            IntPtr ptr;
+            if (ptrs.TryGetValue(rt, out ptr)) {
+                ptrs.Remove(rt);
+            } else if (rt.IsCreated()) {
+                ptr = rt.GetNativeTexturePtr();
+            } else {
+                return;
+            }
+            NvPipeUnityInternal.NvPipe_UnregisterTexture((uint)ptr.ToInt32());
+        }
     }
 
     /// <summary>
@@ -74,53 +90,104 @@ namespace NvPipeUnity {
         private static AsyncEncodeScheduler _instance;
 
         public class InternalTask {
+            public AsyncTextureEncoder encoder;
             public int internalTaskIndex;
             public bool isDone;
             public bool isError;
             public string error;
             public NativeArray<byte> encodedData;
+            public IntPtr leasedData;   //Native pool buffer behind encodedData, returned on dispose.
+            public bool isCapture;      //Captured by a render event, counted in the encoder's live captures.
+#if ENABLE_UNITY_COLLECTIONS_CHECKS
+            public AtomicSafetyHandle safetyHandle;
+#endif
         }
 
         private void Update() {
             DoUpdate();
         }
 
+        /// <summary>
+        /// Finished native tasks, reported by the render thread. Only these are queried, instead of polling every undone task.
+        /// </summary>
+        private static ConcurrentQueue<ulong> completedTasks = new ConcurrentQueue<ulong>();
+        private static HashSet<ulong> completedTaskSet = new HashSet<ulong>();
+
+        private static ulong CompletedTaskKey(uint pipe, uint taskIndex) {
+            return ((ulong)pipe << 32) | taskIndex;
+        }
+
+        //Kept in a static field, so the delegate isn't collected while native code holds it.
+        internal static readonly NvPipeUnityInternal.TaskCompletedCallback taskCompletedCallback = OnTaskCompleted;
+
+        [AOT.MonoPInvokeCallback(typeof(NvPipeUnityInternal.TaskCompletedCallback))]
+        private static void OnTaskCompleted(uint pipe, uint taskIndex, IntPtr userData) {
+            completedTasks.Enqueue(CompletedTaskKey(pipe, taskIndex));
+        }
+
         private unsafe static void DoUpdate() {
             var t = NvPipeUnityInternal.NvPipe_GetRenderThreadPollFunc();
             GL.IssuePluginEvent(t, 0);
-            while (undoneTasks.Count > 0) {
-                var undoneIndex = undoneTasks.Peek();
-                var task = tasks[undoneIndex];
-                NvPipeUnityInternal.NvPipe_EncodeTextureAsyncQuery((uint)task.internalTaskIndex, out bool isDone, out bool isError, out IntPtr encodedData, out ulong encodeSize, out IntPtr error);
-                var err = NvPipeUnityInternal.PollError(0);
+
+            completedTaskSet.Clear();
+            while (completedTasks.TryDequeue(out ulong key))
+                completedTaskSet.Add(key);
+
+            //Every encoder completes independently, so check all undone tasks rather than stopping at the first one.
+            for (int i = 0; i < undoneTasks.Count;) {
+                var task = tasks[undoneTasks[i]];
+                if (task.encoder.closed) {
+                    undoneTasks.RemoveAt(i);
+                    task.isDone = true;
+                    task.isError = true;
+                    task.error = "Encoder already disposed!";
+                    continue;
+                }
+                var pipe = task.encoder.encoder;
+                if (!completedTaskSet.Contains(CompletedTaskKey(pipe, (uint)task.internalTaskIndex))) {
+                    i++;
+                    continue;
+                }
+                NvPipeUnityInternal.NvPipe_EncodeTextureAsyncQuery(pipe, (uint)task.internalTaskIndex, out bool isDone, out bool isError, out IntPtr encodedData, out ulong encodeSize, out IntPtr error);
+                var err = NvPipeUnityInternal.PollError(pipe);
                 if (err != null)
                     throw new Exception(err);
                 if (isDone) {
-                    undoneTasks.Dequeue();
+                    undoneTasks.RemoveAt(i);
                     task.isDone = true;
                     try {
                         task.isError = isError;
                         if (isError) {
                             task.error = Marshal.PtrToStringAnsi(error);
                         } else {
-                            task.encodedData = new NativeArray<byte>((int)encodeSize, Allocator.Persistent);
-                            UnsafeUtility.MemCpy(task.encodedData.GetUnsafePtr(), encodedData.ToPointer(), (long)encodeSize);
+                            //Lease the native buffer instead of copying it, it's pooled and right-sized already.
+                            task.leasedData = NvPipeUnityInternal.NvPipe_LeaseEncodedData(pipe, (uint)task.internalTaskIndex, out ulong leasedSize);
+                            err = NvPipeUnityInternal.PollError(pipe);
+                            if (err != null)
+                                throw new Exception(err);
+                            if (task.leasedData != IntPtr.Zero) {   //Dropped by the encoder's overflow policy otherwise.
+                                task.encodedData = NativeArrayUnsafeUtility.ConvertExistingDataToNativeArray<byte>(task.leasedData.ToPointer(), (int)leasedSize, Allocator.None);
+#if ENABLE_UNITY_COLLECTIONS_CHECKS
+                                task.safetyHandle = AtomicSafetyHandle.Create();
+                                NativeArrayUnsafeUtility.SetAtomicSafetyHandle(ref task.encodedData, task.safetyHandle);
+#endif
+                            }
                         }
                     } finally {
                         //Everything is now in managed side. free native things.
-                        NvPipeUnityInternal.NvPipe_EncodeTextureAsyncClearTask((uint)task.internalTaskIndex);
-                        err = NvPipeUnityInternal.PollError(0);
+                        NvPipeUnityInternal.NvPipe_EncodeTextureAsyncClearTask(pipe, (uint)task.internalTaskIndex);
+                        err = NvPipeUnityInternal.PollError(pipe);
                         if (err != null)
                             Debug.LogError(err);
                     }
                 } else {
-                    break;
+                    i++;
                 }
             }
         }
 
         public static int taskCreationIndex;
-        public static Queue<int> undoneTasks = new Queue<int>();
+        public static List<int> undoneTasks = new List<int>();
         public static Dictionary<int, InternalTask> tasks = new Dictionary<int, InternalTask>();
         public static int EnqueueTask(AsyncTextureEncoder encoder, uint texture, uint width, uint height, bool forceIFrame) {
             var internalTaskID = NvPipeUnityInternal.NvPipe_QueueEncodeTaskInMainThread(encoder.encoder, texture, width, height, forceIFrame);
@@ -130,8 +197,42 @@ namespace NvPipeUnity {
             }
 
             var taskIndex = taskCreationIndex++;
-            undoneTasks.Enqueue(taskIndex);
-            tasks[taskIndex] = new InternalTask() { internalTaskIndex = internalTaskID, isError = false, isDone = false };
+            undoneTasks.Add(taskIndex);
+            tasks[taskIndex] = new InternalTask() { encoder = encoder, internalTaskIndex = internalTaskID, isError = false, isDone = false };
+            return taskIndex;
+        }
+
+        /// <summary>
+        /// Event data handed to CommandBuffers. The render thread may run an event frames after it was recorded,
+        /// so slots are reused round robin and the memory is never freed.
+        /// </summary>
+        private const int CaptureEventSlots = 256;
+        private static IntPtr captureEvents;
+        private static int nextCaptureEvent;
+
+        /// <summary>
+        /// Frame ids of captured frames are their native task index, kept apart from the ids of queued tasks which count up from 1.
+        /// </summary>
+        private const uint FirstCaptureFrameId = 0x80000000;
+        private static uint nextCaptureFrameId = FirstCaptureFrameId;
+
+        public unsafe static int EnqueueCapture(AsyncTextureEncoder encoder, CommandBuffer commandBuffer, uint texture, uint width, uint height, bool forceIFrame) {
+            if (captureEvents == IntPtr.Zero)
+                captureEvents = Marshal.AllocHGlobal(sizeof(NvPipeUnityInternal.CaptureEventData) * CaptureEventSlots);
+
+            var frameId = nextCaptureFrameId;
+            nextCaptureFrameId = nextCaptureFrameId == uint.MaxValue ? FirstCaptureFrameId : nextCaptureFrameId + 1;
+
+            var data = (NvPipeUnityInternal.CaptureEventData*)captureEvents + nextCaptureEvent;
+            nextCaptureEvent = (nextCaptureEvent + 1) % CaptureEventSlots;
+            *data = new NvPipeUnityInternal.CaptureEventData() {
+                pipe = encoder.encoder, texture = texture, width = width, height = height, frameId = frameId, forceIFrame = forceIFrame ? 1u : 0u
+            };
+            commandBuffer.IssuePluginEventAndData(NvPipeUnityInternal.NvPipe_GetCaptureTextureEventFunc(), 0, (IntPtr)data);
+
+            var taskIndex = taskCreationIndex++;
+            undoneTasks.Add(taskIndex);
+            tasks[taskIndex] = new InternalTask() { encoder = encoder, internalTaskIndex = unchecked((int)frameId), isError = false, isDone = false, isCapture = true };
             return taskIndex;
         }
 
@@ -159,8 +260,16 @@ namespace NvPipeUnity {
             if (!tasks.ContainsKey(taskID))
                 return;
             var task = tasks[taskID];
-            if (task.encodedData.IsCreated)
-                task.encodedData.Dispose();
+            if (task.isCapture)
+                task.encoder.liveCaptures--;
+            if (task.leasedData != IntPtr.Zero) {
+#if ENABLE_UNITY_COLLECTIONS_CHECKS
+                AtomicSafetyHandle.Release(task.safetyHandle);
+#endif
+                task.encodedData = default;
+                NvPipeUnityInternal.NvPipe_ReleaseEncodedData(task.leasedData);
+                task.leasedData = IntPtr.Zero;
+            }
             tasks.Remove(taskID);
         }
 
@@ -194,6 +303,15 @@ namespace NvPipeUnity {
             }
         }
 
+        /// <summary>
+        /// The frame was dropped by the encoder's overflow policy. The task is done without data.
+        /// </summary>
+        public bool isDropped {
+            get {
+                return isDone && !isError && AsyncEncodeScheduler.TaskData(handleID).Length == 0;
+            }
+        }
+
         /// <summary>
         /// The error info. This is probably exception info thrown from Native Plugin, maybe hard to understand.
         /// </summary>
@@ -246,6 +364,14 @@ namespace NvPipeUnity {
                 throw new NvPipeException(err);
             }
 
+            //The scheduler only queries tasks reported as finished.
+            NvPipeUnityInternal.NvPipe_SetTaskCompletedCallback(encoder, AsyncEncodeScheduler.taskCompletedCallback, IntPtr.Zero);
+            err = NvPipeUnityInternal.PollError(encoder);
+            if (err != null) {
+                NvPipeUnityInternal.NvPipe_Destroy(encoder);
+                throw new NvPipeException(err);
+            }
+
             switch (format) {
                 case Format.RGBA32:
                     pitch = 4;
@@ -269,6 +395,39 @@ namespace NvPipeUnity {
         Format format;
         Compression compression;
         public bool closed { get; private set; }
+        uint maxPendingTasks = 20;
+        internal int liveCaptures;
+        /// <summary>
+        /// How many tasks of this encoder may exist (submitted, not disposed) at once. Default is 20.
+        /// Only possible while the encoder has no tasks.
+        /// </summary>
+        public void SetMaxPendingTasks(uint count) {
+            if (liveCaptures != 0)
+                throw new NvPipeException("Can't change the task count while tasks exist");
+            NvPipeUnityInternal.NvPipe_SetMaxPendingEncodeTasks(encoder, count);
+            var err = NvPipeUnityInternal.PollError(encoder);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+            maxPendingTasks = count;
+        }
+
+        /// <summary>
+        /// Configure how many frames may wait for encoding, and what happens to frames submitted when it's full.
+        /// Dropped frames finish as done tasks without data.
+        /// </summary>
+        public void SetQueue(uint depth, OverflowPolicy policy, uint timeoutMs = 0) {
+            NvPipeUnityInternal.SetAsyncEncoderQueue(encoder, depth, policy, timeoutMs);
+        }
+
+        /// <summary>
+        /// Number of frames accepted and dropped so far.
+        /// </summary>
+        public ulong GetStats(out ulong droppedFrames, out uint waitingFrames) {
+            NvPipeUnityInternal.NvPipe_GetAsyncEncoderStats(encoder, out ulong queuedFrames, out droppedFrames, out waitingFrames);
+            return queuedFrames;
+        }
+
         public unsafe AsyncEncodeTask EncodeOpenGLTexture(int textureID, bool forceIframe) {
             if (closed)
                 throw new System.Exception("Encoder already disposed!");
@@ -284,6 +443,110 @@ namespace NvPipeUnity {
             return new AsyncEncodeTask() { handleID = t };
         }
 
+        /// <summary>
+        /// Records the capture of this frame into a CommandBuffer, e.g. one added to the camera at CameraEvent.AfterEverything.
+        /// The texture is copied when the command buffer executes, in order with rendering and without waiting for the next Update.
+        /// The event captures once: clear and record the command buffer again every frame.
+        /// Don't mix with EncodeOpenGLTexture on the same encoder.
+        /// </summary>
+        public AsyncEncodeTask CaptureInCommandBuffer(CommandBuffer commandBuffer, RenderTexture texture, bool forceIframe) {
+            if (closed)
+                throw new System.Exception("Encoder already disposed!");
+            if (texture.format != RenderTextureFormat.ARGB32)
+                throw new System.Exception("Only ARGB32 is supported for encoding!");
+            if (liveCaptures >= maxPendingTasks)    //The render thread would drop the frame without a task.
+                throw new NvPipeException("Maximum task count reached. Did you forget to dispose captured tasks?");
+            var t = AsyncEncodeScheduler.EnqueueCapture(this, commandBuffer, (uint)ptrRegistery.GetFor(texture).ToInt32(), width, height, forceIframe);
+            liveCaptures++;
+            return new AsyncEncodeTask() { handleID = t };
+        }
+
+        /// <summary>
+        /// Call before destroying a RenderTexture encoded by this encoder, e.g. one returned to a pool, so its native registration is dropped.
+        /// </summary>
+        public void ReleaseTexture(RenderTexture texture) {
+            ptrRegistery.Release(texture);
+        }
+
+        /// <summary>
+        /// How many textures stay registered with CUDA, the least recently used are dropped beyond it. Default is 32.
+        /// </summary>
+        public void SetTextureCacheSize(uint capacity) {
+            NvPipeUnityInternal.NvPipe_SetGraphicsResourceCacheSize(encoder, capacity);
+            var err = NvPipeUnityInternal.PollError(encoder);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+        }
+
+        /// <summary>
+        /// Record the encoded frames into a fragmented MP4 file, starting at the next keyframe.
+        /// Frames are written by a background thread from a buffer of bufferSize bytes (0 for 64 MB), encoding never waits for the disk.
+        /// </summary>
+        public void StartRecording(string path, ulong bufferSize = 0) {
+            NvPipeUnityInternal.NvPipe_StartRecordingWithBuffer(encoder, path, bufferSize);
+            var err = NvPipeUnityInternal.PollError(encoder);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+        }
+
+        /// <summary>
+        /// Finish the current recording. Throws if it had ended early, e.g. on a write failure.
+        /// </summary>
+        public void StopRecording() {
+            NvPipeUnityInternal.NvPipe_StopRecording(encoder);
+            var err = NvPipeUnityInternal.PollError(encoder);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+        }
+
+        /// <summary>
+        /// Buffer usage of the running recording. If the high-water mark nears the buffer size, frames are about to be dropped.
+        /// </summary>
+        public RecordingStats GetRecordingStats() {
+            NvPipeUnityInternal.NvPipe_GetRecordingStats(encoder, out RecordingStats stats);
+            var err = NvPipeUnityInternal.PollError(encoder);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+            return stats;
+        }
+
+        /// <summary>
+        /// Publish the encoded frames into a named shared-memory ring (Linux), read in place by another process through NvPipeSharedRing.h.
+        /// </summary>
+        /// <param name="name">Shared-memory object name, e.g. "/nvpipe-0"</param>
+        /// <param name="capacity">Ring size in bytes, 0 for 16 MB</param>
+        public void StartSharedOutput(string name, ulong capacity = 0) {
+            NvPipeUnityInternal.NvPipe_StartSharedOutput(encoder, name, capacity);
+            var err = NvPipeUnityInternal.PollError(encoder);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+        }
+
+        public void StopSharedOutput() {
+            NvPipeUnityInternal.NvPipe_StopSharedOutput(encoder);
+            var err = NvPipeUnityInternal.PollError(encoder);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+        }
+
+        /// <summary>
+        /// Send the encoded frames to the clients of a stream server, which may also request keyframes from this encoder.
+        /// </summary>
+        /// <param name="server">Server to send to, null to detach</param>
+        public void AttachStreamServer(StreamServer server) {
+            NvPipeUnityInternal.NvPipe_AttachStreamServer(encoder, server != null ? server.Handle : 0);
+            var err = NvPipeUnityInternal.PollError(encoder);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+        }
+
         public void Dispose() {
             if (!closed && this.encoder != 0) {
                 NvPipeUnityInternal.NvPipe_Destroy(this.encoder);
@@ -293,6 +556,189 @@ namespace NvPipeUnity {
         }
     }
 
+    /// <summary>
+    /// Encodes frames from host or device memory on a background thread, e.g. from AsyncGPUReadback callbacks.
+    /// Works with any graphics API, since no texture is accessed.
+    /// </summary>
+    public class AsyncEncoder : IDisposable {
+        public AsyncEncoder(Codec codec, Format format, Compression compression, float bitrateMbps, UInt16 targetfps, UInt16 width, UInt16 height) {
+            this.width = width;
+            this.height = height;
+            encoder = NvPipeUnityInternal.NvPipe_CreateAsyncEncoder(format, codec, compression, (ulong)(bitrateMbps * 1000 * 1000), targetfps, width, height);
+
+            var err = NvPipeUnityInternal.PollError(0);   //Null for creation error.
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+
+            switch (format) {
+                case Format.RGBA32:
+                    pitch = 4;
+                    break;
+                default:
+                    pitch = 1;
+                    break;
+            }
+            pitch *= width;
+        }
+        ulong pitch;
+        UInt16 width, height;
+        uint encoder;
+
+        /// <summary>
+        /// Queue a frame for encoding. The data is copied before returning.
+        /// </summary>
+        /// <returns>task index, pass to Query and Clear</returns>
+        public unsafe int Submit<TIn>(NativeArray<TIn> uncompressedData, bool forceIframe) where TIn : struct {
+            if (this.encoder == 0) {
+                throw new NvPipeException("The encoder is not intialized correctly!");
+            }
+            var task = NvPipeUnityInternal.NvPipe_EncodeAsync(encoder, new IntPtr(uncompressedData.GetUnsafeReadOnlyPtr()), pitch, width, height, forceIframe);
+            var err = NvPipeUnityInternal.PollError(encoder);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+            return task;
+        }
+
+        /// <summary>
+        /// Check whether a task is finished, and copy its result to output if so.
+        /// Throws if the task failed. A dropped frame is done with encodedSize 0.
+        /// </summary>
+        /// <returns>true if the task is done</returns>
+        public unsafe bool Query(int task, NativeArray<byte> output, out ulong encodedSize) {
+            encodedSize = 0;
+            NvPipeUnityInternal.NvPipe_EncodeAsyncQuery(encoder, task, out bool isDone, out bool isError, out IntPtr encodedData, out ulong size, out IntPtr error);
+            var err = NvPipeUnityInternal.PollError(encoder);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+            if (!isDone)
+                return false;
+            if (isError)
+                throw new NvPipeException(Marshal.PtrToStringAnsi(error));
+            if (size > (ulong)output.Length)
+                throw new NvPipeException("Output buffer is too small for the encoded frame");
+            if (size > 0)
+                UnsafeUtility.MemCpy(output.GetUnsafePtr(), encodedData.ToPointer(), (long)size);
+            encodedSize = size;
+            return true;
+        }
+
+        /// <summary>
+        /// Configure how many frames may wait for encoding, and what happens to frames submitted when it's full.
+        /// </summary>
+        public void SetQueue(uint depth, OverflowPolicy policy, uint timeoutMs = 0) {
+            NvPipeUnityInternal.SetAsyncEncoderQueue(encoder, depth, policy, timeoutMs);
+        }
+
+        /// <summary>
+        /// Number of frames accepted and dropped so far.
+        /// </summary>
+        public ulong GetStats(out ulong droppedFrames, out uint waitingFrames) {
+            NvPipeUnityInternal.NvPipe_GetAsyncEncoderStats(encoder, out ulong queuedFrames, out droppedFrames, out waitingFrames);
+            return queuedFrames;
+        }
+
+        /// <summary>
+        /// Set how many threads encode the frames of all async encoders (default 2), e.g. the number of NVENC engines of the GPU.
+        /// Frames of one encoder are always encoded in order.
+        /// </summary>
+        public static void SetWorkerCount(uint count, bool pinToCores = false) {
+            NvPipeUnityInternal.NvPipe_SetEncodeWorkerCount(count, pinToCores);
+            var err = NvPipeUnityInternal.PollError(0);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+        }
+
+        /// <summary>
+        /// Release a finished task.
+        /// </summary>
+        public void Clear(int task) {
+            NvPipeUnityInternal.NvPipe_EncodeAsyncClearTask(encoder, task);
+            var err = NvPipeUnityInternal.PollError(encoder);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+        }
+
+        /// <summary>
+        /// Record the encoded frames into a fragmented MP4 file, starting at the next keyframe.
+        /// Frames are written by a background thread from a buffer of bufferSize bytes (0 for 64 MB), encoding never waits for the disk.
+        /// </summary>
+        public void StartRecording(string path, ulong bufferSize = 0) {
+            NvPipeUnityInternal.NvPipe_StartRecordingWithBuffer(encoder, path, bufferSize);
+            var err = NvPipeUnityInternal.PollError(encoder);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+        }
+
+        /// <summary>
+        /// Finish the current recording. Throws if it had ended early, e.g. on a write failure.
+        /// </summary>
+        public void StopRecording() {
+            NvPipeUnityInternal.NvPipe_StopRecording(encoder);
+            var err = NvPipeUnityInternal.PollError(encoder);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+        }
+
+        /// <summary>
+        /// Buffer usage of the running recording. If the high-water mark nears the buffer size, frames are about to be dropped.
+        /// </summary>
+        public RecordingStats GetRecordingStats() {
+            NvPipeUnityInternal.NvPipe_GetRecordingStats(encoder, out RecordingStats stats);
+            var err = NvPipeUnityInternal.PollError(encoder);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+            return stats;
+        }
+
+        /// <summary>
+        /// Publish the encoded frames into a named shared-memory ring (Linux), read in place by another process through NvPipeSharedRing.h.
+        /// </summary>
+        /// <param name="name">Shared-memory object name, e.g. "/nvpipe-0"</param>
+        /// <param name="capacity">Ring size in bytes, 0 for 16 MB</param>
+        public void StartSharedOutput(string name, ulong capacity = 0) {
+            NvPipeUnityInternal.NvPipe_StartSharedOutput(encoder, name, capacity);
+            var err = NvPipeUnityInternal.PollError(encoder);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+        }
+
+        public void StopSharedOutput() {
+            NvPipeUnityInternal.NvPipe_StopSharedOutput(encoder);
+            var err = NvPipeUnityInternal.PollError(encoder);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+        }
+
+        /// <summary>
+        /// Send the encoded frames to the clients of a stream server, which may also request keyframes from this encoder.
+        /// </summary>
+        /// <param name="server">Server to send to, null to detach</param>
+        public void AttachStreamServer(StreamServer server) {
+            NvPipeUnityInternal.NvPipe_AttachStreamServer(encoder, server != null ? server.Handle : 0);
+            var err = NvPipeUnityInternal.PollError(encoder);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+        }
+
+        public void Dispose() {
+            if (this.encoder != 0) {
+                NvPipeUnityInternal.NvPipe_Destroy(this.encoder);
+                this.encoder = 0;
+            }
+        }
+    }
+
     public class Encoder : IDisposable {
         /// <summary>
         /// Create a encoder.
@@ -361,14 +807,82 @@ namespace NvPipeUnity {
             return result;
         }
 
-        public void Dispose() {
-            if (!closed && this.encoder != 0) {
-                NvPipeUnityInternal.NvPipe_Destroy(this.encoder);
-                this.encoder = 0;
-                closed = true;
-            }
-        }
-    }
+        /// <summary>
+        /// Record the encoded frames into a fragmented MP4 file, starting at the next keyframe.
+        /// Frames are written by a background thread from a buffer of bufferSize bytes (0 for 64 MB), encoding never waits for the disk.
+        /// </summary>
+        public void StartRecording(string path, ulong bufferSize = 0) {
+            NvPipeUnityInternal.NvPipe_StartRecordingWithBuffer(encoder, path, bufferSize);
+            var err = NvPipeUnityInternal.PollError(encoder);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+        }
+
+        /// <summary>
+        /// Finish the current recording. Throws if it had ended early, e.g. on a write failure.
+        /// </summary>
+        public void StopRecording() {
+            NvPipeUnityInternal.NvPipe_StopRecording(encoder);
+            var err = NvPipeUnityInternal.PollError(encoder);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+        }
+
+        /// <summary>
+        /// Buffer usage of the running recording. If the high-water mark nears the buffer size, frames are about to be dropped.
+        /// </summary>
+        public RecordingStats GetRecordingStats() {
+            NvPipeUnityInternal.NvPipe_GetRecordingStats(encoder, out RecordingStats stats);
+            var err = NvPipeUnityInternal.PollError(encoder);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+            return stats;
+        }
+
+        /// <summary>
+        /// Publish the encoded frames into a named shared-memory ring (Linux), read in place by another process through NvPipeSharedRing.h.
+        /// </summary>
+        /// <param name="name">Shared-memory object name, e.g. "/nvpipe-0"</param>
+        /// <param name="capacity">Ring size in bytes, 0 for 16 MB</param>
+        public void StartSharedOutput(string name, ulong capacity = 0) {
+            NvPipeUnityInternal.NvPipe_StartSharedOutput(encoder, name, capacity);
+            var err = NvPipeUnityInternal.PollError(encoder);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+        }
+
+        public void StopSharedOutput() {
+            NvPipeUnityInternal.NvPipe_StopSharedOutput(encoder);
+            var err = NvPipeUnityInternal.PollError(encoder);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+        }
+
+        /// <summary>
+        /// Send the encoded frames to the clients of a stream server, which may also request keyframes from this encoder.
+        /// </summary>
+        /// <param name="server">Server to send to, null to detach</param>
+        public void AttachStreamServer(StreamServer server) {
+            NvPipeUnityInternal.NvPipe_AttachStreamServer(encoder, server != null ? server.Handle : 0);
+            var err = NvPipeUnityInternal.PollError(encoder);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+        }
+
+        public void Dispose() {
+            if (!closed && this.encoder != 0) {
+                NvPipeUnityInternal.NvPipe_Destroy(this.encoder);
+                this.encoder = 0;
+                closed = true;
+            }
+        }
+    }
 
     public class Decoder : IDisposable {
         public Decoder(Codec codec, Format format, UInt16 width, UInt16 height) {
@@ -383,6 +897,35 @@ namespace NvPipeUnity {
                 throw new NvPipeException(err);
             }
 
+            InitPitch();
+        }
+
+        /// <summary>
+        /// Create a decoder that crops and scales in hardware, e.g. for thumbnails.
+        /// Decoded frames are outputWidth x outputHeight, so output arrays only need to be that large.
+        /// </summary>
+        /// <param name="width">stream width</param>
+        /// <param name="height">stream height</param>
+        /// <param name="outputWidth">decoded width, must be even</param>
+        /// <param name="outputHeight">decoded height, must be even</param>
+        /// <param name="crop">area of the stream to decode, in stream pixels. Zero size for the whole frame.</param>
+        public Decoder(Codec codec, Format format, UInt16 width, UInt16 height, UInt16 outputWidth, UInt16 outputHeight, RectInt crop = default(RectInt)) {
+            this.width = outputWidth;
+            this.height = outputHeight;
+            this.codec = codec;
+            this.format = format;
+            decoder = NvPipeUnityInternal.NvPipe_CreateDecoderWithOutput(format, codec, width, height, outputWidth, outputHeight,
+                (uint)crop.xMin, (uint)crop.yMin, (uint)crop.xMax, (uint)crop.yMax);
+
+            var err = NvPipeUnityInternal.PollError(0);   //Null for creation error.
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+
+            InitPitch();
+        }
+
+        void InitPitch() {
             switch (format) {
                 case Format.RGBA32:
                     pitch = 4;
@@ -417,7 +960,8 @@ namespace NvPipeUnity {
             if (this.decoder == 0) {
                 throw new NvPipeException("The decoder is not intialized correctly!");
             }
-            var result = NvPipeUnityInternal.NvPipe_Decode(decoder, new IntPtr(compressedData.GetUnsafePtr()), compressedDataSize, new IntPtr(output.GetUnsafePtr()), width, height);
+            var result = NvPipeUnityInternal.NvPipe_Decode(decoder, new IntPtr(compressedData.GetUnsafePtr()), compressedDataSize, new IntPtr(output.GetUnsafePtr()),
+                (ulong)output.Length * (ulong)UnsafeUtility.SizeOf<TOut>(), width, height);
             var err = NvPipeUnityInternal.PollError(decoder);
             if (err != null) {
                 throw new NvPipeException(err);
@@ -425,6 +969,95 @@ namespace NvPipeUnity {
             return result;
         }
 
+        /// <summary>
+        /// Submit a frame for decoding without waiting for the result.
+        /// Decoded frames are fetched with Poll, in submission order.
+        /// </summary>
+        /// <param name="compressedData">compressed data</param>
+        /// <param name="compressedDataSize">size of compressed data in byte</param>
+        /// <param name="timestamp">returned by Poll along with the decoded frame</param>
+        public unsafe void Submit(NativeArray<byte> compressedData, ulong compressedDataSize, long timestamp) {
+            if (this.decoder == 0) {
+                throw new NvPipeException("The decoder is not intialized correctly!");
+            }
+            NvPipeUnityInternal.NvPipe_DecodeSubmit(decoder, new IntPtr(compressedData.GetUnsafePtr()), compressedDataSize, timestamp);
+            var err = NvPipeUnityInternal.PollError(decoder);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+        }
+
+        /// <summary>
+        /// Submit an arbitrary chunk of the encoded stream, e.g. a single network packet.
+        /// Frames are decoded as soon as they are complete, and fetched with Poll.
+        /// </summary>
+        /// <param name="data">chunk of the encoded stream</param>
+        /// <param name="dataSize">size of the chunk in byte</param>
+        /// <param name="timestamp">returned by Poll along with the frame starting in this chunk</param>
+        /// <param name="endOfPicture">set if the chunk is known to end a frame, so it's decoded without waiting for the next one</param>
+        public unsafe void SubmitPartial(NativeArray<byte> data, ulong dataSize, long timestamp, bool endOfPicture = false) {
+            if (this.decoder == 0) {
+                throw new NvPipeException("The decoder is not intialized correctly!");
+            }
+            NvPipeUnityInternal.NvPipe_DecodeSubmitPartial(decoder, new IntPtr(data.GetUnsafePtr()), dataSize, timestamp, endOfPicture);
+            var err = NvPipeUnityInternal.PollError(decoder);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+        }
+
+        /// <summary>
+        /// Size of the next frame returned by Poll, as found in the stream. Falls back to the current stream size if no frame is waiting.
+        /// </summary>
+        /// <returns>false if the stream's size is not known yet</returns>
+        public bool GetDecodedFrameSize(out uint frameWidth, out uint frameHeight) {
+            return NvPipeUnityInternal.NvPipe_GetDecodedFrameInfo(decoder, out frameWidth, out frameHeight, out uint framePitch);
+        }
+
+        /// <summary>
+        /// Fetch the next decoded frame, if any.
+        /// Frames take their size from the stream, use GetDecodedFrameSize to size output.
+        /// </summary>
+        /// <typeparam name="TOut">What type of output is, e.g. Color32 or byte</typeparam>
+        /// <param name="output">where to put decoded data</param>
+        /// <param name="timestamp">timestamp passed to Submit for this frame</param>
+        /// <returns>true if a frame was written to output</returns>
+        public unsafe bool Poll<TOut>(NativeArray<TOut> output, out long timestamp) where TOut : struct {
+            if (this.decoder == 0) {
+                throw new NvPipeException("The decoder is not intialized correctly!");
+            }
+            // A frame that doesn't fit output stays queued and the error says which size it needs
+            var result = NvPipeUnityInternal.NvPipe_DecodePoll(decoder, new IntPtr(output.GetUnsafePtr()),
+                (ulong)output.Length * (ulong)UnsafeUtility.SizeOf<TOut>(), 0, 0, out timestamp);
+            var err = NvPipeUnityInternal.PollError(decoder);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+            return result != 0;
+        }
+
+        /// <summary>
+        /// Maximum number of decoded frames kept in device memory. Unfetched frames are dropped oldest first when full.
+        /// </summary>
+        public void SetFramePoolSize(uint size) {
+            NvPipeUnityInternal.NvPipe_SetDecoderFramePoolSize(decoder, size);
+            var err = NvPipeUnityInternal.PollError(decoder);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+        }
+
+        /// <summary>
+        /// Device memory held by this decoder.
+        /// </summary>
+        /// <param name="allocatedFrames">number of allocated pool frames</param>
+        /// <param name="droppedFrames">number of frames dropped because the pool was full</param>
+        /// <returns>size in byte</returns>
+        public ulong GetMemoryUsage(out uint allocatedFrames, out uint droppedFrames) {
+            NvPipeUnityInternal.NvPipe_GetDecoderMemoryUsage(decoder, out allocatedFrames, out ulong bytes, out droppedFrames);
+            return bytes;
+        }
+
         public void Dispose() {
             if (this.decoder != 0) {
                 closed = true;
@@ -434,6 +1067,418 @@ namespace NvPipeUnity {
         }
     }
 
+    /// <summary>
+    /// Lists the NAL units of encoded packets without decoding them, e.g. to find keyframes or parameter sets.
+    /// </summary>
+    public static class NalParser {
+        /// <summary>
+        /// Parse an Annex-B packet. Only the first units.Length NAL units are filled.
+        /// </summary>
+        /// <returns>Number of NAL units in the packet, may be more than units.Length</returns>
+        public static unsafe int Parse(Codec codec, NativeArray<byte> packet, int length, NalUnit[] units) {
+            uint count;
+            fixed (NalUnit* ptr = units) {
+                count = NvPipeUnityInternal.NvPipe_ParseNalUnits(codec, (IntPtr)packet.GetUnsafeReadOnlyPtr(), (ulong)length, (IntPtr)ptr, units == null ? 0 : (uint)units.Length);
+            }
+            var err = NvPipeUnityInternal.PollError(0);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+            return (int)count;
+        }
+    }
+
+    public enum SliceType {
+        None,
+        P,
+        B,
+        I,
+        Unknown,
+    }
+
+    [StructLayout(LayoutKind.Sequential)]
+    public struct NalUnit {
+        public ulong offset;        //Including the start code
+        public ulong size;          //Including the start code
+        public uint startCodeSize;
+        public uint type;           //nal_unit_type
+        public uint isKeyframe;     //IDR / IRAP slice
+        public SliceType sliceType;
+    }
+
+    /// <summary>
+    /// Writes encoded frames into a recording container, which RecordingReader can seek without scanning.
+    /// </summary>
+    public class RecordingWriter : IDisposable {
+        public RecordingWriter(string path, Codec codec, uint width, uint height) {
+            writer = NvPipeUnityInternal.NvPipe_CreateStreamWriter(path, codec, width, height);
+            var err = NvPipeUnityInternal.PollError(0);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+        }
+        uint writer;
+
+        /// <summary>
+        /// Append an encoded frame. Keyframes are detected from the frame itself.
+        /// </summary>
+        /// <param name="timestamp">Presentation time, in any unit. Must not decrease.</param>
+        public unsafe void Append(NativeArray<byte> frame, ulong length, long timestamp) {
+            NvPipeUnityInternal.NvPipe_StreamWriterAppend(writer, (IntPtr)frame.GetUnsafeReadOnlyPtr(), length, timestamp);
+            var err = NvPipeUnityInternal.PollError(writer);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+        }
+
+        /// <summary>
+        /// Write the index. Dispose does it as well, but can't report errors.
+        /// </summary>
+        public void Finish() {
+            NvPipeUnityInternal.NvPipe_StreamWriterFinish(writer);
+            var err = NvPipeUnityInternal.PollError(writer);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+        }
+
+        public void Dispose() {
+            if (this.writer != 0) {
+                NvPipeUnityInternal.NvPipe_Destroy(this.writer);
+                this.writer = 0;
+            }
+        }
+    }
+
+    /// <summary>
+    /// Memory maps a recording container. Frames are views into the mapping, pass them to Decoder without copying.
+    /// </summary>
+    public class RecordingReader : IDisposable {
+        public RecordingReader(string path) {
+            reader = NvPipeUnityInternal.NvPipe_CreateStreamReader(path);
+            var err = NvPipeUnityInternal.PollError(0);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+            NvPipeUnityInternal.NvPipe_StreamReaderGetInfo(reader, out info);
+#if ENABLE_UNITY_COLLECTIONS_CHECKS
+            safetyHandle = AtomicSafetyHandle.Create();
+#endif
+        }
+        uint reader;
+        StreamInfo info;
+#if ENABLE_UNITY_COLLECTIONS_CHECKS
+        AtomicSafetyHandle safetyHandle;    //Invalidates frames once the file is unmapped.
+#endif
+
+        public Codec codec { get { return info.codec; } }
+        public uint width { get { return info.width; } }
+        public uint height { get { return info.height; } }
+        public long frameCount { get { return (long)info.frameCount; } }
+        public long keyframeCount { get { return (long)info.keyframeCount; } }
+        /// <summary>
+        /// False if the writer didn't finish, only the frames up to its last keyframe flush are available then.
+        /// </summary>
+        public bool complete { get { return info.complete != 0; } }
+
+        /// <summary>
+        /// Get a frame without copying it. It stays valid until the reader is disposed.
+        /// </summary>
+        public unsafe NativeArray<byte> GetFrame(long index, out long timestamp, out bool isKeyframe) {
+            NvPipeUnityInternal.NvPipe_StreamReaderGetFrame(reader, (ulong)index, out StreamFrame frame);
+            var err = NvPipeUnityInternal.PollError(reader);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+            timestamp = frame.timestamp;
+            isKeyframe = frame.isKeyframe != 0;
+            var data = NativeArrayUnsafeUtility.ConvertExistingDataToNativeArray<byte>(frame.data.ToPointer(), (int)frame.size, Allocator.None);
+#if ENABLE_UNITY_COLLECTIONS_CHECKS
+            NativeArrayUnsafeUtility.SetAtomicSafetyHandle(ref data, safetyHandle);
+#endif
+            return data;
+        }
+
+        /// <summary>
+        /// The last keyframe at or before a frame. Decode from there to show the frame.
+        /// </summary>
+        /// <returns>-1 if no keyframe precedes the frame</returns>
+        public long FindKeyframe(long index) {
+            bool found = NvPipeUnityInternal.NvPipe_StreamReaderFindKeyframe(reader, (ulong)index, out ulong keyframe);
+            var err = NvPipeUnityInternal.PollError(reader);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+            return found ? (long)keyframe : -1;
+        }
+
+        /// <summary>
+        /// The last frame with a timestamp at or before the given one.
+        /// </summary>
+        /// <returns>-1 if all frames are later</returns>
+        public long FindFrame(long timestamp) {
+            bool found = NvPipeUnityInternal.NvPipe_StreamReaderFindFrame(reader, timestamp, out ulong index);
+            var err = NvPipeUnityInternal.PollError(reader);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+            return found ? (long)index : -1;
+        }
+
+        public void Dispose() {
+            if (this.reader != 0) {
+#if ENABLE_UNITY_COLLECTIONS_CHECKS
+                AtomicSafetyHandle.Release(safetyHandle);
+#endif
+                NvPipeUnityInternal.NvPipe_Destroy(this.reader);
+                this.reader = 0;
+            }
+        }
+    }
+
+    /// <summary>
+    /// Splits encoded frames into RTP packets (H.264 RFC 6184 / HEVC RFC 7798) for sending over UDP.
+    /// </summary>
+    public class RtpPacketizer : IDisposable {
+        /// <param name="mtu">Largest packet including the RTP header, e.g. 1200</param>
+        /// <param name="payloadType">Dynamic payload type, 96-127</param>
+        /// <param name="ssrc">0 for a random one</param>
+        public RtpPacketizer(Codec codec, uint mtu, uint payloadType = 96, uint ssrc = 0) {
+            this.mtu = mtu;
+            packetizer = NvPipeUnityInternal.NvPipe_CreateRtpPacketizer(codec, mtu, payloadType, ssrc);
+            var err = NvPipeUnityInternal.PollError(0);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+        }
+        uint packetizer;
+        public uint mtu { get; private set; }
+
+        /// <summary>
+        /// Packetize a frame. Packet i is at i * mtu in packets, its size in packetSizes[i].
+        /// </summary>
+        /// <param name="timestamp">RTP timestamp, 90 kHz clock</param>
+        /// <returns>Number of packets. If that's more than packetSizes.Length, nothing was written; retry with more room.</returns>
+        public unsafe int Packetize(NativeArray<byte> frame, ulong length, uint timestamp, NativeArray<byte> packets, uint[] packetSizes) {
+            if ((ulong)packets.Length < (ulong)packetSizes.Length * mtu) {
+                throw new NvPipeException("Packet buffer must hold packetSizes.Length * mtu bytes");
+            }
+            uint count;
+            fixed (uint* sizes = packetSizes) {
+                count = NvPipeUnityInternal.NvPipe_RtpPacketize(packetizer, (IntPtr)frame.GetUnsafeReadOnlyPtr(), length, timestamp, (IntPtr)packets.GetUnsafePtr(), (IntPtr)sizes, (uint)packetSizes.Length);
+            }
+            var err = NvPipeUnityInternal.PollError(packetizer);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+            return (int)count;
+        }
+
+        public void Dispose() {
+            if (this.packetizer != 0) {
+                NvPipeUnityInternal.NvPipe_Destroy(this.packetizer);
+                this.packetizer = 0;
+            }
+        }
+    }
+
+    /// <summary>
+    /// Reorders received RTP packets and reassembles them into frames for Decoder.Decode, waiting for late packets up to an adaptive playout delay.
+    /// </summary>
+    public class RtpReceiver : IDisposable {
+        /// <param name="payloadType">Payload type of the stream, other packets are ignored</param>
+        /// <param name="minDelayMs">Lower bound of the playout delay</param>
+        /// <param name="maxDelayMs">Upper bound of the playout delay</param>
+        /// <param name="waitForKeyframe">Drop frames after a loss until the next keyframe</param>
+        public RtpReceiver(Codec codec, uint payloadType = 96, uint minDelayMs = 5, uint maxDelayMs = 200, bool waitForKeyframe = true) {
+            receiver = NvPipeUnityInternal.NvPipe_CreateRtpReceiver(codec, payloadType, minDelayMs, maxDelayMs, waitForKeyframe);
+            var err = NvPipeUnityInternal.PollError(0);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+        }
+        uint receiver;
+
+        /// <summary>
+        /// Add a received packet. Thread safe, may be called from a socket thread.
+        /// </summary>
+        /// <param name="arrivalUs">Arrival time in microseconds, on the same clock as Poll</param>
+        public unsafe void Push(byte[] packet, int length, long arrivalUs) {
+            fixed (byte* data = packet) {
+                NvPipeUnityInternal.NvPipe_RtpReceiverPush(receiver, (IntPtr)data, (ulong)length, arrivalUs);
+            }
+            var err = NvPipeUnityInternal.PollError(receiver);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+        }
+
+        /// <summary>
+        /// Take the next complete frame. info reports losses and keyframe requests even if no frame is returned.
+        /// </summary>
+        /// <returns>Size of the frame, 0 if none is ready</returns>
+        public unsafe ulong Poll(long nowUs, NativeArray<byte> frame, out RtpFrameInfo info) {
+            ulong size = NvPipeUnityInternal.NvPipe_RtpReceiverPoll(receiver, nowUs, (IntPtr)frame.GetUnsafePtr(), (ulong)frame.Length, out info);
+            var err = NvPipeUnityInternal.PollError(receiver);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+            return size;
+        }
+
+        public RtpReceiverStats GetStats() {
+            RtpReceiverStats stats;
+            NvPipeUnityInternal.NvPipe_GetRtpReceiverStats(receiver, out stats);
+            var err = NvPipeUnityInternal.PollError(receiver);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+            return stats;
+        }
+
+        public void Dispose() {
+            if (this.receiver != 0) {
+                NvPipeUnityInternal.NvPipe_Destroy(this.receiver);
+                this.receiver = 0;
+            }
+        }
+    }
+
+    /// <summary>
+    /// Serves one encoded stream to many TCP and WebSocket clients, sending each frame without a copy per client.
+    /// Late joiners start at a cached GOP or at a requested keyframe.
+    /// </summary>
+    public class StreamServer : IDisposable {
+        /// <param name="address">Local address to listen on, null for all</param>
+        /// <param name="port">Port to listen on, 0 for any free one (see GetStats)</param>
+        /// <param name="clientBufferSize">Bytes queued per client before it skips ahead to a keyframe, 0 for 8 MB</param>
+        public StreamServer(Codec codec, string address = null, uint port = 0, ulong clientBufferSize = 0) {
+            server = NvPipeUnityInternal.NvPipe_CreateStreamServer(codec, address, port, clientBufferSize);
+            var err = NvPipeUnityInternal.PollError(0);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+        }
+        uint server;
+
+        internal uint Handle {
+            get { return server; }
+        }
+
+        /// <summary>
+        /// Send a frame that wasn't encoded by an attached encoder.
+        /// </summary>
+        public unsafe void Send(NativeArray<byte> frame, ulong size, long timestamp) {
+            NvPipeUnityInternal.NvPipe_StreamServerSend(server, (IntPtr)frame.GetUnsafeReadOnlyPtr(), size, timestamp);
+            var err = NvPipeUnityInternal.PollError(server);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+        }
+
+        /// <summary>
+        /// True if the next frame given to Send should be a keyframe. Requests of several clients are coalesced into one.
+        /// </summary>
+        public bool TakeKeyframeRequest() {
+            bool request = NvPipeUnityInternal.NvPipe_StreamServerTakeKeyframeRequest(server);
+            var err = NvPipeUnityInternal.PollError(server);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+            return request;
+        }
+
+        public StreamServerStats GetStats() {
+            StreamServerStats stats;
+            NvPipeUnityInternal.NvPipe_GetStreamServerStats(server, out stats);
+            var err = NvPipeUnityInternal.PollError(server);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+            return stats;
+        }
+
+        public void Dispose() {
+            if (this.server != 0) {
+                NvPipeUnityInternal.NvPipe_Destroy(this.server);
+                this.server = 0;
+            }
+        }
+    }
+
+    [StructLayout(LayoutKind.Sequential)]
+    public struct RtpFrameInfo {
+        public ulong size;              //Also set if the frame didn't fit
+        public uint timestamp;
+        public uint isKeyframe;
+        public uint lostPackets;        //Since the previous poll
+        public uint droppedFrames;
+        public uint requestKeyframe;    //Ask the sender for a keyframe, e.g. via RTCP PLI
+    }
+
+    [StructLayout(LayoutKind.Sequential)]
+    public struct RtpReceiverStats {
+        public ulong receivedPackets;
+        public ulong lostPackets;
+        public ulong latePackets;
+        public ulong invalidPackets;
+        public ulong completeFrames;
+        public ulong droppedFrames;
+        public ulong keyframeRequests;
+        public uint jitterUs;
+        public uint playoutDelayUs;
+        public uint waitingForKeyframe;
+    }
+
+    [StructLayout(LayoutKind.Sequential)]
+    public struct StreamServerStats {
+        public uint port;
+        public uint clients;
+        public ulong sentFrames;
+        public ulong sentBytes;
+        public ulong droppedFrames;     //Skipped for clients that fell behind
+        public ulong keyframeRequests;
+        public ulong forcedKeyframes;   //After coalescing
+        public ulong cachedJoins;       //Clients started at the cached GOP
+    }
+
+    public enum RecordingBackend {
+        PWrite,
+        IoUring,
+    }
+
+    [StructLayout(LayoutKind.Sequential)]
+    public struct RecordingStats {
+        public ulong bufferSize;
+        public ulong queuedBytes;       //Not written yet
+        public ulong highWaterMark;     //Most bytes queued at once
+        public ulong writtenBytes;
+        public ulong droppedFrames;     //Didn't fit into the buffer
+        public RecordingBackend backend;
+        public uint active;
+    }
+
+    [StructLayout(LayoutKind.Sequential)]
+    public struct StreamInfo {
+        public Codec codec;
+        public uint width;
+        public uint height;
+        public uint complete;
+        public ulong frameCount;
+        public ulong keyframeCount;
+        public long firstTimestamp;
+        public long lastTimestamp;
+    }
+
+    [StructLayout(LayoutKind.Sequential)]
+    public struct StreamFrame {
+        public IntPtr data;         //Into the file mapping
+        public ulong size;
+        public long timestamp;
+        public ulong index;
+        public uint isKeyframe;
+    }
+
     public class NvPipeException : System.Exception {
         public NvPipeException(string msg) : base(msg) {
 
@@ -445,6 +1490,14 @@ namespace NvPipeUnity {
         HEVC,
     }
 
+    public enum OverflowPolicy {
+        Fail,
+        DropOldest,
+        DropNewest,
+        Block,
+        Coalesce,
+    }
+
     public enum Format {
         RGBA32,
         UINT4,
@@ -468,12 +1521,44 @@ namespace NvPipeUnity {
         [DllImport("NvPipe")]
         public static extern void NvPipe_ResetEncodeTasks();
 
+        [DllImport("NvPipe")]
+        public static extern void NvPipe_SetMaxPendingEncodeTasks(uint nvp, uint count);
+
         [DllImport("NvPipe")]
         public static extern uint NvPipe_CreateTextureAsyncEncoder(Format format, Codec codec, Compression compression, ulong bitrate, uint targetfps, uint width, uint height);
 
         [DllImport("NvPipe")]
         public static extern void NvPipe_SetBitrate(uint pipe, ulong bitrate, uint targetFrameRate);
 
+        [DllImport("NvPipe")]
+        public static extern uint NvPipe_CreateAsyncEncoder(Format format, Codec codec, Compression compression, ulong bitrate, uint targetfps, uint width, uint height);
+
+        [DllImport("NvPipe")]
+        public static extern int NvPipe_EncodeAsync(uint pipe, IntPtr src, ulong srcPitch, uint width, uint height, bool forceIFrame);
+
+        [DllImport("NvPipe")]
+        public static extern void NvPipe_EncodeAsyncQuery(uint pipe, int taskIndex, [MarshalAs(UnmanagedType.I1)] out bool isDone, [MarshalAs(UnmanagedType.I1)] out bool isError, out IntPtr encodedData, out ulong encodeSize, out IntPtr error);
+
+        [DllImport("NvPipe")]
+        public static extern void NvPipe_EncodeAsyncClearTask(uint pipe, int taskIndex);
+
+        [DllImport("NvPipe")]
+        public static extern void NvPipe_SetAsyncEncoderQueue(uint pipe, uint depth, OverflowPolicy policy, uint timeoutMs);
+
+        [DllImport("NvPipe")]
+        public static extern void NvPipe_GetAsyncEncoderStats(uint pipe, out ulong queuedFrames, out ulong droppedFrames, out uint waitingFrames);
+
+        [DllImport("NvPipe")]
+        public static extern void NvPipe_SetEncodeWorkerCount(uint count, bool pinToCores);
+
+        public static void SetAsyncEncoderQueue(uint pipe, uint depth, OverflowPolicy policy, uint timeoutMs) {
+            NvPipe_SetAsyncEncoderQueue(pipe, depth, policy, timeoutMs);
+            var err = PollError(pipe);
+            if (err != null) {
+                throw new NvPipeException(err);
+            }
+        }
+
         [DllImport("NvPipe")]
         public static extern ulong NvPipe_Encode(uint pipe, IntPtr src, ulong srcPitch, IntPtr dst, ulong dstSize, uint width, uint height, bool forceIFrame);
 
@@ -486,18 +1571,171 @@ namespace NvPipeUnity {
         [DllImport("NvPipe")]
         public static extern IntPtr NvPipe_GetRenderThreadPollFunc();
 
+        [StructLayout(LayoutKind.Sequential)]
+        public struct CaptureEventData {
+            public uint pipe;
+            public uint texture;
+            public uint width;
+            public uint height;
+            public uint frameId;
+            public uint forceIFrame;
+        }
+
+        [DllImport("NvPipe")]
+        public static extern IntPtr NvPipe_GetCaptureTextureEventFunc();
+
+        [DllImport("NvPipe")]
+        public static extern void NvPipe_SetGraphicsResourceCacheSize(uint pipe, uint capacity);
+
+        [DllImport("NvPipe")]
+        public static extern void NvPipe_UnregisterTexture(uint texture);
+
+        [DllImport("NvPipe")]
+        public static extern uint NvPipe_ParseNalUnits(Codec codec, IntPtr data, ulong size, IntPtr units, uint maxUnits);
+
+        [DllImport("NvPipe")]
+        public static extern uint NvPipe_CreateStreamWriter(string path, Codec codec, uint width, uint height);
+
+        [DllImport("NvPipe")]
+        [return: MarshalAs(UnmanagedType.I1)]
+        public static extern bool NvPipe_StreamWriterAppend(uint writer, IntPtr data, ulong size, long timestamp);
+
+        [DllImport("NvPipe")]
+        [return: MarshalAs(UnmanagedType.I1)]
+        public static extern bool NvPipe_StreamWriterFinish(uint writer);
+
+        [DllImport("NvPipe")]
+        public static extern uint NvPipe_CreateStreamReader(string path);
+
+        [DllImport("NvPipe")]
+        [return: MarshalAs(UnmanagedType.I1)]
+        public static extern bool NvPipe_StreamReaderGetInfo(uint reader, out StreamInfo info);
+
+        [DllImport("NvPipe")]
+        [return: MarshalAs(UnmanagedType.I1)]
+        public static extern bool NvPipe_StreamReaderGetFrame(uint reader, ulong index, out StreamFrame frame);
+
+        [DllImport("NvPipe")]
+        [return: MarshalAs(UnmanagedType.I1)]
+        public static extern bool NvPipe_StreamReaderFindKeyframe(uint reader, ulong index, out ulong keyframeIndex);
+
+        [DllImport("NvPipe")]
+        [return: MarshalAs(UnmanagedType.I1)]
+        public static extern bool NvPipe_StreamReaderFindFrame(uint reader, long timestamp, out ulong index);
+
+        [DllImport("NvPipe")]
+        public static extern uint NvPipe_CreateRtpPacketizer(Codec codec, uint mtu, uint payloadType, uint ssrc);
+
+        [DllImport("NvPipe")]
+        public static extern uint NvPipe_RtpPacketize(uint packetizer, IntPtr frame, ulong size, uint timestamp, IntPtr buffer, IntPtr packetSizes, uint maxPackets);
+
+        [DllImport("NvPipe")]
+        public static extern uint NvPipe_CreateRtpReceiver(Codec codec, uint payloadType, uint minDelayMs, uint maxDelayMs, [MarshalAs(UnmanagedType.I1)] bool waitForKeyframe);
+
+        [DllImport("NvPipe")]
+        [return: MarshalAs(UnmanagedType.I1)]
+        public static extern bool NvPipe_RtpReceiverPush(uint receiver, IntPtr packet, ulong size, long arrivalUs);
+
+        [DllImport("NvPipe")]
+        public static extern ulong NvPipe_RtpReceiverPoll(uint receiver, long nowUs, IntPtr dst, ulong dstSize, out RtpFrameInfo info);
+
+        [DllImport("NvPipe")]
+        public static extern void NvPipe_GetRtpReceiverStats(uint receiver, out RtpReceiverStats stats);
+
+        [DllImport("NvPipe")]
+        public static extern uint NvPipe_CreateStreamServer(Codec codec, string address, uint port, ulong clientBufferSize);
+
+        [DllImport("NvPipe")]
+        [return: MarshalAs(UnmanagedType.I1)]
+        public static extern bool NvPipe_StreamServerSend(uint server, IntPtr frame, ulong size, long timestamp);
+
+        [DllImport("NvPipe")]
+        [return: MarshalAs(UnmanagedType.I1)]
+        public static extern bool NvPipe_StreamServerTakeKeyframeRequest(uint server);
+
+        [DllImport("NvPipe")]
+        public static extern void NvPipe_GetStreamServerStats(uint server, out StreamServerStats stats);
+
         [DllImport("NvPipe")]
         public static extern void NvPipe_EncodeTextureAsyncQuery(
-            uint taskIndex, out bool isDone, out bool isError, out IntPtr encodedData, out ulong encodeSize, out IntPtr error);
+            uint nvp, uint taskIndex, [MarshalAs(UnmanagedType.I1)] out bool isDone, [MarshalAs(UnmanagedType.I1)] out bool isError, out IntPtr encodedData, out ulong encodeSize, out IntPtr error);
+
+        [DllImport("NvPipe")]
+        public static extern void NvPipe_EncodeTextureAsyncClearTask(uint nvp, uint taskIndex);
+
+        [UnmanagedFunctionPointer(CallingConvention.StdCall)]
+        public delegate void TaskCompletedCallback(uint pipe, uint taskIndex, IntPtr userData);
 
         [DllImport("NvPipe")]
-        public static extern void NvPipe_EncodeTextureAsyncClearTask(uint taskIndex);
+        public static extern void NvPipe_SetTaskCompletedCallback(uint pipe, TaskCompletedCallback callback, IntPtr userData);
+
+        [DllImport("NvPipe")]
+        public static extern int NvPipe_GetTaskCompletedEventFd(uint pipe);
+
+        [DllImport("NvPipe")]
+        public static extern void NvPipe_StartRecording(uint pipe, string path);
+
+        [DllImport("NvPipe")]
+        public static extern void NvPipe_StartRecordingWithBuffer(uint pipe, string path, ulong bufferSize);
+
+        [DllImport("NvPipe")]
+        public static extern void NvPipe_StopRecording(uint pipe);
+
+        [DllImport("NvPipe")]
+        public static extern void NvPipe_StartSharedOutput(uint pipe, string name, ulong capacity);
+
+        [DllImport("NvPipe")]
+        public static extern void NvPipe_StopSharedOutput(uint pipe);
+
+        [DllImport("NvPipe")]
+        public static extern void NvPipe_AttachStreamServer(uint pipe, uint server);
+
+        [DllImport("NvPipe")]
+        public static extern void NvPipe_GetRecordingStats(uint pipe, out RecordingStats stats);
+
+        [DllImport("NvPipe")]
+        public static extern IntPtr NvPipe_LeaseEncodedData(uint nvp, uint taskIndex, out ulong size);
+
+        [DllImport("NvPipe")]
+        public static extern void NvPipe_ReleaseEncodedData(IntPtr data);
 
         [DllImport("NvPipe")]
         public static extern uint NvPipe_CreateDecoder(Format format, Codec codec, uint width, uint height);
 
         [DllImport("NvPipe")]
-        public static extern ulong NvPipe_Decode(uint nvp, IntPtr src, ulong srcSize, IntPtr dst, uint width, uint height);
+        public static extern uint NvPipe_CreateDecoderWithOutput(Format format, Codec codec, uint width, uint height, uint outputWidth, uint outputHeight,
+            uint cropLeft, uint cropTop, uint cropRight, uint cropBottom);
+
+        [DllImport("NvPipe")]
+        public static extern ulong NvPipe_Decode(uint nvp, IntPtr src, ulong srcSize, IntPtr dst, ulong dstSize, uint width, uint height);
+
+        [DllImport("NvPipe")]
+        [return: MarshalAs(UnmanagedType.I1)]
+        public static extern bool NvPipe_DecodeSubmit(uint nvp, IntPtr src, ulong srcSize, long timestamp);
+
+        [DllImport("NvPipe")]
+        [return: MarshalAs(UnmanagedType.I1)]
+        public static extern bool NvPipe_DecodeSubmitPartial(uint nvp, IntPtr src, ulong srcSize, long timestamp, [MarshalAs(UnmanagedType.I1)] bool endOfPicture);
+
+        [DllImport("NvPipe")]
+        public static extern ulong NvPipe_DecodePoll(uint nvp, IntPtr dst, ulong dstSize, uint width, uint height, out long timestamp);
+
+        [DllImport("NvPipe")]
+        [return: MarshalAs(UnmanagedType.I1)]
+        public static extern bool NvPipe_GetDecodedFrameInfo(uint nvp, out uint width, out uint height, out uint pitch);
+
+        [DllImport("NvPipe")]
+        [return: MarshalAs(UnmanagedType.I1)]
+        public static extern bool NvPipe_DecodeLockFrame(uint nvp, out IntPtr frame, out uint pitch, out long timestamp);
+
+        [DllImport("NvPipe")]
+        public static extern void NvPipe_DecodeUnlockFrame(uint nvp, IntPtr frame);
+
+        [DllImport("NvPipe")]
+        public static extern void NvPipe_SetDecoderFramePoolSize(uint nvp, uint size);
+
+        [DllImport("NvPipe")]
+        public static extern void NvPipe_GetDecoderMemoryUsage(uint nvp, out uint allocatedFrames, out ulong bytes, out uint droppedFrames);
 
         [DllImport("NvPipe")]
         public static extern ulong NvPipe_DecodeTexture(uint nvp, IntPtr src, ulong srcSize, uint texture, uint target, uint width, uint height);
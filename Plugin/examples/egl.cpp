@@ -47,9 +47,10 @@ void captureFramebufferPPM(GLuint framebuffer, uint32_t width, uint32_t height,
 }
 
 
-int main(int argc, char* argv[])
+int main()
 {
-    std::cout << "NvPipe example application: Render to offscreen framebuffer using EGL," << std::endl << "encode framebuffer, decode to display texture." << std::endl << std::endl;
+    std::cout << "NvPipe example application: Render to offscreen framebuffer using EGL," << std::endl << "encode framebuffer, decode to display texture." << std::endl;
+    std::cout << "Compares the CUDA-GL interop encoder backend with NVENC's native OpenGL input." << std::endl << std::endl;
 
     const uint32_t width = 3840;
     const uint32_t height = 2160;
@@ -57,6 +58,8 @@ int main(int argc, char* argv[])
     const NvPipe_Codec codec = NVPIPE_H264;
     const float bitrateMbps = 32;
     const uint32_t targetFPS = 90;
+    const uint32_t numFrames = 100;
+    const uint32_t numCapturedFrames = 10;
 
 
     std::cout << "Resolution: " << width << " x " << height << std::endl;
@@ -182,21 +185,30 @@ int main(int argc, char* argv[])
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
 
-    // Create encoder
-    NvPipe* encoder = NvPipe_CreateEncoder(NVPIPE_RGBA32, codec, NVPIPE_LOSSY, bitrateMbps * 1000 * 1000, targetFPS, width, height);
+    // Create encoders, one per backend
+    uint32_t encoder = NvPipe_CreateEncoderWithBackend(NVPIPE_RGBA32, codec, NVPIPE_LOSSY, bitrateMbps * 1000 * 1000, targetFPS, width, height, NVPIPE_ENCODER_BACKEND_CUDA);
     if (!encoder)
-        std::cerr << "Failed to create encoder: " << NvPipe_GetError(NULL) << std::endl;
+        std::cerr << "Failed to create encoder: " << NvPipe_GetError(0) << std::endl;
+
+    uint32_t glEncoder = NvPipe_CreateEncoderWithBackend(NVPIPE_RGBA32, codec, NVPIPE_LOSSY, bitrateMbps * 1000 * 1000, targetFPS, width, height, NVPIPE_ENCODER_BACKEND_OPENGL);
+    if (!glEncoder)
+        std::cerr << "Failed to create OpenGL backend encoder: " << NvPipe_GetError(0) << std::endl;
 
     // Create decoder
-    NvPipe* decoder = NvPipe_CreateDecoder(NVPIPE_RGBA32, codec, width, height);
+    uint32_t decoder = NvPipe_CreateDecoder(NVPIPE_RGBA32, codec, width, height);
     if (!decoder)
-        std::cerr << "Failed to create decoder: " << NvPipe_GetError(NULL) << std::endl;
+        std::cerr << "Failed to create decoder: " << NvPipe_GetError(0) << std::endl;
 
 
     Timer timer;
-    std::cout << std::endl << "Frame | Encode (ms) | Decode (ms) | Size (KB)" << std::endl;
+    double totalEncodeMs = 0.0;
+    double totalGLEncodeMs = 0.0;
+    std::cout << std::endl << "Frame | Encode CUDA (ms) | Encode GL (ms) | Decode (ms) | Size (KB)" << std::endl;
+
+    std::vector<uint8_t> compressed(width * height * 4);
+    std::vector<uint8_t> glCompressed(width * height * 4);
 
-    for (uint32_t i = 0; i < 10; ++i)
+    for (uint32_t i = 0; i < numFrames; ++i)
     {
         // Render dummy scene (Nothing to see here; just some oldschool immediate mode.. urgh)
         glBindFramebuffer(GL_DRAW_FRAMEBUFFER, serverFBO);
@@ -225,11 +237,10 @@ int main(int argc, char* argv[])
 
         glFinish(); // Make sure rendering is complete before grabbing frame
 
-        captureFramebufferPPM(serverFBO, width, height, "egl-input" + std::to_string(i) + ".ppm");
-
-        // Encode
-        std::vector<uint8_t> compressed(width * height * 4);
+        if (i < numCapturedFrames)
+            captureFramebufferPPM(serverFBO, width, height, "egl-input" + std::to_string(i) + ".ppm");
 
+        // Encode through CUDA-GL interop
         timer.reset();
         uint64_t size = NvPipe_EncodeTexture(encoder, serverColorTex, GL_TEXTURE_2D, compressed.data(), compressed.size(), width, height, false);
         double encodeMs = timer.getElapsedMilliseconds();
@@ -237,6 +248,21 @@ int main(int argc, char* argv[])
         if (0 == size)
             std::cerr << "Encode error: " << NvPipe_GetError(encoder) << std::endl;
 
+        // Encode the same texture through NVENC's OpenGL interface
+        timer.reset();
+        uint64_t glSize = NvPipe_EncodeTexture(glEncoder, serverColorTex, GL_TEXTURE_2D, glCompressed.data(), glCompressed.size(), width, height, false);
+        double glEncodeMs = timer.getElapsedMilliseconds();
+
+        if (0 == glSize)
+            std::cerr << "OpenGL backend encode error: " << NvPipe_GetError(glEncoder) << std::endl;
+
+        // First frame includes session setup
+        if (i > 0)
+        {
+            totalEncodeMs += encodeMs;
+            totalGLEncodeMs += glEncodeMs;
+        }
+
 
         // Decode
         timer.reset();
@@ -247,7 +273,7 @@ int main(int argc, char* argv[])
             std::cerr << "Decode error: " << NvPipe_GetError(decoder) << std::endl;
 
         double sizeKB = size / 1000.0;
-        std::cout << std::fixed << std::setprecision(1) << std::setw(5) << i << " | " << std::setw(11) << encodeMs << " | " <<  std::setw(11) << decodeMs << " | " <<  std::setw(8) << sizeKB << std::endl;
+        std::cout << std::fixed << std::setprecision(1) << std::setw(5) << i << " | " << std::setw(16) << encodeMs << " | " << std::setw(14) << glEncodeMs << " | " <<  std::setw(11) << decodeMs << " | " <<  std::setw(8) << sizeKB << std::endl;
 
 
 
@@ -260,11 +286,16 @@ int main(int argc, char* argv[])
         glBindVertexArray(clientFullscreenVAO);
         glDrawArrays(GL_POINTS, 0, 1);
 
-        captureFramebufferPPM(0, width, height, "egl-output" + std::to_string(i) + ".ppm");
+        if (i < numCapturedFrames)
+            captureFramebufferPPM(0, width, height, "egl-output" + std::to_string(i) + ".ppm");
     }
 
+    std::cout << std::endl << "Average encode (ms): CUDA " << std::setprecision(2) << totalEncodeMs / (numFrames - 1)
+              << " | GL " << totalGLEncodeMs / (numFrames - 1) << std::endl;
+
     // Clean up
     NvPipe_Destroy(encoder);
+    NvPipe_Destroy(glEncoder);
     NvPipe_Destroy(decoder);
 
     eglTerminate(display);
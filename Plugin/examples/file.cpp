@@ -31,9 +31,8 @@
 
 #include <iostream>
 #include <vector>
-#include <fstream>
 
-int main(int argc, char* argv[])
+int main()
 {
     std::cout << "NvPipe example application: Encodes to a file / decodes from a file." << std::endl << "Useful for testing if only encoding or decoding is enabled." << std::endl << std::endl;
 
@@ -67,11 +66,13 @@ int main(int argc, char* argv[])
     savePPM(rgba.data(), width, height, "file-input.ppm");
 
 
-    NvPipe* encoder = NvPipe_CreateEncoder(NVPIPE_RGBA32, codec, NVPIPE_LOSSY, bitrateMbps * 1000 * 1000, targetFPS, width, height);
+    uint32_t encoder = NvPipe_CreateEncoder(NVPIPE_RGBA32, codec, NVPIPE_LOSSY, bitrateMbps * 1000 * 1000, targetFPS, width, height);
     if (!encoder)
-        std::cerr << "Failed to create encoder: " << NvPipe_GetError(NULL) << std::endl;
+        std::cerr << "Failed to create encoder: " << NvPipe_GetError(0) << std::endl;
 
-    std::ofstream out("stream.bin", std::ios::out | std::ios::binary);
+    uint32_t out = NvPipe_CreateStreamWriter("stream.nvps", codec, width, height);
+    if (!out)
+        std::cerr << "Failed to create stream writer: " << NvPipe_GetError(0) << std::endl;
 
     std::cout << std::endl << "Encoding..." << std::endl;
 
@@ -84,13 +85,16 @@ int main(int argc, char* argv[])
         if (0 == size)
             std::cerr << "Encode error: " << NvPipe_GetError(encoder) << std::endl;
 
-        out.write((char*) &size, sizeof(uint64_t));
-        out.write((char*) compressed.data(), size);
+        // Frames are timestamped in microseconds at the target frame rate
+        if (!NvPipe_StreamWriterAppend(out, compressed.data(), size, i * 1000000ll / targetFPS))
+            std::cerr << "Write error: " << NvPipe_GetError(out) << std::endl;
 
         std::cout << i << ": " << encodeMs << " ms" << std::endl;
     }
 
-    out.close();
+    if (!NvPipe_StreamWriterFinish(out))
+        std::cerr << "Write error: " << NvPipe_GetError(out) << std::endl;
+    NvPipe_Destroy(out);
 
     NvPipe_Destroy(encoder);
 #endif
@@ -98,15 +102,15 @@ int main(int argc, char* argv[])
 
     // Decoding
 #ifdef NVPIPE_WITH_DECODER
-    NvPipe* decoder = NvPipe_CreateDecoder(NVPIPE_RGBA32, codec, width, height);
+    uint32_t decoder = NvPipe_CreateDecoder(NVPIPE_RGBA32, codec, width, height);
     if (!decoder)
-        std::cerr << "Failed to create decoder: " << NvPipe_GetError(NULL) << std::endl;
+        std::cerr << "Failed to create decoder: " << NvPipe_GetError(0) << std::endl;
 
-    std::ifstream in("stream.bin", std::ios::in | std::ios::binary);
+    uint32_t in = NvPipe_CreateStreamReader("stream.nvps");
     if (!in)
     {
         std::cerr << std::endl;
-        std::cerr << "Error: Failed to open input file \"stream.bin\"." << std::endl;
+        std::cerr << "Error: Failed to open input file \"stream.nvps\": " << NvPipe_GetError(0) << std::endl;
         std::cerr << "The file can be created using this example with" << std::endl;
         std::cerr << "NvPipe encoding enabled." << std::endl;
         return 1;
@@ -114,16 +118,19 @@ int main(int argc, char* argv[])
 
     std::cout << std::endl << "Decoding..." << std::endl;
 
-    for (uint32_t i = 0; i < 10; ++i)
-    {
-        uint64_t size;
-        in.read((char*) &size, sizeof(uint64_t));
-        in.read((char*) compressed.data(), size);
+    NvPipe_StreamInfo info;
+    NvPipe_StreamReaderGetInfo(in, &info);
 
+    for (uint64_t i = 0; i < info.frameCount; ++i)
+    {
+        // The frame points into the file mapping, no copy is needed
+        NvPipe_StreamFrame frame;
+        NvPipe_StreamReaderGetFrame(in, i, &frame);
+        uint64_t size = frame.size;
 
         // Decode
         timer.reset();
-        uint64_t r = NvPipe_Decode(decoder, compressed.data(), size, rgba.data(), width, height);
+        uint64_t r = NvPipe_Decode(decoder, frame.data, size, rgba.data(), rgba.size(), width, height);
         double decodeMs = timer.getElapsedMilliseconds();
 
         if (r == size)
@@ -135,7 +142,21 @@ int main(int argc, char* argv[])
             savePPM(rgba.data(), width, height, "file-output.ppm");
     }
 
-    in.close();
+    // Seeking: the last frame is shown by decoding from the keyframe before it
+    uint64_t keyframe;
+    if (info.frameCount > 0 && NvPipe_StreamReaderFindKeyframe(in, info.frameCount - 1, &keyframe))
+    {
+        timer.reset();
+        for (uint64_t i = keyframe; i < info.frameCount; ++i)
+        {
+            NvPipe_StreamFrame frame;
+            NvPipe_StreamReaderGetFrame(in, i, &frame);
+            NvPipe_Decode(decoder, frame.data, frame.size, rgba.data(), rgba.size(), width, height);
+        }
+        std::cout << "Seek to frame " << info.frameCount - 1 << " from keyframe " << keyframe << ": " << timer.getElapsedMilliseconds() << " ms" << std::endl;
+    }
+
+    NvPipe_Destroy(in);
 
     NvPipe_Destroy(decoder);
 #endif
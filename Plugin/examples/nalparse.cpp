@@ -0,0 +1,105 @@
+/* Copyright (c) 2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <NvPipe.h>
+
+#include "utils.h"
+
+#include <iostream>
+#include <vector>
+#include <fstream>
+#include <iterator>
+#include <map>
+
+// Byte by byte start code search, as consumers did before NvPipe_ParseNalUnits
+uint64_t countStartCodes(const std::vector<uint8_t>& data)
+{
+    uint64_t count = 0;
+    for (uint64_t i = 0; i + 2 < data.size(); ++i)
+        if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1)
+            ++count;
+    return count;
+}
+
+int main(int argc, char* argv[])
+{
+    std::cout << "NvPipe example application: Parses the NAL units of a recorded Annex-B stream and measures parser throughput." << std::endl << std::endl;
+
+    const std::string path = argc > 1 ? argv[1] : "ExampleRawStream.bin";
+    const NvPipe_Codec codec = (argc > 2 && std::string(argv[2]) == "hevc") ? NVPIPE_HEVC : NVPIPE_H264;
+    const uint32_t iterations = 200;
+
+    std::ifstream in(path.c_str(), std::ios::in | std::ios::binary);
+    if (!in)
+    {
+        std::cerr << "Failed to open " << path << std::endl;
+        return 1;
+    }
+    std::vector<uint8_t> stream((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+    std::cout << "Stream: " << path << " (" << stream.size() << " bytes)" << std::endl;
+    std::cout << "Codec: " << (codec == NVPIPE_H264 ? "H.264" : "HEVC") << std::endl << std::endl;
+
+    // Count first, then parse into a buffer of the right size
+    uint32_t count = NvPipe_ParseNalUnits(codec, stream.data(), stream.size(), NULL, 0);
+    std::vector<NvPipe_NalUnit> units(count);
+    NvPipe_ParseNalUnits(codec, stream.data(), stream.size(), units.data(), count);
+
+    std::map<uint32_t, uint32_t> types;
+    uint32_t keyframes = 0;
+    uint32_t slices[5] = {};
+    for (const NvPipe_NalUnit& unit : units)
+    {
+        types[unit.type]++;
+        keyframes += unit.isKeyframe ? 1 : 0;
+        slices[unit.sliceType]++;
+    }
+
+    std::cout << count << " NAL units, " << keyframes << " keyframe slices" << std::endl;
+    for (auto& t : types)
+        std::cout << "  type " << std::setw(2) << t.first << ": " << t.second << std::endl;
+    std::cout << "Slices: " << slices[NVPIPE_SLICE_I] << " I, " << slices[NVPIPE_SLICE_P] << " P, " << slices[NVPIPE_SLICE_B] << " B, " << slices[NVPIPE_SLICE_UNKNOWN] << " unknown" << std::endl << std::endl;
+
+    // Throughput
+    Timer timer;
+    for (uint32_t i = 0; i < iterations; ++i)
+        NvPipe_ParseNalUnits(codec, stream.data(), stream.size(), units.data(), count);
+    double parseSeconds = timer.getElapsedSeconds();
+
+    timer.reset();
+    uint64_t naiveCount = 0;
+    for (uint32_t i = 0; i < iterations; ++i)
+        naiveCount += countStartCodes(stream);
+    double naiveSeconds = timer.getElapsedSeconds();
+
+    const double megabytes = 1.0e-6 * stream.size() * iterations;
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << "NvPipe_ParseNalUnits: " << megabytes / parseSeconds << " MB/s" << std::endl;
+    std::cout << "Byte by byte scan:    " << megabytes / naiveSeconds << " MB/s (" << naiveCount / iterations << " start codes)" << std::endl;
+
+    return 0;
+}
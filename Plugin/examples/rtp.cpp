@@ -0,0 +1,255 @@
+/* Copyright (c) 2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <NvPipe.h>
+
+#include "utils.h"
+
+#include <iostream>
+#include <vector>
+#include <fstream>
+#include <iterator>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <random>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+// Splits a recorded stream at parameter sets and at the first slice of each picture
+std::vector<std::vector<uint8_t>> splitAccessUnits(NvPipe_Codec codec, const std::vector<uint8_t>& stream)
+{
+    std::vector<NvPipe_NalUnit> units(NvPipe_ParseNalUnits(codec, stream.data(), stream.size(), NULL, 0));
+    NvPipe_ParseNalUnits(codec, stream.data(), stream.size(), units.data(), units.size());
+
+    std::vector<std::vector<uint8_t>> frames;
+    bool afterParameterSets = false;
+    for (const NvPipe_NalUnit& unit : units)
+    {
+        const uint8_t* nal = stream.data() + unit.offset + unit.startCodeSize;
+        const bool parameterSet = codec == NVPIPE_HEVC ? (unit.type >= 32 && unit.type <= 34) : (unit.type == 7 || unit.type == 8);
+        const bool firstSlice = unit.sliceType != NVPIPE_SLICE_NONE && (codec == NVPIPE_HEVC ? (nal[2] & 0x80) : (nal[1] & 0x80));
+
+        if (frames.empty() || (parameterSet && !afterParameterSets) || (firstSlice && !afterParameterSets))
+            frames.emplace_back();
+        afterParameterSets = parameterSet;
+
+        frames.back().insert(frames.back().end(), stream.begin() + unit.offset, stream.begin() + unit.offset + unit.size);
+    }
+    return frames;
+}
+
+// The frame without start codes and trailing zeros, to compare what the receiver rebuilt
+std::vector<uint8_t> nalPayloads(NvPipe_Codec codec, const std::vector<uint8_t>& frame)
+{
+    std::vector<NvPipe_NalUnit> units(NvPipe_ParseNalUnits(codec, frame.data(), frame.size(), NULL, 0));
+    NvPipe_ParseNalUnits(codec, frame.data(), frame.size(), units.data(), units.size());
+
+    std::vector<uint8_t> payloads;
+    for (const NvPipe_NalUnit& unit : units)
+    {
+        uint64_t end = unit.offset + unit.size;
+        while (end > unit.offset + unit.startCodeSize && frame[end - 1] == 0)
+            --end;
+        payloads.insert(payloads.end(), frame.begin() + unit.offset + unit.startCodeSize, frame.begin() + end);
+    }
+    return payloads;
+}
+
+struct Arrival
+{
+    int64_t timeUs;
+    std::vector<uint8_t> packet;
+};
+
+int main(int argc, char* argv[])
+{
+    std::cout << "NvPipe example application: Sends a recorded stream as RTP over loopback UDP with simulated loss and jitter, and checks what the receiver reassembles." << std::endl << std::endl;
+
+    const std::string path = argc > 1 ? argv[1] : "ExampleRawStream.bin";
+    const NvPipe_Codec codec = (argc > 2 && std::string(argv[2]) == "hevc") ? NVPIPE_HEVC : NVPIPE_H264;
+    const double lossPercent = argc > 3 ? atof(argv[3]) : 1.0;
+    const uint32_t jitterMs = argc > 4 ? (uint32_t) atoi(argv[4]) : 20;
+    const uint32_t mtu = 1200;
+    const uint32_t payloadType = 96;
+    const uint32_t frameRate = 30;
+    const uint32_t maxPackets = 4096;
+
+    std::ifstream in(path.c_str(), std::ios::in | std::ios::binary);
+    if (!in)
+    {
+        std::cerr << "Failed to open " << path << std::endl;
+        return 1;
+    }
+    std::vector<uint8_t> stream((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    std::vector<std::vector<uint8_t>> frames = splitAccessUnits(codec, stream);
+
+    std::cout << "Stream: " << path << " (" << frames.size() << " frames)" << std::endl;
+    std::cout << "MTU: " << mtu << " bytes" << std::endl;
+    std::cout << "Loss: " << lossPercent << " %, jitter: up to " << jitterMs << " ms" << std::endl << std::endl;
+
+    uint32_t packetizer = NvPipe_CreateRtpPacketizer(codec, mtu, payloadType, 0);
+    if (!packetizer)
+    {
+        std::cerr << "Failed to create packetizer: " << NvPipe_GetError(0) << std::endl;
+        return 1;
+    }
+
+    // Decode whatever arrives, so every loss shows up as dropped frames rather than a wait for the next keyframe
+    uint32_t rtpReceiver = NvPipe_CreateRtpReceiver(codec, payloadType, 5, 200, false);
+    if (!rtpReceiver)
+    {
+        std::cerr << "Failed to create receiver: " << NvPipe_GetError(0) << std::endl;
+        return 1;
+    }
+
+    // Packetize everything up front and give each packet a simulated arrival time: sent at the frame rate, delayed randomly, some lost
+    std::mt19937 random(42);
+    std::uniform_real_distribution<double> percent(0.0, 100.0);
+    std::uniform_int_distribution<int64_t> delayUs(0, jitterMs * 1000);
+
+    std::vector<uint8_t> packets(maxPackets * mtu);
+    std::vector<uint32_t> packetSizes(maxPackets);
+    std::vector<Arrival> arrivals;
+
+    Timer timer;
+    double packetizeMs = 0;
+    uint64_t packetCount = 0;
+    uint64_t dropped = 0;
+
+    for (size_t i = 0; i < frames.size(); ++i)
+    {
+        const uint32_t timestamp = (uint32_t)(i * 90000 / frameRate);
+        const int64_t sendUs = (int64_t)(i * 1000000 / frameRate);
+
+        timer.reset();
+        uint32_t count = NvPipe_RtpPacketize(packetizer, frames[i].data(), frames[i].size(), timestamp, packets.data(), packetSizes.data(), maxPackets);
+        packetizeMs += timer.getElapsedMilliseconds();
+
+        if (count == 0 || count > maxPackets)
+        {
+            std::cerr << "Packetize error: " << (count ? "too many packets" : NvPipe_GetError(packetizer)) << std::endl;
+            return 1;
+        }
+
+        for (uint32_t p = 0; p < count; ++p)
+        {
+            if (percent(random) < lossPercent)
+            {
+                dropped++;
+                continue;
+            }
+            const uint8_t* packet = packets.data() + p * mtu;
+            arrivals.push_back({ sendUs + p * 10 + delayUs(random), std::vector<uint8_t>(packet, packet + packetSizes[p]) });
+        }
+        packetCount += count;
+    }
+    std::stable_sort(arrivals.begin(), arrivals.end(), [](const Arrival& a, const Arrival& b) { return a.timeUs < b.timeUs; });
+
+    // Loopback sockets, each packet is received before the next one is sent
+    int receiver = socket(AF_INET, SOCK_DGRAM, 0);
+    int sender = socket(AF_INET, SOCK_DGRAM, 0);
+
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addressSize = sizeof(address);
+    if (bind(receiver, (sockaddr*) &address, sizeof(address)) != 0 || getsockname(receiver, (sockaddr*) &address, &addressSize) != 0)
+    {
+        std::cerr << "Failed to bind loopback socket" << std::endl;
+        return 1;
+    }
+
+    std::vector<uint8_t> received(mtu);
+    std::vector<uint8_t> frame(4 * 1024 * 1024);
+    uint32_t delivered = 0;
+    uint32_t mismatches = 0;
+    uint32_t keyframeRequests = 0;
+    int64_t lastTimestamp = -1;
+
+    // Takes all frames that are ready at the given time and compares them with the originals
+    auto poll = [&](int64_t nowUs) -> bool
+    {
+        NvPipe_RtpFrameInfo info;
+        while (true)
+        {
+            uint64_t size = NvPipe_RtpReceiverPoll(rtpReceiver, nowUs, frame.data(), frame.size(), &info);
+            if (info.requestKeyframe)
+                keyframeRequests++;
+            if (size == 0)
+                return info.size == 0;
+
+            const size_t index = (size_t)((uint64_t) info.timestamp * frameRate / 90000);
+            if ((int64_t) info.timestamp <= lastTimestamp || index >= frames.size() || nalPayloads(codec, std::vector<uint8_t>(frame.begin(), frame.begin() + size)) != nalPayloads(codec, frames[index]))
+                mismatches++;
+            lastTimestamp = info.timestamp;
+            delivered++;
+        }
+    };
+
+    uint64_t bytes = 0;
+    for (const Arrival& arrival : arrivals)
+    {
+        if (!poll(arrival.timeUs))
+        {
+            std::cerr << "Poll error: " << NvPipe_GetError(rtpReceiver) << std::endl;
+            return 1;
+        }
+
+        sendto(sender, arrival.packet.data(), arrival.packet.size(), 0, (sockaddr*) &address, sizeof(address));
+        ssize_t size = recv(receiver, received.data(), received.size(), 0);
+        if (size <= 0)
+        {
+            std::cerr << "Receive error" << std::endl;
+            return 1;
+        }
+        NvPipe_RtpReceiverPush(rtpReceiver, received.data(), (uint64_t) size, arrival.timeUs);
+        bytes += size;
+    }
+    poll(arrivals.empty() ? 0 : arrivals.back().timeUs + 10 * 1000 * 1000);
+
+    NvPipe_RtpReceiverStats stats;
+    NvPipe_GetRtpReceiverStats(rtpReceiver, &stats);
+
+    std::cout << "Packets: " << packetCount << " sent, " << dropped << " lost on the way (" << bytes << " bytes received)" << std::endl;
+    std::cout << "Packetize: " << packetizeMs << " ms total, " << packetizeMs * 1000.0 / frames.size() << " us per frame" << std::endl;
+    std::cout << "Frames: " << delivered << " of " << frames.size() << " delivered, " << stats.droppedFrames << " dropped" << std::endl;
+    std::cout << "Receiver: " << stats.lostPackets << " lost, " << stats.latePackets << " late packets, " << keyframeRequests << " keyframe requests" << std::endl;
+    std::cout << "Jitter: " << stats.jitterUs / 1000.0 << " ms, playout delay: " << stats.playoutDelayUs / 1000.0 << " ms" << std::endl;
+    std::cout << "Mismatches: " << mismatches << std::endl;
+
+    close(sender);
+    close(receiver);
+    NvPipe_Destroy(rtpReceiver);
+    NvPipe_Destroy(packetizer);
+
+    const bool complete = dropped > 0 || delivered == frames.size();
+    return mismatches == 0 && complete ? 0 : 1;
+}
@@ -0,0 +1,325 @@
+/* Copyright (c) 2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <NvPipe.h>
+
+#include "utils.h"
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <fstream>
+#include <iterator>
+#include <cstring>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <memory>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+// Splits a recorded stream at parameter sets and at the first slice of each picture
+std::vector<std::vector<uint8_t>> splitAccessUnits(NvPipe_Codec codec, const std::vector<uint8_t>& stream)
+{
+    std::vector<NvPipe_NalUnit> units(NvPipe_ParseNalUnits(codec, stream.data(), stream.size(), NULL, 0));
+    NvPipe_ParseNalUnits(codec, stream.data(), stream.size(), units.data(), units.size());
+
+    std::vector<std::vector<uint8_t>> frames;
+    bool afterParameterSets = false;
+    for (const NvPipe_NalUnit& unit : units)
+    {
+        const uint8_t* nal = stream.data() + unit.offset + unit.startCodeSize;
+        const bool parameterSet = codec == NVPIPE_HEVC ? (unit.type >= 32 && unit.type <= 34) : (unit.type == 7 || unit.type == 8);
+        const bool firstSlice = unit.sliceType != NVPIPE_SLICE_NONE && (codec == NVPIPE_HEVC ? (nal[2] & 0x80) : (nal[1] & 0x80));
+
+        if (frames.empty() || (parameterSet && !afterParameterSets) || (firstSlice && !afterParameterSets))
+            frames.emplace_back();
+        afterParameterSets = parameterSet;
+
+        frames.back().insert(frames.back().end(), stream.begin() + unit.offset, stream.begin() + unit.offset + unit.size);
+    }
+    return frames;
+}
+
+bool readExact(int socket, uint8_t* data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t n = recv(socket, data, size, 0);
+        if (n <= 0)
+            return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+struct ClientResult
+{
+    uint64_t frames = 0;
+    uint64_t bytes = 0;
+    uint64_t keyframes = 0;
+    uint64_t resyncs = 0;
+    uint32_t errors = 0;
+};
+
+// A viewer: connects as raw TCP or WebSocket client and checks every frame against what was sent
+void runClient(uint16_t port, bool websocket, uint64_t lastSequence, const std::vector<std::vector<uint8_t>>& frames,
+    const std::atomic<int32_t>* schedule, ClientResult& result)
+{
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(s, (sockaddr*) &address, sizeof(address)) != 0)
+    {
+        result.errors++;
+        close(s);
+        return;
+    }
+
+    if (websocket)
+    {
+        // Key and expected accept value from the example in RFC 6455
+        const std::string request = "GET /stream HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+            "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n";
+        send(s, request.data(), request.size(), 0);
+
+        std::string response;
+        uint8_t c;
+        while (response.find("\r\n\r\n") == std::string::npos && readExact(s, &c, 1))
+            response.push_back((char) c);
+        if (response.find(" 101 ") == std::string::npos || response.find("s3pPLMBiTxaQ9kYGzzhZRbK+xOo=") == std::string::npos)
+        {
+            result.errors++;
+            close(s);
+            return;
+        }
+    }
+    else
+    {
+        send(s, "NVPR", 4, 0);
+    }
+
+    std::vector<uint8_t> payload;
+    int64_t previous = -1;
+    while (true)
+    {
+        if (websocket)
+        {
+            uint8_t frameHeader[10];
+            if (!readExact(s, frameHeader, 2))
+                break;
+            uint64_t length = frameHeader[1] & 0x7F;
+            if (length == 126 && readExact(s, frameHeader + 2, 2))
+                length = (frameHeader[2] << 8) | frameHeader[3];
+            else if (length == 127 && readExact(s, frameHeader + 2, 8))
+                for (int i = 0; i < 8; ++i)
+                    length = (i == 0 ? 0 : length << 8) | frameHeader[2 + i];
+            if (frameHeader[0] != 0x82 || length < 16)
+            {
+                result.errors++;
+                break;
+            }
+        }
+
+        uint8_t header[16];
+        if (!readExact(s, header, sizeof(header)))
+            break;
+        uint32_t size, flags;
+        int64_t sequence;
+        memcpy(&size, header, 4);
+        memcpy(&flags, header + 4, 4);
+        memcpy(&sequence, header + 8, 8);
+
+        payload.resize(size);
+        if (!readExact(s, payload.data(), size))
+            break;
+
+        // Starts at a keyframe, and continues without gaps unless it skipped ahead to a keyframe, never back
+        const bool keyframe = (flags & 1) != 0;
+        if ((previous < 0 && !keyframe) || (previous >= 0 && sequence != previous + 1 && !keyframe) || (previous >= 0 && sequence <= previous))
+            result.errors++;
+        if (previous >= 0 && sequence != previous + 1)
+            result.resyncs++;
+        if (payload != frames[schedule[sequence].load()])
+            result.errors++;
+
+        previous = sequence;
+        result.frames++;
+        result.keyframes += keyframe ? 1 : 0;
+        result.bytes += size;
+        if ((uint64_t) sequence == lastSequence)
+            break;
+    }
+    close(s);
+}
+
+// Sends an HTTP request and returns the status line of the response
+std::string requestStatus(uint16_t port, const std::string& request)
+{
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    std::string response;
+    if (connect(s, (sockaddr*) &address, sizeof(address)) == 0)
+    {
+        send(s, request.data(), request.size(), 0);
+        uint8_t c;
+        while (response.find("\r\n") == std::string::npos && readExact(s, &c, 1))
+            response.push_back((char) c);
+    }
+    close(s);
+    return response.substr(0, response.find("\r\n"));
+}
+
+int main(int argc, char* argv[])
+{
+    std::cout << "NvPipe example application: Streams a recorded stream to many loopback clients through one server." << std::endl << std::endl;
+
+    const std::string path = argc > 1 ? argv[1] : "ExampleRawStream.bin";
+    const uint32_t clientCount = argc > 2 ? (uint32_t) atoi(argv[2]) : 64;
+    const uint32_t frameCount = argc > 3 ? (uint32_t) atoi(argv[3]) : 3000;
+    const uint32_t frameIntervalUs = argc > 4 ? (uint32_t) atoi(argv[4]) : 0;    // 0: as fast as possible
+    const NvPipe_Codec codec = NVPIPE_H264;
+
+    std::ifstream in(path.c_str(), std::ios::in | std::ios::binary);
+    if (!in)
+    {
+        std::cerr << "Failed to open " << path << std::endl;
+        return 1;
+    }
+    std::vector<uint8_t> stream((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    std::vector<std::vector<uint8_t>> frames = splitAccessUnits(codec, stream);
+
+    uint32_t server = NvPipe_CreateStreamServer(codec, "127.0.0.1", 0, 0);
+    if (!server)
+    {
+        std::cerr << "Failed to create server: " << NvPipe_GetError(0) << std::endl;
+        return 1;
+    }
+    NvPipe_StreamServerStats stats;
+    NvPipe_GetStreamServerStats(server, &stats);
+
+    std::cout << "Stream: " << path << " (" << frames.size() << " frames, sent " << frameCount << " times)" << std::endl;
+    std::cout << "Clients: " << clientCount << " (half WebSocket, a quarter joins late)" << std::endl;
+    std::cout << "Port: " << stats.port << std::endl << std::endl;
+
+    // Upgrades without the WebSocket fields are refused, a version other than 13 gets told which one to use
+    uint32_t handshakeErrors = 0;
+    const std::string noUpgrade = requestStatus((uint16_t) stats.port, "GET /stream HTTP/1.1\r\nHost: localhost\r\n"
+        "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n");
+    const std::string oldVersion = requestStatus((uint16_t) stats.port, "GET /stream HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\n"
+        "Connection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 8\r\n\r\n");
+    handshakeErrors += noUpgrade.find(" 400 ") == std::string::npos ? 1 : 0;
+    handshakeErrors += oldVersion.find(" 426 ") == std::string::npos ? 1 : 0;
+
+    // Which recorded frame went out as which message, for the clients to compare
+    std::unique_ptr<std::atomic<int32_t>[]> schedule(new std::atomic<int32_t>[frameCount]);
+    std::vector<ClientResult> results(clientCount);
+    std::vector<std::thread> clients;
+    const uint32_t lateClients = clientCount / 4;
+
+    auto startClients = [&](uint32_t begin, uint32_t end)
+    {
+        for (uint32_t i = begin; i < end; ++i)
+            clients.emplace_back(runClient, (uint16_t) stats.port, i % 2 == 1, frameCount - 1, std::cref(frames), schedule.get(), std::ref(results[i]));
+
+        // Wait until they are past their handshake
+        for (int attempt = 0; attempt < 2500; ++attempt)
+        {
+            NvPipe_GetStreamServerStats(server, &stats);
+            if (stats.clients >= end)
+                break;
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+    };
+    startClients(0, clientCount - lateClients);
+
+    // Stands in for the encoder: the recording's first frame is its keyframe, sent whenever the server asks for one
+    Timer timer;
+    size_t next = 0;
+    for (uint32_t sequence = 0; sequence < frameCount; ++sequence)
+    {
+        if (sequence == frameCount / 3)
+            startClients(clientCount - lateClients, clientCount);
+
+        if (NvPipe_StreamServerTakeKeyframeRequest(server))
+            next = 0;
+        schedule[sequence] = (int32_t) next;
+        NvPipe_StreamServerSend(server, frames[next].data(), frames[next].size(), sequence);
+        next = (next + 1 < frames.size()) ? next + 1 : 1;
+
+        if (frameIntervalUs)
+            std::this_thread::sleep_for(std::chrono::microseconds(frameIntervalUs));
+    }
+
+    // Clients stop at the last frame; one that skipped past it stops when the server closes
+    for (int attempt = 0; attempt < 200; ++attempt)
+    {
+        NvPipe_GetStreamServerStats(server, &stats);
+        if (stats.clients == 0)
+            break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    NvPipe_GetStreamServerStats(server, &stats);
+    NvPipe_Destroy(server);
+    for (auto& t : clients)
+        t.join();
+    double seconds = timer.getElapsedMilliseconds() / 1000.0;
+
+    ClientResult total;
+    uint32_t incomplete = 0;
+    for (const ClientResult& r : results)
+    {
+        total.frames += r.frames;
+        total.bytes += r.bytes;
+        total.keyframes += r.keyframes;
+        total.resyncs += r.resyncs;
+        total.errors += r.errors;
+        incomplete += r.frames == 0 ? 1 : 0;
+    }
+    total.errors += handshakeErrors;
+
+    std::cout << "Received: " << total.frames << " frames, " << total.bytes / 1000000 << " MB in " << std::fixed << std::setprecision(2) << seconds << " s ("
+        << total.bytes / seconds / 1000000.0 << " MB/s over all clients)" << std::endl;
+    std::cout << "Server: " << stats.sentFrames << " frames sent, " << stats.droppedFrames << " skipped for slow clients, " << stats.cachedJoins << " joins from the cached GOP" << std::endl;
+    std::cout << "Keyframes: " << stats.keyframeRequests << " requests, " << stats.forcedKeyframes << " forced after coalescing" << std::endl;
+    std::cout << "Clients that skipped ahead: " << total.resyncs << ", without any frame: " << incomplete << std::endl;
+    std::cout << "Errors: " << total.errors << std::endl;
+
+    // Unpaced, clients that fall behind wait for a keyframe, which the server asks for at most every 250 ms
+    if (frameIntervalUs && incomplete)
+        return 1;
+    return total.errors == 0 ? 0 : 1;
+}
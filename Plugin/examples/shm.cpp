@@ -0,0 +1,159 @@
+/* Copyright (c) 2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <NvPipe.h>
+#include <NvPipeSharedRing.h>
+
+#include "utils.h"
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+// The networking side: only needs NvPipeSharedRing.h, reads the frames in place
+int readFrames(const std::string& name)
+{
+    SharedRingReader* reader = nullptr;
+    for (int attempt = 0; attempt < 500 && !reader; ++attempt)
+    {
+        try
+        {
+            reader = new SharedRingReader(name);
+        }
+        catch (const std::exception&)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));    // The encoder process hasn't created the ring yet
+        }
+    }
+    if (!reader)
+    {
+        std::cerr << "Failed to open shared ring " << name << std::endl;
+        return 1;
+    }
+
+    uint64_t frames = 0;
+    uint64_t keyframes = 0;
+    uint64_t bytes = 0;
+    int64_t totalLatencyUs = 0;
+    int64_t maxLatencyUs = 0;
+
+    SharedRingPacket packet;
+    while (reader->acquire(packet, 1000))
+    {
+        // Same steady clock as the writer, so the difference is the delivery latency
+        int64_t nowUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        totalLatencyUs += nowUs - packet.timestamp;
+        maxLatencyUs = std::max(maxLatencyUs, nowUs - packet.timestamp);
+
+        frames++;
+        keyframes += packet.keyframe ? 1 : 0;
+        bytes += packet.size;
+        reader->release();
+    }
+
+    std::cout << "Reader: " << frames << " frames (" << keyframes << " keyframes, " << bytes / 1000 << " KB), " << reader->droppedFrames() << " dropped" << std::endl;
+    if (frames > 0)
+        std::cout << "Delivery latency: " << totalLatencyUs / frames << " us average, " << maxLatencyUs << " us max" << std::endl;
+
+    delete reader;
+    return frames > 0 ? 0 : 1;
+}
+
+int main(int argc, char* argv[])
+{
+    std::cout << "NvPipe example application: Publishes encoded frames into shared memory for a reader process." << std::endl << std::endl;
+
+    const std::string name = argc > 1 ? argv[1] : "/nvpipe-example";
+    const uint32_t width = 1920;
+    const uint32_t height = 1080;
+    const NvPipe_Codec codec = NVPIPE_H264;
+    const float bitrateMbps = 32;
+    const uint32_t targetFPS = 60;
+    const uint32_t frameCount = 300;
+
+    std::cout << "Shared ring: " << name << std::endl;
+    std::cout << "Resolution: " << width << " x " << height << std::endl << std::endl;
+
+    // Fork before CUDA is initialized, the child stands in for a separate networking process
+    pid_t child = fork();
+    if (child == 0)
+        _exit(readFrames(name));
+
+    uint32_t encoder = NvPipe_CreateEncoder(NVPIPE_RGBA32, codec, NVPIPE_LOSSY, bitrateMbps * 1000 * 1000, targetFPS, width, height);
+    if (!encoder)
+    {
+        std::cerr << "Failed to create encoder: " << NvPipe_GetError(0) << std::endl;
+        return 1;
+    }
+
+    NvPipe_StartSharedOutput(encoder, name.c_str(), 0);
+    const char* error = NvPipe_GetError(encoder);
+    if (error && *error)
+    {
+        std::cerr << "Failed to start shared output: " << error << std::endl;
+        return 1;
+    }
+
+    std::vector<uint8_t> rgba(width * height * 4);
+    std::vector<uint8_t> compressed(rgba.size());
+
+    Timer timer;
+    double encodeMs = 0;
+
+    for (uint32_t i = 0; i < frameCount; ++i)
+    {
+        // Moving pattern, so every frame differs
+        for (uint32_t y = 0; y < height; ++y)
+            for (uint32_t x = 0; x < width; ++x)
+                rgba[4 * (y * width + x) + 0] = (uint8_t)((x + i * 4) ^ y);
+
+        timer.reset();
+        uint64_t size = NvPipe_Encode(encoder, rgba.data(), width * 4, compressed.data(), compressed.size(), width, height, false);
+        encodeMs += timer.getElapsedMilliseconds();
+
+        if (0 == size)
+            std::cerr << "Encode error: " << NvPipe_GetError(encoder) << std::endl;
+
+        std::this_thread::sleep_for(std::chrono::microseconds(1000000 / targetFPS));
+    }
+
+    // Closes the ring, the reader drains it and stops
+    NvPipe_StopSharedOutput(encoder);
+    NvPipe_Destroy(encoder);
+
+    std::cout << "Encoder: " << frameCount << " frames, " << std::fixed << std::setprecision(2) << encodeMs / frameCount << " ms per encode (including the publish)" << std::endl;
+
+    int status = 0;
+    waitpid(child, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
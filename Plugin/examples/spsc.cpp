@@ -0,0 +1,224 @@
+/* Copyright (c) 2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <NvPipeSpscRing.h>
+
+#include "utils.h"
+
+#include <iostream>
+#include <iomanip>
+#include <memory>
+#include <random>
+#include <thread>
+
+static uint32_t failures = 0;
+
+void check(bool condition, const std::string& what)
+{
+    if (!condition)
+    {
+        std::cerr << "FAILED: " << what << std::endl;
+        failures++;
+    }
+}
+
+// One thread: full and empty edges, size() and order across many wraparounds
+void testSingleThread()
+{
+    for (uint32_t capacity : { 1u, 2u, 3u, 7u, 64u })
+    {
+        SpscRing<uint64_t> ring(capacity);
+        const std::string name = "capacity " + std::to_string(capacity) + ": ";
+        check(ring.capacity() == capacity, name + "capacity()");
+
+        uint64_t value = 0;
+        check(ring.front() == nullptr && !ring.pop(value), name + "pop from an empty ring");
+
+        uint64_t pushed = 0;
+        uint64_t popped = 0;
+        std::mt19937 random(capacity);
+        for (uint32_t round = 0; round < 1000; ++round)
+        {
+            // Fill to a random level, sometimes until full
+            uint32_t fill = random() % (capacity + 2);
+            for (uint32_t i = 0; i < fill; ++i)
+            {
+                uint64_t next = pushed;
+                bool full = ring.size() == capacity;
+                check(ring.push(std::move(next)) == !full, name + "push succeeds unless full");
+                if (!full)
+                    pushed++;
+            }
+            check(ring.size() == pushed - popped, name + "size() after push");
+
+            // Drain to a random level, sometimes until empty
+            uint32_t drain = random() % (capacity + 2);
+            for (uint32_t i = 0; i < drain; ++i)
+            {
+                bool empty = ring.size() == 0;
+                if (i % 2 == 0)
+                {
+                    check(ring.pop(value) == !empty, name + "pop succeeds unless empty");
+                }
+                else
+                {
+                    uint64_t* front = ring.front();
+                    check((front != nullptr) == !empty, name + "front() unless empty");
+                    if (front)
+                    {
+                        value = *front;
+                        ring.pop();
+                    }
+                }
+                if (!empty)
+                {
+                    check(value == popped, name + "order");
+                    popped++;
+                }
+            }
+            check(ring.size() == pushed - popped, name + "size() after pop");
+        }
+    }
+}
+
+// Popped elements are released right away, not when their slot is reused
+void testOwnership()
+{
+    SpscRing<std::shared_ptr<int>> ring(4);
+    std::shared_ptr<int> value = std::make_shared<int>(42);
+    std::shared_ptr<int> copy = value;
+    ring.push(std::move(copy));
+    check(value.use_count() == 2, "ring holds a reference");
+
+    std::shared_ptr<int> out;
+    ring.pop(out);
+    out.reset();
+    check(value.use_count() == 1, "popped element released");
+}
+
+struct Item
+{
+    uint64_t sequence = 0;
+    uint64_t check = 0;    // Derived from sequence, catches torn or stale slots
+};
+
+// Producer and consumer threads: every item arrives exactly once and in order
+bool testThreads(uint32_t capacity, uint64_t count, bool pauseProducer, bool pauseConsumer)
+{
+    SpscRing<Item> ring(capacity);
+    uint64_t fullCount = 0;
+    uint64_t emptyCount = 0;
+    uint64_t errors = 0;
+
+    auto pause = [](std::mt19937& random)
+    {
+        if (random() % 4096 == 0)
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        else if (random() % 64 == 0)
+            std::this_thread::yield();
+    };
+
+    Timer timer;
+    std::thread producer([&]()
+    {
+        std::mt19937 random(1);
+        for (uint64_t i = 0; i < count; ++i)
+        {
+            Item item;
+            item.sequence = i;
+            item.check = i * 0x9E3779B97F4A7C15ull;
+            while (!ring.push(std::move(item)))
+            {
+                fullCount++;
+                std::this_thread::yield();
+            }
+            if (pauseProducer)
+                pause(random);
+        }
+    });
+
+    std::thread consumer([&]()
+    {
+        std::mt19937 random(2);
+        uint64_t expected = 0;
+        Item item;
+        while (expected < count)
+        {
+            if (!ring.pop(item))
+            {
+                emptyCount++;
+                std::this_thread::yield();
+                continue;
+            }
+            if (item.sequence != expected || item.check != expected * 0x9E3779B97F4A7C15ull)
+            {
+                errors++;
+                expected = item.sequence;    // Report once per gap or duplicate, not for every following item
+            }
+            expected++;
+            if (pauseConsumer)
+                pause(random);
+        }
+    });
+
+    producer.join();
+    consumer.join();
+    double seconds = timer.getElapsedSeconds();
+
+    bool ok = errors == 0 && ring.size() == 0;
+    std::cout << std::setw(8) << capacity << std::setw(10) << (pauseProducer ? "yes" : "no") << std::setw(10) << (pauseConsumer ? "yes" : "no")
+        << std::setw(12) << fullCount << std::setw(12) << emptyCount
+        << std::setw(10) << std::fixed << std::setprecision(1) << count / seconds / 1.0e6
+        << std::setw(10) << errors << std::endl;
+    return ok;
+}
+
+int main(int argc, char* argv[])
+{
+    std::cout << "NvPipe example application: Stress tests the lock-free task queue between the main and render threads." << std::endl << std::endl;
+
+    const uint64_t count = argc > 1 ? strtoull(argv[1], nullptr, 10) : 10000000;
+
+    testSingleThread();
+    testOwnership();
+    std::cout << "Single thread: " << (failures == 0 ? "passed" : "FAILED") << std::endl << std::endl;
+
+    std::cout << "Two threads, " << count << " items each run" << std::endl;
+    std::cout << std::setw(8) << "Slots" << std::setw(10) << "Slow in" << std::setw(10) << "Slow out"
+        << std::setw(12) << "Full" << std::setw(12) << "Empty" << std::setw(10) << "M/s" << std::setw(10) << "Errors" << std::endl;
+
+    // A producer that stalls empties the ring, a stalling consumer fills it
+    for (uint32_t capacity : { 1u, 2u, 20u, 1024u })
+    {
+        check(testThreads(capacity, count, false, false), "threads");
+        check(testThreads(capacity, count / 4, true, false), "threads, slow producer");
+        check(testThreads(capacity, count / 4, false, true), "threads, slow consumer");
+    }
+
+    std::cout << std::endl << (failures == 0 ? "All tests passed" : "Tests FAILED") << std::endl;
+    return failures == 0 ? 0 : 1;
+}
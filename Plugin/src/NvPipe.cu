@@ -29,6 +29,10 @@
 
 #ifdef NVPIPE_WITH_ENCODER
 #include "NvCodec/NvEncoder/NvEncoderCuda.h"
+#if defined(NVPIPE_WITH_OPENGL) && !defined(_WIN32)
+#define NVPIPE_WITH_NVENC_OPENGL	// NVENC only accepts OpenGL input on Linux
+#include "NvCodec/NvEncoder/NvEncoderGL.h"
+#endif
 #endif
 
 #ifdef NVPIPE_WITH_DECODER
@@ -39,14 +43,22 @@
 #include "Utils/NvCodecUtils.h"
 
 #include <memory>
+#include <algorithm>
 #include <iostream>
 #include <string>
 #include <sstream>
+#include <cstring>
 #include <unordered_map>
 #include <mutex>
 #include <queue>
+#include <deque>
+#include <vector>
+#include <list>
+#include <map>
+#include <chrono>
 #include <thread>
 #include <atomic>
+#include <functional>
 #include <cuda.h>
 #include <cuda_runtime_api.h>
 #include <condition_variable>
@@ -55,31 +67,29 @@
 #include <cuda_gl_interop.h>
 #endif
 
+#ifndef _WIN32
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "NvPipeException.h"
+#include "NvPipeMp4Writer.h"
+#include "NvPipeNalParser.h"
+#include "NvPipeRecordingSink.h"
+#include "NvPipeRtp.h"
+#include "NvPipeSharedRingWriter.h"
+#include "NvPipeStreamFile.h"
+#include "NvPipeStreamServer.h"
+#include "NvPipeSpscRing.h"
+
 #ifdef _DEBUG
 #define DEBUG_LOG(fmt, ...) (::fprintf(stderr, fmt, __VA_ARGS__))
 #else
 #define DEBUG_LOG(fmt, ...) 
 #endif
 
-class Exception
-{
-public:
-	Exception(std::string msg) : message(msg) {}
-	std::string getErrorString() const { return message; }
-public:
-	std::string message;
-};
-
-template<typename T>
-static bool CheckInsideQueueRange(T head, T tail, T tocheck) {	//Check when on a circular buffer, given a range[tail, head), is tocheck inside the range.
-	if (head >= tail) {
-		return (tocheck < head && tocheck >= tail);	//Didn't check, hope this is right.
-	}
-	else {
-		return (tocheck < head || tocheck >= tail);
-	}
-}
-
 inline void CUDA_THROW(cudaError_t code, std::string errorMessage)
 {
 	if (cudaSuccess != code) {
@@ -303,20 +313,61 @@ void nv12_to_uint32(const uint8_t* src, uint32_t srcPitch, uint8_t* dst, uint32_
 }
 
 #ifdef NVPIPE_WITH_OPENGL
+__global__
+void nv12_to_rgba32_surface(const uint8_t* src, uint32_t srcPitch, cudaSurfaceObject_t dst, uint32_t width, uint32_t height)
+{
+	const uint32_t x = blockIdx.x * blockDim.x + threadIdx.x;
+	const uint32_t y = blockIdx.y * blockDim.y + threadIdx.y;
+
+	if (x < width && y < height)
+	{
+		// Same BT.709 (limited range) conversion as Nv12ToColor32, but written straight into the texture surface
+		const uint8_t* UV = src + srcPitch * (height + y / 2) + (x & ~1u);
+
+		const float scale = 255.0f / (235.0f - 16.0f);
+		const float fy = scale * ((float)src[y * srcPitch + x] - 16.0f);
+		const float fu = scale * ((float)UV[0] - 128.0f);
+		const float fv = scale * ((float)UV[1] - 128.0f);
+
+		const float r = fy + 1.5748f * fv;
+		const float g = fy - 0.187324f * fu - 0.468124f * fv;
+		const float b = fy + 1.8556f * fu;
+
+		const uchar4 rgba = make_uchar4(
+			(uint8_t)fminf(fmaxf(r, 0.0f), 255.0f),
+			(uint8_t)fminf(fmaxf(g, 0.0f), 255.0f),
+			(uint8_t)fminf(fmaxf(b, 0.0f), 255.0f),
+			0);
+
+		surf2Dwrite(rgba, dst, x * sizeof(uchar4), y);
+	}
+}
+
 /**
  * @brief Utility class for managing CUDA-GL interop graphics resources.
+ * Registrations are kept in LRU order, the least recently used ones are unregistered once there are more than the capacity.
  */
 class GraphicsResourceRegistry
 {
 public:
+	static constexpr uint32_t kDefaultCapacity = 32;
+
+	GraphicsResourceRegistry()
+	{
+		std::lock_guard<std::mutex> lock(RegistriesMutex());
+		Registries().push_back(this);
+	}
+
 	virtual ~GraphicsResourceRegistry()
 	{
-		// Unregister all
-		for (auto& r : this->registeredPBOs)
-			CUDA_THROW(cudaGraphicsUnregisterResource(r.second.graphicsResource),
-				"Failed to unregister PBO graphics resource");
+		{
+			std::lock_guard<std::mutex> lock(RegistriesMutex());
+			auto& registries = Registries();
+			registries.erase(std::remove(registries.begin(), registries.end(), this), registries.end());
+		}
 
-		for (auto& r : this->registeredTextures) {
+		// Unregister all
+		for (auto& r : this->registered) {
 			auto result = cudaGraphicsUnregisterResource(r.second.graphicsResource);
 			//CUDA_THROW(result,"Failed to unregister texture graphics resource");  
 
@@ -330,10 +381,66 @@ public:
 		}
 	}
 
+	/**
+	 * Marks a texture as destroyed in every registry, from any thread.
+	 * Each registry unregisters it in collectReleasedTextures, before the GL name is used again.
+	 */
+	static void ReleaseTexture(uint32_t texture)
+	{
+		std::lock_guard<std::mutex> lock(RegistriesMutex());
+		for (auto registry : Registries())
+			registry->releasedTextures.push_back(texture);
+	}
+
+	/**
+	 * Unregisters the textures released since the last call. Called on the thread using the registry.
+	 * @return The released texture names, to drop other state kept for them.
+	 */
+	std::vector<uint32_t> collectReleasedTextures()
+	{
+		std::vector<uint32_t> released;
+		{
+			std::lock_guard<std::mutex> lock(RegistriesMutex());
+			released.swap(this->releasedTextures);
+		}
+
+		for (uint32_t texture : released)
+		{
+			auto it = this->registered.find(Key(false, texture));
+			if (it != this->registered.end())
+				this->unregister(it);
+		}
+		return released;
+	}
+
+	/**
+	 * Sets how many textures and PBOs stay registered. Safe from any thread, applied at the next registration.
+	 */
+	void setCapacity(uint32_t capacity)
+	{
+		this->capacity = std::max(capacity, 1u);
+	}
+
+	/**
+	 * Registrations used until endBatch() are not evicted, so they can be mapped together.
+	 */
+	void beginBatch()
+	{
+		this->batching = true;
+		this->batch++;
+	}
+
+	void endBatch()
+	{
+		this->batching = false;
+		this->batch++;	// Nothing is mapped anymore
+		this->evict();
+	}
+
 	cudaGraphicsResource_t getTextureGraphicsResource(uint32_t texture, uint32_t target, uint32_t width, uint32_t height, uint32_t flags)
 	{
 		// Check if texture needs to be (re)registered
-		RegisteredTexture& reg = this->registeredTextures[texture];
+		Registration& reg = this->use(Key(false, texture));
 
 		if (reg.width != width || reg.height != height || reg.target != target) {
 			if (reg.graphicsResource) {
@@ -351,13 +458,15 @@ public:
 			reg.target = target;
 		}
 
-		return reg.graphicsResource;
+		cudaGraphicsResource_t resource = reg.graphicsResource;
+		this->evict();
+		return resource;
 	}
 
 	cudaGraphicsResource_t getPBOGraphicsResource(uint32_t pbo, uint32_t width, uint32_t height, uint32_t flags)
 	{
 		// Check if PBO needs to be (re)registered
-		RegisteredPBO& reg = this->registeredPBOs[pbo];
+		Registration& reg = this->use(Key(true, pbo));
 
 		if (reg.width != width || reg.height != height) {
 			if (reg.graphicsResource) {
@@ -374,26 +483,88 @@ public:
 			reg.height = height;
 		}
 
-		return reg.graphicsResource;
+		cudaGraphicsResource_t resource = reg.graphicsResource;
+		this->evict();
+		return resource;
 	}
 
 private:
-	struct RegisteredTexture
+	struct Registration
 	{
 		cudaGraphicsResource_t graphicsResource = nullptr;
 		uint32_t width = 0;
 		uint32_t height = 0;
 		uint32_t target = 0;
+		uint64_t batch = 0;	// Last batch the registration was used in
+		std::list<uint64_t>::iterator lruPosition;
 	};
-	std::unordered_map<uint32_t, RegisteredTexture> registeredTextures;
 
-	struct RegisteredPBO
+	static uint64_t Key(bool pbo, uint32_t name)
 	{
-		cudaGraphicsResource_t graphicsResource = nullptr;
-		uint32_t width = 0;
-		uint32_t height = 0;
-	};
-	std::unordered_map<uint32_t, RegisteredPBO> registeredPBOs;
+		return ((uint64_t)pbo << 32) | name;
+	}
+
+	static std::vector<GraphicsResourceRegistry*>& Registries()
+	{
+		static std::vector<GraphicsResourceRegistry*>& registries = *new std::vector<GraphicsResourceRegistry*>();
+		return registries;
+	}
+
+	static std::mutex& RegistriesMutex()
+	{
+		static std::mutex& mutex = *new std::mutex();
+		return mutex;
+	}
+
+	Registration& use(uint64_t key)
+	{
+		if (!this->batching)
+			this->batch++;
+
+		auto it = this->registered.find(key);
+		if (it == this->registered.end())
+		{
+			it = this->registered.emplace(key, Registration()).first;
+			this->lru.push_front(key);
+			it->second.lruPosition = this->lru.begin();
+		}
+		else
+		{
+			this->lru.splice(this->lru.begin(), this->lru, it->second.lruPosition);
+		}
+
+		it->second.batch = this->batch;
+		return it->second;
+	}
+
+	void evict()
+	{
+		// The least recently used registration is at the back, registrations of the running batch may be mapped
+		while (this->registered.size() > this->capacity)
+		{
+			auto it = this->registered.find(this->lru.back());
+			if (it->second.batch == this->batch)
+				break;
+			this->unregister(it);
+		}
+	}
+
+	void unregister(std::unordered_map<uint64_t, Registration>::iterator it)
+	{
+		// Errors are ignored, a released GL texture is usually gone already and the registration is dropped either way
+		if (it->second.graphicsResource)
+			cudaGraphicsUnregisterResource(it->second.graphicsResource);
+		this->lru.erase(it->second.lruPosition);
+		this->registered.erase(it);
+	}
+
+	std::unordered_map<uint64_t, Registration> registered;
+	std::list<uint64_t> lru;	// Most recently used first
+	std::atomic<uint32_t> capacity{ kDefaultCapacity };
+	bool batching = false;
+	uint64_t batch = 0;
+
+	std::vector<uint32_t> releasedTextures;	// Guarded by RegistriesMutex()
 };
 #endif
 
@@ -443,13 +614,25 @@ inline std::string EncErrorCodeToString(NVENCSTATUS code)
 class Encoder
 {
 public:
-	Encoder(NvPipe_Format format, NvPipe_Codec codec, NvPipe_Compression compression, uint64_t bitrate, uint32_t targetFrameRate, uint32_t width, uint32_t height)
+	Encoder(NvPipe_Format format, NvPipe_Codec codec, NvPipe_Compression compression, uint64_t bitrate, uint32_t targetFrameRate, uint32_t width, uint32_t height,
+		NvPipe_EncoderBackend backend = NVPIPE_ENCODER_BACKEND_CUDA)
 	{
 		this->format = format;
 		this->codec = codec;
 		this->compression = compression;
 		this->bitrate = bitrate;
 		this->targetFrameRate = targetFrameRate;
+		this->backend = backend;
+
+		if (this->backend == NVPIPE_ENCODER_BACKEND_OPENGL)
+		{
+#ifdef NVPIPE_WITH_NVENC_OPENGL
+			if (this->format != NVPIPE_RGBA32)
+				throw Exception("The OpenGL encoder backend only supports the RGBA32 format");
+#else
+			throw Exception("The OpenGL encoder backend is only available on Linux with the OpenGL interface");
+#endif
+		}
 
 		this->recreate(width, height);
 	}
@@ -459,6 +642,8 @@ public:
 		// Destroy encoder
 		if (this->encoder)
 		{
+			this->releaseInputSurfaces();
+
 			std::vector<std::vector<uint8_t>> tmp;
 			this->encoder->EndEncode(tmp);
 			this->encoder->DestroyEncoder();
@@ -494,71 +679,104 @@ public:
 		this->targetFrameRate = targetFrameRate;
 	}
 
-	uint64_t encode(const void* src, uint64_t srcPitch, uint8_t* dst, uint64_t dstSize, uint32_t width, uint32_t height, bool forceIFrame)
+	/**
+	 * Writes the encoded frames into an MP4 file from the next keyframe on, which is forced.
+	 * Frames are queued in a buffer of bufferSize bytes (0 for the default) and written by a background thread.
+	 */
+	void startRecording(const std::string& path, uint64_t bufferSize)
 	{
-		// Recreate encoder if size changed
-		if (this->format == NVPIPE_UINT16)
-			this->recreate(width * 2, height); // split into two adjecent tiles in Y channel
-		else if (this->format == NVPIPE_UINT32)
-			this->recreate(width * 4, height); // split into four adjecent tiles in Y channel
-		else
-			this->recreate(width, height);
+		std::unique_ptr<Mp4Writer> writer(new Mp4Writer(path, this->codec, this->targetFrameRate, bufferSize));
 
-		// RGBA can be directly copied from host or device
-		if (this->format == NVPIPE_RGBA32)
+		// The previous recording is drained here, not under the lock the encode path takes
+		std::unique_ptr<Mp4Writer> previous;
+		std::unique_ptr<Mp4Writer> failed;
 		{
-			const NvEncInputFrame* f = this->encoder->GetNextInputFrame();
-			CUDA_THROW(cudaMemcpy2D(f->inputPtr, f->pitch, src, srcPitch, width * 4, height, isDevicePointer(src) ? cudaMemcpyDeviceToDevice : cudaMemcpyHostToDevice),
-				"Failed to copy input frame");
+			std::lock_guard<std::mutex> lock(this->recordingMutex);
+			previous = std::move(this->recording);
+			failed = std::move(this->failedRecording);
+			this->recording = std::move(writer);
+			this->recordingError.clear();
+			this->requestIFrame = true;
 		}
-		// Other formats need to be copied to the device and converted
-		else
-		{
-			// Copy to device if necessary
-			bool copyToDevice = !isDevicePointer(src);
-			if (copyToDevice)
-			{
-				this->recreateDeviceBuffer(width, height);
-				CUDA_THROW(cudaMemcpy(this->deviceBuffer, src, getFrameSize(this->format, width, height), cudaMemcpyHostToDevice),
-					"Failed to copy input frame");
-			}
+	}
 
-			// Convert
-			const NvEncInputFrame* f = this->encoder->GetNextInputFrame();
+	/**
+	 * Finishes the recording. Returns the error that ended it early, if any.
+	 */
+	std::string stopRecording()
+	{
+		std::unique_ptr<Mp4Writer> writer;
+		std::unique_ptr<Mp4Writer> failed;
+		std::string error;
+		{
+			std::lock_guard<std::mutex> lock(this->recordingMutex);
+			writer = std::move(this->recording);
+			failed = std::move(this->failedRecording);
+			error = std::move(this->recordingError);
+		}
 
-			if (this->format == NVPIPE_UINT4)
+		if (writer)
+		{
+			try
 			{
-				// one thread per pixel (extract 4 bit and copy to 8 bit)
-				dim3 gridSize(width / 16 + 1, height / 2 + 1);
-				dim3 blockSize(16, 2);
-
-				uint4_to_nv12 << <gridSize, blockSize >> > ((uint8_t*)(copyToDevice ? this->deviceBuffer : src), srcPitch, (uint8_t*)f->inputPtr, f->pitch, width, height);
+				writer->finish();
 			}
-			else if (this->format == NVPIPE_UINT8)
+			catch (const Exception & e)
 			{
-				// one thread per pixel (copy 8 bit)
-				dim3 gridSize(width / 16 + 1, height / 2 + 1);
-				dim3 blockSize(16, 2);
-
-				uint8_to_nv12 << <gridSize, blockSize >> > ((uint8_t*)(copyToDevice ? this->deviceBuffer : src), srcPitch, (uint8_t*)f->inputPtr, f->pitch, width, height);
+				error = e.message;
 			}
-			else if (this->format == NVPIPE_UINT16)
-			{
-				// one thread per pixel (split 16 bit into 2x 8 bit)
-				dim3 gridSize(width / 16 + 1, height / 2 + 1);
-				dim3 blockSize(16, 2);
+		}
+		return error;
+	}
 
-				uint16_to_nv12 << <gridSize, blockSize >> > ((uint8_t*)(copyToDevice ? this->deviceBuffer : src), srcPitch, (uint8_t*)f->inputPtr, f->pitch, width, height);
-			}
-			else if (this->format == NVPIPE_UINT32)
-			{
-				// one thread per pixel (split 32 bit into 4x 8 bit)
-				dim3 gridSize(width / 16 + 1, height / 2 + 1);
-				dim3 blockSize(16, 2);
+	void getRecordingStats(NvPipe_RecordingStats* stats)
+	{
+		std::lock_guard<std::mutex> lock(this->recordingMutex);
+		*stats = NvPipe_RecordingStats();
+		if (this->recording)
+		{
+			this->recording->getStats(stats);
+			stats->active = 1;
+		}
+	}
 
-				uint32_to_nv12 << <gridSize, blockSize >> > ((uint8_t*)(copyToDevice ? this->deviceBuffer : src), srcPitch, (uint8_t*)f->inputPtr, f->pitch, width, height);
-			}
+	/**
+	 * Publishes the encoded frames into a named shared-memory ring for another process, replacing a running output.
+	 */
+	void startSharedOutput(const std::string& name, uint64_t capacity)
+	{
+		std::unique_ptr<SharedRingWriter> writer(new SharedRingWriter(name, this->codec, capacity));
+
+		std::unique_ptr<SharedRingWriter> previous;
+		{
+			std::lock_guard<std::mutex> lock(this->sharedOutputMutex);
+			previous = std::move(this->sharedOutput);
+			this->sharedOutput = std::move(writer);
+		}
+	}
+
+	void stopSharedOutput()
+	{
+		std::unique_ptr<SharedRingWriter> writer;
+		{
+			std::lock_guard<std::mutex> lock(this->sharedOutputMutex);
+			writer = std::move(this->sharedOutput);
 		}
+	}
+
+	/**
+	 * Sends the encoded frames to a stream server, which also gets to force keyframes. Not owned: the encoder stops
+	 * sending when the server is destroyed.
+	 */
+	void attachStreamServer(const std::shared_ptr<StreamServer>& server)
+	{
+		std::lock_guard<std::mutex> lock(this->streamServerMutex);
+		this->streamServer = server;
+	}
+
+	uint64_t encode(const void* src, uint64_t srcPitch, uint8_t* dst, uint64_t dstSize, uint32_t width, uint32_t height, bool forceIFrame)
+	{
+		this->copyInput(src, srcPitch, width, height);
 
 		// Encode
 		return this->encode(dst, dstSize, forceIFrame);
@@ -566,6 +784,11 @@ public:
 
 #ifdef NVPIPE_WITH_OPENGL
 
+	void setResourceCacheCapacity(uint32_t capacity)
+	{
+		this->registry.setCapacity(capacity);
+	}
+
 	uint64_t encodeTexture(uint32_t texture, uint32_t target, uint8_t* dst, uint64_t dstSize, uint32_t width, uint32_t height, bool forceIFrame)
 	{
 		if (this->format != NVPIPE_RGBA32)
@@ -573,6 +796,13 @@ public:
 
 		// Recreate encoder if size changed
 		this->recreate(width, height);
+		this->collectReleasedTextures();
+
+#ifdef NVPIPE_WITH_NVENC_OPENGL
+		// NVENC reads the texture itself, no interop mapping or copy
+		if (this->backend == NVPIPE_ENCODER_BACKEND_OPENGL)
+			return this->encode(dst, dstSize, forceIFrame, this->getTextureSurface(texture, target, width, height));
+#endif
 
 		// Map texture and copy input to encoder
 		cudaGraphicsResource_t resource = this->registry.getTextureGraphicsResource(texture, target, width, height, cudaGraphicsRegisterFlagsReadOnly);
@@ -623,6 +853,79 @@ public:
 #endif
 
 protected:
+	/**
+	 * Copies (and converts) a host or device frame into the next encoder input, recreating the encoder if the size changed.
+	 */
+	void copyInput(const void* src, uint64_t srcPitch, uint32_t width, uint32_t height)
+	{
+		if (this->backend != NVPIPE_ENCODER_BACKEND_CUDA)
+			throw Exception("The OpenGL encoder backend only encodes textures");
+
+		// Recreate encoder if size changed
+		if (this->format == NVPIPE_UINT16)
+			this->recreate(width * 2, height); // split into two adjecent tiles in Y channel
+		else if (this->format == NVPIPE_UINT32)
+			this->recreate(width * 4, height); // split into four adjecent tiles in Y channel
+		else
+			this->recreate(width, height);
+
+		// RGBA can be directly copied from host or device
+		if (this->format == NVPIPE_RGBA32)
+		{
+			const NvEncInputFrame* f = this->encoder->GetNextInputFrame();
+			CUDA_THROW(cudaMemcpy2D(f->inputPtr, f->pitch, src, srcPitch, width * 4, height, isDevicePointer(src) ? cudaMemcpyDeviceToDevice : cudaMemcpyHostToDevice),
+				"Failed to copy input frame");
+		}
+		// Other formats need to be copied to the device and converted
+		else
+		{
+			// Copy to device if necessary
+			bool copyToDevice = !isDevicePointer(src);
+			if (copyToDevice)
+			{
+				this->recreateDeviceBuffer(width, height);
+				CUDA_THROW(cudaMemcpy(this->deviceBuffer, src, getFrameSize(this->format, width, height), cudaMemcpyHostToDevice),
+					"Failed to copy input frame");
+			}
+
+			// Convert
+			const NvEncInputFrame* f = this->encoder->GetNextInputFrame();
+
+			if (this->format == NVPIPE_UINT4)
+			{
+				// one thread per pixel (extract 4 bit and copy to 8 bit)
+				dim3 gridSize(width / 16 + 1, height / 2 + 1);
+				dim3 blockSize(16, 2);
+
+				uint4_to_nv12 << <gridSize, blockSize >> > ((uint8_t*)(copyToDevice ? this->deviceBuffer : src), srcPitch, (uint8_t*)f->inputPtr, f->pitch, width, height);
+			}
+			else if (this->format == NVPIPE_UINT8)
+			{
+				// one thread per pixel (copy 8 bit)
+				dim3 gridSize(width / 16 + 1, height / 2 + 1);
+				dim3 blockSize(16, 2);
+
+				uint8_to_nv12 << <gridSize, blockSize >> > ((uint8_t*)(copyToDevice ? this->deviceBuffer : src), srcPitch, (uint8_t*)f->inputPtr, f->pitch, width, height);
+			}
+			else if (this->format == NVPIPE_UINT16)
+			{
+				// one thread per pixel (split 16 bit into 2x 8 bit)
+				dim3 gridSize(width / 16 + 1, height / 2 + 1);
+				dim3 blockSize(16, 2);
+
+				uint16_to_nv12 << <gridSize, blockSize >> > ((uint8_t*)(copyToDevice ? this->deviceBuffer : src), srcPitch, (uint8_t*)f->inputPtr, f->pitch, width, height);
+			}
+			else if (this->format == NVPIPE_UINT32)
+			{
+				// one thread per pixel (split 32 bit into 4x 8 bit)
+				dim3 gridSize(width / 16 + 1, height / 2 + 1);
+				dim3 blockSize(16, 2);
+
+				uint32_to_nv12 << <gridSize, blockSize >> > ((uint8_t*)(copyToDevice ? this->deviceBuffer : src), srcPitch, (uint8_t*)f->inputPtr, f->pitch, width, height);
+			}
+		}
+	}
+
 	void recreate(uint32_t width, uint32_t height)
 	{
 		std::lock_guard<std::mutex> lock(Encoder::mutex);
@@ -635,10 +938,13 @@ protected:
 		this->height = height;
 
 		// Ensure we have a CUDA context
-		CUDA_THROW(cudaDeviceSynchronize(),
-			"Failed to synchronize device");
-		CUcontext cudaContext;
-		cuCtxGetCurrent(&cudaContext);
+		CUcontext cudaContext = nullptr;
+		if (this->backend == NVPIPE_ENCODER_BACKEND_CUDA)
+		{
+			CUDA_THROW(cudaDeviceSynchronize(),
+				"Failed to synchronize device");
+			cuCtxGetCurrent(&cudaContext);
+		}
 
 		// Create encoder
 		try
@@ -646,6 +952,8 @@ protected:
 			// Destroy previous encoder
 			if (this->encoder)
 			{
+				this->releaseInputSurfaces();
+
 				std::vector<std::vector<uint8_t>> tmp;
 				this->encoder->EndEncode(tmp);
 				this->encoder->DestroyEncoder();
@@ -653,7 +961,12 @@ protected:
 			}
 
 			NV_ENC_BUFFER_FORMAT bufferFormat = (this->format == NVPIPE_RGBA32) ? NV_ENC_BUFFER_FORMAT_ABGR : NV_ENC_BUFFER_FORMAT_NV12;
-			this->encoder = std::unique_ptr<NvEncoderCuda>(new NvEncoderCuda(cudaContext, width, height, bufferFormat, 0));
+#ifdef NVPIPE_WITH_NVENC_OPENGL
+			if (this->backend == NVPIPE_ENCODER_BACKEND_OPENGL)
+				this->encoder = std::unique_ptr<NvEncoder>(new NvEncoderGL(width, height, bufferFormat, 0));	// Needs the current GL context
+			else
+#endif
+				this->encoder = std::unique_ptr<NvEncoder>(new NvEncoderCuda(cudaContext, width, height, bufferFormat, 0));
 
 			NV_ENC_INITIALIZE_PARAMS initializeParams = { NV_ENC_INITIALIZE_PARAMS_VER };
 			NV_ENC_CONFIG encodeConfig = { NV_ENC_CONFIG_VER };
@@ -698,46 +1011,213 @@ protected:
 		}
 	}
 
-	uint64_t encode(uint8_t* dst, uint64_t dstSize, bool forceIFrame)
+	uint64_t encode(uint8_t* dst, uint64_t dstSize, bool forceIFrame, NV_ENC_REGISTERED_PTR externalInput = nullptr)
 	{
 		std::vector<std::vector<uint8_t>> packets;
+		this->encodePackets(packets, forceIFrame, externalInput);
+		const int64_t timeUs = NowMicroseconds();
+		this->record(packets, timeUs);
+		this->publish(packets, timeUs);
 
-		try
-		{
-			if (forceIFrame)
+		// Copy output
+		uint64_t size = 0;
+		for (auto& p : packets)
+		{
+			if (size + p.size() <= dstSize)
 			{
-				NV_ENC_PIC_PARAMS params = {};
-				params.encodePicFlags = NV_ENC_PIC_FLAG_FORCEIDR | NV_ENC_PIC_FLAG_OUTPUT_SPSPPS;
-
-				this->encoder->EncodeFrame(packets, &params);
+				memcpy(dst + size, p.data(), p.size());
+				size += p.size();
 			}
 			else
 			{
-				this->encoder->EncodeFrame(packets);
+				throw Exception("Encode output buffer overflow");
 			}
 		}
+
+		return size;
+	}
+
+	/**
+	 * Encodes the next input frame, or an input surface registered with the current encoder session.
+	 */
+	void encodePackets(std::vector<std::vector<uint8_t>>& packets, bool forceIFrame, NV_ENC_REGISTERED_PTR externalInput = nullptr)
+	{
+		if (this->requestIFrame.exchange(false))
+			forceIFrame = true;
+
+		try
+		{
+			NV_ENC_PIC_PARAMS params = {};
+			if (forceIFrame)
+				params.encodePicFlags = NV_ENC_PIC_FLAG_FORCEIDR | NV_ENC_PIC_FLAG_OUTPUT_SPSPPS;
+
+			if (externalInput)
+				this->encoder->EncodeExternalFrame(externalInput, packets, forceIFrame ? &params : nullptr);
+			else
+				this->encoder->EncodeFrame(packets, forceIFrame ? &params : nullptr);
+		}
 		catch (NVENCException & e)
 		{
 			throw Exception("Encode failed (" + e.getErrorString() + ", error " + std::to_string(e.getErrorCode()) + " = " + EncErrorCodeToString(e.getErrorCode()) + ")");
 		}
+	}
 
-		// Copy output
-		uint64_t size = 0;
+	/**
+	 * Adds an encoded frame to the recording, a failure ends the recording instead of the encode.
+	 */
+	void record(const std::vector<std::vector<uint8_t>>& packets, int64_t timeUs)
+	{
+		std::lock_guard<std::mutex> lock(this->recordingMutex);
+		if (!this->recording)
+			return;
+
+		try
+		{
+			this->recording->writeFrame(packets, this->width, this->height, timeUs);
+			if (this->recording->takeKeyframeRequest())
+				this->requestIFrame = true;
+		}
+		catch (const Exception & e)
+		{
+			// Closing drains the write-behind buffer, stopRecording does that off the encode path
+			this->recordingError = e.message;
+			this->failedRecording = std::move(this->recording);
+		}
+	}
+
+	/**
+	 * Hands an encoded frame to the shared output and the stream server, if any. Neither copies more than once or blocks.
+	 */
+	void publish(const std::vector<std::vector<uint8_t>>& packets, int64_t timeUs)
+	{
+		{
+			std::lock_guard<std::mutex> lock(this->sharedOutputMutex);
+			if (this->sharedOutput)
+			{
+				this->sharedOutput->publish(packets, this->width, this->height, timeUs);
+				if (this->sharedOutput->takeKeyframeRequest())
+					this->requestIFrame = true;
+			}
+		}
+
+		std::lock_guard<std::mutex> lock(this->streamServerMutex);
+		std::shared_ptr<StreamServer> server = this->streamServer.lock();
+		if (!server)
+			return;
+
+		this->serverParts.clear();
+		this->serverSizes.clear();
 		for (auto& p : packets)
 		{
-			if (size + p.size() <= dstSize)
+			this->serverParts.push_back(p.data());
+			this->serverSizes.push_back(p.size());
+		}
+		server->send(this->serverParts.data(), this->serverSizes.data(), (uint32_t)packets.size(), timeUs);
+		if (server->takeKeyframeRequest())
+			this->requestIFrame = true;
+	}
+
+	static int64_t NowMicroseconds()
+	{
+		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	/**
+	 * Called before the encoder session is destroyed, to unregister surfaces registered with it.
+	 */
+	virtual void releaseInputSurfaces()
+	{
+#ifdef NVPIPE_WITH_NVENC_OPENGL
+		for (auto& t : this->textureSurfaces)
+		{
+			try
 			{
-				memcpy(dst + size, p.data(), p.size());
-				size += p.size();
+				this->encoder->UnregisterExternalInput(t.second.surface);
 			}
-			else
+			catch (NVENCException&)
 			{
-				throw Exception("Encode output buffer overflow");
 			}
 		}
+		this->textureSurfaces.clear();
+#endif
+	}
 
-		return size;
+#ifdef NVPIPE_WITH_NVENC_OPENGL
+	struct TextureSurface
+	{
+		NV_ENC_INPUT_RESOURCE_OPENGL_TEX resource = {};	// Kept alive while registered
+		NV_ENC_REGISTERED_PTR surface = nullptr;
+		uint32_t width = 0;
+		uint32_t height = 0;
+	};
+
+	/**
+	 * Registers the texture as NVENC input surface on first use, like the CUDA path's GraphicsResourceRegistry.
+	 */
+	NV_ENC_REGISTERED_PTR getTextureSurface(uint32_t texture, uint32_t target, uint32_t width, uint32_t height)
+	{
+		TextureSurface& t = this->textureSurfaces[std::make_pair(texture, target)];
+		try
+		{
+			if (t.surface && (t.width != width || t.height != height))
+			{
+				this->encoder->UnregisterExternalInput(t.surface);
+				t.surface = nullptr;
+			}
+
+			if (!t.surface)
+			{
+				t.resource.texture = texture;
+				t.resource.target = target;
+				t.surface = this->encoder->RegisterExternalInput(&t.resource, NV_ENC_INPUT_RESOURCE_TYPE_OPENGL_TEX, width * 4);
+				t.width = width;
+				t.height = height;
+			}
+		}
+		catch (NVENCException & e)
+		{
+			this->textureSurfaces.erase(std::make_pair(texture, target));
+			throw Exception("Failed to register texture with encoder (" + e.getErrorString() + ", error " + std::to_string(e.getErrorCode()) + " = " + EncErrorCodeToString(e.getErrorCode()) + ")");
+		}
+
+		return t.surface;
 	}
+#endif
+
+#ifdef NVPIPE_WITH_OPENGL
+	/**
+	 * Drops the registrations of textures destroyed by the application, before their names are reused.
+	 */
+	void collectReleasedTextures()
+	{
+		std::vector<uint32_t> released = this->registry.collectReleasedTextures();
+#ifdef NVPIPE_WITH_NVENC_OPENGL
+		for (uint32_t texture : released)
+		{
+			for (auto it = this->textureSurfaces.begin(); it != this->textureSurfaces.end();)
+			{
+				if (it->first.first != texture)
+				{
+					++it;
+					continue;
+				}
+
+				try
+				{
+					this->encoder->UnregisterExternalInput(it->second.surface);
+				}
+				catch (NVENCException&)
+				{
+					// The GL texture is usually gone already
+				}
+				it = this->textureSurfaces.erase(it);
+			}
+		}
+#else
+		(void)released;
+#endif
+	}
+#endif
 
 	void recreateDeviceBuffer(uint32_t width, uint32_t height)
 	{
@@ -761,10 +1241,25 @@ protected:
 	NvPipe_Compression compression;
 	uint64_t bitrate;
 	uint32_t targetFrameRate;
+	NvPipe_EncoderBackend backend;
 	uint32_t width = 0;
 	uint32_t height = 0;
 
-	std::unique_ptr<NvEncoderCuda> encoder;
+	std::unique_ptr<NvEncoder> encoder;
+	std::atomic<bool> requestIFrame{ false };	// Forces an IDR on the next frame
+
+	std::mutex recordingMutex;
+	std::unique_ptr<Mp4Writer> recording;
+	std::unique_ptr<Mp4Writer> failedRecording;	// Ended by an error, closed by the next start or stop
+	std::string recordingError;
+
+	std::mutex sharedOutputMutex;
+	std::unique_ptr<SharedRingWriter> sharedOutput;
+
+	std::mutex streamServerMutex;
+	std::weak_ptr<StreamServer> streamServer;
+	std::vector<const uint8_t*> serverParts;
+	std::vector<uint64_t> serverSizes;
 
 	void* deviceBuffer = nullptr;
 	uint64_t deviceBufferSize = 0;
@@ -774,6 +1269,9 @@ protected:
 #ifdef NVPIPE_WITH_OPENGL
 	GraphicsResourceRegistry registry;
 #endif
+#ifdef NVPIPE_WITH_NVENC_OPENGL
+	std::map<std::pair<uint32_t, uint32_t>, TextureSurface> textureSurfaces;	// By texture and target
+#endif
 };
 
 std::mutex Encoder::mutex;
@@ -793,39 +1291,408 @@ inline std::string DecErrorCodeToString(CUresult code)
 	return "Unknown error code";
 }
 
+/**
+ * @brief Splits an Annex-B byte stream fed in arbitrary chunks into complete access units.
+ * A picture is considered complete once the first NAL unit of the next access unit (AUD, parameter sets, SEI
+ * or the first slice of a new picture) has arrived, or when the caller marks the end of a picture explicitly.
+ */
+class AccessUnitAssembler
+{
+public:
+	AccessUnitAssembler(NvPipe_Codec codec) : codec(codec) {}
+
+	template<typename F>
+	void append(const uint8_t* data, uint64_t size, int64_t timestamp, bool endOfPicture, F onAccessUnit)
+	{
+		if (size > 0)
+			this->chunks.push_back(Chunk{ this->buffer.size(), timestamp });
+		this->buffer.insert(this->buffer.end(), data, data + size);
+
+		// Look for NAL units that start a new access unit
+		const size_t headerSize = (this->codec == NVPIPE_HEVC) ? 2 : 1;
+		size_t i = this->scanOffset;
+		while (true)
+		{
+			// Start codes before the limit have their NAL header (and the byte after it) buffered
+			const size_t limit = (this->buffer.size() > 3 + headerSize) ? this->buffer.size() - 3 - headerSize : 0;
+			if (i >= limit)
+				break;
+			i = (size_t)FindStartCode(this->buffer.data(), i, limit + 2);
+			if (i >= limit)
+			{
+				i = limit;
+				break;
+			}
+
+			// Include the leading zero of a 4 byte start code
+			size_t nalStart = (i > 0 && this->buffer[i - 1] == 0) ? i - 1 : i;
+			const uint8_t* nal = this->buffer.data() + i + 3;
+
+			bool isSlice, startsAccessUnit;
+			this->classify(nal, isSlice, startsAccessUnit);
+
+			if (startsAccessUnit && this->hasPicture && nalStart > 0)
+			{
+				onAccessUnit(this->buffer.data(), (uint64_t)nalStart, this->chunks.front().timestamp);
+
+				this->buffer.erase(this->buffer.begin(), this->buffer.begin() + nalStart);
+				this->dropChunks(nalStart);
+				this->hasPicture = false;
+				i -= nalStart;
+			}
+
+			this->hasPicture |= isSlice;
+			i += 3;
+		}
+		this->scanOffset = i;
+
+		if (endOfPicture)
+			this->flush(onAccessUnit);
+	}
+
+	template<typename F>
+	void flush(F onAccessUnit)
+	{
+		// Parameter sets or SEI sent on their own belong to the next picture, they stay until its slices arrive
+		if (!this->hasPicture)
+			return;
+
+		onAccessUnit(this->buffer.data(), (uint64_t)this->buffer.size(), this->chunks.front().timestamp);
+		this->reset();
+	}
+
+	void reset()
+	{
+		this->buffer.clear();
+		this->chunks.clear();
+		this->scanOffset = 0;
+		this->hasPicture = false;
+	}
+
+private:
+	struct Chunk
+	{
+		size_t offset;	// In buffer
+		int64_t timestamp;
+	};
+
+	/**
+	 * Forgets the chunks before offset. An access unit takes the timestamp of the chunk it starts in,
+	 * also if its start code straddles two chunks.
+	 */
+	void dropChunks(size_t offset)
+	{
+		size_t first = 0;
+		while (first + 1 < this->chunks.size() && this->chunks[first + 1].offset <= offset)
+			++first;
+		this->chunks.erase(this->chunks.begin(), this->chunks.begin() + first);
+		for (Chunk& chunk : this->chunks)
+			chunk.offset = chunk.offset > offset ? chunk.offset - offset : 0;
+	}
+
+	void classify(const uint8_t* nal, bool& isSlice, bool& startsAccessUnit) const
+	{
+		if (this->codec == NVPIPE_HEVC)
+		{
+			const uint8_t type = (nal[0] >> 1) & 0x3F;
+			isSlice = type < 32;
+			// VPS, SPS, PPS, AUD, prefix SEI, or first_slice_segment_in_pic_flag
+			startsAccessUnit = (type >= 32 && type <= 35) || type == 39 || (isSlice && (nal[2] & 0x80));
+		}
+		else
+		{
+			const uint8_t type = nal[0] & 0x1F;
+			isSlice = type >= 1 && type <= 5;
+			// SEI, SPS, PPS, AUD, or first_mb_in_slice == 0 (ue(v) coded as a single 1 bit)
+			startsAccessUnit = (type >= 6 && type <= 9) || (isSlice && (nal[1] & 0x80));
+		}
+	}
+
+	NvPipe_Codec codec;
+	std::vector<uint8_t> buffer;
+	std::vector<Chunk> chunks;	// Where the buffered chunks start, with their timestamps
+	size_t scanOffset = 0;
+	bool hasPicture = false;
+};
+
 /**
  * @brief Decoder implementation.
  */
 class Decoder
 {
 public:
-	Decoder(NvPipe_Format format, NvPipe_Codec codec, uint32_t width, uint32_t height)
+	Decoder(NvPipe_Format format, NvPipe_Codec codec, uint32_t width, uint32_t height, uint32_t outputWidth = 0, uint32_t outputHeight = 0, const Rect* cropRect = nullptr) :
+		assembler(codec)
 	{
 		this->format = format;
 		this->codec = codec;
 
-		this->recreate(width, height);
+		// Optional post-processing in NVDEC (crop, then scale to the output size)
+		if (outputWidth || outputHeight || cropRect)
+		{
+			if (this->format != NVPIPE_RGBA32 && this->format != NVPIPE_UINT8)
+				throw Exception("Decoder crop and resize are only supported for the RGBA32 and UINT8 formats");
+
+			if (cropRect && cropRect->r && cropRect->b)
+			{
+				if (cropRect->l < 0 || cropRect->t < 0 || cropRect->r <= cropRect->l || cropRect->b <= cropRect->t
+					|| (width && (uint32_t)cropRect->r > width) || (height && (uint32_t)cropRect->b > height))
+					throw Exception("Invalid decoder crop rectangle");
+
+				if ((cropRect->l | cropRect->t | cropRect->r | cropRect->b) & 1)
+					throw Exception("Decoder crop rectangle must be aligned to even pixels");
+
+				this->cropRect = *cropRect;
+			}
+
+			if (!outputWidth != !outputHeight)
+				throw Exception("Decoder output width and height must be set together");
+
+			if (outputWidth && outputHeight)
+			{
+				if ((outputWidth & 1) || (outputHeight & 1))
+					throw Exception("Decoder output size must be even");
+
+				this->resizeDim.w = (int)outputWidth;
+				this->resizeDim.h = (int)outputHeight;
+			}
+		}
+
+		this->create(width, height);
 	}
 
 	~Decoder()
 	{
+		// Return frames that were never polled
+		this->releaseReadyFrames();
+
 		// Free temporary device memory
 		if (this->deviceBuffer)
 			cudaFree(this->deviceBuffer);
 	}
 
-	uint64_t decode(const uint8_t* src, uint64_t srcSize, void* dst, uint32_t width, uint32_t height)
+	uint64_t decode(const uint8_t* src, uint64_t srcSize, void* dst, uint64_t dstSize, uint32_t width, uint32_t height)
+	{
+		// Decode
+		uint8_t* decoded = this->decode(src, srcSize);
+
+		FrameInfo info = this->getCurrentFrameInfo();
+		this->checkFrameSize(info, width, height);
+		if (decoded)
+			this->checkOutputSize(info, dstSize);
+
+		return this->convert(decoded, info, dst);
+	}
+
+	/**
+	 * Feeds one packet into the decoder without waiting for output.
+	 * Every picture NVDEC finishes is kept (locked) until it is fetched with poll().
+	 */
+	void submit(const uint8_t* src, uint64_t srcSize, int64_t timestamp)
+	{
+		// Keep a pool frame free for the new picture by dropping the oldest one nobody fetched yet
+		while (!this->readyFrames.empty() && this->readyFrames.size() + this->lockedFrames.size() >= this->framePoolSize)
+		{
+			this->decoder->UnlockFrame(&this->readyFrames.front().data, 1);
+			this->readyFrames.pop_front();
+			this->droppedFrames++;
+		}
+
+		int numFramesDecoded = 0;
+		uint8_t** decodedFrames;
+		int64_t* timeStamps;
+
+		try
+		{
+			this->decoder->DecodeLockFrame(src, srcSize, &decodedFrames, &numFramesDecoded, CUVID_PKT_ENDOFPICTURE, &timeStamps, timestamp);
+		}
+		catch (NVDECException & e)
+		{
+			throw Exception("Decode failed (" + e.getErrorString() + ", error " + std::to_string(e.getErrorCode()) + " = " + DecErrorCodeToString(e.getErrorCode()) + ")");
+		}
+
+		for (int i = 0; i < numFramesDecoded; ++i)
+		{
+			ReadyFrame frame;
+			frame.data = decodedFrames[i];
+			frame.timestamp = timeStamps[i];
+			frame.info = this->getCurrentFrameInfo();
+			this->readyFrames.push_back(frame);
+		}
+	}
+
+	/**
+	 * Converts the oldest finished frame into dst.
+	 * @return Size of decoded data in bytes or 0 if no frame is ready yet.
+	 */
+	uint64_t poll(void* dst, uint64_t dstSize, uint32_t width, uint32_t height, int64_t* timestamp)
+	{
+		if (this->readyFrames.empty())
+			return 0;
+
+		// A frame that doesn't fit stays queued, so it can be fetched again with a larger buffer
+		this->checkFrameSize(this->readyFrames.front().info, width, height);
+		this->checkOutputSize(this->readyFrames.front().info, dstSize);
+
+		ReadyFrame frame = this->readyFrames.front();
+		this->readyFrames.pop_front();
+
+		if (timestamp)
+			*timestamp = frame.timestamp;
+
+		uint64_t size = 0;
+		try
+		{
+			size = this->convert(frame.data, frame.info, dst);
+		}
+		catch (...)
+		{
+			this->decoder->UnlockFrame(&frame.data, 1);
+			throw;
+		}
+
+		this->decoder->UnlockFrame(&frame.data, 1);
+		return size;
+	}
+
+	/**
+	 * Feeds an arbitrary chunk of an Annex-B stream (e.g. one network packet).
+	 * Every access unit completed by this chunk is submitted right away; frames are fetched with poll().
+	 */
+	void submitPartial(const uint8_t* src, uint64_t srcSize, int64_t timestamp, bool endOfPicture)
+	{
+		this->assembler.append(src, srcSize, timestamp, endOfPicture, [&](const uint8_t* data, uint64_t size, int64_t ts)
+		{
+			this->submit(data, size, ts);
+		});
+	}
+
+	uint32_t getReadyFrameCount() const
+	{
+		return (uint32_t)this->readyFrames.size();
+	}
+
+	/**
+	 * Size of the next frame returned by poll()/lockFrame(), or of the current sequence if no frame is waiting.
+	 * @return False if no sequence header has been decoded yet.
+	 */
+	bool getDecodedFrameInfo(uint32_t* width, uint32_t* height, uint32_t* pitch)
+	{
+		FrameInfo info;
+		if (!this->readyFrames.empty())
+			info = this->readyFrames.front().info;
+		else if (this->decoder->HasVideoFormat())
+			info = this->getCurrentFrameInfo();
+		else
+			return false;
+
+		if (width)
+			*width = info.width;
+		if (height)
+			*height = info.height;
+		if (pitch)
+			*pitch = info.pitch;
+
+		return true;
+	}
+
+	/**
+	 * Hands out the oldest finished frame (NV12 device memory) without copying or converting it.
+	 * The frame stays valid until unlockFrame() is called or the decoder is recreated.
+	 * @return False if no frame is ready yet.
+	 */
+	bool lockFrame(void** frame, uint32_t* pitch, int64_t* timestamp)
+	{
+		if (this->readyFrames.empty())
+			return false;
+
+		ReadyFrame ready = this->readyFrames.front();
+		this->readyFrames.pop_front();
+		this->lockedFrames.push_back(ready.data);
+
+		*frame = ready.data;
+		if (pitch)
+			*pitch = ready.info.pitch;
+		if (timestamp)
+			*timestamp = ready.timestamp;
+
+		return true;
+	}
+
+	void unlockFrame(void* frame)
+	{
+		auto it = std::find(this->lockedFrames.begin(), this->lockedFrames.end(), (uint8_t*)frame);
+		if (it == this->lockedFrames.end())
+			throw Exception("Frame is not locked by this decoder");
+
+		uint8_t* data = *it;
+		this->lockedFrames.erase(it);
+		this->decoder->UnlockFrame(&data, 1);
+	}
+
+	void setFramePoolSize(uint32_t size)
+	{
+		if (size < 2)
+			throw Exception("Decoder frame pool needs at least two frames");
+
+		this->framePoolSize = size;
+		this->decoder->SetMaxFrameAlloc((int)size);
+	}
+
+	void getMemoryUsage(uint32_t* allocatedFrames, uint64_t* bytes, uint32_t* droppedFrames)
+	{
+		uint32_t frames = (uint32_t)this->decoder->GetFrameAllocCount();
+
+		if (allocatedFrames)
+			*allocatedFrames = frames;
+		if (bytes)
+			*bytes = frames * (uint64_t)this->decoder->GetFrameAllocSize() + this->deviceBufferSize;
+		if (droppedFrames)
+			*droppedFrames = this->droppedFrames + (uint32_t)this->decoder->GetDroppedFrameCount();
+	}
+
+private:
+	struct FrameInfo
+	{
+		uint32_t width = 0;	// in pixels of the output format
+		uint32_t height = 0;
+		uint32_t pitch = 0;	// of the NV12 frame
+	};
+
+	FrameInfo getCurrentFrameInfo()
 	{
-		// Recreate decoder if size changed
+		FrameInfo info;
+		info.width = this->decoder->GetWidth();
+		info.height = this->decoder->GetHeight();
+		info.pitch = this->decoder->GetDeviceFramePitch();
+
 		if (this->format == NVPIPE_UINT16)
-			this->recreate(width * 2, height); // split into two adjecent tiles in Y channel
+			info.width /= 2; // split into two adjecent tiles in Y channel
 		else if (this->format == NVPIPE_UINT32)
-			this->recreate(width * 4, height); // split into four adjecent tiles in Y channel
-		else
-			this->recreate(width, height);
+			info.width /= 4; // split into four adjecent tiles in Y channel
 
-		// Decode
-		uint8_t* decoded = this->decode(src, srcSize);
+		return info;
+	}
+
+	void checkFrameSize(const FrameInfo& info, uint32_t width, uint32_t height) const
+	{
+		// 0 x 0 accepts whatever the bitstream contains
+		if ((width || height) && (width != info.width || height != info.height))
+			throw Exception("Decoded frame size (" + std::to_string(info.width) + " x " + std::to_string(info.height) + ") doesn't match the requested size (" + std::to_string(width) + " x " + std::to_string(height) + ")");
+	}
+
+	void checkOutputSize(const FrameInfo& info, uint64_t dstSize) const
+	{
+		// The stream may grow mid-session when the size isn't fixed, so this is checked for every frame
+		const uint64_t size = getFrameSize(this->format, info.width, info.height);
+		if (dstSize < size)
+			throw Exception("Output buffer too small for the decoded frame (" + std::to_string(info.width) + " x " + std::to_string(info.height) + " needs " + std::to_string(size) + " bytes, got " + std::to_string(dstSize) + ")");
+	}
+
+	uint64_t convert(uint8_t* decoded, const FrameInfo& info, void* dst)
+	{
+		const uint32_t width = info.width;
+		const uint32_t height = info.height;
 
 		if (nullptr != decoded)
 		{
@@ -839,7 +1706,7 @@ public:
 
 			if (this->format == NVPIPE_RGBA32)
 			{
-				Nv12ToColor32<RGBA32>(decoded, width, dstDevice, width * 4, width, height);
+				Nv12ToColor32<RGBA32>(decoded, info.pitch, dstDevice, width * 4, width, height);
 			}
 			else if (this->format == NVPIPE_UINT4)
 			{
@@ -847,7 +1714,7 @@ public:
 				dim3 gridSize(width / 16 / 2 + 1, height / 2 + 1);
 				dim3 blockSize(16, 2);
 
-				nv12_to_uint4 << <gridSize, blockSize >> > (decoded, this->decoder->GetDeviceFramePitch(), dstDevice, width / 2, width, height);
+				nv12_to_uint4 << <gridSize, blockSize >> > (decoded, info.pitch, dstDevice, width / 2, width, height);
 			}
 			else if (this->format == NVPIPE_UINT8)
 			{
@@ -855,7 +1722,7 @@ public:
 				dim3 gridSize(width / 16 + 1, height / 2 + 1);
 				dim3 blockSize(16, 2);
 
-				nv12_to_uint8 << <gridSize, blockSize >> > (decoded, this->decoder->GetDeviceFramePitch(), dstDevice, width, width, height);
+				nv12_to_uint8 << <gridSize, blockSize >> > (decoded, info.pitch, dstDevice, width, width, height);
 			}
 			else if (this->format == NVPIPE_UINT16)
 			{
@@ -863,7 +1730,7 @@ public:
 				dim3 gridSize(width / 16 + 1, height / 2 + 1);
 				dim3 blockSize(16, 2);
 
-				nv12_to_uint16 << <gridSize, blockSize >> > (decoded, this->decoder->GetDeviceFramePitch(), dstDevice, width * 2, width, height);
+				nv12_to_uint16 << <gridSize, blockSize >> > (decoded, info.pitch, dstDevice, width * 2, width, height);
 			}
 			else if (this->format == NVPIPE_UINT32)
 			{
@@ -871,7 +1738,7 @@ public:
 				dim3 gridSize(width / 16 + 1, height / 2 + 1);
 				dim3 blockSize(16, 2);
 
-				nv12_to_uint32 << <gridSize, blockSize >> > (decoded, this->decoder->GetDeviceFramePitch(), dstDevice, width * 4, width, height);
+				nv12_to_uint32 << <gridSize, blockSize >> > (decoded, info.pitch, dstDevice, width * 4, width, height);
 			}
 
 			// Copy to host if necessary
@@ -885,34 +1752,71 @@ public:
 		return 0;
 	}
 
+public:
 #ifdef NVPIPE_WITH_OPENGL
 
-	uint64_t decodeTexture(const uint8_t* src, uint64_t srcSize, uint32_t texture, uint32_t target, uint32_t width, uint32_t height)
+	void setResourceCacheCapacity(uint32_t capacity)
+	{
+		this->registry.setCapacity(capacity);
+	}
+
+	uint64_t decodeTexture(const uint8_t* src, uint64_t srcSize, uint32_t texture, uint32_t target, uint32_t width, uint32_t height)
 	{
 		if (this->format != NVPIPE_RGBA32)
 			throw Exception("The OpenGL interface only supports the RGBA32 format");
+		if (!width || !height)
+			throw Exception("Decoding into a texture needs the texture's size");	// The kernel must not write beyond it
 
-		// Recreate decoder if size changed
-		this->recreate(width, height);
+		this->registry.collectReleasedTextures();
 
 		// Decode
 		uint8_t* decoded = this->decode(src, srcSize);
 
 		if (nullptr != decoded)
 		{
-			// Convert to RGBA
-			this->recreateDeviceBuffer(width, height);
-			Nv12ToColor32<RGBA32>(decoded, width, (uint8_t*)this->deviceBuffer, width * 4, width, height);
+			FrameInfo info = this->getCurrentFrameInfo();
+			this->checkFrameSize(info, width, height);
+
+			// Map texture as surface and convert to RGBA directly into it
+			width = info.width;
+			height = info.height;
 
-			// Copy output to texture
-			cudaGraphicsResource_t resource = this->registry.getTextureGraphicsResource(texture, target, width, height, cudaGraphicsRegisterFlagsWriteDiscard);
+			cudaGraphicsResource_t resource = this->registry.getTextureGraphicsResource(texture, target, width, height, cudaGraphicsRegisterFlagsSurfaceLoadStore);
 			CUDA_THROW(cudaGraphicsMapResources(1, &resource),
 				"Failed to map texture graphics resource");
-			cudaArray_t array;
-			CUDA_THROW(cudaGraphicsSubResourceGetMappedArray(&array, resource, 0, 0),
-				"Failed get texture graphics resource array");
-			CUDA_THROW(cudaMemcpy2DToArray(array, 0, 0, this->deviceBuffer, width * 4, width * 4, height, cudaMemcpyDeviceToDevice),
-				"Failed to copy to texture array");
+
+			try
+			{
+				cudaArray_t array;
+				CUDA_THROW(cudaGraphicsSubResourceGetMappedArray(&array, resource, 0, 0),
+					"Failed get texture graphics resource array");
+
+				cudaResourceDesc surfaceDesc;
+				memset(&surfaceDesc, 0, sizeof(surfaceDesc));
+				surfaceDesc.resType = cudaResourceTypeArray;
+				surfaceDesc.res.array.array = array;
+
+				cudaSurfaceObject_t surface = 0;
+				CUDA_THROW(cudaCreateSurfaceObject(&surface, &surfaceDesc),
+					"Failed to create texture surface object");
+
+				// one thread per pixel (convert NV12 to RGBA)
+				dim3 gridSize(width / 16 + 1, height / 2 + 1);
+				dim3 blockSize(16, 2);
+
+				nv12_to_rgba32_surface << <gridSize, blockSize >> > (decoded, info.pitch, surface, width, height);
+
+				cudaError_t kernelResult = cudaGetLastError();
+				cudaDestroySurfaceObject(surface);
+				CUDA_THROW(kernelResult,
+					"Failed to convert frame into texture surface");
+			}
+			catch (...)
+			{
+				cudaGraphicsUnmapResources(1, &resource);
+				throw;
+			}
+
 			CUDA_THROW(cudaGraphicsUnmapResources(1, &resource),
 				"Failed to unmap texture graphics resource");
 
@@ -936,8 +1840,17 @@ public:
 		CUDA_THROW(cudaGraphicsResourceGetMappedPointer(&pboPointer, &pboSize, resource),
 			"Failed to get mapped PBO pointer");
 
-		// Decode
-		uint64_t size = this->decode(src, srcSize, pboPointer, width, height);
+		// Decode, the frame size is checked against the PBO before anything is written
+		uint64_t size = 0;
+		try
+		{
+			size = this->decode(src, srcSize, pboPointer, pboSize, width, height);
+		}
+		catch (...)
+		{
+			cudaGraphicsUnmapResources(1, &resource);
+			throw;
+		}
 
 		// Unmap PBO
 		CUDA_THROW(cudaGraphicsUnmapResources(1, &resource),
@@ -949,33 +1862,32 @@ public:
 #endif
 
 private:
-	void recreate(uint32_t width, uint32_t height)
+	void create(uint32_t width, uint32_t height)
 	{
 		std::lock_guard<std::mutex> lock(Decoder::mutex);
 
-		// Only recreate if necessary
-		if (width == this->width && height == this->height)
-			return;
-
-		this->width = width;
-		this->height = height;
+		// The stream size is taken from the sequence header, width and height only size the decoder session up front
+		if (this->format == NVPIPE_UINT16)
+			width *= 2; // split into two adjecent tiles in Y channel
+		else if (this->format == NVPIPE_UINT32)
+			width *= 4; // split into four adjecent tiles in Y channel
 
-		// Ensure we have a CUDA context
-		CUDA_THROW(cudaDeviceSynchronize(),
-			"Failed to synchronize device");
 		CUcontext cudaContext;
 		cuCtxGetCurrent(&cudaContext);
+		if (!cudaContext)
+		{
+			// Ensure we have a CUDA context
+			CUDA_THROW(cudaFree(0),
+				"Failed to initialize CUDA context");
+			cuCtxGetCurrent(&cudaContext);
+		}
 
 		// Create decoder
 		try
 		{
-			// Destroy previous decoder
-			if (this->decoder)
-			{
-				this->decoder.reset();
-			}
-
-			this->decoder = std::unique_ptr<NvDecoder>(new NvDecoder(cudaContext, width, height, true, (this->codec == NVPIPE_HEVC) ? cudaVideoCodec_HEVC : cudaVideoCodec_H264,/* &Decoder::mutex*/ nullptr, true));
+			this->decoder = std::unique_ptr<NvDecoder>(new NvDecoder(cudaContext, width, height, true, (this->codec == NVPIPE_HEVC) ? cudaVideoCodec_HEVC : cudaVideoCodec_H264,/* &Decoder::mutex*/ nullptr, true,
+				false, &this->cropRect, &this->resizeDim, width, height));
+			this->decoder->SetMaxFrameAlloc((int)this->framePoolSize);
 		}
 		catch (NVDECException & e)
 		{
@@ -1009,6 +1921,18 @@ private:
 		return decodedFrames[numFramesDecoded - 1];
 	}
 
+	void releaseReadyFrames()
+	{
+		for (auto& frame : this->readyFrames)
+			this->decoder->UnlockFrame(&frame.data, 1);
+
+		for (auto& frame : this->lockedFrames)
+			this->decoder->UnlockFrame(&frame, 1);
+
+		this->readyFrames.clear();
+		this->lockedFrames.clear();
+	}
+
 	void recreateDeviceBuffer(uint32_t width, uint32_t height)
 	{
 		// (Re)allocate temporary device memory if necessary
@@ -1026,14 +1950,30 @@ private:
 	}
 
 private:
+	struct ReadyFrame
+	{
+		uint8_t* data = nullptr;
+		int64_t timestamp = 0;
+		FrameInfo info;
+	};
+
 	NvPipe_Format format;
 	NvPipe_Codec codec;
-	uint32_t width = 0;
-	uint32_t height = 0;
+
+	Rect cropRect = {};
+	Dim resizeDim = {};
 
 	std::unique_ptr<NvDecoder> decoder;
 	int64_t n = 0;
 
+	static constexpr uint32_t kDefaultFramePoolSize = 8;
+
+	std::deque<ReadyFrame> readyFrames;	// Frames finished by submit(), waiting for poll()
+	std::vector<uint8_t*> lockedFrames;	// Frames handed out by lockFrame()
+	uint32_t framePoolSize = kDefaultFramePoolSize;
+	uint32_t droppedFrames = 0;
+	AccessUnitAssembler assembler;	// Partial data fed through submitPartial()
+
 	void* deviceBuffer = nullptr;
 	uint64_t deviceBufferSize = 0;
 
@@ -1077,339 +2017,2365 @@ SOFTWARE.
 */
 
 #ifdef NVPIPE_WITH_ENCODER
-#ifdef NVPIPE_WITH_OPENGL
-class AsyncTextureEncoder : public Encoder
+/**
+ * @brief Process-wide pool of pinned host buffers for encoded frames.
+ * Buffers are leased out to the async encoders and, through NvPipe_LeaseEncodedData, to the caller, who returns them
+ * with NvPipe_ReleaseEncodedData. Being global, a lease stays valid after its encoder is destroyed.
+ */
+class EncodedBufferPool
 {
-	struct IntermediateBuffer {
-		CUdeviceptr ptr;
-		size_t pitch;
-		~IntermediateBuffer()
-		{
-			cuMemFree(ptr);
-		}
-	};
 public:
-	static constexpr int kEncodeBufferCount = 3;
-	AsyncTextureEncoder(NvPipe_Format format, NvPipe_Codec codec, NvPipe_Compression compression, uint64_t bitrate, uint32_t targetFrameRate, uint32_t width, uint32_t height) :
-		Encoder(format, codec, compression, bitrate, targetFrameRate, width, height),
-		m_clearedPtr(0), m_encodedPtr(0), m_pendingTaskPtr(0)
+	static constexpr uint64_t kGranularity = 64 * 1024;
+	static constexpr size_t kMaxFreeBuffers = 16;
+
+	uint8_t* lease(uint64_t size)
 	{
-		m_outputBufferSize = width * height * 4;
-		for (size_t i = 0; i < 3; i++)
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		// Reuse the smallest free buffer that fits, unless it's way too large
+		auto it = m_free.lower_bound(size);
+		if (it != m_free.end() && it->first <= 2 * (size > kGranularity ? size : kGranularity))
+		{
+			uint8_t* data = it->second;
+			m_free.erase(it);
+			return data;
+		}
+
+		Allocation allocation;
+		allocation.capacity = (size + kGranularity - 1) / kGranularity * kGranularity;
+		if (allocation.capacity == 0)
+			allocation.capacity = kGranularity;
+
+		void* data = nullptr;
+		allocation.pinned = (cudaHostAlloc(&data, allocation.capacity, cudaHostAllocDefault) == cudaSuccess);
+		if (!allocation.pinned)
 		{
-			cuMemAllocPitch(&m_intermdiateBuffer[i].ptr, &m_intermdiateBuffer[i].pitch, width * 4, height, 16);
-			this->m_outputBuffer[i] = std::make_unique<uint8_t[]>(m_outputBufferSize);
+			cudaGetLastError();	// Pinned memory is a nice-to-have, fall back to pageable memory
+			data = malloc(allocation.capacity);
+			if (!data)
+				throw Exception("Failed to allocate encoded data buffer");
 		}
-		m_closed = false;
-		m_encodeThread = std::make_unique<std::thread>(&AsyncTextureEncoder::encodeThread, this);
+
+		m_allocations[(uint8_t*)data] = allocation;
+		return (uint8_t*)data;
 	}
 
-	virtual ~AsyncTextureEncoder()
+	void release(const uint8_t* data)
 	{
-		m_closed = true;
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		auto it = m_allocations.find(data);
+		if (it == m_allocations.end())
+			throw Exception("Buffer is not an encoded data buffer");
+
+		m_free.emplace(it->second.capacity, (uint8_t*)data);
+
+		// Keep the larger buffers around, frames tend to stay the same size
+		while (m_free.size() > kMaxFreeBuffers)
 		{
-			std::lock_guard<std::mutex> lock(this->m_cvMutex);
-			this->m_blockCv.notify_one();	
+			uint8_t* smallest = m_free.begin()->second;
+			m_free.erase(m_free.begin());
+
+			if (m_allocations[smallest].pinned)
+				cudaFreeHost(smallest);
+			else
+				free(smallest);
+			m_allocations.erase(smallest);
 		}
-		m_encodeThread->join();
 	}
 
-	int encodeTextureAsync(uint32_t texture, uint32_t target, uint32_t width, uint32_t height, bool forceIFrame) {
-		if (this->format != NVPIPE_RGBA32)
-			throw Exception("The OpenGL interface only supports the RGBA32 format");
+private:
+	struct Allocation
+	{
+		uint64_t capacity = 0;
+		bool pinned = false;
+	};
+
+	std::mutex m_mutex;
+	std::unordered_map<const uint8_t*, Allocation> m_allocations;
+	std::multimap<uint64_t, uint8_t*> m_free;	// By capacity
+};
 
-		if ((this->m_pendingTaskPtr + 1) % kEncodeBufferCount == this->m_clearedPtr)  //Encode/Clear task is too slow.
+// Never destructed, leases may be returned until the process ends.
+static EncodedBufferPool& g_encodedBufferPool = *new EncodedBufferPool();
+
+/**
+ * @brief Pool buffer holding one encoded frame, returned to the pool unless detached.
+ */
+struct EncodedBuffer
+{
+	EncodedBuffer() = default;
+	EncodedBuffer(const EncodedBuffer&) = delete;
+	EncodedBuffer& operator=(const EncodedBuffer&) = delete;
+	EncodedBuffer(EncodedBuffer&& other) : data(other.data), size(other.size)
+	{
+		other.data = nullptr;
+		other.size = 0;
+	}
+	EncodedBuffer& operator=(EncodedBuffer&& other)
+	{
+		if (this != &other)
 		{
-			throw Exception("Encoder is too slow or task is not cleared, failed to enqueue new encode task. \n");
+			this->reset();
+			data = other.data;
+			size = other.size;
+			other.data = nullptr;
+			other.size = 0;
 		}
+		return *this;
+	}
+	~EncodedBuffer()
+	{
+		this->reset();
+	}
 
-		auto currentTaskIndex = this->m_pendingTaskPtr.load();
+	void reset()
+	{
+		if (data)
+			g_encodedBufferPool.release(data);
+		data = nullptr;
+		size = 0;
+	}
 
-		// Map texture and copy input to encoder
-		cudaGraphicsResource_t resource = this->registry.getTextureGraphicsResource(texture, target, width, height, cudaGraphicsRegisterFlagsReadOnly);
-		CUDA_THROW(cudaGraphicsMapResources(1, &resource),
-			"Failed to map texture graphics resource");
-		cudaArray_t array;
-		CUDA_THROW(cudaGraphicsSubResourceGetMappedArray(&array, resource, 0, 0),
-			"Failed get texture graphics resource array");
+	// Hands the buffer to the caller, who returns it with NvPipe_ReleaseEncodedData.
+	uint8_t* detach()
+	{
+		uint8_t* result = data;
+		data = nullptr;
+		size = 0;
+		return result;
+	}
 
-		//Copy to intermediate buffer.
-		CUDA_THROW(cudaMemcpy2DFromArray(
-			(void*)m_intermdiateBuffer[currentTaskIndex].ptr,
-			m_intermdiateBuffer[currentTaskIndex].pitch,
-			array,
-			0, 0, width * 4, height, cudaMemcpyDeviceToDevice),
-			"Failed to copy memory to intermediate buffer."
-		);
+	uint8_t* data = nullptr;
+	uint64_t size = 0;
+};
+#endif
 
-		// Unmap texture
-		CUDA_THROW(cudaGraphicsUnmapResources(1, &resource),
-			"Failed to unmap texture graphics resource");
+#ifdef NVPIPE_WITH_ENCODER
+/**
+ * @brief Work of one asynchronous encoder, run by the EncodeScheduler's workers.
+ */
+class EncodeJob
+{
+public:
+	virtual ~EncodeJob() = default;
 
-		{//Enqueue the task.
+	/**
+	 * Encodes one queued frame.
+	 * @return True if more frames are waiting.
+	 */
+	virtual bool runEncodeJob() = 0;
+};
 
-			AsyncTask task;
-			task.forceIFrame = forceIFrame;
-			task.height = height;
-			task.width = width;
-			task.isError = false;
-			m_tasks[currentTaskIndex] = std::move(task);
-			DEBUG_LOG("Encoder: %d task is in async queue now\n", currentTaskIndex);
+/**
+ * @brief Process-wide pool of encode workers shared by all asynchronous encoders.
+ * A job is queued at most once and run by one worker at a time, so the frames of an encoder stay in order,
+ * while jobs of different encoders run in parallel. Jobs with more frames go to the back of the queue after each frame.
+ */
+class EncodeScheduler
+{
+public:
+	static constexpr uint32_t kDefaultWorkerCount = 2;
 
-			//Task is published, move pointer to next, and encode thread can operate on current task.
-			//Atomic guarantees this happens after m_tasks[currentTaskIndex] = std::move(task);
-			this->m_pendingTaskPtr = (this->m_pendingTaskPtr + 1) % kEncodeBufferCount;
-			
-			{
-				//Inform encode thread.
-				std::lock_guard<std::mutex> lock(this->m_cvMutex);
-				this->m_blockCv.notify_one();
-			}
-		}
-		return currentTaskIndex;    //Return task number.
+	EncodeScheduler()
+	{
+#ifndef _WIN32
+		// Restored when pinning is turned off again, so the process' own cpuset is respected
+		CPU_ZERO(&m_defaultAffinity);
+		pthread_getaffinity_np(pthread_self(), sizeof(m_defaultAffinity), &m_defaultAffinity);
+#endif
+		this->setWorkerCount(kDefaultWorkerCount, false);
 	}
 
-	void encodeThread() {
-		std::unique_lock<std::mutex> lock(this->m_cvMutex);
-		while (!m_closed)
-		{
-			if (m_encodedPtr == m_pendingTaskPtr)	//No task for now. wait.
-			{
-				this->m_blockCv.wait(lock);
-				continue;
-			}
+	/**
+	 * @param count Number of workers, e.g. the number of NVENC engines of the GPU.
+	 * @param pinToCores Pins worker i to core i (Linux only). Otherwise the affinity is left alone,
+	 * unless the workers were pinned before.
+	 */
+	void setWorkerCount(uint32_t count, bool pinToCores)
+	{
+		if (count == 0)
+			throw Exception("At least one encode worker is required");
+#ifdef _WIN32
+		if (pinToCores)
+			throw Exception("Pinning encode workers to cores is only supported on Linux");
+#endif
 
-			auto& currTask = m_tasks[m_encodedPtr];
+		// Held until retired workers are joined, a concurrent resize could otherwise revive them
+		std::lock_guard<std::mutex> resizeLock(m_resizeMutex);
 
-			DEBUG_LOG("Encoder thread: Encoding task: %d\n", m_encodedPtr.load());
+		std::vector<std::thread> stopped;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			const bool wasPinned = m_pinToCores;
+			m_workerCount = count;
+			m_pinToCores = pinToCores;
 
-			try
+			while (m_workers.size() < count)
 			{
-				// Encode
-				const NvEncInputFrame* f = this->encoder->GetNextInputFrame();
-				CUDA_THROW(cudaMemcpy2D(f->inputPtr, f->pitch,
-					(void*)m_intermdiateBuffer[m_encodedPtr].ptr,
-					m_intermdiateBuffer[m_encodedPtr].pitch,
-					width * 4, currTask.height, cudaMemcpyDeviceToDevice),
-					"Failed to copy from texture array");
-				uint64_t size = this->encode(m_outputBuffer[m_encodedPtr].get(), m_outputBufferSize, currTask.forceIFrame);
-				m_tasks[m_encodedPtr].isError = false;
-				m_tasks[m_encodedPtr].encodedSize = size;
+				uint32_t index = (uint32_t)m_workers.size();
+				m_workers.emplace_back(&EncodeScheduler::worker, this, index);
 			}
-			catch (const Exception & e)
+			while (m_workers.size() > count)
 			{
-				m_tasks[m_encodedPtr].isError = true;
-				m_tasks[m_encodedPtr].error = e.message;
+				stopped.push_back(std::move(m_workers.back()));
+				m_workers.pop_back();
 			}
+			if (pinToCores || wasPinned)
+				for (uint32_t i = 0; i < count; ++i)
+					this->pinWorker(i);
 
-			DEBUG_LOG("Encoding finished\n");
-			m_encodedPtr = (m_encodedPtr + 1) % kEncodeBufferCount;
+			m_workCv.notify_all();
 		}
-	}
 
-	void QueryTask(int taskIndex, bool* isDone, bool* isError, std::string* error) {
-		DEBUG_LOG("Encoder Query: query %d\n", taskIndex);
-		if (!CheckInsideQueueRange(m_pendingTaskPtr.load(), m_clearedPtr.load(), taskIndex)) {
-			//This task doesn't eixsts.
-			DEBUG_LOG("Encoder Query: task doesn't exists\n");
-			throw Exception("Task doesn't exists");
-		}
-		if (CheckInsideQueueRange(m_pendingTaskPtr.load(), m_encodedPtr.load(), taskIndex)) {
-			//Not encoded yet
-			DEBUG_LOG("Encoder Query: task %d not encoded yet\n", taskIndex);
-			*isDone = false;
-			*isError = false;
-			return;
-		}
-		if (CheckInsideQueueRange(m_encodedPtr.load(), m_clearedPtr.load(), taskIndex)) {
-			//Done
-			DEBUG_LOG("Encoder Query: task %d is done.\n", taskIndex);
-			auto& task = m_tasks[taskIndex];
-			*isDone = true;
-			*isError = task.isError;
-			if (task.isError)
-				*error = task.error;
-			return;
-		}
-		DEBUG_LOG("Query Task Exception Encoutnered, Current Status: Pending %d Encoding %d Clearing %d Query %d\n", m_pendingTaskPtr.load(), m_encodedPtr.load(), m_clearedPtr.load(), taskIndex);
-		throw Exception("Unknown error");
+		// Stopped workers finish their current frame first
+		for (auto& t : stopped)
+			t.join();
 	}
 
-	uint8_t* AcquireTaskData(int taskIndex, uint64_t* encodeSize) {
-		auto& task = m_tasks[taskIndex];
-		if (!CheckInsideQueueRange(m_encodedPtr.load(), m_clearedPtr.load(), taskIndex)) {
-			throw Exception("The task is not done yet!");
-		}
-		if (!task.isError)
-			*encodeSize = m_tasks[taskIndex].encodedSize;
-		return m_outputBuffer[taskIndex].get();
+	void schedule(EncodeJob* job)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_ready.push_back(job);
+		m_workCv.notify_one();
 	}
 
-	void ClearTask(int taskIndex) {
-		if (taskIndex != m_clearedPtr) {
-			throw Exception("Only next task could be cleared!");
-		}
-		if (taskIndex == m_encodedPtr) {
-			throw Exception("The task is not finished yet!");
+	/**
+	 * Removes a job from the queue, waiting for a worker still running it.
+	 */
+	void remove(EncodeJob* job)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (true)
+		{
+			m_ready.erase(std::remove(m_ready.begin(), m_ready.end(), job), m_ready.end());
+			if (std::find(m_running.begin(), m_running.end(), job) == m_running.end())
+				break;
+			m_doneCv.wait(lock);
 		}
-		m_tasks[m_clearedPtr] = AsyncTask();
-		m_clearedPtr = (1 + m_clearedPtr) % kEncodeBufferCount;
-		DEBUG_LOG("Encoder: %d task is cleared\n", m_clearedPtr.load());
 	}
 
 private:
-
-	struct AsyncTask
+	void worker(uint32_t index)
 	{
-		AsyncTask()
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (true)
 		{
-		}
-		uint32_t width;
-		uint32_t height;
-		bool forceIFrame;
+			m_workCv.wait(lock, [this, index] { return index >= m_workerCount || !m_ready.empty(); });
+			if (index >= m_workerCount)
+				break;
 
-		//bool isDone;	//isDone could be inferred from circular buffer pointers.
-		bool isError;
-		uint64_t encodedSize;
-		std::string error;
-	};
+			EncodeJob* job = m_ready.front();
+			m_ready.pop_front();
+			m_running.push_back(job);
 
-	std::mutex m_cvMutex;	//Need lock to avoid encoder thread always running. The lock won't affect anything if encoder is busy.
-	std::condition_variable m_blockCv;
-
-	std::atomic<bool> m_closed;
-	std::atomic<int> m_pendingTaskPtr;
-	std::atomic<int> m_encodedPtr;
-	std::atomic<int> m_clearedPtr;
-	IntermediateBuffer m_intermdiateBuffer[kEncodeBufferCount];
-	std::unique_ptr<uint8_t[]> m_outputBuffer[kEncodeBufferCount];
-	uint64_t m_outputBufferSize;
-	AsyncTask m_tasks[kEncodeBufferCount];
-	std::unique_ptr<std::thread> m_encodeThread;
-};
+			lock.unlock();
+			bool more = job->runEncodeJob();
+			lock.lock();
+
+			m_running.erase(std::find(m_running.begin(), m_running.end(), job));
+			if (more)
+			{
+				m_ready.push_back(job);
+				m_workCv.notify_one();
+			}
+			m_doneCv.notify_all();
+		}
+	}
+
+	void pinWorker(uint32_t index)
+	{
+#ifndef _WIN32
+		cpu_set_t set = m_defaultAffinity;
+		if (m_pinToCores)
+		{
+			uint32_t cores = std::max(1u, std::thread::hardware_concurrency());
+			CPU_ZERO(&set);
+			CPU_SET(index % cores, &set);
+		}
+		pthread_setaffinity_np(m_workers[index].native_handle(), sizeof(set), &set);
 #endif
+	}
+
+	std::mutex m_resizeMutex;	// Serializes setWorkerCount()
+	std::mutex m_mutex;
+	std::condition_variable m_workCv;	// Signals workers about ready jobs
+	std::condition_variable m_doneCv;	// Signals remove() about finished jobs
+	std::deque<EncodeJob*> m_ready;
+	std::vector<EncodeJob*> m_running;
+	std::vector<std::thread> m_workers;
+	uint32_t m_workerCount = 0;
+	bool m_pinToCores = false;
+#ifndef _WIN32
+	cpu_set_t m_defaultAffinity;
 #endif
+};
 
-struct Instance
+// Never destructed, encoders destroyed during process exit still remove their jobs.
+static EncodeScheduler& GetEncodeScheduler()
 {
-#ifdef NVPIPE_WITH_ENCODER
-	std::unique_ptr<Encoder> encoder;
-#ifdef NVPIPE_WITH_OPENGL
-	std::unique_ptr<AsyncTextureEncoder> asyncTextureEncoder;
-#endif
+	static EncodeScheduler& scheduler = *new EncodeScheduler();
+	return scheduler;
+}
 #endif
 
+#ifdef NVPIPE_WITH_ENCODER
+/**
+ * @brief Common part of the asynchronous encoders: a bounded queue of staging slots drained by the shared EncodeScheduler.
+ * A slot is free again as soon as its frame is encoded; results are kept separately until the caller clears them.
+ */
+class AsyncEncoderBase : public Encoder, private EncodeJob
+{
+public:
+	static constexpr uint32_t kDefaultQueueDepth = 3;
+	static constexpr uint32_t kMaxUnclearedTasks = 64;
 
-#ifdef NVPIPE_WITH_DECODER
-	std::unique_ptr<Decoder> decoder;
-#endif
-
+	struct TaskResult
+	{
+		int id = 0;
+		bool isError = false;
+		bool isDropped = false;
+		std::string error;
+		EncodedBuffer data;	// Sized to the encoded frame
+	};
 
-	std::string error;
-};
+	AsyncEncoderBase(NvPipe_Format format, NvPipe_Codec codec, NvPipe_Compression compression, uint64_t bitrate, uint32_t targetFrameRate, uint32_t width, uint32_t height) :
+		Encoder(format, codec, compression, bitrate, targetFrameRate, width, height)
+	{
+		// Encode workers switch to the context the encoder was created with
+		cuCtxGetCurrent(&m_cudaContext);
 
-std::string sharedError; // shared error code for create functions (NOT threadsafe)
-std::unordered_map<uint32_t, std::shared_ptr<Instance>> g_pipes;
-std::mutex g_pipeDictMutex;
-uint32_t g_pipeCreationIndex = 1;	//Start with 1, since GetError requries a special value(0 here) for global error.
+		this->resizeQueue(kDefaultQueueDepth);
+	}
 
-static void DeletePipe(uint32_t id) {
-	std::lock_guard<std::mutex> lock(g_pipeDictMutex);
-	g_pipes.erase(id);
-}
+	virtual ~AsyncEncoderBase()
+	{
+		this->shutdown();
 
-static std::shared_ptr<Instance> GetPipe(uint32_t id) {
-	std::lock_guard<std::mutex> lock(g_pipeDictMutex);
-	auto ite = g_pipes.find(id);
-	if (ite == g_pipes.end()) {
-		return nullptr;
+		// Unregister input surfaces before Encoder destroys the session
+		this->releaseInputSurfaces();
+		m_retiredSlots.clear();
 	}
-	return ite->second;
-}
 
-static uint32_t InsertNewPipe(std::shared_ptr<Instance> instance) {
-	std::lock_guard<std::mutex> lock(g_pipeDictMutex);
-	auto index = g_pipeCreationIndex++;
-	g_pipes[index] = instance;
-	return index;
-}
+	/**
+	 * Stops encoding and waits for an encode worker still running this encoder. Most derived destructors call this
+	 * first: a worker may otherwise still be in encodeSlot while their members are destroyed.
+	 */
+	void shutdown()
+	{
+		{
+			std::lock_guard<std::mutex> lock(this->m_mutex);
+			m_closed = true;
+			this->m_slotCv.notify_all();
+		}
+		GetEncodeScheduler().remove(this);
+	}
 
-#ifdef NVPIPE_WITH_ENCODER
+	/**
+	 * @param depth Number of frames that may wait for (or be in) encoding at once, at least 2.
+	 * @param policy What happens to a frame submitted while all slots are in use.
+	 * @param timeoutMs Maximum wait for NVPIPE_OVERFLOW_BLOCK.
+	 */
+	void setQueuePolicy(uint32_t depth, NvPipe_OverflowPolicy policy, uint32_t timeoutMs)
+	{
+		if (depth < 2)
+			throw Exception("Async encode queue depth must be at least 2");
 
-UNITY_INTERFACE_EXPORT uint32_t UNITY_INTERFACE_API NvPipe_CreateEncoder(NvPipe_Format format, NvPipe_Codec codec, NvPipe_Compression compression, uint64_t bitrate, uint32_t targetFrameRate, uint32_t width, uint32_t height)
-{
-	auto instance = std::make_shared<Instance>();
+		std::lock_guard<std::mutex> lock(this->m_mutex);
+		this->resizeQueue(depth);
+		m_policy = policy;
+		m_timeout = std::chrono::milliseconds(timeoutMs);
+	}
 
-	try
+	/**
+	 * @param handler Called with the id of every finished or dropped task, on the thread that finished it and without holding the queue lock.
+	 */
+	void setCompletionHandler(std::function<void(int)> handler)
 	{
-		instance->encoder = std::unique_ptr<Encoder>(new Encoder(format, codec, compression, bitrate, targetFrameRate, width, height));
-		return InsertNewPipe(instance);
+		std::lock_guard<std::mutex> lock(this->m_mutex);
+		m_completionHandler = std::move(handler);
 	}
-	catch (Exception & e)
+
+	/**
+	 * @return Number of tasks finished so far, so pollers can skip encoders without news.
+	 */
+	uint64_t getFinishedCount() const
 	{
-		sharedError = e.getErrorString();
-		return 0;
+		return m_finishedCount.load(std::memory_order_acquire);
 	}
 
-	return 0;
-}
-
-#ifdef NVPIPE_WITH_OPENGL
-UNITY_INTERFACE_EXPORT uint32_t UNITY_INTERFACE_API NvPipe_CreateTextureAsyncEncoder(NvPipe_Format format, NvPipe_Codec codec, NvPipe_Compression compression, uint64_t bitrate, uint32_t targetFrameRate, uint32_t width, uint32_t height)
-{
-	auto instance = std::make_shared<Instance>();
-
-	try
+	void getStats(uint64_t* queuedFrames, uint64_t* droppedFrames, uint32_t* waitingFrames)
 	{
-		instance->asyncTextureEncoder = std::make_unique<AsyncTextureEncoder>(format, codec, compression, bitrate, targetFrameRate, width, height);
-		return InsertNewPipe(instance);
+		std::lock_guard<std::mutex> lock(this->m_mutex);
+		if (queuedFrames)
+			*queuedFrames = m_queuedFrames;
+		if (droppedFrames)
+			*droppedFrames = m_droppedFrames;
+		if (waitingFrames)
+			*waitingFrames = (uint32_t)m_waiting.size() + (m_encodingId >= 0 ? 1 : 0);
 	}
-	catch (Exception & e)
+
+	/**
+	 * @return Result of a finished task (valid until the task is cleared), or nullptr if it is still queued.
+	 */
+	const TaskResult* queryTask(int taskId)
 	{
-		sharedError = e.getErrorString();
-		return 0;
+		std::lock_guard<std::mutex> lock(this->m_mutex);
+		return this->findTask(taskId);
 	}
 
-	return 0;
-}
-#endif
+	/**
+	 * Moves the result of a finished task out and clears it.
+	 * @return False if the task is still queued.
+	 */
+	bool takeTask(int taskId, TaskResult* result)
+	{
+		std::lock_guard<std::mutex> lock(this->m_mutex);
+		if (this->findTask(taskId) == nullptr)
+			return false;
 
-UNITY_INTERFACE_EXPORT void UNITY_INTERFACE_API NvPipe_SetBitrate(uint64_t pipe, uint64_t bitrate, uint32_t targetFrameRate)
-{
-	auto instance = GetPipe(pipe);
-	if (instance == nullptr)
-		return;
+		this->eraseResult(taskId, result);
+		return true;
+	}
 
-	if (!instance->encoder)
+	/**
+	 * Hands the encoded data of a finished task over to the caller, the task itself still needs to be cleared.
+	 * @return Pool buffer to return with NvPipe_ReleaseEncodedData, or nullptr if the task is still queued or has no data.
+	 */
+	uint8_t* leaseTaskData(int taskId, uint64_t* size)
 	{
-		instance->error = "Invalid NvPipe encoder.";
-		return;
+		std::lock_guard<std::mutex> lock(this->m_mutex);
+		auto result = const_cast<TaskResult*>(this->findTask(taskId));
+		*size = 0;
+		if (result == nullptr)
+			return nullptr;
+
+		*size = result->data.size;
+		return result->data.detach();
 	}
 
-	try
+	void clearTask(int taskId)
 	{
-		return instance->encoder->setBitrate(bitrate, targetFrameRate);
+		std::lock_guard<std::mutex> lock(this->m_mutex);
+		if (this->findTask(taskId) == nullptr)
+			throw Exception("The task is not finished yet!");
+
+		this->eraseResult(taskId, nullptr);
 	}
-	catch (Exception & e)
+
+protected:
+	struct StagingBuffer
+	{
+		void* ptr = nullptr;
+		uint64_t size = 0;
+		uint64_t pitch = 0;
+		bool onDevice = false;
+		~StagingBuffer()
+		{
+			release();
+		}
+		void release()
+		{
+			if (ptr)
+			{
+				if (onDevice)
+					cudaFree(ptr);
+				else
+					cudaFreeHost(ptr);
+			}
+			ptr = nullptr;
+			size = 0;
+		}
+		void reserve(uint64_t requiredSize, bool device)
+		{
+			if (ptr && onDevice == device && size >= requiredSize)
+				return;
+
+			release();
+			onDevice = device;
+			size = requiredSize;
+			if (onDevice)
+				CUDA_THROW(cudaMalloc(&ptr, size),
+					"Failed to allocate device staging buffer");
+			else
+				CUDA_THROW(cudaHostAlloc(&ptr, size, cudaHostAllocDefault),
+					"Failed to allocate pinned staging buffer");
+		}
+		void reservePitched(uint64_t widthBytes, uint32_t height)
+		{
+			if (ptr && onDevice && pitch >= widthBytes && size >= pitch * height)
+				return;
+
+			release();
+			onDevice = true;
+			size_t allocPitch;
+			CUDA_THROW(cudaMallocPitch(&ptr, &allocPitch, widthBytes, height),
+				"Failed to allocate device staging buffer");
+			pitch = allocPitch;
+			size = pitch * height;
+		}
+	};
+
+	struct Slot
+	{
+		~Slot()
+		{
+			if (copyDone)
+				cudaEventDestroy(copyDone);
+		}
+
+		StagingBuffer buffer;
+		uint64_t pitch = 0;	// of the frame in buffer
+		uint32_t width = 0;
+		uint32_t height = 0;
+		bool forceIFrame = false;
+		int id = -1;
+		int64_t timeUs = 0;	// When the frame was submitted, for recordings
+
+		// Set if buffer is filled asynchronously, the encode worker waits for the event before reading it
+		cudaEvent_t copyDone = nullptr;
+		bool copyPending = false;
+
+		// buffer registered as NVENC input surface (encode worker only)
+		NV_ENC_REGISTERED_PTR surface = nullptr;
+		void* surfaceBuffer = nullptr;
+	};
+
+	/**
+	 * Encodes a filled slot on an encode worker. By default its frame is copied into the encoder's next input frame.
+	 */
+	virtual void encodeSlot(Slot& slot, std::vector<std::vector<uint8_t>>& packets)
+	{
+		this->copyInput(slot.buffer.ptr, slot.pitch, slot.width, slot.height);
+		this->encodePackets(packets, slot.forceIFrame);
+	}
+
+	void releaseInputSurface(Slot& slot)
+	{
+		if (slot.surface && this->encoder)
+		{
+			try
+			{
+				this->encoder->UnregisterExternalInput(slot.surface);
+			}
+			catch (NVENCException&)
+			{
+			}
+		}
+		slot.surface = nullptr;
+		slot.surfaceBuffer = nullptr;
+	}
+
+	void releaseInputSurfaces() override
+	{
+		std::lock_guard<std::mutex> lock(this->m_mutex);
+		for (auto& slot : m_slots)
+			this->releaseInputSurface(*slot);
+		for (auto& slot : m_retiredSlots)
+			this->releaseInputSurface(*slot);
+
+		Encoder::releaseInputSurfaces();
+	}
+
+	/**
+	 * Reserves a slot according to the overflow policy, lets copyInput(Slot&) fill it and queues it for encoding.
+	 * @return Task id. A frame dropped right away still gets an id, whose result is marked as dropped.
+	 */
+	template<typename F>
+	int enqueue(uint32_t width, uint32_t height, bool forceIFrame, F copyInput)
+	{
+		const int64_t submitTime = NowMicroseconds();
+		std::unique_lock<std::mutex> lock(this->m_mutex);
+
+		if (m_results.size() + m_waiting.size() >= kMaxUnclearedTasks)
+			throw Exception("Too many uncleared encode tasks. Did you forget to clear finished tasks?");
+
+		int id = m_nextTaskId;
+		m_nextTaskId = (m_nextTaskId + 1) & 0x7fffffff;
+
+		if (m_freeSlots.empty())
+		{
+			switch (m_policy)
+			{
+			case NVPIPE_OVERFLOW_DROP_NEWEST:
+				this->pushDropped(id);
+				this->notifyDropped(lock);
+				return id;
+
+			case NVPIPE_OVERFLOW_DROP_OLDEST:
+				this->dropWaiting(1);
+				break;
+
+			case NVPIPE_OVERFLOW_COALESCE:
+				// Frames were skipped, restart the stream cleanly with the newest one
+				this->dropWaiting(m_waiting.size());
+				forceIFrame = true;
+				break;
+
+			case NVPIPE_OVERFLOW_BLOCK:
+				m_slotCv.wait_for(lock, m_timeout, [this] { return m_closed || !m_freeSlots.empty(); });
+				break;
+
+			default:
+				break;
+			}
+
+			if (m_freeSlots.empty())
+				throw Exception("Encoder is too slow or task is not cleared, failed to enqueue new encode task.");
+		}
+
+		Slot* slot = m_freeSlots.back();
+		m_freeSlots.pop_back();
+
+		// Copy without holding the lock, the encode worker keeps running meanwhile
+		lock.unlock();
+		try
+		{
+			copyInput(*slot);
+		}
+		catch (...)
+		{
+			lock.lock();
+			m_freeSlots.push_back(slot);
+			throw;
+		}
+		lock.lock();
+
+		slot->id = id;
+		slot->width = width;
+		slot->height = height;
+		slot->forceIFrame = forceIFrame;
+		slot->timeUs = submitTime;
+		m_waiting.push_back(slot);
+		m_queuedFrames++;
+		DEBUG_LOG("Encoder: %d task is in async queue now\n", id);
+
+		// Queue the job unless a worker has it already
+		bool schedule = !m_scheduled;
+		m_scheduled = true;
+		this->notifyDropped(lock);
+		if (schedule)
+			GetEncodeScheduler().schedule(this);
+		return id;
+	}
+
+private:
+	/**
+	 * Called by an encode worker, never by two at once.
+	 */
+	bool runEncodeJob() override
+	{
+		cuCtxSetCurrent(m_cudaContext);
+
+		std::unique_lock<std::mutex> lock(this->m_mutex);
+		if (m_closed || m_waiting.empty())
+		{
+			m_scheduled = false;
+			return false;
+		}
+
+		// Slots removed by resizeQueue, their surfaces are unregistered by the encode worker
+		for (auto& slot : m_retiredSlots)
+			this->releaseInputSurface(*slot);
+		m_retiredSlots.clear();
+
+		Slot* slot = m_waiting.front();
+		m_waiting.pop_front();
+		m_encodingId = slot->id;
+
+		TaskResult result;
+		result.id = slot->id;
+
+		// Encoding doesn't need the lock, new tasks can be submitted meanwhile
+		lock.unlock();
+
+		DEBUG_LOG("Encode worker: Encoding task: %d\n", result.id);
+		try
+		{
+			if (slot->copyPending)
+			{
+				CUDA_THROW(cudaEventSynchronize(slot->copyDone),
+					"Failed to wait for input copy");
+				slot->copyPending = false;
+			}
+
+			std::vector<std::vector<uint8_t>> packets;
+			this->encodeSlot(*slot, packets);
+			this->record(packets, slot->timeUs);
+			this->publish(packets, slot->timeUs);
+
+			// Output buffers grow with the actual frame size, rather than a worst case per pixel
+			uint64_t size = 0;
+			for (auto& p : packets)
+				size += p.size();
+
+			result.data.data = g_encodedBufferPool.lease(size);
+			result.data.size = size;
+			size = 0;
+			for (auto& p : packets)
+			{
+				memcpy(result.data.data + size, p.data(), p.size());
+				size += p.size();
+			}
+		}
+		catch (const Exception & e)
+		{
+			result.isError = true;
+			result.error = e.message;
+		}
+
+		lock.lock();
+		int id = result.id;
+		m_results.push_back(std::move(result));
+		m_freeSlots.push_back(slot);
+		m_encodingId = -1;
+		m_finishedCount.fetch_add(1, std::memory_order_release);
+		this->m_slotCv.notify_all();
+
+		// Still scheduled meanwhile, so completions are reported in order
+		if (m_completionHandler)
+		{
+			auto handler = m_completionHandler;
+			lock.unlock();
+			handler(id);
+			lock.lock();
+		}
+
+		// Drops the job from the scheduler once the queue is empty, the next submit queues it again
+		bool more = !m_closed && !m_waiting.empty();
+		if (!more)
+			m_scheduled = false;
+		return more;
+	}
+
+	void resizeQueue(uint32_t depth)
+	{
+		while (m_slots.size() < depth)
+		{
+			m_slots.push_back(std::make_unique<Slot>());
+			m_freeSlots.push_back(m_slots.back().get());
+		}
+
+		if (m_slots.size() > depth)
+		{
+			if (m_freeSlots.size() < m_slots.size() - depth)
+				throw Exception("Can't shrink the encode queue while frames are queued");
+
+			while (m_slots.size() > depth)
+			{
+				Slot* slot = m_freeSlots.back();
+				m_freeSlots.pop_back();
+				auto it = std::find_if(m_slots.begin(), m_slots.end(), [slot](const std::unique_ptr<Slot>& s) { return s.get() == slot; });
+				m_retiredSlots.push_back(std::move(*it));
+				m_slots.erase(it);
+			}
+		}
+	}
+
+	void pushDropped(int id)
+	{
+		TaskResult result;
+		result.id = id;
+		result.isDropped = true;
+		m_results.push_back(std::move(result));
+		m_droppedFrames++;
+		m_finishedCount.fetch_add(1, std::memory_order_release);
+		m_droppedIds.push_back(id);
+		DEBUG_LOG("Encoder: %d task dropped\n", id);
+	}
+
+	// Reports tasks dropped while the lock was held, releases the lock
+	void notifyDropped(std::unique_lock<std::mutex>& lock)
+	{
+		std::vector<int> ids;
+		ids.swap(m_droppedIds);
+		auto handler = m_completionHandler;
+		lock.unlock();
+
+		if (handler)
+			for (int id : ids)
+				handler(id);
+	}
+
+	void dropWaiting(size_t count)
+	{
+		for (size_t i = 0; i < count && !m_waiting.empty(); ++i)
+		{
+			Slot* slot = m_waiting.front();
+			m_waiting.pop_front();
+			this->pushDropped(slot->id);
+			m_freeSlots.push_back(slot);
+		}
+	}
+
+	const TaskResult* findTask(int taskId)
+	{
+		for (auto& result : m_results)
+			if (result.id == taskId)
+				return &result;
+
+		if (taskId == m_encodingId)
+			return nullptr;
+		for (auto slot : m_waiting)
+			if (slot->id == taskId)
+				return nullptr;
+
+		throw Exception("Task doesn't exists");
+	}
+
+	void eraseResult(int taskId, TaskResult* out)
+	{
+		auto it = std::find_if(m_results.begin(), m_results.end(), [taskId](const TaskResult& r) { return r.id == taskId; });
+		if (out)
+			*out = std::move(*it);
+		m_results.erase(it);
+	}
+
+	CUcontext m_cudaContext = nullptr;
+	std::mutex m_mutex;
+	std::condition_variable m_slotCv;	// Signals blocked submits about free slots
+
+	bool m_closed = false;
+	bool m_scheduled = false;	// Queued in or run by the EncodeScheduler
+	NvPipe_OverflowPolicy m_policy = NVPIPE_OVERFLOW_FAIL;
+	std::chrono::milliseconds m_timeout{ 0 };
+
+	std::vector<std::unique_ptr<Slot>> m_slots;
+	std::vector<std::unique_ptr<Slot>> m_retiredSlots;	// Removed from the queue, freed by the next encode job
+	std::vector<Slot*> m_freeSlots;
+	std::deque<Slot*> m_waiting;	// Submitted, not picked up by an encode worker yet
+	int m_encodingId = -1;
+	std::list<TaskResult> m_results;	// Finished, not cleared yet (list keeps handed out pointers valid)
+	int m_nextTaskId = 0;
+
+	uint64_t m_queuedFrames = 0;
+	uint64_t m_droppedFrames = 0;
+
+	std::function<void(int)> m_completionHandler;
+	std::vector<int> m_droppedIds;	// Not reported to the completion handler yet
+	std::atomic<uint64_t> m_finishedCount{ 0 };
+};
+
+/**
+ * @brief Encodes host or device frames on a background thread.
+ * Input is copied into a staging slot (pinned host memory or device memory) on submit, so the caller never waits for NVENC.
+ */
+class AsyncEncoder : public AsyncEncoderBase
+{
+public:
+	using AsyncEncoderBase::AsyncEncoderBase;
+
+	~AsyncEncoder()
+	{
+		this->shutdown();
+	}
+
+	/**
+	 * Copies the frame into a staging slot and queues it for encoding.
+	 * @return Task id, used to query and clear the task.
+	 */
+	int encodeAsync(const void* src, uint64_t srcPitch, uint32_t width, uint32_t height, bool forceIFrame)
+	{
+		return this->enqueue(width, height, forceIFrame, [&](Slot& slot)
+		{
+			// Copy input to staging buffer tightly packed, only the visible part of each source row is read
+			const uint64_t rowSize = (this->format == NVPIPE_UINT4) ? (width + 1) / 2 : getFrameSize(this->format, width, 1);
+			if (srcPitch < rowSize)
+				throw Exception("Source pitch (" + std::to_string(srcPitch) + ") is smaller than a row (" + std::to_string(rowSize) + " bytes)");
+
+			bool onDevice = isDevicePointer(src);
+			slot.buffer.reserve(rowSize * height, onDevice);
+			slot.pitch = rowSize;
+
+			if (onDevice)
+				CUDA_THROW(cudaMemcpy2D(slot.buffer.ptr, rowSize, src, srcPitch, rowSize, height, cudaMemcpyDeviceToDevice),
+					"Failed to copy input frame to staging buffer");
+			else if (srcPitch == rowSize)
+				memcpy(slot.buffer.ptr, src, rowSize * height);
+			else
+				for (uint32_t y = 0; y < height; ++y)
+					memcpy((uint8_t*)slot.buffer.ptr + y * rowSize, (const uint8_t*)src + y * srcPitch, rowSize);
+		});
+	}
+};
+
+#ifdef NVPIPE_WITH_OPENGL
+class AsyncTextureEncoder : public AsyncEncoderBase
+{
+public:
+	using AsyncEncoderBase::AsyncEncoderBase;
+
+	~AsyncTextureEncoder()
+	{
+		this->shutdown();
+
+		if (m_copyStream)
+			cudaStreamDestroy(m_copyStream);
+	}
+
+protected:
+	/**
+	 * The slot's staging buffer doubles as NVENC input surface, so the texture is only copied once.
+	 */
+	void encodeSlot(Slot& slot, std::vector<std::vector<uint8_t>>& packets) override
+	{
+		this->recreate(slot.width, slot.height);	// Releases the surfaces of the old session
+
+		// The render thread reallocates the buffer when the frame grew
+		if (slot.surface && slot.surfaceBuffer != slot.buffer.ptr)
+			this->releaseInputSurface(slot);
+
+		if (!slot.surface)
+		{
+			try
+			{
+				slot.surface = this->encoder->RegisterExternalInput(slot.buffer.ptr, NV_ENC_INPUT_RESOURCE_TYPE_CUDADEVICEPTR, (int)slot.pitch);
+				slot.surfaceBuffer = slot.buffer.ptr;
+			}
+			catch (NVENCException & e)
+			{
+				throw Exception("Failed to register input surface (" + e.getErrorString() + ", error " + std::to_string(e.getErrorCode()) + " = " + EncErrorCodeToString(e.getErrorCode()) + ")");
+			}
+		}
+
+		this->encodePackets(packets, slot.forceIFrame, slot.surface);
+	}
+
+public:
+	struct TextureFrame
+	{
+		uint32_t texture = 0;
+		uint32_t target = 0;
+		uint32_t width = 0;
+		uint32_t height = 0;
+		bool forceIFrame = false;
+		int taskId = -1;	// Encoder task, once the frame entered the queue
+		std::string error;	// Why it didn't
+	};
+
+	/**
+	 * Called on the render thread. Maps the textures of all frames with a single call, then only queues
+	 * their copies on a dedicated stream, the encode worker waits for them instead of the render thread.
+	 * Failures are reported per frame, the other frames are encoded regardless.
+	 */
+	void encodeTexturesAsync(std::vector<TextureFrame>& frames)
+	{
+		std::vector<cudaGraphicsResource_t> resources(frames.size(), nullptr);
+		std::vector<cudaGraphicsResource_t> mapped;
+
+		try
+		{
+			this->collectReleasedTextures();
+			if (this->format != NVPIPE_RGBA32)
+				throw Exception("The OpenGL interface only supports the RGBA32 format");
+			if (!m_copyStream)
+				CUDA_THROW(cudaStreamCreateWithFlags(&m_copyStream, cudaStreamNonBlocking),
+					"Failed to create texture copy stream");
+		}
+		catch (const Exception & e)
+		{
+			for (auto& frame : frames)
+				frame.error = e.message;
+			return;
+		}
+
+		// Register all first, the registry doesn't evict the textures of a batch while it's mapped
+		this->registry.beginBatch();
+		for (size_t i = 0; i < frames.size(); ++i)
+		{
+			try
+			{
+				resources[i] = this->registry.getTextureGraphicsResource(frames[i].texture, frames[i].target, frames[i].width, frames[i].height, cudaGraphicsRegisterFlagsReadOnly);
+				if (std::find(mapped.begin(), mapped.end(), resources[i]) == mapped.end())
+					mapped.push_back(resources[i]);	// A texture captured twice is mapped once
+			}
+			catch (const Exception & e)
+			{
+				frames[i].error = e.message;
+			}
+		}
+
+		try
+		{
+			if (!mapped.empty())
+				CUDA_THROW(cudaGraphicsMapResources((int)mapped.size(), mapped.data(), m_copyStream),
+					"Failed to map texture graphics resources");
+		}
+		catch (const Exception & e)
+		{
+			for (auto& frame : frames)
+				if (frame.error.empty())
+					frame.error = e.message;
+			this->registry.endBatch();
+			return;
+		}
+
+		for (size_t i = 0; i < frames.size(); ++i)
+		{
+			TextureFrame& frame = frames[i];
+			if (!frame.error.empty())
+				continue;
+
+			try
+			{
+				frame.taskId = this->enqueue(frame.width, frame.height, frame.forceIFrame, [&](Slot& slot)
+				{
+					if (!slot.copyDone)
+						CUDA_THROW(cudaEventCreateWithFlags(&slot.copyDone, cudaEventDisableTiming),
+							"Failed to create texture copy event");
+
+					cudaArray_t array;
+					CUDA_THROW(cudaGraphicsSubResourceGetMappedArray(&array, resources[i], 0, 0),
+						"Failed get texture graphics resource array");
+
+					//Copy to intermediate buffer.
+					slot.buffer.reservePitched(frame.width * 4, frame.height);
+					slot.pitch = slot.buffer.pitch;
+					CUDA_THROW(cudaMemcpy2DFromArrayAsync(
+						slot.buffer.ptr,
+						slot.buffer.pitch,
+						array,
+						0, 0, frame.width * 4, frame.height, cudaMemcpyDeviceToDevice, m_copyStream),
+						"Failed to copy memory to intermediate buffer."
+					);
+					CUDA_THROW(cudaEventRecord(slot.copyDone, m_copyStream),
+						"Failed to record texture copy event");
+					slot.copyPending = true;
+				});
+			}
+			catch (const Exception & e)
+			{
+				frame.taskId = -1;
+				frame.error = e.message;
+			}
+		}
+
+		// Unmap all textures, ordered after the copies on the stream, so GL only continues once they are done.
+		// The frames are queued already; if this fails, the next map fails and reports it.
+		cudaError_t unmapResult = cudaGraphicsUnmapResources((int)mapped.size(), mapped.data(), m_copyStream);
+		if (unmapResult != cudaSuccess)
+			DEBUG_LOG("Failed to unmap texture graphics resources (Error %d: %s)\n", (int)unmapResult, cudaGetErrorString(unmapResult));
+		this->registry.endBatch();
+	}
+
+private:
+	cudaStream_t m_copyStream = nullptr;
+};
+
+/**
+ * @brief Texture encode tasks of one AsyncTextureEncoder, passed between Unity's main thread and render thread.
+ * Every encoder has its own queues, so a slow encoder never holds up the completions of another one.
+ */
+struct AsyncTextureTasks
+{
+	static constexpr uint32_t kDefaultTaskCount = 20;
+
+	struct PendingTask	// main -> render
+	{
+		uint32_t id = 0;
+		uint32_t texture = 0;
+		uint32_t width = 0;
+		uint32_t height = 0;
+		bool forceIFrame = false;
+	};
+
+	struct FinishedTask	// render -> main
+	{
+		uint32_t id = 0;
+		bool isError = false;
+		bool captured = false;	// Started by a render event, not counted in tasksInPipeline
+		std::string error;
+		EncodedBuffer result;	// Moved out of the encoder, so it stays valid until the task is cleared or leased.
+	};
+
+	struct InFlightTask	// Render thread only
+	{
+		uint32_t id = 0;
+		int encoderTaskId = 0;
+		bool captured = false;
+	};
+
+	explicit AsyncTextureTasks(uint32_t count = kDefaultTaskCount) :
+		maxTaskCount(count), pending(count), finished(count)
+	{
+	}
+
+	const uint32_t maxTaskCount;
+	SpscRing<PendingTask> pending;
+	SpscRing<FinishedTask> finished;
+
+	// Render thread only
+	std::deque<InFlightTask> inFlight;
+	std::deque<FinishedTask> overflow;	// Finished while the finished queue was full, handed over by a later poll
+	uint64_t seenFinishedCount = 0;	// Encoder's finished count at the last scan of inFlight
+
+	// Written by the render thread, frames captured by render events bypass the main thread's bookkeeping
+	std::atomic<uint64_t> capturedFrames{ 0 };
+	std::atomic<uint64_t> droppedCaptures{ 0 };	// The pipe already held its maximum task count
+
+	// Main thread only
+	uint32_t nextTaskId = 1;	// 0 is returned on error
+	uint32_t firstValidTaskId = 1;	// Tasks before this were reset and are dropped when they finish
+	uint32_t tasksInPipeline = 0;	// Pushed to pending, not popped from finished yet
+	std::unordered_map<uint32_t, FinishedTask> results;
+};
+#endif
+#endif
+
+#ifdef NVPIPE_WITH_ENCODER
+/**
+ * @brief Completion notifications of an async pipe: an application callback and, on Linux, an eventfd.
+ */
+struct CompletionNotifier
+{
+	~CompletionNotifier()
+	{
+#ifndef _WIN32
+		if (eventFd >= 0)
+			close(eventFd);
+#endif
+	}
+
+	void setCallback(NvPipe_TaskCompletedCallback callback, void* userData)
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->callback = callback;
+		this->userData = userData;
+	}
+
+	int getEventFd()
+	{
+#ifdef _WIN32
+		throw Exception("Completion event file descriptors are only available on Linux");
+#else
+		std::lock_guard<std::mutex> lock(this->mutex);
+		if (eventFd < 0)
+		{
+			eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			if (eventFd < 0)
+				throw Exception("Failed to create completion eventfd");
+		}
+		return eventFd;
+#endif
+	}
+
+	void notify(uint32_t pipe, uint32_t taskIndex)
+	{
+		NvPipe_TaskCompletedCallback callback;
+		void* userData;
+		int fd;
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			callback = this->callback;
+			userData = this->userData;
+			fd = this->eventFd;
+		}
+
+		if (callback)
+			callback(pipe, taskIndex, userData);
+
+#ifndef _WIN32
+		// The counter adds up, a reader learns how many tasks finished since its last read
+		if (fd >= 0)
+		{
+			uint64_t one = 1;
+			ssize_t written = write(fd, &one, sizeof(one));
+			(void)written;
+		}
+#endif
+	}
+
+	std::mutex mutex;
+	NvPipe_TaskCompletedCallback callback = nullptr;
+	void* userData = nullptr;
+	int eventFd = -1;
+};
+#endif
+
+struct Instance
+{
+#ifdef NVPIPE_WITH_ENCODER
+	std::unique_ptr<Encoder> encoder;
+	std::unique_ptr<AsyncEncoder> asyncEncoder;
+#ifdef NVPIPE_WITH_OPENGL
+	std::unique_ptr<AsyncTextureEncoder> asyncTextureEncoder;
+	std::shared_ptr<AsyncTextureTasks> asyncTextureTasks;	//Replaced atomically, the render thread may be reading it
+#endif
+	std::shared_ptr<CompletionNotifier> notifier;	//Set atomically, the render thread may be reading it
+#endif
+
+
+#ifdef NVPIPE_WITH_DECODER
+	std::unique_ptr<Decoder> decoder;
+#endif
+
+	std::unique_ptr<StreamWriter> streamWriter;
+	std::unique_ptr<StreamReader> streamReader;
+	std::unique_ptr<RtpPacketizer> rtpPacketizer;
+	std::unique_ptr<RtpReceiver> rtpReceiver;
+	std::shared_ptr<StreamServer> streamServer;	// Shared with the encoders it is attached to
+
+
+	std::string error;
+};
+
+std::string sharedError; // shared error code for create functions (NOT threadsafe)
+std::unordered_map<uint32_t, std::shared_ptr<Instance>> g_pipes;
+std::mutex g_pipeDictMutex;
+uint32_t g_pipeCreationIndex = 1;	//Start with 1, since GetError requries a special value(0 here) for global error.
+
+static void DeletePipe(uint32_t id) {
+	std::lock_guard<std::mutex> lock(g_pipeDictMutex);
+	g_pipes.erase(id);
+}
+
+static std::shared_ptr<Instance> GetPipe(uint32_t id) {
+	std::lock_guard<std::mutex> lock(g_pipeDictMutex);
+	auto ite = g_pipes.find(id);
+	if (ite == g_pipes.end()) {
+		return nullptr;
+	}
+	return ite->second;
+}
+
+static uint32_t InsertNewPipe(std::shared_ptr<Instance> instance) {
+	std::lock_guard<std::mutex> lock(g_pipeDictMutex);
+	auto index = g_pipeCreationIndex++;
+	g_pipes[index] = instance;
+	return index;
+}
+
+#ifdef NVPIPE_WITH_ENCODER
+
+UNITY_INTERFACE_EXPORT uint32_t UNITY_INTERFACE_API NvPipe_CreateEncoder(NvPipe_Format format, NvPipe_Codec codec, NvPipe_Compression compression, uint64_t bitrate, uint32_t targetFrameRate, uint32_t width, uint32_t height)
+{
+	auto instance = std::make_shared<Instance>();
+
+	try
+	{
+		instance->encoder = std::unique_ptr<Encoder>(new Encoder(format, codec, compression, bitrate, targetFrameRate, width, height));
+		return InsertNewPipe(instance);
+	}
+	catch (Exception & e)
+	{
+		sharedError = e.getErrorString();
+		return 0;
+	}
+
+	return 0;
+}
+
+UNITY_INTERFACE_EXPORT uint32_t UNITY_INTERFACE_API NvPipe_CreateEncoderWithBackend(NvPipe_Format format, NvPipe_Codec codec, NvPipe_Compression compression, uint64_t bitrate, uint32_t targetFrameRate, uint32_t width, uint32_t height, NvPipe_EncoderBackend backend)
+{
+	auto instance = std::make_shared<Instance>();
+
+	try
+	{
+		instance->encoder = std::unique_ptr<Encoder>(new Encoder(format, codec, compression, bitrate, targetFrameRate, width, height, backend));
+		return InsertNewPipe(instance);
+	}
+	catch (Exception & e)
+	{
+		sharedError = e.getErrorString();
+		return 0;
+	}
+
+	return 0;
+}
+
+UNITY_INTERFACE_EXPORT uint32_t UNITY_INTERFACE_API NvPipe_CreateAsyncEncoder(NvPipe_Format format, NvPipe_Codec codec, NvPipe_Compression compression, uint64_t bitrate, uint32_t targetFrameRate, uint32_t width, uint32_t height)
+{
+	auto instance = std::make_shared<Instance>();
+
+	try
+	{
+		instance->asyncEncoder = std::make_unique<AsyncEncoder>(format, codec, compression, bitrate, targetFrameRate, width, height);
+		return InsertNewPipe(instance);
+	}
+	catch (Exception & e)
+	{
+		sharedError = e.getErrorString();
+		return 0;
+	}
+
+	return 0;
+}
+
+#ifdef NVPIPE_WITH_OPENGL
+UNITY_INTERFACE_EXPORT uint32_t UNITY_INTERFACE_API NvPipe_CreateTextureAsyncEncoder(NvPipe_Format format, NvPipe_Codec codec, NvPipe_Compression compression, uint64_t bitrate, uint32_t targetFrameRate, uint32_t width, uint32_t height)
+{
+	auto instance = std::make_shared<Instance>();
+
+	try
+	{
+		instance->asyncTextureEncoder = std::make_unique<AsyncTextureEncoder>(format, codec, compression, bitrate, targetFrameRate, width, height);
+		instance->asyncTextureTasks = std::make_shared<AsyncTextureTasks>();
+		return InsertNewPipe(instance);
+	}
+	catch (Exception & e)
+	{
+		sharedError = e.getErrorString();
+		return 0;
+	}
+
+	return 0;
+}
+#endif
+
+UNITY_INTERFACE_EXPORT void UNITY_INTERFACE_API NvPipe_SetBitrate(uint64_t pipe, uint64_t bitrate, uint32_t targetFrameRate)
+{
+	auto instance = GetPipe(pipe);
+	if (instance == nullptr)
+		return;
+
+	if (!instance->encoder)
+	{
+		instance->error = "Invalid NvPipe encoder.";
+		return;
+	}
+
+	try
+	{
+		return instance->encoder->setBitrate(bitrate, targetFrameRate);
+	}
+	catch (Exception & e)
+	{
+		instance->error = e.getErrorString();
+	}
+}
+
+UNITY_INTERFACE_EXPORT uint64_t UNITY_INTERFACE_API NvPipe_Encode(uint32_t pipe, const void* src, uint64_t srcPitch, uint8_t* dst, uint64_t dstSize, uint32_t width, uint32_t height, bool forceIFrame)
+{
+	auto instance = GetPipe(pipe);
+	if (instance == nullptr)
+		return 0;
+	if (!instance->encoder)
+	{
+		instance->error = "Invalid NvPipe encoder.";
+		return 0;
+	}
+
+	try
+	{
+		return instance->encoder->encode(src, srcPitch, dst, dstSize, width, height, forceIFrame);
+	}
+	catch (Exception & e)
+	{
+		instance->error = e.getErrorString();
+		return 0;
+	}
+}
+
+UNITY_INTERFACE_EXPORT int32_t UNITY_INTERFACE_API NvPipe_EncodeAsync(uint32_t pipe, const void* src, uint64_t srcPitch, uint32_t width, uint32_t height, bool forceIFrame)
+{
+	auto instance = GetPipe(pipe);
+	if (instance == nullptr)
+		return -1;
+	if (!instance->asyncEncoder)
+	{
+		instance->error = "Invalid NvPipe async encoder.";
+		return -1;
+	}
+
+	try
+	{
+		return instance->asyncEncoder->encodeAsync(src, srcPitch, width, height, forceIFrame);
+	}
+	catch (Exception & e)
+	{
+		instance->error = e.getErrorString();
+		return -1;
+	}
+}
+
+UNITY_INTERFACE_EXPORT void UNITY_INTERFACE_API NvPipe_EncodeAsyncQuery(uint32_t pipe, int32_t taskIndex, bool* isDone, bool* isError, uint8_t** encodedData, uint64_t* encodeSize, const char** error)
+{
+	auto instance = GetPipe(pipe);
+	if (instance == nullptr)
+		return;
+	if (!instance->asyncEncoder)
+	{
+		instance->error = "Invalid NvPipe async encoder.";
+		return;
+	}
+
+	try
+	{
+		auto result = instance->asyncEncoder->queryTask(taskIndex);
+		*isDone = (result != nullptr);
+		*isError = false;
+		if (result)
+		{
+			*isError = result->isError;
+			if (result->isError)
+			{
+				*error = result->error.c_str();
+			}
+			else
+			{
+				// Dropped frames report no data
+				*encodedData = result->isDropped ? nullptr : result->data.data;
+				*encodeSize = result->data.size;
+			}
+		}
+	}
+	catch (Exception & e)
+	{
+		instance->error = e.getErrorString();
+	}
+}
+
+UNITY_INTERFACE_EXPORT void UNITY_INTERFACE_API NvPipe_EncodeAsyncClearTask(uint32_t pipe, int32_t taskIndex)
+{
+	auto instance = GetPipe(pipe);
+	if (instance == nullptr)
+		return;
+	if (!instance->asyncEncoder)
+	{
+		instance->error = "Invalid NvPipe async encoder.";
+		return;
+	}
+
+	try
+	{
+		instance->asyncEncoder->clearTask(taskIndex);
+	}
+	catch (Exception & e)
+	{
+		instance->error = e.getErrorString();
+	}
+}
+
+static AsyncEncoderBase* GetAsyncEncoder(const std::shared_ptr<Instance>& instance)
+{
+	if (instance->asyncEncoder)
+		return instance->asyncEncoder.get();
+#ifdef NVPIPE_WITH_OPENGL
+	if (instance->asyncTextureEncoder)
+		return instance->asyncTextureEncoder.get();
+#endif
+	return nullptr;
+}
+
+UNITY_INTERFACE_EXPORT void UNITY_INTERFACE_API NvPipe_SetAsyncEncoderQueue(uint32_t pipe, uint32_t depth, NvPipe_OverflowPolicy policy, uint32_t timeoutMs)
+{
+	auto instance = GetPipe(pipe);
+	if (instance == nullptr)
+		return;
+	auto encoder = GetAsyncEncoder(instance);
+	if (!encoder)
+	{
+		instance->error = "Invalid NvPipe async encoder.";
+		return;
+	}
+
+	try
+	{
+		encoder->setQueuePolicy(depth, policy, timeoutMs);
+	}
+	catch (Exception & e)
+	{
+		instance->error = e.getErrorString();
+	}
+}
+
+UNITY_INTERFACE_EXPORT void UNITY_INTERFACE_API NvPipe_GetAsyncEncoderStats(uint32_t pipe, uint64_t* queuedFrames, uint64_t* droppedFrames, uint32_t* waitingFrames)
+{
+	auto instance = GetPipe(pipe);
+	if (instance == nullptr)
+		return;
+	auto encoder = GetAsyncEncoder(instance);
+	if (!encoder)
+	{
+		instance->error = "Invalid NvPipe async encoder.";
+		return;
+	}
+
+	encoder->getStats(queuedFrames, droppedFrames, waitingFrames);
+#ifdef NVPIPE_WITH_OPENGL
+	auto tasks = std::atomic_load(&instance->asyncTextureTasks);
+	if (tasks)
+		*droppedFrames += tasks->droppedCaptures.load();
+#endif
+}
+
+UNITY_INTERFACE_EXPORT void UNITY_INTERFACE_API NvPipe_SetEncodeWorkerCount(uint32_t count, bool pinToCores)
+{
+	try
+	{
+		GetEncodeScheduler().setWorkerCount(count, pinToCores);
+	}
+	catch (Exception & e)
+	{
+		sharedError = e.getErrorString();
+	}
+}
+
+static std::shared_ptr<CompletionNotifier> GetNotifier(uint32_t pipe, const std::shared_ptr<Instance>& instance)
+{
+	auto notifier = std::atomic_load(&instance->notifier);
+	if (notifier)
+		return notifier;
+
+	notifier = std::make_shared<CompletionNotifier>();
+	if (instance->asyncEncoder)
+	{
+		//Reported right from the encode worker
+		instance->asyncEncoder->setCompletionHandler([notifier, pipe](int taskIndex) { notifier->notify(pipe, (uint32_t)taskIndex); });
+	}
+#ifdef NVPIPE_WITH_OPENGL
+	else if (instance->asyncTextureEncoder)
+	{
+		//Reported by the render thread poll, once the result can be queried
+	}
+#endif
+	else
+	{
+		throw Exception("Invalid NvPipe async encoder.");
+	}
+
+	std::atomic_store(&instance->notifier, notifier);
+	return notifier;
+}
+
+UNITY_INTERFACE_EXPORT void UNITY_INTERFACE_API NvPipe_SetTaskCompletedCallback(uint32_t pipe, NvPipe_TaskCompletedCallback callback, void* userData)
+{
+	auto instance = GetPipe(pipe);
+	if (instance == nullptr)
+		return;
+
+	try
+	{
+		GetNotifier(pipe, instance)->setCallback(callback, userData);
+	}
+	catch (Exception & e)
+	{
+		instance->error = e.getErrorString();
+	}
+}
+
+UNITY_INTERFACE_EXPORT int32_t UNITY_INTERFACE_API NvPipe_GetTaskCompletedEventFd(uint32_t pipe)
+{
+	auto instance = GetPipe(pipe);
+	if (instance == nullptr)
+		return -1;
+
+	try
+	{
+		return GetNotifier(pipe, instance)->getEventFd();
+	}
+	catch (Exception & e)
+	{
+		instance->error = e.getErrorString();
+	}
+	return -1;
+}
+
+static Encoder* GetEncoder(const std::shared_ptr<Instance>& instance)
+{
+	if (instance->encoder)
+		return instance->encoder.get();
+	return GetAsyncEncoder(instance);
+}
+
+UNITY_INTERFACE_EXPORT void UNITY_INTERFACE_API NvPipe_StartRecording(uint32_t pipe, const char* path)
+{
+	NvPipe_StartRecordingWithBuffer(pipe, path, 0);
+}
+
+UNITY_INTERFACE_EXPORT void UNITY_INTERFACE_API NvPipe_StartRecordingWithBuffer(uint32_t pipe, const char* path, uint64_t bufferSize)
+{
+	auto instance = GetPipe(pipe);
+	if (instance == nullptr)
+		return;
+	auto encoder = GetEncoder(instance);
+	if (!encoder || path == nullptr)
+	{
+		instance->error = encoder ? "Invalid recording path." : "Invalid NvPipe encoder.";
+		return;
+	}
+
+	try
+	{
+		encoder->startRecording(path, bufferSize);
+	}
+	catch (Exception & e)
+	{
+		instance->error = e.getErrorString();
+	}
+}
+
+UNITY_INTERFACE_EXPORT void UNITY_INTERFACE_API NvPipe_StopRecording(uint32_t pipe)
+{
+	auto instance = GetPipe(pipe);
+	if (instance == nullptr)
+		return;
+	auto encoder = GetEncoder(instance);
+	if (!encoder)
+	{
+		instance->error = "Invalid NvPipe encoder.";
+		return;
+	}
+
+	std::string error = encoder->stopRecording();
+	if (!error.empty())
+		instance->error = error;
+}
+
+UNITY_INTERFACE_EXPORT void UNITY_INTERFACE_API NvPipe_GetRecordingStats(uint32_t pipe, NvPipe_RecordingStats* stats)
+{
+	auto instance = GetPipe(pipe);
+	if (instance == nullptr)
+		return;
+	auto encoder = GetEncoder(instance);
+	if (!encoder || stats == nullptr)
+	{
+		instance->error = encoder ? "Invalid recording stats." : "Invalid NvPipe encoder.";
+		return;
+	}
+
+	encoder->getRecordingStats(stats);
+}
+
+UNITY_INTERFACE_EXPORT void UNITY_INTERFACE_API NvPipe_StartSharedOutput(uint32_t pipe, const char* name, uint64_t capacity)
+{
+	auto instance = GetPipe(pipe);
+	if (instance == nullptr)
+		return;
+	auto encoder = GetEncoder(instance);
+	if (!encoder || name == nullptr)
+	{
+		instance->error = encoder ? "Invalid shared output name." : "Invalid NvPipe encoder.";
+		return;
+	}
+
+	try
+	{
+		encoder->startSharedOutput(name, capacity);
+	}
+	catch (Exception & e)
+	{
+		instance->error = e.getErrorString();
+	}
+}
+
+UNITY_INTERFACE_EXPORT void UNITY_INTERFACE_API NvPipe_StopSharedOutput(uint32_t pipe)
+{
+	auto instance = GetPipe(pipe);
+	if (instance == nullptr)
+		return;
+	auto encoder = GetEncoder(instance);
+	if (!encoder)
+	{
+		instance->error = "Invalid NvPipe encoder.";
+		return;
+	}
+
+	encoder->stopSharedOutput();
+}
+
+UNITY_INTERFACE_EXPORT void UNITY_INTERFACE_API NvPipe_AttachStreamServer(uint32_t pipe, uint32_t server)
+{
+	auto instance = GetPipe(pipe);
+	if (instance == nullptr)
+		return;
+	auto encoder = GetEncoder(instance);
+	if (!encoder)
+	{
+		instance->error = "Invalid NvPipe encoder.";
+		return;
+	}
+
+	std::shared_ptr<StreamServer> streamServer;
+	if (server != 0)
+	{
+		auto serverInstance = GetPipe(server);
+		if (serverInstance == nullptr || !serverInstance->streamServer)
+		{
+			instance->error = "Invalid NvPipe stream server.";
+			return;
+		}
+		streamServer = serverInstance->streamServer;
+	}
+
+	encoder->attachStreamServer(streamServer);
+}
+
+#ifdef NVPIPE_WITH_OPENGL
+
+UNITY_INTERFACE_EXPORT uint64_t UNITY_INTERFACE_API NvPipe_EncodeTexture(uint32_t pipe, uint32_t texture, uint32_t target, uint8_t* dst, uint64_t dstSize, uint32_t width, uint32_t height, bool forceIFrame)
+{
+	auto instance = GetPipe(pipe);
+
+	if (instance == nullptr)
+		return 0;
+
+	if (!instance->encoder)
+	{
+		instance->error = "Invalid NvPipe encoder.";
+		return 0;
+	}
+
+	try
+	{
+		return instance->encoder->encodeTexture(texture, target, dst, dstSize, width, height, forceIFrame);
+	}
+	catch (Exception & e)
+	{
+		instance->error = e.getErrorString();
+		return 0;
+	}
+}
+
+
+/*
+==================================
+Async OpenGL Texture Encoding.
+==================================
+*/
+
+/*Main thread only. Moves tasks finished by the render thread into the result map.*/
+static void CollectFinishedTasks(AsyncTextureTasks& tasks) {
+	AsyncTextureTasks::FinishedTask task;
+	while (tasks.finished.pop(task))
+	{
+		if (!task.captured)
+			tasks.tasksInPipeline--;
+		if (task.id >= tasks.firstValidTaskId)
+			tasks.results[task.id] = std::move(task);
+	}
+}
+
+/*
+Called in main thread, to clear all async encoding tasks.
+But actual encoders and tasks inside it won't be destructed.
+*/
+UNITY_INTERFACE_EXPORT void UNITY_INTERFACE_API NvPipe_ResetEncodeTasks() {
+	std::vector<std::shared_ptr<Instance>> pipes;
+	{
+		std::lock_guard<std::mutex> lock(g_pipeDictMutex);
+		for (auto& p : g_pipes)
+			if (p.second->asyncTextureTasks)
+				pipes.push_back(p.second);
+	}
+
+	for (auto& pipe : pipes)
+	{
+		//Tasks still owned by the render thread are dropped once they finish.
+		auto& tasks = *pipe->asyncTextureTasks;
+		CollectFinishedTasks(tasks);
+		tasks.results.clear();
+		tasks.firstValidTaskId = tasks.nextTaskId;
+	}
+
+	DEBUG_LOG("async encode queue reset\n");
+}
+
+/*
+Called in main thread, to change how many async encoding tasks could exist at the same time for an encoder.
+Only possible while the encoder has no tasks.
+*/
+UNITY_INTERFACE_EXPORT void UNITY_INTERFACE_API NvPipe_SetMaxPendingEncodeTasks(uint32_t nvp, uint32_t count) {
+	auto pipe = GetPipe(nvp);
+	if (pipe == nullptr)
+		return;
+	if (pipe->asyncTextureTasks == nullptr) {
+		pipe->error = "Invalid async texture encoder";
+		return;
+	}
+	if (count < 2) {
+		pipe->error = "At least 2 pending encode tasks are required";
+		return;
+	}
+
+	auto& tasks = pipe->asyncTextureTasks;
+	CollectFinishedTasks(*tasks);
+	if (tasks->tasksInPipeline != 0 || !tasks->results.empty()) {
+		pipe->error = "Can't change the task count while tasks exist";
+		return;
+	}
+
+	//The render thread only sees the new queues through a new pipe reference.
+	auto newTasks = std::make_shared<AsyncTextureTasks>(count);
+	newTasks->nextTaskId = tasks->nextTaskId;
+	newTasks->firstValidTaskId = tasks->nextTaskId;
+	std::atomic_store(&pipe->asyncTextureTasks, newTasks);
+}
+
+/*Called in main thread, to enqueue a new task.*/
+UNITY_INTERFACE_EXPORT uint32_t UNITY_INTERFACE_API NvPipe_QueueEncodeTaskInMainThread(uint32_t nvp, uint32_t texture, uint32_t width, uint32_t height, bool forceIFrame) {
+	auto pipe = GetPipe(nvp);
+	if (pipe == nullptr)
+		return 0;
+	if (pipe->asyncTextureEncoder == nullptr) {
+		pipe->error = "Invalid async texture encoder";
+		return 0;
+	}
+
+	auto& tasks = *pipe->asyncTextureTasks;
+	CollectFinishedTasks(tasks);
+	if (tasks.tasksInPipeline + tasks.results.size() >= tasks.maxTaskCount) {	//Reached maximum submit tasks per frame, or earlier tasks are not cleared yet.
+		static char msgBuffer[200];
+		sprintf(msgBuffer, "Maximum task count reached. Did you forget to clear task, or submitted too many tasks(%u) at once?", tasks.maxTaskCount);
+		pipe->error = msgBuffer;
+		return 0;
+	}
+
+	AsyncTextureTasks::PendingTask task;
+	task.id = tasks.nextTaskId;
+	task.texture = texture;
+	task.width = width;
+	task.height = height;
+	task.forceIFrame = forceIFrame;
+	if (!tasks.pending.push(std::move(task))) {
+		pipe->error = "Async encode task queue is full";
+		return 0;
+	}
+
+	tasks.tasksInPipeline++;
+	tasks.nextTaskId = (tasks.nextTaskId == UINT32_MAX) ? 1 : tasks.nextTaskId + 1;
+	DEBUG_LOG("async encode task enqueued, task index %u\n", task.id);
+	return task.id;
+}
+
+/*Render thread only. Hands a finished task to the main thread, or keeps it until the finished queue has room again.*/
+static void FinishTextureTask(uint32_t pipe, AsyncTextureTasks& tasks, CompletionNotifier* notifier, AsyncTextureTasks::FinishedTask&& finished) {
+	uint32_t id = finished.id;
+	if (!tasks.overflow.empty() || !tasks.finished.push(std::move(finished))) {
+		DEBUG_LOG("RTP: finished queue full, task %u handed over later\n", id);
+		tasks.overflow.push_back(std::move(finished));
+		return;
+	}
+	if (notifier)
+		notifier->notify(pipe, id);
+}
+
+/*Render thread only. Retries the tasks that didn't fit into the finished queue, in order.*/
+static void FlushFinishedTasks(uint32_t pipe, AsyncTextureTasks& tasks, CompletionNotifier* notifier) {
+	while (!tasks.overflow.empty())
+	{
+		uint32_t id = tasks.overflow.front().id;
+		if (!tasks.finished.push(std::move(tasks.overflow.front())))
+			return;
+		tasks.overflow.pop_front();
+		if (notifier)
+			notifier->notify(pipe, id);
+	}
+}
+
+/*Render thread only. Copies the textures into the encoder with one mapping, a failure finishes its task right away.*/
+static void StartTextureTasks(uint32_t pipe, AsyncTextureEncoder& encoder, AsyncTextureTasks& tasks, CompletionNotifier* notifier, const std::vector<AsyncTextureTasks::PendingTask>& batch, bool captured) {
+	std::vector<AsyncTextureEncoder::TextureFrame> frames(batch.size());
+	for (size_t i = 0; i < batch.size(); ++i)
+	{
+		frames[i].texture = batch[i].texture;
+		frames[i].target = GL_TEXTURE_2D;
+		frames[i].width = batch[i].width;
+		frames[i].height = batch[i].height;
+		frames[i].forceIFrame = batch[i].forceIFrame;
+	}
+
+	//Errors here are not stored in instance.error, since we're in render thread. Put them along inside the finished task.
+	encoder.encodeTexturesAsync(frames);
+
+	for (size_t i = 0; i < batch.size(); ++i)
+	{
+		if (frames[i].error.empty())
+		{
+			AsyncTextureTasks::InFlightTask inFlight;
+			inFlight.id = batch[i].id;
+			inFlight.encoderTaskId = frames[i].taskId;
+			inFlight.captured = captured;
+			tasks.inFlight.push_back(inFlight);
+			DEBUG_LOG("RTP: %u entered encoder queue\n", inFlight.id);
+			continue;
+		}
+
+		AsyncTextureTasks::FinishedTask finished;
+		finished.id = batch[i].id;
+		finished.captured = captured;
+		finished.isError = true;
+		finished.error = std::move(frames[i].error);
+		DEBUG_LOG("RTP: %u failed to enqueue to encoder, error:%s\n", finished.id, finished.error.c_str());
+		FinishTextureTask(pipe, tasks, notifier, std::move(finished));
+	}
+}
+
+/*Render thread only. Moves pending tasks of one encoder into it and hands back finished ones.*/
+static void PollTextureEncoder(uint32_t pipe, AsyncTextureEncoder& encoder, AsyncTextureTasks& tasks, CompletionNotifier* notifier) {
+	FlushFinishedTasks(pipe, tasks, notifier);
+
+	//All textures queued since the last poll are mapped together.
+	std::vector<AsyncTextureTasks::PendingTask> batch;
+	AsyncTextureTasks::PendingTask* pending;
+	while ((pending = tasks.pending.front()) != nullptr)
+	{
+		batch.push_back(*pending);
+		tasks.pending.pop();
+	}
+	if (!batch.empty())
+		StartTextureTasks(pipe, encoder, tasks, notifier, batch, false);
+
+	//Nothing finished since the last scan, skip querying the encoder.
+	uint64_t finishedCount = encoder.getFinishedCount();
+	if (finishedCount == tasks.seenFinishedCount)
+		return;
+	tasks.seenFinishedCount = finishedCount;
+
+	//Query any task is done.
+	for (auto it = tasks.inFlight.begin(); it != tasks.inFlight.end();)
+	{
+		AsyncTextureTasks::FinishedTask finished;
+		finished.id = it->id;
+		finished.captured = it->captured;
+
+		try
+		{	//Take the result from encoder once it's finished, this also clears the encoder task.
+			AsyncEncoderBase::TaskResult result;
+			if (!encoder.takeTask(it->encoderTaskId, &result)) {
+				++it;
+				continue;
+			}
+
+			finished.isError = result.isError;
+			finished.error = std::move(result.error);
+			finished.result = std::move(result.data);	//Empty if the frame was dropped
+		}
+		catch (const Exception & e)
+		{
+			DEBUG_LOG("RTP: Exception during query task %u status. %s\n", it->id, e.message.c_str());
+			finished.isError = true;
+			finished.error = e.message;
+		}
+
+		FinishTextureTask(pipe, tasks, notifier, std::move(finished));
+		it = tasks.inFlight.erase(it);
+	}
+}
+
+/*
+Called by render thread
+To move all pending tasks into corresponding encoders,
+and update all task infos from encoder.
+*/
+UNITY_INTERFACE_EXPORT void UNITY_INTERFACE_API NvPipe_RenderThreadPoll(int)
+{
+	//Hold references, so encoders destroyed by the main thread meanwhile stay alive until polled.
+	std::vector<std::pair<uint32_t, std::shared_ptr<Instance>>> pipes;
+	{
+		std::lock_guard<std::mutex> lock(g_pipeDictMutex);
+		for (auto& p : g_pipes)
+			if (p.second->asyncTextureEncoder)
+				pipes.push_back(p);
+	}
+
+	DEBUG_LOG("RTP: Render thread polling %zu encoders\n", pipes.size());
+	for (auto& pipe : pipes)
+	{
+		auto tasks = std::atomic_load(&pipe.second->asyncTextureTasks);
+		auto notifier = std::atomic_load(&pipe.second->notifier);
+		PollTextureEncoder(pipe.first, *pipe.second->asyncTextureEncoder, *tasks, notifier.get());
+	}
+	DEBUG_LOG("Render thread polling finished\n");
+}
+
+UNITY_INTERFACE_EXPORT UnityRenderingEvent UNITY_INTERFACE_API NvPipe_GetRenderThreadPollFunc() {
+	return NvPipe_RenderThreadPoll;
+}
+
+/*
+Called by render thread, from a CommandBuffer.
+Captures one texture right where the event sits in the frame, then polls the encoder like NvPipe_RenderThreadPoll.
+*/
+UNITY_INTERFACE_EXPORT void UNITY_INTERFACE_API NvPipe_CaptureTextureEvent(int, void* data)
+{
+	if (data == nullptr)
+		return;
+	NvPipe_CaptureEventData capture = *static_cast<const NvPipe_CaptureEventData*>(data);	//Copy, the caller may reuse the memory afterwards
+	if (capture.frameId == 0)
+		return;
+
+	auto pipe = GetPipe(capture.pipe);
+	if (pipe == nullptr || !pipe->asyncTextureEncoder)
+		return;
+
+	auto tasks = std::atomic_load(&pipe->asyncTextureTasks);
+	auto notifier = std::atomic_load(&pipe->notifier);
+
+	//The main thread doesn't know about this task, so count everything that still has to pass the finished queue.
+	if (tasks->pending.size() + tasks->inFlight.size() + tasks->finished.size() + tasks->overflow.size() >= tasks->maxTaskCount) {
+		tasks->droppedCaptures++;
+		DEBUG_LOG("RTP: captured frame %u dropped, too many tasks\n", capture.frameId);
+	}
+	else {
+		AsyncTextureTasks::PendingTask task;
+		task.id = capture.frameId;
+		task.texture = capture.texture;
+		task.width = capture.width;
+		task.height = capture.height;
+		task.forceIFrame = capture.forceIFrame != 0;
+		tasks->capturedFrames++;
+		StartTextureTasks(capture.pipe, *pipe->asyncTextureEncoder, *tasks, notifier.get(), { task }, true);
+	}
+
+	PollTextureEncoder(capture.pipe, *pipe->asyncTextureEncoder, *tasks, notifier.get());
+}
+
+UNITY_INTERFACE_EXPORT UnityRenderingEventAndData UNITY_INTERFACE_API NvPipe_GetCaptureTextureEventFunc() {
+	return NvPipe_CaptureTextureEvent;
+}
+
+/*
+Called in main thread, query status of encode task.
+Only task error will be returned in **error. Other error goes to the encoder's error.
+*/
+UNITY_INTERFACE_EXPORT void UNITY_INTERFACE_API NvPipe_EncodeTextureAsyncQuery(
+	uint32_t nvp, uint32_t taskIndex, bool* isDone, bool* isError, uint8_t** encodedData, uint64_t* encodeSize, const char** error) {
+	auto pipe = GetPipe(nvp);
+	if (pipe == nullptr)
+		return;
+	if (pipe->asyncTextureTasks == nullptr) {
+		pipe->error = "Invalid async texture encoder";
+		return;
+	}
+
+	auto& tasks = *pipe->asyncTextureTasks;
+	CollectFinishedTasks(tasks);
+
+	auto it = tasks.results.find(taskIndex);
+	if (it == tasks.results.end()) {
+		//Ids wrap around, so compare relative to the next id
+		//Frames captured by render events use their own ids, the main thread can't tell whether they exist yet.
+		bool captured = tasks.capturedFrames.load() != 0;
+		if (taskIndex == 0 || (!captured && tasks.nextTaskId - taskIndex > tasks.nextTaskId - tasks.firstValidTaskId)) {
+			pipe->error = "Task is not valid!";
+			return;
+		}
+		//Not done yet.
+		*isDone = false;
+		return;
+	}
+
+	auto& task = it->second;
+	*isDone = true;
+	*isError = task.isError;
+	if (task.isError) {
+		*error = task.error.c_str();
+	}
+	else {
+		*encodeSize = task.result.size;
+		*encodedData = task.result.data;
+	}
+}
+
+/*Called in main thread, to notify that a task could be cleared.*/
+UNITY_INTERFACE_EXPORT void UNITY_INTERFACE_API NvPipe_EncodeTextureAsyncClearTask(uint32_t nvp, uint32_t taskIndex) {
+	auto pipe = GetPipe(nvp);
+	if (pipe == nullptr)
+		return;
+	if (pipe->asyncTextureTasks == nullptr) {
+		pipe->error = "Invalid async texture encoder";
+		return;
+	}
+
+	auto& tasks = *pipe->asyncTextureTasks;
+	if (tasks.results.erase(taskIndex) == 0) {
+		pipe->error = "The task is still being executed or doesn't exist, and can't be cleared";
+		return;
+	}
+	DEBUG_LOG("RTP: %u is cleared \n", taskIndex);
+}
+
+#endif
+
+/*
+Called in main thread, takes over the encoded data of a finished async encoder task, so no copy is needed.
+The task still has to be cleared, and the data returned with NvPipe_ReleaseEncodedData.
+*/
+UNITY_INTERFACE_EXPORT uint8_t* UNITY_INTERFACE_API NvPipe_LeaseEncodedData(uint32_t nvp, uint32_t taskIndex, uint64_t* size) {
+	auto pipe = GetPipe(nvp);
+	if (pipe == nullptr)
+		return nullptr;
+	*size = 0;
+
+	try {
+		if (pipe->asyncEncoder)
+			return pipe->asyncEncoder->leaseTaskData((int32_t)taskIndex, size);
+
+#ifdef NVPIPE_WITH_OPENGL
+		if (pipe->asyncTextureTasks) {
+			auto& tasks = *pipe->asyncTextureTasks;
+			CollectFinishedTasks(tasks);
+
+			auto it = tasks.results.find(taskIndex);
+			if (it == tasks.results.end()) {
+				pipe->error = "The task is still being executed or doesn't exist, and can't be leased";
+				return nullptr;
+			}
+			*size = it->second.result.size;
+			return it->second.result.detach();
+		}
+#endif
+		pipe->error = "Invalid NvPipe async encoder.";
+	}
+	catch (Exception & e) {
+		pipe->error = e.getErrorString();
+	}
+	return nullptr;
+}
+
+UNITY_INTERFACE_EXPORT void UNITY_INTERFACE_API NvPipe_ReleaseEncodedData(const uint8_t* data) {
+	if (data == nullptr)
+		return;
+
+	try {
+		g_encodedBufferPool.release(data);
+	}
+	catch (Exception & e) {
+		sharedError = e.getErrorString();
+	}
+}
+
+#endif
+
+#ifdef NVPIPE_WITH_DECODER
+
+UNITY_INTERFACE_EXPORT uint32_t UNITY_INTERFACE_API NvPipe_CreateDecoder(NvPipe_Format format, NvPipe_Codec codec, uint32_t width, uint32_t height)
+{
+	auto instance = std::make_shared<Instance>();
+
+	try
+	{
+		instance->decoder = std::unique_ptr<Decoder>(new Decoder(format, codec, width, height));
+		return InsertNewPipe(instance);
+	}
+	catch (Exception & e)
+	{
+		sharedError = e.getErrorString();
+		return 0;
+	}
+
+	return 0;
+}
+
+UNITY_INTERFACE_EXPORT uint32_t UNITY_INTERFACE_API NvPipe_CreateDecoderWithOutput(NvPipe_Format format, NvPipe_Codec codec, uint32_t width, uint32_t height, uint32_t outputWidth, uint32_t outputHeight,
+	uint32_t cropLeft, uint32_t cropTop, uint32_t cropRight, uint32_t cropBottom)
+{
+	auto instance = std::make_shared<Instance>();
+
+	try
+	{
+		Rect cropRect = { (int)cropLeft, (int)cropTop, (int)cropRight, (int)cropBottom };
+		instance->decoder = std::unique_ptr<Decoder>(new Decoder(format, codec, width, height, outputWidth, outputHeight, &cropRect));
+		return InsertNewPipe(instance);
+	}
+	catch (Exception & e)
+	{
+		sharedError = e.getErrorString();
+		return 0;
+	}
+
+	return 0;
+}
+
+UNITY_INTERFACE_EXPORT uint64_t UNITY_INTERFACE_API NvPipe_Decode(uint32_t nvp, const uint8_t* src, uint64_t srcSize, void* dst, uint64_t dstSize, uint32_t width, uint32_t height)
+{
+	auto instance = GetPipe(nvp);
+	if (instance == nullptr)
+		return 0;
+	if (!instance->decoder)
+	{
+		instance->error = "Invalid NvPipe decoder.";
+		return 0;
+	}
+
+	try
+	{
+		return instance->decoder->decode(src, srcSize, dst, dstSize, width, height);
+	}
+	catch (Exception & e)
+	{
+		instance->error = e.getErrorString();
+		return 0;
+	}
+}
+
+UNITY_INTERFACE_EXPORT bool UNITY_INTERFACE_API NvPipe_DecodeSubmit(uint32_t nvp, const uint8_t* src, uint64_t srcSize, int64_t timestamp)
+{
+	auto instance = GetPipe(nvp);
+	if (instance == nullptr)
+		return false;
+	if (!instance->decoder)
+	{
+		instance->error = "Invalid NvPipe decoder.";
+		return false;
+	}
+
+	try
+	{
+		instance->decoder->submit(src, srcSize, timestamp);
+		return true;
+	}
+	catch (Exception & e)
+	{
+		instance->error = e.getErrorString();
+		return false;
+	}
+}
+
+UNITY_INTERFACE_EXPORT bool UNITY_INTERFACE_API NvPipe_DecodeSubmitPartial(uint32_t nvp, const uint8_t* src, uint64_t srcSize, int64_t timestamp, bool endOfPicture)
+{
+	auto instance = GetPipe(nvp);
+	if (instance == nullptr)
+		return false;
+	if (!instance->decoder)
+	{
+		instance->error = "Invalid NvPipe decoder.";
+		return false;
+	}
+
+	try
+	{
+		instance->decoder->submitPartial(src, srcSize, timestamp, endOfPicture);
+		return true;
+	}
+	catch (Exception & e)
+	{
+		instance->error = e.getErrorString();
+		return false;
+	}
+}
+
+UNITY_INTERFACE_EXPORT uint64_t UNITY_INTERFACE_API NvPipe_DecodePoll(uint32_t nvp, void* dst, uint64_t dstSize, uint32_t width, uint32_t height, int64_t* timestamp)
+{
+	auto instance = GetPipe(nvp);
+	if (instance == nullptr)
+		return 0;
+	if (!instance->decoder)
+	{
+		instance->error = "Invalid NvPipe decoder.";
+		return 0;
+	}
+
+	try
+	{
+		return instance->decoder->poll(dst, dstSize, width, height, timestamp);
+	}
+	catch (Exception & e)
+	{
+		instance->error = e.getErrorString();
+		return 0;
+	}
+}
+
+UNITY_INTERFACE_EXPORT bool UNITY_INTERFACE_API NvPipe_GetDecodedFrameInfo(uint32_t nvp, uint32_t* width, uint32_t* height, uint32_t* pitch)
+{
+	auto instance = GetPipe(nvp);
+	if (instance == nullptr)
+		return false;
+	if (!instance->decoder)
+	{
+		instance->error = "Invalid NvPipe decoder.";
+		return false;
+	}
+
+	return instance->decoder->getDecodedFrameInfo(width, height, pitch);
+}
+
+UNITY_INTERFACE_EXPORT bool UNITY_INTERFACE_API NvPipe_DecodeLockFrame(uint32_t nvp, void** frame, uint32_t* pitch, int64_t* timestamp)
+{
+	auto instance = GetPipe(nvp);
+	if (instance == nullptr)
+		return false;
+	if (!instance->decoder)
+	{
+		instance->error = "Invalid NvPipe decoder.";
+		return false;
+	}
+
+	try
+	{
+		return instance->decoder->lockFrame(frame, pitch, timestamp);
+	}
+	catch (Exception & e)
+	{
+		instance->error = e.getErrorString();
+		return false;
+	}
+}
+
+UNITY_INTERFACE_EXPORT void UNITY_INTERFACE_API NvPipe_DecodeUnlockFrame(uint32_t nvp, void* frame)
+{
+	auto instance = GetPipe(nvp);
+	if (instance == nullptr)
+		return;
+	if (!instance->decoder)
+	{
+		instance->error = "Invalid NvPipe decoder.";
+		return;
+	}
+
+	try
+	{
+		instance->decoder->unlockFrame(frame);
+	}
+	catch (Exception & e)
 	{
 		instance->error = e.getErrorString();
 	}
 }
 
-UNITY_INTERFACE_EXPORT uint64_t UNITY_INTERFACE_API NvPipe_Encode(uint32_t pipe, const void* src, uint64_t srcPitch, uint8_t* dst, uint64_t dstSize, uint32_t width, uint32_t height, bool forceIFrame)
+UNITY_INTERFACE_EXPORT void UNITY_INTERFACE_API NvPipe_SetDecoderFramePoolSize(uint32_t nvp, uint32_t size)
+{
+	auto instance = GetPipe(nvp);
+	if (instance == nullptr)
+		return;
+	if (!instance->decoder)
+	{
+		instance->error = "Invalid NvPipe decoder.";
+		return;
+	}
+
+	try
+	{
+		instance->decoder->setFramePoolSize(size);
+	}
+	catch (Exception & e)
+	{
+		instance->error = e.getErrorString();
+	}
+}
+
+UNITY_INTERFACE_EXPORT void UNITY_INTERFACE_API NvPipe_GetDecoderMemoryUsage(uint32_t nvp, uint32_t* allocatedFrames, uint64_t* bytes, uint32_t* droppedFrames)
+{
+	auto instance = GetPipe(nvp);
+	if (instance == nullptr)
+		return;
+	if (!instance->decoder)
+	{
+		instance->error = "Invalid NvPipe decoder.";
+		return;
+	}
+
+	instance->decoder->getMemoryUsage(allocatedFrames, bytes, droppedFrames);
+}
+
+#ifdef NVPIPE_WITH_OPENGL
+
+UNITY_INTERFACE_EXPORT uint64_t UNITY_INTERFACE_API NvPipe_DecodeTexture(uint32_t nvp, const uint8_t* src, uint64_t srcSize, uint32_t texture, uint32_t target, uint32_t width, uint32_t height)
 {
-	auto instance = GetPipe(pipe);
+	auto instance = GetPipe(nvp);
 	if (instance == nullptr)
 		return 0;
-	if (!instance->encoder)
+	if (!instance->decoder)
 	{
-		instance->error = "Invalid NvPipe encoder.";
+		instance->error = "Invalid NvPipe decoder.";
 		return 0;
 	}
 
 	try
 	{
-		return instance->encoder->encode(src, srcPitch, dst, dstSize, width, height, forceIFrame);
+		return instance->decoder->decodeTexture(src, srcSize, texture, target, width, height);
 	}
 	catch (Exception & e)
 	{
@@ -1418,295 +4384,239 @@ UNITY_INTERFACE_EXPORT uint64_t UNITY_INTERFACE_API NvPipe_Encode(uint32_t pipe,
 	}
 }
 
+#endif
+
+#endif
+
 #ifdef NVPIPE_WITH_OPENGL
 
-UNITY_INTERFACE_EXPORT uint64_t UNITY_INTERFACE_API NvPipe_EncodeTexture(uint32_t pipe, uint32_t texture, uint32_t target, uint8_t* dst, uint64_t dstSize, uint32_t width, uint32_t height, bool forceIFrame)
+UNITY_INTERFACE_EXPORT void UNITY_INTERFACE_API NvPipe_SetGraphicsResourceCacheSize(uint32_t pipe, uint32_t capacity)
 {
 	auto instance = GetPipe(pipe);
-
 	if (instance == nullptr)
+		return;
+
+#ifdef NVPIPE_WITH_ENCODER
+	Encoder* encoder = instance->encoder ? instance->encoder.get() : instance->asyncTextureEncoder.get();
+	if (encoder)
+	{
+		encoder->setResourceCacheCapacity(capacity);
+		return;
+	}
+#endif
+#ifdef NVPIPE_WITH_DECODER
+	if (instance->decoder)
+	{
+		instance->decoder->setResourceCacheCapacity(capacity);
+		return;
+	}
+#endif
+
+	instance->error = "The pipe doesn't use OpenGL resources.";
+}
+
+UNITY_INTERFACE_EXPORT void UNITY_INTERFACE_API NvPipe_UnregisterTexture(uint32_t texture)
+{
+	GraphicsResourceRegistry::ReleaseTexture(texture);
+}
+
+#endif
+
+UNITY_INTERFACE_EXPORT uint32_t UNITY_INTERFACE_API NvPipe_ParseNalUnits(NvPipe_Codec codec, const uint8_t* data, uint64_t size, NvPipe_NalUnit* units, uint32_t maxUnits)
+{
+	if (data == nullptr && size > 0)
+	{
+		sharedError = "Invalid packet";
+		return 0;
+	}
+	if (codec != NVPIPE_H264 && codec != NVPIPE_HEVC)
+	{
+		sharedError = "Invalid codec";
 		return 0;
+	}
 
-	if (!instance->encoder)
+	NalParser parser(codec);
+	return parser.parse(data, size, units, units ? maxUnits : 0);
+}
+
+UNITY_INTERFACE_EXPORT uint32_t UNITY_INTERFACE_API NvPipe_CreateStreamWriter(const char* path, NvPipe_Codec codec, uint32_t width, uint32_t height)
+{
+	if (path == nullptr)
 	{
-		instance->error = "Invalid NvPipe encoder.";
+		sharedError = "Invalid recording path";
 		return 0;
 	}
 
+	auto instance = std::make_shared<Instance>();
+
 	try
 	{
-		return instance->encoder->encodeTexture(texture, target, dst, dstSize, width, height, forceIFrame);
+		instance->streamWriter = std::unique_ptr<StreamWriter>(new StreamWriter(path, codec, width, height));
+		return InsertNewPipe(instance);
 	}
 	catch (Exception & e)
 	{
-		instance->error = e.getErrorString();
+		sharedError = e.getErrorString();
 		return 0;
 	}
 }
 
-
-/*
-==================================
-Async OpenGL Texture Encoding.
-==================================
-*/
-struct MainThreadPendingTask {	//Tasks from main thread.
-	MainThreadPendingTask() = default;
-	MainThreadPendingTask(std::shared_ptr<Instance> nvp, uint32_t texture, uint32_t width, uint32_t height, bool forceIFrame)
+UNITY_INTERFACE_EXPORT bool UNITY_INTERFACE_API NvPipe_StreamWriterAppend(uint32_t writer, const uint8_t* data, uint64_t size, int64_t timestamp)
+{
+	auto instance = GetPipe(writer);
+	if (instance == nullptr)
+		return false;
+	if (!instance->streamWriter || (data == nullptr && size > 0))
 	{
-		this->pipe = nvp;
-		this->texture = texture;
-		this->width = width;
-		this->height = height;
-		this->forceIFrame = forceIFrame;
-
-		this->isDone = false;
-		this->isError = false;
+		instance->error = instance->streamWriter ? "Invalid frame." : "Invalid NvPipe stream writer.";
+		return false;
 	}
 
-	std::shared_ptr<Instance> pipe;
-	uint32_t texture;
-	uint32_t width;
-	uint32_t height;
-	bool forceIFrame;
-	int mainThreadTaskIndex;
-
-	//Available once the renderthread submitted task to encoder
-	int encoderTaskIndex;
-
-	//Available once results are polled from encoder.
-	bool isDone;
-	bool isError;
-	uint8_t* resultBuffer;
-	std::string error;
-	uint64_t encodedSize;
-};
-
-static constexpr int MAX_PENDING_TASK_COUNT = 20;	//Up to 20 tasks could exist at the same time.
-static MainThreadPendingTask mainThreadPendingTasks[MAX_PENDING_TASK_COUNT];	//This is a circular buffer.
-
-static std::atomic<uint32_t> g_pendingTaskPtr(0);		//circular buffer pointer.
-static std::atomic<uint32_t> g_submittedTaskPtr(0);		//circular buffer pointer.
-static std::atomic<uint32_t> g_doneTaskPtr(0);
-static std::atomic<uint32_t> g_cleardTaskPtr(0);
-
-static std::mutex g_destructMutex;	/*Used when resetting encode tasks. Reset only callde by main thread, so only RenderThread calls will need this mutex.*/
-
-/*
-Called in main thread, to clear all async encoding tasks.
-But actual encoders and tasks inside it won't be destructed.
-*/
-UNITY_INTERFACE_EXPORT void UNITY_INTERFACE_API NvPipe_ResetEncodeTasks() {
-	std::lock_guard<std::mutex> lock(g_destructMutex);
-	for (size_t i = 0; i < MAX_PENDING_TASK_COUNT; i++)
+	try
 	{
-		mainThreadPendingTasks[i] = MainThreadPendingTask();
+		instance->streamWriter->append(data, size, timestamp);
+		return true;
+	}
+	catch (Exception & e)
+	{
+		instance->error = e.getErrorString();
+		return false;
 	}
-	g_pendingTaskPtr = 0;
-	g_submittedTaskPtr = 0;
-	g_doneTaskPtr = 0;
-	g_cleardTaskPtr = 0;
-
-	DEBUG_LOG("async encode queue reset\n");
 }
 
-/*Called in main thread, to enqueue a new task.*/
-UNITY_INTERFACE_EXPORT uint32_t UNITY_INTERFACE_API NvPipe_QueueEncodeTaskInMainThread(uint32_t nvp, uint32_t texture, uint32_t width, uint32_t height, bool forceIFrame) {
-	auto pipe = GetPipe(nvp);
-	if (pipe == nullptr)
-		return 0;
-	if ((g_pendingTaskPtr + 1) % MAX_PENDING_TASK_COUNT == g_cleardTaskPtr) {	//Reached maximum submit tasks per frame, or earlier tasks are not cleared yet.
-		static char msgBuffer[200];
-		sprintf(msgBuffer, "Maximum task count reached. Did you forget to clear task, or submitted too many tasks(%d) at once?", MAX_PENDING_TASK_COUNT);
-		pipe->error = msgBuffer;
-		return 0;
+UNITY_INTERFACE_EXPORT bool UNITY_INTERFACE_API NvPipe_StreamWriterFinish(uint32_t writer)
+{
+	auto instance = GetPipe(writer);
+	if (instance == nullptr)
+		return false;
+	if (!instance->streamWriter)
+	{
+		instance->error = "Invalid NvPipe stream writer.";
+		return false;
 	}
 
-	if (pipe->asyncTextureEncoder == nullptr) {
-		pipe->error = "Invalid async texture encoder";
-		return 0;
+	try
+	{
+		instance->streamWriter->finish();
+		return true;
+	}
+	catch (Exception & e)
+	{
+		instance->error = e.getErrorString();
+		return false;
 	}
-
-	auto ptr = g_pendingTaskPtr.load();
-	mainThreadPendingTasks[g_pendingTaskPtr] = MainThreadPendingTask(pipe, texture, width, height, forceIFrame);
-	g_pendingTaskPtr = (1 + g_pendingTaskPtr) % MAX_PENDING_TASK_COUNT;
-	DEBUG_LOG("async encode task enqueued, task index %d\n", ptr);
-	return ptr;
 }
 
-/*
-Called by render thread
-To move all pending tasks into corresponding encoders,
-and update all task infos from encoder.
-*/
-UNITY_INTERFACE_EXPORT void UNITY_INTERFACE_API NvPipe_RenderThreadPoll(int)
+UNITY_INTERFACE_EXPORT uint32_t UNITY_INTERFACE_API NvPipe_CreateStreamReader(const char* path)
 {
-	std::lock_guard<std::mutex> lock(g_destructMutex);
-	DEBUG_LOG("RTP: Render thread polling(Move to encoder)\n");
-	while (g_submittedTaskPtr != g_pendingTaskPtr)
+	if (path == nullptr)
 	{
-		DEBUG_LOG("RTP: %d, %d\n", g_submittedTaskPtr.load(), g_pendingTaskPtr.load());
-		auto& task = mainThreadPendingTasks[g_submittedTaskPtr];
-		//Allocate buffer
+		sharedError = "Invalid recording path";
+		return 0;
+	}
 
-		try     //Error here is not stored in instance.error, since we're in render thread. Put error along inside SubmittedTask.
-		{
-			task.encoderTaskIndex = task.pipe->asyncTextureEncoder->encodeTextureAsync(task.texture, GL_TEXTURE_2D, task.width, task.height, task.forceIFrame);
+	auto instance = std::make_shared<Instance>();
 
-			DEBUG_LOG("RTP: %d entered encoder queue\n", g_submittedTaskPtr.load());
-			task.isDone = false;
-			task.isError = false;
-		}
-		catch (const Exception & e)
-		{
-			task.isDone = true;
-			task.isError = true;
-			task.error = e.message;
-			DEBUG_LOG("RTP: %d failed to enqueue to encoder, error:%s\n", g_submittedTaskPtr.load(), e.message.c_str());
-		}
-		g_submittedTaskPtr = (g_submittedTaskPtr + 1) % MAX_PENDING_TASK_COUNT;
+	try
+	{
+		instance->streamReader = std::unique_ptr<StreamReader>(new StreamReader(path));
+		return InsertNewPipe(instance);
 	}
-
-	DEBUG_LOG("RTP: Render thread polling(Check done)\n");
-	//Query any task is done.
-	while (g_doneTaskPtr != g_submittedTaskPtr)
+	catch (Exception & e)
 	{
-		DEBUG_LOG("RTP: %d, %d\n", g_doneTaskPtr.load(), g_submittedTaskPtr.load());
-		auto& task = mainThreadPendingTasks[g_doneTaskPtr];
-
-		if (!task.isDone)	//Try to get task done.
-		{
-			try
-			{	//Query task status from encoder.
-				task.pipe->asyncTextureEncoder->QueryTask(task.encoderTaskIndex,
-					&task.isDone,
-					&task.isError,
-					&task.error);
-
-				if (task.isDone)
-					DEBUG_LOG("RTP: Task set to done\n");
-				if (task.isError)
-					DEBUG_LOG("RTP: Task done with error: %s\n", task.error.c_str());
-
-				if (task.isDone) {
-					if (!task.isError) {
-						//Get buffer back.
-						task.resultBuffer = task.pipe->asyncTextureEncoder->AcquireTaskData(task.encoderTaskIndex,
-							&task.encodedSize);
-					}
-					if (task.isDone) {
-						task.pipe->asyncTextureEncoder->ClearTask(task.encoderTaskIndex);
-					}
-				}
-			}
-			catch (const Exception & e)
-			{
-				DEBUG_LOG("RTP: Exception during query task %d status. %s\n", task.encoderTaskIndex, e.message.c_str());
-				task.isDone = true; task.isError = true; task.error = e.message;
-			}
-		}
-
-		if (task.isDone) {
-			g_doneTaskPtr = (g_doneTaskPtr + 1) % MAX_PENDING_TASK_COUNT;
-		}
-		else {
-			//We can't "done" next task if current task is not done yet.
-			break;
-		}
+		sharedError = e.getErrorString();
+		return 0;
 	}
-
-	DEBUG_LOG("Render thread polling finished\n");
 }
 
-UNITY_INTERFACE_EXPORT UnityRenderingEvent UNITY_INTERFACE_API NvPipe_GetRenderThreadPollFunc() {
-	return NvPipe_RenderThreadPoll;
+static StreamReader* GetStreamReader(const std::shared_ptr<Instance>& instance)
+{
+	if (!instance->streamReader)
+		instance->error = "Invalid NvPipe stream reader.";
+	return instance->streamReader.get();
 }
 
-/*
-Called in main thread, query status of encode task.
-Only task error will be returned in **error. Other error goes to sharedError
-*/
-UNITY_INTERFACE_EXPORT void UNITY_INTERFACE_API NvPipe_EncodeTextureAsyncQuery(
-	uint32_t taskIndex, bool* isDone, bool* isError, uint8_t** encodedData, uint64_t* encodeSize, const char** error) {
-
-	try
+UNITY_INTERFACE_EXPORT bool UNITY_INTERFACE_API NvPipe_StreamReaderGetInfo(uint32_t reader, NvPipe_StreamInfo* info)
+{
+	auto instance = GetPipe(reader);
+	if (instance == nullptr || !GetStreamReader(instance))
+		return false;
+	if (info == nullptr)
 	{
-		//Check taskIndex is valid.
-		if (taskIndex >= MAX_PENDING_TASK_COUNT || !CheckInsideQueueRange(g_pendingTaskPtr.load(), g_cleardTaskPtr.load(), taskIndex))
-		{
-			throw Exception("Task is not valid!");
-		}
+		instance->error = "Invalid stream info.";
+		return false;
+	}
 
-		if (CheckInsideQueueRange(g_pendingTaskPtr.load(), g_doneTaskPtr.load(), taskIndex)) {
-			//Not done yet.
-			*isDone = false;
-			return;
-		}
+	instance->streamReader->getInfo(info);
+	return true;
+}
 
-		if (CheckInsideQueueRange(g_doneTaskPtr.load(), g_cleardTaskPtr.load(), taskIndex)) {
-			auto& task = mainThreadPendingTasks[taskIndex];
-			//Small check
-			if (task.isDone != true) {
-				//This should never happen
-				throw Exception("Fatal error.");
-			}
-			*isDone = true;
-			*isError = task.isError;
-			if (task.isError) {
-				*error = task.error.c_str();
-			}
-			else {
-				*encodeSize = task.encodedSize;
-				*encodedData = task.resultBuffer;
-			}
-			return;
-		}
+UNITY_INTERFACE_EXPORT bool UNITY_INTERFACE_API NvPipe_StreamReaderGetFrame(uint32_t reader, uint64_t index, NvPipe_StreamFrame* frame)
+{
+	auto instance = GetPipe(reader);
+	if (instance == nullptr || !GetStreamReader(instance))
+		return false;
+	if (frame == nullptr)
+	{
+		instance->error = "Invalid stream frame.";
+		return false;
+	}
 
-		throw Exception("Unknown error....");
+	try
+	{
+		instance->streamReader->getFrame(index, frame);
+		return true;
 	}
-	catch (const Exception & e)
+	catch (Exception & e)
 	{
-		sharedError = e.message;
+		instance->error = e.getErrorString();
+		return false;
 	}
-
 }
 
-/*Called in main thread, to notify that a task could be cleared.*/
-UNITY_INTERFACE_EXPORT void UNITY_INTERFACE_API NvPipe_EncodeTextureAsyncClearTask(uint32_t taskIndex) {
-	try
+UNITY_INTERFACE_EXPORT bool UNITY_INTERFACE_API NvPipe_StreamReaderFindKeyframe(uint32_t reader, uint64_t index, uint64_t* keyframeIndex)
+{
+	auto instance = GetPipe(reader);
+	if (instance == nullptr || !GetStreamReader(instance))
+		return false;
+	if (keyframeIndex == nullptr)
 	{
-		if (g_cleardTaskPtr != taskIndex) {
-			throw Exception("Only next uncleared task could be cleared");
-		}
-		if (taskIndex == g_doneTaskPtr) {
-			throw Exception("The task is still being executed and can't be cleared");
-		}
-
-		DEBUG_LOG("RTP: %d is cleared \n", g_cleardTaskPtr.load());
-		mainThreadPendingTasks[taskIndex] = MainThreadPendingTask();	//Clear it to empty object, to release references to pipe or buffer.
+		instance->error = "Invalid keyframe index.";
+		return false;
+	}
 
-		g_cleardTaskPtr = (g_cleardTaskPtr + 1) % MAX_PENDING_TASK_COUNT;
+	try
+	{
+		return instance->streamReader->findKeyframe(index, keyframeIndex);
 	}
 	catch (Exception & e)
 	{
-		sharedError = e.getErrorString();
-		return;
+		instance->error = e.getErrorString();
+		return false;
 	}
 }
 
-#endif
-
-#endif
+UNITY_INTERFACE_EXPORT bool UNITY_INTERFACE_API NvPipe_StreamReaderFindFrame(uint32_t reader, int64_t timestamp, uint64_t* index)
+{
+	auto instance = GetPipe(reader);
+	if (instance == nullptr || !GetStreamReader(instance))
+		return false;
+	if (index == nullptr)
+	{
+		instance->error = "Invalid frame index.";
+		return false;
+	}
 
-#ifdef NVPIPE_WITH_DECODER
+	return instance->streamReader->findFrame(timestamp, index);
+}
 
-UNITY_INTERFACE_EXPORT uint32_t UNITY_INTERFACE_API NvPipe_CreateDecoder(NvPipe_Format format, NvPipe_Codec codec, uint32_t width, uint32_t height)
+UNITY_INTERFACE_EXPORT uint32_t UNITY_INTERFACE_API NvPipe_CreateRtpPacketizer(NvPipe_Codec codec, uint32_t mtu, uint32_t payloadType, uint32_t ssrc)
 {
 	auto instance = std::make_shared<Instance>();
 
 	try
 	{
-		instance->decoder = std::unique_ptr<Decoder>(new Decoder(format, codec, width, height));
+		instance->rtpPacketizer = std::unique_ptr<RtpPacketizer>(new RtpPacketizer(codec, mtu, payloadType, ssrc));
 		return InsertNewPipe(instance);
 	}
 	catch (Exception & e)
@@ -1714,59 +4624,142 @@ UNITY_INTERFACE_EXPORT uint32_t UNITY_INTERFACE_API NvPipe_CreateDecoder(NvPipe_
 		sharedError = e.getErrorString();
 		return 0;
 	}
-
-	return 0;
 }
 
-UNITY_INTERFACE_EXPORT uint64_t UNITY_INTERFACE_API NvPipe_Decode(uint32_t nvp, const uint8_t* src, uint64_t srcSize, void* dst, uint32_t width, uint32_t height)
+UNITY_INTERFACE_EXPORT uint32_t UNITY_INTERFACE_API NvPipe_RtpPacketize(uint32_t packetizer, const uint8_t* frame, uint64_t size, uint32_t timestamp, uint8_t* buffer, uint32_t* packetSizes, uint32_t maxPackets)
 {
-	auto instance = GetPipe(nvp);
+	auto instance = GetPipe(packetizer);
 	if (instance == nullptr)
 		return 0;
-	if (!instance->decoder)
+	if (!instance->rtpPacketizer || (frame == nullptr && size > 0))
 	{
-		instance->error = "Invalid NvPipe decoder.";
+		instance->error = instance->rtpPacketizer ? "Invalid frame." : "Invalid NvPipe RTP packetizer.";
 		return 0;
 	}
 
+	return instance->rtpPacketizer->packetize(frame, size, timestamp, buffer, packetSizes, maxPackets);
+}
+
+UNITY_INTERFACE_EXPORT uint32_t UNITY_INTERFACE_API NvPipe_CreateRtpReceiver(NvPipe_Codec codec, uint32_t payloadType, uint32_t minDelayMs, uint32_t maxDelayMs, bool waitForKeyframe)
+{
+	auto instance = std::make_shared<Instance>();
+
 	try
 	{
-		return instance->decoder->decode(src, srcSize, dst, width, height);
+		instance->rtpReceiver = std::unique_ptr<RtpReceiver>(new RtpReceiver(codec, payloadType, minDelayMs, maxDelayMs, waitForKeyframe));
+		return InsertNewPipe(instance);
 	}
 	catch (Exception & e)
 	{
-		instance->error = e.getErrorString();
+		sharedError = e.getErrorString();
 		return 0;
 	}
 }
 
-#ifdef NVPIPE_WITH_OPENGL
+UNITY_INTERFACE_EXPORT bool UNITY_INTERFACE_API NvPipe_RtpReceiverPush(uint32_t receiver, const uint8_t* packet, uint64_t size, int64_t arrivalUs)
+{
+	auto instance = GetPipe(receiver);
+	if (instance == nullptr)
+		return false;
+	if (!instance->rtpReceiver || (packet == nullptr && size > 0))
+	{
+		instance->error = instance->rtpReceiver ? "Invalid packet." : "Invalid NvPipe RTP receiver.";
+		return false;
+	}
+
+	instance->rtpReceiver->push(packet, size, arrivalUs);
+	return true;
+}
 
-UNITY_INTERFACE_EXPORT uint32_t UNITY_INTERFACE_API NvPipe_DecodeTexture(uint32_t nvp, const uint8_t* src, uint32_t srcSize, uint32_t texture, uint32_t target, uint32_t width, uint32_t height)
+UNITY_INTERFACE_EXPORT uint64_t UNITY_INTERFACE_API NvPipe_RtpReceiverPoll(uint32_t receiver, int64_t nowUs, uint8_t* dst, uint64_t dstSize, NvPipe_RtpFrameInfo* info)
 {
-	auto instance = GetPipe(nvp);
+	auto instance = GetPipe(receiver);
 	if (instance == nullptr)
 		return 0;
-	if (!instance->decoder)
+	if (!instance->rtpReceiver || info == nullptr)
 	{
-		instance->error = "Invalid NvPipe decoder.";
+		instance->error = instance->rtpReceiver ? "Invalid frame info." : "Invalid NvPipe RTP receiver.";
 		return 0;
 	}
 
+	uint64_t size = instance->rtpReceiver->poll(nowUs, dst, dstSize, info);
+	if (size == 0 && info->size > 0 && dst != nullptr)
+		instance->error = "Frame buffer too small.";
+	return size;
+}
+
+UNITY_INTERFACE_EXPORT void UNITY_INTERFACE_API NvPipe_GetRtpReceiverStats(uint32_t receiver, NvPipe_RtpReceiverStats* stats)
+{
+	auto instance = GetPipe(receiver);
+	if (instance == nullptr)
+		return;
+	if (!instance->rtpReceiver || stats == nullptr)
+	{
+		instance->error = instance->rtpReceiver ? "Invalid receiver stats." : "Invalid NvPipe RTP receiver.";
+		return;
+	}
+
+	instance->rtpReceiver->getStats(stats);
+}
+
+UNITY_INTERFACE_EXPORT uint32_t UNITY_INTERFACE_API NvPipe_CreateStreamServer(NvPipe_Codec codec, const char* address, uint32_t port, uint64_t clientBufferSize)
+{
+	auto instance = std::make_shared<Instance>();
+
 	try
 	{
-		return instance->decoder->decodeTexture(src, srcSize, texture, target, width, height);
+		instance->streamServer = std::make_shared<StreamServer>(codec, address, port, clientBufferSize);
+		return InsertNewPipe(instance);
 	}
 	catch (Exception & e)
 	{
-		instance->error = e.getErrorString();
+		sharedError = e.getErrorString();
 		return 0;
 	}
 }
 
-#endif
+UNITY_INTERFACE_EXPORT bool UNITY_INTERFACE_API NvPipe_StreamServerSend(uint32_t server, const uint8_t* frame, uint64_t size, int64_t timestamp)
+{
+	auto instance = GetPipe(server);
+	if (instance == nullptr)
+		return false;
+	if (!instance->streamServer || (frame == nullptr && size > 0))
+	{
+		instance->error = instance->streamServer ? "Invalid frame." : "Invalid NvPipe stream server.";
+		return false;
+	}
 
-#endif
+	instance->streamServer->send(&frame, &size, 1, timestamp);
+	return true;
+}
+
+UNITY_INTERFACE_EXPORT bool UNITY_INTERFACE_API NvPipe_StreamServerTakeKeyframeRequest(uint32_t server)
+{
+	auto instance = GetPipe(server);
+	if (instance == nullptr)
+		return false;
+	if (!instance->streamServer)
+	{
+		instance->error = "Invalid NvPipe stream server.";
+		return false;
+	}
+
+	return instance->streamServer->takeKeyframeRequest();
+}
+
+UNITY_INTERFACE_EXPORT void UNITY_INTERFACE_API NvPipe_GetStreamServerStats(uint32_t server, NvPipe_StreamServerStats* stats)
+{
+	auto instance = GetPipe(server);
+	if (instance == nullptr)
+		return;
+	if (!instance->streamServer || stats == nullptr)
+	{
+		instance->error = instance->streamServer ? "Invalid server stats." : "Invalid NvPipe stream server.";
+		return;
+	}
+
+	instance->streamServer->getStats(stats);
+}
 
 UNITY_INTERFACE_EXPORT void UNITY_INTERFACE_API NvPipe_Destroy(uint32_t pipe)
 {
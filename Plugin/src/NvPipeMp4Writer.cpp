@@ -0,0 +1,508 @@
+/* Copyright (c) 2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "NvPipeMp4Writer.h"
+
+#include <algorithm>
+#include <cstring>
+
+/**
+ * @brief Big-endian writer for ISO BMFF boxes.
+ */
+class BoxWriter
+{
+public:
+	void u8(uint32_t v) { this->data.push_back((uint8_t)v); }
+	void u16(uint32_t v) { this->u8(v >> 8); this->u8(v); }
+	void u32(uint32_t v) { this->u16(v >> 16); this->u16(v); }
+	void u64(uint64_t v) { this->u32((uint32_t)(v >> 32)); this->u32((uint32_t)v); }
+	void zeros(size_t count) { this->data.insert(this->data.end(), count, 0); }
+	void bytes(const uint8_t* p, size_t size) { this->data.insert(this->data.end(), p, p + size); }
+	void fourcc(const char* type) { this->bytes((const uint8_t*)type, 4); }
+
+	size_t begin(const char* type)
+	{
+		size_t start = this->data.size();
+		this->u32(0);	// Patched in end()
+		this->fourcc(type);
+		return start;
+	}
+
+	size_t beginFull(const char* type, uint8_t version, uint32_t flags)
+	{
+		size_t start = this->begin(type);
+		this->u32(((uint32_t)version << 24) | flags);
+		return start;
+	}
+
+	void end(size_t start)
+	{
+		this->patch32(start, (uint32_t)(this->data.size() - start));
+	}
+
+	void patch32(size_t offset, uint32_t v)
+	{
+		for (int i = 0; i < 4; ++i)
+			this->data[offset + i] = (uint8_t)(v >> (24 - 8 * i));
+	}
+
+	void matrix()
+	{
+		const uint32_t unity[9] = { 0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000 };
+		for (uint32_t v : unity)
+			this->u32(v);
+	}
+
+	std::vector<uint8_t> data;
+};
+
+constexpr uint32_t Mp4Writer::kTimescale;
+
+Mp4Writer::Mp4Writer(const std::string& path, NvPipe_Codec codec, uint32_t frameRate, uint64_t bufferSize) :
+	codec(codec), frameRate(frameRate ? frameRate : 30), sink(path, bufferSize), parser(codec)
+{
+}
+
+Mp4Writer::~Mp4Writer()
+{
+	try
+	{
+		this->finish();
+	}
+	catch (const Exception&)
+	{
+	}
+}
+
+void Mp4Writer::writeFrame(const std::vector<std::vector<uint8_t>>& packets, uint32_t width, uint32_t height, int64_t timeUs)
+{
+	// Reuses the buffer of the frame written last
+	Sample& sample = this->next;
+	sample.data.clear();
+	sample.keyframe = false;
+	sample.timeUs = timeUs;
+	for (auto& p : packets)
+		this->appendPacket(p, sample);
+
+	if (!this->headerWritten)
+	{
+		if (!sample.keyframe || this->sps.empty() || this->pps.empty() || (this->codec == NVPIPE_HEVC && this->vps.empty()))
+			return;
+		this->writeHeader(width, height);
+		this->firstTimeUs = timeUs;
+	}
+	else if (width != this->width || height != this->height)
+	{
+		throw Exception("Recording doesn't support frame size changes");
+	}
+
+	if (sample.data.empty())
+		return;
+
+	if (this->pending.data.empty())
+	{
+		std::swap(this->pending, sample);
+		return;
+	}
+
+	// Decode times must increase, even if frames arrive within the same clock tick
+	int64_t duration = this->ticks(sample.timeUs) - this->ticks(this->pending.timeUs);
+	this->writeFragment(this->pending, (uint32_t)std::max<int64_t>(duration, 1));
+	this->lastDuration = (uint32_t)std::max<int64_t>(duration, 1);
+	std::swap(this->pending, sample);
+}
+
+void Mp4Writer::finish()
+{
+	if (!this->pending.data.empty())
+	{
+		this->writeFragment(this->pending, this->lastDuration ? this->lastDuration : kTimescale / this->frameRate);
+		this->pending.data.clear();
+	}
+	this->sink.close();
+}
+
+bool Mp4Writer::takeKeyframeRequest()
+{
+	bool requested = this->keyframeRequested;
+	this->keyframeRequested = false;
+	return requested;
+}
+
+void Mp4Writer::getStats(NvPipe_RecordingStats* stats) const
+{
+	this->sink.getStats(stats);
+	stats->droppedFrames = this->droppedFrames;
+}
+
+int64_t Mp4Writer::ticks(int64_t timeUs) const
+{
+	return (timeUs - this->firstTimeUs) * kTimescale / 1000000;
+}
+
+bool Mp4Writer::isValidParameterSet(uint32_t type, uint32_t size) const
+{
+	uint32_t minSize = 2;
+	if (this->codec == NVPIPE_HEVC)
+		minSize = (type == 33) ? 15 : 3;
+	else if (type == 7)
+		minSize = 5;
+	return size >= minSize && size <= 0xFFFF;
+}
+
+void Mp4Writer::appendPacket(const std::vector<uint8_t>& packet, Sample& sample)
+{
+	this->units.resize(this->parser.parse(packet.data(), packet.size(), nullptr, 0));
+	this->parser.parse(packet.data(), packet.size(), this->units.data(), (uint32_t)this->units.size());
+
+	for (auto& unit : this->units)
+	{
+		const uint8_t* nal = packet.data() + unit.offset + unit.startCodeSize;
+		const uint32_t size = (uint32_t)(unit.size - unit.startCodeSize);
+
+		// Parameter sets go into the sample description, access unit delimiters are dropped
+		std::vector<uint8_t>* parameterSet = nullptr;
+		bool skip = false;
+		if (this->codec == NVPIPE_HEVC)
+		{
+			parameterSet = unit.type == 32 ? &this->vps : unit.type == 33 ? &this->sps : unit.type == 34 ? &this->pps : nullptr;
+			skip = unit.type == 35;
+		}
+		else
+		{
+			parameterSet = unit.type == 7 ? &this->sps : unit.type == 8 ? &this->pps : nullptr;
+			skip = unit.type == 9;
+		}
+
+		if (parameterSet)
+		{
+			// Malformed ones are dropped, the header waits for the next keyframe's
+			if (!this->isValidParameterSet(unit.type, size))
+				continue;
+			if (this->headerWritten && (parameterSet->size() != size || memcmp(parameterSet->data(), nal, size) != 0))
+				throw Exception("Recording doesn't support changes of the stream parameters");
+			parameterSet->assign(nal, nal + size);
+			continue;
+		}
+		if (skip || size == 0)
+			continue;
+
+		sample.keyframe |= unit.isKeyframe != 0;
+		for (int i = 3; i >= 0; --i)
+			sample.data.push_back((uint8_t)(size >> (8 * i)));
+		sample.data.insert(sample.data.end(), nal, nal + size);
+	}
+}
+
+void Mp4Writer::writeHeader(uint32_t width, uint32_t height)
+{
+	this->width = width;
+	this->height = height;
+
+	BoxWriter w;
+	size_t ftyp = w.begin("ftyp");
+	w.fourcc("isom");
+	w.u32(0x200);
+	w.fourcc("isom");
+	w.fourcc("iso6");
+	w.fourcc("mp41");
+	w.end(ftyp);
+
+	size_t moov = w.begin("moov");
+	{
+		size_t mvhd = w.beginFull("mvhd", 0, 0);
+		w.u32(0);	// creation_time
+		w.u32(0);	// modification_time
+		w.u32(1000);	// timescale
+		w.u32(0);	// duration, given by the fragments
+		w.u32(0x00010000);	// rate
+		w.u16(0x0100);	// volume
+		w.zeros(10);
+		w.matrix();
+		w.zeros(24);
+		w.u32(2);	// next_track_ID
+		w.end(mvhd);
+
+		size_t trak = w.begin("trak");
+		{
+			size_t tkhd = w.beginFull("tkhd", 0, 3);	// enabled, in movie
+			w.u32(0);
+			w.u32(0);
+			w.u32(1);	// track_ID
+			w.u32(0);
+			w.u32(0);	// duration
+			w.zeros(8);
+			w.u16(0);	// layer
+			w.u16(0);	// alternate_group
+			w.u16(0);	// volume
+			w.u16(0);
+			w.matrix();
+			w.u32(width << 16);
+			w.u32(height << 16);
+			w.end(tkhd);
+
+			size_t mdia = w.begin("mdia");
+			{
+				size_t mdhd = w.beginFull("mdhd", 0, 0);
+				w.u32(0);
+				w.u32(0);
+				w.u32(kTimescale);
+				w.u32(0);
+				w.u16(0x55C4);	// "und"
+				w.u16(0);
+				w.end(mdhd);
+
+				size_t hdlr = w.beginFull("hdlr", 0, 0);
+				w.u32(0);
+				w.fourcc("vide");
+				w.zeros(12);
+				w.bytes((const uint8_t*)"VideoHandler", 13);
+				w.end(hdlr);
+
+				size_t minf = w.begin("minf");
+				{
+					size_t vmhd = w.beginFull("vmhd", 0, 1);
+					w.zeros(8);
+					w.end(vmhd);
+
+					size_t dinf = w.begin("dinf");
+					size_t dref = w.beginFull("dref", 0, 0);
+					w.u32(1);
+					size_t url = w.beginFull("url ", 0, 1);	// Media is in this file
+					w.end(url);
+					w.end(dref);
+					w.end(dinf);
+
+					size_t stbl = w.begin("stbl");
+					this->writeSampleDescription(w);
+					for (const char* empty : { "stts", "stsc", "stco" })
+					{
+						size_t box = w.beginFull(empty, 0, 0);
+						w.u32(0);
+						w.end(box);
+					}
+					size_t stsz = w.beginFull("stsz", 0, 0);
+					w.u32(0);
+					w.u32(0);
+					w.end(stsz);
+					w.end(stbl);
+				}
+				w.end(minf);
+			}
+			w.end(mdia);
+		}
+		w.end(trak);
+
+		size_t mvex = w.begin("mvex");
+		size_t trex = w.beginFull("trex", 0, 0);
+		w.u32(1);	// track_ID
+		w.u32(1);	// default_sample_description_index
+		w.u32(0);
+		w.u32(0);
+		w.u32(0);
+		w.end(trex);
+		w.end(mvex);
+	}
+	w.end(moov);
+
+	if (!this->sink.write(w.data.data(), w.data.size()))
+		throw Exception("Recording buffer is too small for the MP4 header");
+	this->headerWritten = true;
+}
+
+void Mp4Writer::writeSampleDescription(BoxWriter& w)
+{
+	size_t stsd = w.beginFull("stsd", 0, 0);
+	w.u32(1);
+
+	size_t entry = w.begin(this->codec == NVPIPE_HEVC ? "hvc1" : "avc1");
+	w.zeros(6);
+	w.u16(1);	// data_reference_index
+	w.zeros(16);
+	w.u16(this->width);
+	w.u16(this->height);
+	w.u32(0x00480000);	// 72 dpi
+	w.u32(0x00480000);
+	w.u32(0);
+	w.u16(1);	// frame_count
+	w.zeros(32);	// compressorname
+	w.u16(0x0018);	// depth
+	w.u16(0xFFFF);
+
+	if (this->codec == NVPIPE_HEVC)
+		this->writeHvcC(w);
+	else
+		this->writeAvcC(w);
+
+	w.end(entry);
+	w.end(stsd);
+}
+
+void Mp4Writer::writeAvcC(BoxWriter& w)
+{
+	size_t avcC = w.begin("avcC");
+	w.u8(1);	// configurationVersion
+	w.u8(this->sps[1]);	// profile, compatibility and level from the SPS
+	w.u8(this->sps[2]);
+	w.u8(this->sps[3]);
+	w.u8(0xFF);	// 4 byte NAL unit lengths
+	w.u8(0xE1);	// 1 SPS
+	w.u16((uint32_t)this->sps.size());
+	w.bytes(this->sps.data(), this->sps.size());
+	w.u8(1);	// 1 PPS
+	w.u16((uint32_t)this->pps.size());
+	w.bytes(this->pps.data(), this->pps.size());
+
+	// High profiles also describe the chroma format and bit depths (ISO/IEC 14496-15 5.3.3.1.2)
+	const uint32_t profile = this->sps[1];
+	if (profile == 100 || profile == 110 || profile == 122 || profile == 144)
+	{
+		uint32_t chromaFormat = 1, bitDepthLuma = 0, bitDepthChroma = 0;
+		NalBitReader reader(this->sps.data() + 4, this->sps.size() - 4);
+		uint32_t spsId, separateColourPlane;
+		bool ok = reader.readUE(spsId) && reader.readUE(chromaFormat) &&
+			(chromaFormat != 3 || reader.readBits(1, separateColourPlane)) &&
+			reader.readUE(bitDepthLuma) && reader.readUE(bitDepthChroma);
+		if (!ok || chromaFormat > 3 || bitDepthLuma > 7 || bitDepthChroma > 7)
+		{
+			chromaFormat = 1;
+			bitDepthLuma = 0;
+			bitDepthChroma = 0;
+		}
+
+		w.u8(0xFC | chromaFormat);
+		w.u8(0xF8 | bitDepthLuma);
+		w.u8(0xF8 | bitDepthChroma);
+		w.u8(0);	// numOfSequenceParameterSetExt
+	}
+	w.end(avcC);
+}
+
+void Mp4Writer::writeHvcC(BoxWriter& w)
+{
+	// SPS fields, NVENC's defaults if they can't be read
+	uint32_t maxSubLayersMinus1 = 0, temporalIdNesting = 1, chromaFormat = 1, bitDepthLuma = 0, bitDepthChroma = 0;
+	uint8_t profileTierLevel[12] = {};
+
+	NalBitReader reader(this->sps.data() + 2, this->sps.size() - 2);
+	uint32_t v;
+	bool ok = reader.readBits(4, v) && reader.readBits(3, maxSubLayersMinus1) && reader.readBits(1, temporalIdNesting);
+	for (int i = 0; ok && i < 12; ++i)
+	{
+		ok = reader.readBits(8, v);
+		profileTierLevel[i] = (uint8_t)v;
+	}
+	// Sub-layer profiles would come next, NVENC doesn't write them
+	if (ok && maxSubLayersMinus1 == 0)
+	{
+		uint32_t spsId, separateColourPlane, pictureWidth, pictureHeight, conformanceWindow, offset;
+		ok = reader.readUE(spsId) && reader.readUE(chromaFormat) &&
+			(chromaFormat != 3 || reader.readBits(1, separateColourPlane)) &&
+			reader.readUE(pictureWidth) && reader.readUE(pictureHeight) && reader.readBits(1, conformanceWindow);
+		for (int i = 0; ok && conformanceWindow && i < 4; ++i)
+			ok = reader.readUE(offset);
+		ok = ok && reader.readUE(bitDepthLuma) && reader.readUE(bitDepthChroma);
+		if (!ok || chromaFormat > 3 || bitDepthLuma > 7 || bitDepthChroma > 7)
+		{
+			chromaFormat = 1;
+			bitDepthLuma = 0;
+			bitDepthChroma = 0;
+		}
+	}
+
+	size_t hvcC = w.begin("hvcC");
+	w.u8(1);	// configurationVersion
+	w.bytes(profileTierLevel, sizeof(profileTierLevel));
+	w.u16(0xF000);	// min_spatial_segmentation_idc
+	w.u8(0xFC);	// parallelismType
+	w.u8(0xFC | chromaFormat);
+	w.u8(0xF8 | bitDepthLuma);
+	w.u8(0xF8 | bitDepthChroma);
+	w.u16(0);	// avgFrameRate
+	w.u8(((maxSubLayersMinus1 + 1) << 3) | (temporalIdNesting << 2) | 3);	// 4 byte NAL unit lengths
+	w.u8(3);
+	const std::pair<uint32_t, const std::vector<uint8_t>*> arrays[3] = { { 32, &this->vps }, { 33, &this->sps }, { 34, &this->pps } };
+	for (auto& a : arrays)
+	{
+		w.u8(0x80 | a.first);	// array_completeness
+		w.u16(1);
+		w.u16((uint32_t)a.second->size());
+		w.bytes(a.second->data(), a.second->size());
+	}
+	w.end(hvcC);
+}
+
+void Mp4Writer::writeFragment(const Sample& sample, uint32_t duration)
+{
+	BoxWriter w;
+	size_t moof = w.begin("moof");
+	size_t mfhd = w.beginFull("mfhd", 0, 0);
+	w.u32(++this->sequence);
+	w.end(mfhd);
+
+	size_t traf = w.begin("traf");
+	size_t tfhd = w.beginFull("tfhd", 0, 0x020000);	// default-base-is-moof
+	w.u32(1);
+	w.end(tfhd);
+
+	size_t tfdt = w.beginFull("tfdt", 1, 0);
+	w.u64((uint64_t)std::max<int64_t>(this->ticks(sample.timeUs), this->nextDecodeTime));
+	w.end(tfdt);
+
+	size_t trun = w.beginFull("trun", 0, 0x000701);	// data offset, duration, size, flags
+	w.u32(1);
+	size_t dataOffset = w.data.size();
+	w.u32(0);
+	w.u32(duration);
+	w.u32((uint32_t)sample.data.size());
+	w.u32(sample.keyframe ? 0x02000000 : 0x01010000);	// Depends on no / other samples, non-sync
+	w.end(trun);
+	w.end(traf);
+	w.end(moof);
+
+	w.patch32(dataOffset, (uint32_t)(w.data.size() + 8));	// From the moof to the mdat payload
+	w.u32((uint32_t)(8 + sample.data.size()));
+	w.fourcc("mdat");
+
+	this->nextDecodeTime = std::max<int64_t>(this->ticks(sample.timeUs), this->nextDecodeTime) + duration;
+
+	// A full buffer means the disk fell behind. Frames are dropped until a keyframe fits, tfdt keeps the timeline intact.
+	if (this->dropping && !sample.keyframe)
+	{
+		this->droppedFrames++;
+		return;
+	}
+	if (!this->sink.write(w.data.data(), w.data.size(), sample.data.data(), sample.data.size()))
+	{
+		if (!this->dropping || sample.keyframe)
+			this->keyframeRequested = true;
+		this->dropping = true;
+		this->droppedFrames++;
+		return;
+	}
+	this->dropping = false;
+}
@@ -0,0 +1,119 @@
+/* Copyright (c) 2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef NVPIPE_MP4_WRITER_H
+#define NVPIPE_MP4_WRITER_H
+
+#include "NvPipe.h"
+#include "NvPipeNalParser.h"
+#include "NvPipeRecordingSink.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class BoxWriter;
+
+/**
+ * @brief Writes encoder output as fragmented MP4, one fragment per frame.
+ * The header follows the first keyframe, which carries the parameter sets. Every fragment is complete when
+ * written, so the file stays playable up to the last frame written if the application stops at any point.
+ * Sample durations come from the time to the next frame, so each frame is written once the next one arrives.
+ */
+class Mp4Writer
+{
+public:
+	static constexpr uint32_t kTimescale = 90000;
+
+	Mp4Writer(const std::string& path, NvPipe_Codec codec, uint32_t frameRate, uint64_t bufferSize);
+	~Mp4Writer();
+
+	/**
+	 * Adds the packets of one encoded frame. Frames before the first keyframe are skipped.
+	 */
+	void writeFrame(const std::vector<std::vector<uint8_t>>& packets, uint32_t width, uint32_t height, int64_t timeUs);
+
+	/**
+	 * Writes the last frame, with the duration of the frame before it, and waits until everything is on disk.
+	 */
+	void finish();
+
+	/**
+	 * True once after frames were dropped because the buffer was full. Recording resumes at the next keyframe.
+	 */
+	bool takeKeyframeRequest();
+
+	void getStats(NvPipe_RecordingStats* stats) const;
+
+private:
+	struct Sample
+	{
+		std::vector<uint8_t> data;	// Length prefixed NAL units
+		bool keyframe = false;
+		int64_t timeUs = 0;
+	};
+
+	int64_t ticks(int64_t timeUs) const;
+
+	/**
+	 * Shortest parameter sets the sample description can be built from: the H.264 SPS carries profile,
+	 * compatibility and level after its header, the HEVC SPS its profile_tier_level. Lengths are stored in 16 bits.
+	 */
+	bool isValidParameterSet(uint32_t type, uint32_t size) const;
+
+	void appendPacket(const std::vector<uint8_t>& packet, Sample& sample);
+	void writeHeader(uint32_t width, uint32_t height);
+	void writeSampleDescription(BoxWriter& w);
+	void writeAvcC(BoxWriter& w);
+	void writeHvcC(BoxWriter& w);
+	void writeFragment(const Sample& sample, uint32_t duration);
+
+	NvPipe_Codec codec;
+	uint32_t frameRate;
+	RecordingSink sink;
+	bool dropping = false;
+	bool keyframeRequested = false;
+	uint64_t droppedFrames = 0;
+
+	std::vector<uint8_t> vps;
+	std::vector<uint8_t> sps;
+	std::vector<uint8_t> pps;
+	bool headerWritten = false;
+	uint32_t width = 0;
+	uint32_t height = 0;
+
+	NalParser parser;
+	std::vector<NvPipe_NalUnit> units;
+	Sample pending;
+	Sample next;
+	int64_t firstTimeUs = 0;
+	int64_t nextDecodeTime = 0;
+	uint32_t lastDuration = 0;
+	uint32_t sequence = 0;
+};
+
+#endif
@@ -0,0 +1,227 @@
+/* Copyright (c) 2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "NvPipeNalParser.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+uint64_t FindStartCode(const uint8_t* data, uint64_t begin, uint64_t end)
+{
+	uint64_t i = begin;
+#if defined(__SSE2__) || defined(_M_X64)
+	const __m128i zero = _mm_setzero_si128();
+	for (; i + 18 <= end; i += 16)
+	{
+		uint32_t zeros = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data + i)), zero));
+		uint32_t candidates = zeros & ((zeros >> 1) | 0x8000);	// Zero followed by a zero, the last byte pairs with the next block
+		while (candidates)
+		{
+#ifdef _MSC_VER
+			unsigned long j;
+			_BitScanForward(&j, candidates);
+#else
+			uint32_t j = (uint32_t)__builtin_ctz(candidates);
+#endif
+			if (data[i + j + 1] == 0 && data[i + j + 2] == 1)
+				return i + j;
+			candidates &= candidates - 1;
+		}
+	}
+#endif
+	for (; i + 2 < end; ++i)
+		if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1)
+			return i;
+	return end;
+}
+
+bool NalBitReader::readBits(uint32_t count, uint32_t& value)
+{
+	value = 0;
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		if (this->bit == 8 && !this->nextByte())
+			return false;
+		value = (value << 1) | ((this->current >> (7 - this->bit)) & 1);
+		this->bit++;
+	}
+	return true;
+}
+
+bool NalBitReader::readUE(uint32_t& value)
+{
+	uint32_t leadingZeros = 0;
+	uint32_t bit = 0;
+	while (this->readBits(1, bit) && bit == 0)
+	{
+		if (++leadingZeros > 31)
+			return false;
+	}
+	if (bit == 0)
+		return false;
+
+	uint32_t suffix;
+	if (!this->readBits(leadingZeros, suffix))
+		return false;
+	value = (uint32_t)((1ull << leadingZeros) - 1 + suffix);
+	return true;
+}
+
+bool NalBitReader::nextByte()
+{
+	// 00 00 03 -> 00 00
+	if (this->zeros >= 2 && this->pos < this->size && this->data[this->pos] == 3)
+	{
+		this->pos++;
+		this->zeros = 0;
+	}
+	if (this->pos >= this->size)
+		return false;
+
+	this->current = this->data[this->pos++];
+	this->zeros = (this->current == 0) ? this->zeros + 1 : 0;
+	this->bit = 0;
+	return true;
+}
+
+uint32_t NalParser::parse(const uint8_t* data, uint64_t size, NvPipe_NalUnit* units, uint32_t maxUnits)
+{
+	uint32_t count = 0;
+	uint64_t pos = FindStartCode(data, 0, size);
+	uint64_t start = (pos > 0 && pos < size && data[pos - 1] == 0) ? pos - 1 : pos;	// Include the leading zero of a 4 byte start code
+
+	while (pos < size)
+	{
+		const uint64_t payload = pos + 3;
+		const uint64_t next = FindStartCode(data, payload, size);
+		const uint64_t nextStart = (next < size && next > payload && data[next - 1] == 0) ? next - 1 : next;
+
+		if (count < maxUnits)
+		{
+			NvPipe_NalUnit& unit = units[count];
+			unit.offset = start;
+			unit.size = nextStart - start;
+			unit.startCodeSize = (uint32_t)(payload - start);
+			this->classify(data + payload, nextStart - payload, unit);
+		}
+		count++;
+
+		pos = next;
+		start = nextStart;
+	}
+
+	return count;
+}
+
+void NalParser::classify(const uint8_t* nal, uint64_t size, NvPipe_NalUnit& unit)
+{
+	unit.type = 0;
+	unit.isKeyframe = 0;
+	unit.sliceType = NVPIPE_SLICE_NONE;
+	if (size == 0)
+		return;
+
+	if (this->codec == NVPIPE_HEVC)
+		this->classifyHEVC(nal, size, unit);
+	else
+		this->classifyH264(nal, size, unit);
+}
+
+void NalParser::classifyH264(const uint8_t* nal, uint64_t size, NvPipe_NalUnit& unit)
+{
+	unit.type = nal[0] & 0x1F;
+	if (unit.type < 1 || unit.type > 5)
+		return;
+
+	unit.isKeyframe = (unit.type == 5);
+
+	// first_mb_in_slice, slice_type
+	NalBitReader reader(nal + 1, size - 1);
+	uint32_t firstMb, sliceType;
+	if (!reader.readUE(firstMb) || !reader.readUE(sliceType))
+	{
+		unit.sliceType = NVPIPE_SLICE_UNKNOWN;
+		return;
+	}
+
+	static const NvPipe_SliceType types[5] = { NVPIPE_SLICE_P, NVPIPE_SLICE_B, NVPIPE_SLICE_I, NVPIPE_SLICE_P, NVPIPE_SLICE_I };	// P, B, I, SP, SI
+	unit.sliceType = types[sliceType % 5];
+}
+
+void NalParser::classifyHEVC(const uint8_t* nal, uint64_t size, NvPipe_NalUnit& unit)
+{
+	unit.type = (nal[0] >> 1) & 0x3F;
+	if (size < 2)
+		return;
+
+	NalBitReader reader(nal + 2, size - 2);
+	if (unit.type == 34)	// PPS
+	{
+		uint32_t ppsId, spsId, dependentSlices, outputFlagPresent, extraBits;
+		if (reader.readUE(ppsId) && ppsId < 64 && reader.readUE(spsId) &&
+			reader.readBits(1, dependentSlices) && reader.readBits(1, outputFlagPresent) && reader.readBits(3, extraBits))
+			this->extraSliceHeaderBits[ppsId] = extraBits;
+		return;
+	}
+
+	// VCL NAL units, 22 and 23 are reserved IRAP types
+	const bool isSlice = unit.type <= 9 || (unit.type >= 16 && unit.type <= 21);
+	if (!isSlice)
+		return;
+
+	const bool isIRAP = unit.type >= 16 && unit.type <= 21;
+	unit.isKeyframe = isIRAP;
+
+	uint32_t firstSegment, noOutputOfPriorPics = 0, ppsId, sliceType;
+	if (!reader.readBits(1, firstSegment) || (isIRAP && !reader.readBits(1, noOutputOfPriorPics)) || !reader.readUE(ppsId) || ppsId >= 64)
+	{
+		unit.sliceType = NVPIPE_SLICE_UNKNOWN;
+		return;
+	}
+
+	// slice_segment_address needs the picture size from the SPS
+	if (!firstSegment)
+	{
+		unit.sliceType = this->lastSliceType;
+		return;
+	}
+
+	uint32_t reserved;
+	if (!reader.readBits(this->extraSliceHeaderBits[ppsId], reserved) || !reader.readUE(sliceType) || sliceType > 2)
+	{
+		unit.sliceType = NVPIPE_SLICE_UNKNOWN;
+		return;
+	}
+
+	static const NvPipe_SliceType types[3] = { NVPIPE_SLICE_B, NVPIPE_SLICE_P, NVPIPE_SLICE_I };
+	unit.sliceType = types[sliceType];
+	this->lastSliceType = unit.sliceType;
+}
@@ -0,0 +1,90 @@
+/* Copyright (c) 2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef NVPIPE_NAL_PARSER_H
+#define NVPIPE_NAL_PARSER_H
+
+#include "NvPipe.h"
+
+#include <cstdint>
+
+/**
+ * @brief Returns the position of the next 00 00 01 start code in [begin, end), or end.
+ * With SSE2, 16 bytes are tested for zero pairs at once and only blocks containing one are checked byte by byte.
+ */
+uint64_t FindStartCode(const uint8_t* data, uint64_t begin, uint64_t end);
+
+/**
+ * @brief Reads the leading fields of a NAL unit payload, skipping emulation prevention bytes.
+ */
+class NalBitReader
+{
+public:
+	NalBitReader(const uint8_t* data, uint64_t size) : data(data), size(size) {}
+
+	bool readBits(uint32_t count, uint32_t& value);
+
+	// Exp-Golomb ue(v)
+	bool readUE(uint32_t& value);
+
+private:
+	bool nextByte();
+
+	const uint8_t* data;
+	uint64_t size;
+	uint64_t pos = 0;
+	uint32_t zeros = 0;
+	uint8_t current = 0;
+	uint32_t bit = 8;
+};
+
+/**
+ * @brief Splits an Annex-B packet into NAL units and classifies them without decoding.
+ * HEVC slice headers depend on the PPS, which is taken from the same packet when it's there (NVENC's default is assumed otherwise).
+ * Segments after the first of a picture need the SPS to parse, they take the slice type of the previous segment.
+ */
+class NalParser
+{
+public:
+	NalParser(NvPipe_Codec codec) : codec(codec) {}
+
+	/**
+	 * Returns the number of NAL units in the packet, the first maxUnits are written to units.
+	 */
+	uint32_t parse(const uint8_t* data, uint64_t size, NvPipe_NalUnit* units, uint32_t maxUnits);
+
+private:
+	void classify(const uint8_t* nal, uint64_t size, NvPipe_NalUnit& unit);
+	void classifyH264(const uint8_t* nal, uint64_t size, NvPipe_NalUnit& unit);
+	void classifyHEVC(const uint8_t* nal, uint64_t size, NvPipe_NalUnit& unit);
+
+	NvPipe_Codec codec;
+	uint32_t extraSliceHeaderBits[64] = {};	// num_extra_slice_header_bits by PPS id
+	NvPipe_SliceType lastSliceType = NVPIPE_SLICE_UNKNOWN;
+};
+
+#endif
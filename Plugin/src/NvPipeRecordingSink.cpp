@@ -0,0 +1,368 @@
+/* Copyright (c) 2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "NvPipeRecordingSink.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+RecordingFile::RecordingFile(const std::string& path)
+{
+#ifdef _WIN32
+	m_handle = CreateFileA(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (m_handle == INVALID_HANDLE_VALUE)
+		throw Exception("Failed to open recording file " + path);
+#else
+	m_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (m_fd < 0)
+		throw Exception("Failed to open recording file " + path);
+#endif
+#ifdef NVPIPE_HAS_IO_URING
+	this->setupRing();
+#endif
+}
+
+RecordingFile::~RecordingFile()
+{
+#ifdef NVPIPE_HAS_IO_URING
+	this->closeRing();
+#endif
+#ifdef _WIN32
+	CloseHandle(m_handle);
+#else
+	close(m_fd);
+#endif
+}
+
+NvPipe_RecordingBackend RecordingFile::backend() const
+{
+	return m_ringFd >= 0 ? NVPIPE_RECORDING_IO_URING : NVPIPE_RECORDING_PWRITE;
+}
+
+void RecordingFile::write(const std::vector<Segment>& segments)
+{
+#ifdef NVPIPE_HAS_IO_URING
+	if (m_ringFd >= 0)
+	{
+		this->writeRing(segments);
+		return;
+	}
+#endif
+	for (const Segment& segment : segments)
+		this->writeAt(segment.data, segment.size, segment.offset);
+}
+
+void RecordingFile::writeAt(const uint8_t* data, uint64_t size, uint64_t offset)
+{
+	while (size > 0)
+	{
+#ifdef _WIN32
+		OVERLAPPED overlapped = {};
+		overlapped.Offset = (DWORD)offset;
+		overlapped.OffsetHigh = (DWORD)(offset >> 32);
+		DWORD written = 0;
+		if (!WriteFile(m_handle, data, (DWORD)std::min<uint64_t>(size, 1u << 30), &written, &overlapped) || written == 0)
+			throw Exception("Failed to write recording");
+#else
+		ssize_t written = pwrite(m_fd, data, size, (off_t)offset);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			throw Exception("Failed to write recording: " + std::string(strerror(written < 0 ? errno : EIO)));
+#endif
+		data += written;
+		size -= written;
+		offset += written;
+	}
+}
+
+#ifdef NVPIPE_HAS_IO_URING
+const uint32_t RecordingFile::kRingEntries;
+
+void RecordingFile::setupRing()
+{
+	io_uring_params params = {};
+	int fd = (int)syscall(__NR_io_uring_setup, kRingEntries, &params);
+	if (fd < 0)
+		return;	// Not supported or disabled, e.g. by a container's seccomp profile
+
+	m_sqSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+	m_cqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	m_sqeSize = params.sq_entries * sizeof(io_uring_sqe);
+
+	m_sq = mmap(nullptr, m_sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	m_cq = mmap(nullptr, m_cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	m_sqes = (io_uring_sqe*)mmap(nullptr, m_sqeSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	m_ringFd = fd;
+	if (m_sq == MAP_FAILED || m_cq == MAP_FAILED || m_sqes == MAP_FAILED)
+	{
+		this->closeRing();
+		return;
+	}
+
+	uint8_t* sq = (uint8_t*)m_sq;
+	uint8_t* cq = (uint8_t*)m_cq;
+	m_sqTail = (std::atomic<uint32_t>*)(sq + params.sq_off.tail);
+	m_sqMask = *(uint32_t*)(sq + params.sq_off.ring_mask);
+	m_sqArray = (uint32_t*)(sq + params.sq_off.array);
+	m_sqEntries = params.sq_entries;
+	m_cqHead = (std::atomic<uint32_t>*)(cq + params.cq_off.head);
+	m_cqTail = (std::atomic<uint32_t>*)(cq + params.cq_off.tail);
+	m_cqMask = *(uint32_t*)(cq + params.cq_off.ring_mask);
+	m_cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+}
+
+void RecordingFile::closeRing()
+{
+	if (m_sqes && m_sqes != MAP_FAILED)
+		munmap(m_sqes, m_sqeSize);
+	if (m_cq && m_cq != MAP_FAILED)
+		munmap(m_cq, m_cqSize);
+	if (m_sq && m_sq != MAP_FAILED)
+		munmap(m_sq, m_sqSize);
+	if (m_ringFd >= 0)
+		close(m_ringFd);
+	m_sq = m_cq = nullptr;
+	m_sqes = nullptr;
+	m_ringFd = -1;
+}
+
+void RecordingFile::writeRing(const std::vector<Segment>& segments)
+{
+	for (size_t first = 0; first < segments.size(); first += m_sqEntries)
+	{
+		const uint32_t count = (uint32_t)std::min<size_t>(segments.size() - first, m_sqEntries);
+		m_iovecs.resize(count);
+
+		// Only this thread submits, so the tail is ours and every submission is reaped before the next
+		uint32_t tail = m_sqTail->load(std::memory_order_relaxed);
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			const Segment& segment = segments[first + i];
+			m_iovecs[i].iov_base = (void*)segment.data;
+			m_iovecs[i].iov_len = segment.size;
+
+			const uint32_t index = (tail + i) & m_sqMask;
+			io_uring_sqe& sqe = m_sqes[index];
+			memset(&sqe, 0, sizeof(sqe));
+			sqe.opcode = IORING_OP_WRITEV;
+			sqe.fd = m_fd;
+			sqe.addr = (uint64_t)(uintptr_t)&m_iovecs[i];
+			sqe.len = 1;
+			sqe.off = segment.offset;
+			sqe.user_data = first + i;
+			m_sqArray[index] = index;
+		}
+		m_sqTail->store(tail + count, std::memory_order_release);
+
+		uint32_t completed = 0;
+		while (completed < count)
+		{
+			int r = (int)syscall(__NR_io_uring_enter, m_ringFd, completed == 0 ? count : 0, count - completed, IORING_ENTER_GETEVENTS, nullptr, 0);
+			if (r < 0 && errno != EINTR)
+				throw Exception("Failed to write recording: " + std::string(strerror(errno)));
+
+			uint32_t head = m_cqHead->load(std::memory_order_relaxed);
+			const uint32_t cqTail = m_cqTail->load(std::memory_order_acquire);
+			for (; head != cqTail; ++head, ++completed)
+			{
+				const io_uring_cqe& cqe = m_cqes[head & m_cqMask];
+				const Segment& segment = segments[cqe.user_data];
+				if (cqe.res < 0)
+					throw Exception("Failed to write recording: " + std::string(strerror(-cqe.res)));
+
+				// Short writes are rare (e.g. a full disk), the rest goes the slow way to surface the error
+				if ((uint64_t)cqe.res < segment.size)
+					this->writeAt(segment.data + cqe.res, segment.size - cqe.res, segment.offset + cqe.res);
+			}
+			m_cqHead->store(head, std::memory_order_release);
+		}
+	}
+}
+#endif
+
+const uint64_t RecordingSink::kAlignment;
+const uint64_t RecordingSink::kBatchSize;
+const uint64_t RecordingSink::kDefaultCapacity;
+
+RecordingSink::RecordingSink(const std::string& path, uint64_t capacity) :
+	m_file(path)
+{
+	m_capacity = std::max<uint64_t>((capacity ? capacity : kDefaultCapacity) + kAlignment - 1, kBatchSize) / kAlignment * kAlignment;
+#ifdef _WIN32
+	m_buffer = (uint8_t*)_aligned_malloc(m_capacity, kAlignment);
+#else
+	if (posix_memalign((void**)&m_buffer, kAlignment, m_capacity) != 0)
+		m_buffer = nullptr;
+#endif
+	if (!m_buffer)
+		throw Exception("Failed to allocate recording buffer");
+
+	// Fault the pages in now rather than on the encode path
+	memset(m_buffer, 0, m_capacity);
+
+	m_thread = std::thread(&RecordingSink::flushLoop, this);
+}
+
+RecordingSink::~RecordingSink()
+{
+	try
+	{
+		this->close();
+	}
+	catch (const Exception&)
+	{
+	}
+#ifdef _WIN32
+	_aligned_free(m_buffer);
+#else
+	free(m_buffer);
+#endif
+}
+
+bool RecordingSink::write(const uint8_t* first, uint64_t firstSize, const uint8_t* second, uint64_t secondSize)
+{
+	if (m_failed.load(std::memory_order_acquire))
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		throw Exception(m_error);
+	}
+
+	const uint64_t head = m_head.load(std::memory_order_relaxed);
+	const uint64_t queued = head - m_tail.load(std::memory_order_acquire);
+	if (queued + firstSize + secondSize > m_capacity)
+		return false;
+
+	this->copy(head, first, firstSize);
+	this->copy(head + firstSize, second, secondSize);
+	m_head.store(head + firstSize + secondSize, std::memory_order_release);
+
+	const uint64_t now = queued + firstSize + secondSize;
+	if (now > m_highWaterMark.load(std::memory_order_relaxed))
+		m_highWaterMark.store(now, std::memory_order_relaxed);
+
+	// Only wake the writer once a full batch is waiting, smaller amounts go out on its timer
+	if (now >= kBatchSize && queued < kBatchSize)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_wake.notify_one();
+	}
+	return true;
+}
+
+void RecordingSink::close()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_closing = true;
+	}
+	m_wake.notify_one();
+	if (m_thread.joinable())
+		m_thread.join();
+
+	if (m_failed.load(std::memory_order_acquire))
+		throw Exception(m_error);
+}
+
+void RecordingSink::getStats(NvPipe_RecordingStats* stats) const
+{
+	const uint64_t tail = m_tail.load(std::memory_order_acquire);
+	stats->bufferSize = m_capacity;
+	stats->queuedBytes = m_head.load(std::memory_order_acquire) - tail;
+	stats->highWaterMark = m_highWaterMark.load(std::memory_order_relaxed);
+	stats->writtenBytes = tail;
+	stats->backend = m_file.backend();
+}
+
+void RecordingSink::copy(uint64_t position, const uint8_t* data, uint64_t size)
+{
+	if (size == 0)
+		return;
+	const uint64_t offset = position % m_capacity;
+	const uint64_t firstPart = std::min(size, m_capacity - offset);
+	memcpy(m_buffer + offset, data, firstPart);
+	memcpy(m_buffer, data + firstPart, size - firstPart);
+}
+
+void RecordingSink::flushLoop()
+{
+	std::vector<RecordingFile::Segment> segments;
+
+	while (true)
+	{
+		bool closing;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_wake.wait_for(lock, std::chrono::milliseconds(100), [this] {
+				return m_closing || m_head.load(std::memory_order_acquire) - m_tail.load(std::memory_order_relaxed) >= kBatchSize;
+			});
+			closing = m_closing;
+		}
+
+		// Ring positions are file offsets, so aligning them aligns both. Only the end of the recording may be unaligned.
+		const uint64_t tail = m_tail.load(std::memory_order_relaxed);
+		const uint64_t head = m_head.load(std::memory_order_acquire);
+		const uint64_t end = closing ? head : tail + (head - tail) / kAlignment * kAlignment;
+
+		segments.clear();
+		for (uint64_t position = tail; position < end; )
+		{
+			const uint64_t offset = position % m_capacity;
+			const uint64_t size = std::min(std::min(end - position, m_capacity - offset), kBatchSize);
+			segments.push_back({ m_buffer + offset, size, position });
+			position += size;
+		}
+
+		try
+		{
+			if (!segments.empty())
+				m_file.write(segments);
+		}
+		catch (const Exception& e)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_error = e.message;
+			m_failed.store(true, std::memory_order_release);
+			return;
+		}
+		m_tail.store(end, std::memory_order_release);
+
+		if (closing)
+			return;
+	}
+}
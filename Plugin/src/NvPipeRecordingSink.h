@@ -0,0 +1,167 @@
+/* Copyright (c) 2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef NVPIPE_RECORDING_SINK_H
+#define NVPIPE_RECORDING_SINK_H
+
+#include "NvPipe.h"
+#include "NvPipeException.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <winsock2.h>
+#include <windows.h>
+#else
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+// io_uring is used through raw system calls, so only the kernel headers are needed
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define NVPIPE_HAS_IO_URING
+#endif
+#endif
+#endif
+
+/**
+ * @brief Positional file writes for RecordingSink. Batches go through io_uring where the kernel allows it, pwrite otherwise.
+ */
+class RecordingFile
+{
+public:
+	struct Segment
+	{
+		const uint8_t* data;
+		uint64_t size;
+		uint64_t offset;
+	};
+
+	explicit RecordingFile(const std::string& path);
+	~RecordingFile();
+	NvPipe_RecordingBackend backend() const;
+
+	/**
+	 * Writes all segments, with a single submission when io_uring is used.
+	 */
+	void write(const std::vector<Segment>& segments);
+
+private:
+	void writeAt(const uint8_t* data, uint64_t size, uint64_t offset);
+
+#ifdef NVPIPE_HAS_IO_URING
+	static const uint32_t kRingEntries = 16;
+
+	void setupRing();
+	void closeRing();
+	void writeRing(const std::vector<Segment>& segments);
+
+	void* m_sq = nullptr;
+	void* m_cq = nullptr;
+	io_uring_sqe* m_sqes = nullptr;
+	size_t m_sqSize = 0;
+	size_t m_cqSize = 0;
+	size_t m_sqeSize = 0;
+	std::atomic<uint32_t>* m_sqTail = nullptr;
+	uint32_t m_sqMask = 0;
+	uint32_t* m_sqArray = nullptr;
+	uint32_t m_sqEntries = 0;
+	std::atomic<uint32_t>* m_cqHead = nullptr;
+	std::atomic<uint32_t>* m_cqTail = nullptr;
+	uint32_t m_cqMask = 0;
+	io_uring_cqe* m_cqes = nullptr;
+	std::vector<iovec> m_iovecs;
+#endif
+
+	int m_ringFd = -1;
+#ifdef _WIN32
+	HANDLE m_handle = INVALID_HANDLE_VALUE;
+#else
+	int m_fd = -1;
+#endif
+};
+
+/**
+ * @brief Write-behind file output for recordings. The producer copies into a preallocated ring and never touches the disk;
+ * a background thread writes the ring out in large batches that are aligned in memory and in the file.
+ * A write that doesn't fit is rejected instead of waiting for the disk.
+ */
+class RecordingSink
+{
+public:
+	static const uint64_t kAlignment = 4096;
+	static const uint64_t kBatchSize = 1 << 20;
+	static const uint64_t kDefaultCapacity = 64 << 20;
+
+	RecordingSink(const std::string& path, uint64_t capacity);
+	~RecordingSink();
+
+	/**
+	 * Producer side, from one thread at a time. Queues both parts or neither, returns false if they don't fit.
+	 */
+	bool write(const uint8_t* first, uint64_t firstSize, const uint8_t* second = nullptr, uint64_t secondSize = 0);
+
+	/**
+	 * Writes out everything queued and stops the writer thread. Throws the first write error.
+	 */
+	void close();
+
+	void getStats(NvPipe_RecordingStats* stats) const;
+
+private:
+	void copy(uint64_t position, const uint8_t* data, uint64_t size);
+	void flushLoop();
+
+	RecordingFile m_file;
+	uint8_t* m_buffer = nullptr;
+	uint64_t m_capacity = 0;
+
+	std::atomic<uint64_t> m_head{ 0 };	// Bytes queued so far, owned by the producer
+	std::atomic<uint64_t> m_tail{ 0 };	// Bytes written so far, owned by the writer thread
+	std::atomic<uint64_t> m_highWaterMark{ 0 };
+
+	std::mutex m_mutex;
+	std::condition_variable m_wake;
+	bool m_closing = false;
+	std::atomic<bool> m_failed{ false };
+	std::string m_error;
+	std::thread m_thread;
+};
+
+#endif
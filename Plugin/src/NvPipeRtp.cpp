@@ -0,0 +1,662 @@
+/* Copyright (c) 2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "NvPipeRtp.h"
+
+#include <algorithm>
+#include <cstring>
+#include <random>
+#include <string>
+
+const uint32_t RtpPacketizer::kHeaderSize;
+const uint32_t RtpPacketizer::kMinMtu;
+const uint32_t RtpPacketizer::kMaxMtu;
+
+RtpPacketizer::RtpPacketizer(NvPipe_Codec codec, uint32_t mtu, uint32_t payloadType, uint32_t ssrc) :
+	parser(codec), codec(codec), mtu(mtu), payloadType(payloadType), ssrc(ssrc)
+{
+	if (codec != NVPIPE_H264 && codec != NVPIPE_HEVC)
+		throw Exception("Invalid codec");
+	if (mtu < kMinMtu || mtu > kMaxMtu)
+		throw Exception("RTP MTU must be between " + std::to_string(kMinMtu) + " and " + std::to_string(kMaxMtu) + " bytes");
+	if (payloadType > 127)
+		throw Exception("RTP payload type must be less than 128");
+
+	// Random sequence start as recommended by RFC 3550, and SSRC unless one is given
+	std::random_device random;
+	this->sequence = (uint16_t)random();
+	if (this->ssrc == 0)
+		this->ssrc = random();
+}
+
+uint32_t RtpPacketizer::getMtu() const
+{
+	return this->mtu;
+}
+
+uint32_t RtpPacketizer::packetize(const uint8_t* frame, uint64_t size, uint32_t timestamp, uint8_t* buffer, uint32_t* sizes, uint32_t maxPackets)
+{
+	uint32_t count = this->parser.parse(frame, size, nullptr, 0);
+	this->units.resize(count);
+	this->parser.parse(frame, size, this->units.data(), count);
+
+	this->nals.clear();
+	const uint32_t headerSize = this->nalHeaderSize();
+	for (const NvPipe_NalUnit& unit : this->units)
+	{
+		Nal nal = { frame + unit.offset + unit.startCodeSize, unit.size - unit.startCodeSize };
+		while (nal.size > 0 && nal.data[nal.size - 1] == 0)	// trailing_zero_8bits belong to the byte stream only
+			nal.size--;
+		if (nal.size >= headerSize)
+			this->nals.push_back(nal);
+	}
+
+	const uint32_t packets = this->run(timestamp, nullptr, nullptr, 0);
+	if (buffer == nullptr || sizes == nullptr || packets > maxPackets)
+		return packets;
+
+	this->run(timestamp, buffer, sizes, packets);
+	this->sequence = (uint16_t)(this->sequence + packets);
+	return packets;
+}
+
+uint32_t RtpPacketizer::nalHeaderSize() const
+{
+	return this->codec == NVPIPE_HEVC ? 2 : 1;
+}
+
+uint32_t RtpPacketizer::run(uint32_t timestamp, uint8_t* buffer, uint32_t* sizes, uint32_t total)
+{
+	const uint64_t payloadMax = this->mtu - kHeaderSize;
+	const uint32_t headerSize = this->nalHeaderSize();
+	uint32_t count = 0;
+
+	for (size_t i = 0; i < this->nals.size(); )
+	{
+		// Aggregate as many of the following NAL units as fit, e.g. parameter sets with the slice after them
+		size_t end = i;
+		uint64_t aggregateSize = headerSize;
+		while (end < this->nals.size() && aggregateSize + 2 + this->nals[end].size <= payloadMax)
+			aggregateSize += 2 + this->nals[end++].size;
+
+		if (end - i >= 2)
+		{
+			if (buffer)
+			{
+				uint8_t* p = this->writeHeader(buffer, count, count + 1 == total, timestamp);
+				p = this->writeAggregationHeader(p, i, end);
+				for (size_t n = i; n < end; ++n)
+				{
+					p[0] = (uint8_t)(this->nals[n].size >> 8);
+					p[1] = (uint8_t)this->nals[n].size;
+					memcpy(p + 2, this->nals[n].data, this->nals[n].size);
+					p += 2 + this->nals[n].size;
+				}
+				sizes[count] = (uint32_t)(kHeaderSize + aggregateSize);
+			}
+			count++;
+			i = end;
+			continue;
+		}
+
+		const Nal& nal = this->nals[i++];
+		if (nal.size <= payloadMax)
+		{
+			if (buffer)
+			{
+				uint8_t* p = this->writeHeader(buffer, count, count + 1 == total, timestamp);
+				memcpy(p, nal.data, nal.size);
+				sizes[count] = (uint32_t)(kHeaderSize + nal.size);
+			}
+			count++;
+			continue;
+		}
+
+		// Fragments carry the NAL unit header in the FU indicator and header instead of the payload
+		const uint64_t fragmentMax = payloadMax - headerSize - 1;
+		for (uint64_t offset = headerSize; offset < nal.size; offset += fragmentMax)
+		{
+			if (buffer)
+			{
+				const uint64_t fragment = std::min(fragmentMax, nal.size - offset);
+				uint8_t* p = this->writeHeader(buffer, count, count + 1 == total, timestamp);
+				p = this->writeFragmentHeader(p, nal, offset == headerSize, offset + fragment == nal.size);
+				memcpy(p, nal.data + offset, fragment);
+				sizes[count] = (uint32_t)(kHeaderSize + headerSize + 1 + fragment);
+			}
+			count++;
+		}
+	}
+
+	return count;
+}
+
+uint8_t* RtpPacketizer::writeHeader(uint8_t* buffer, uint32_t index, bool marker, uint32_t timestamp) const
+{
+	uint8_t* p = buffer + (uint64_t)index * this->mtu;
+	const uint16_t seq = (uint16_t)(this->sequence + index);
+	p[0] = 0x80;	// Version 2, no padding, extension or CSRCs
+	p[1] = (uint8_t)((marker ? 0x80 : 0) | this->payloadType);
+	p[2] = (uint8_t)(seq >> 8);
+	p[3] = (uint8_t)seq;
+	p[4] = (uint8_t)(timestamp >> 24);
+	p[5] = (uint8_t)(timestamp >> 16);
+	p[6] = (uint8_t)(timestamp >> 8);
+	p[7] = (uint8_t)timestamp;
+	p[8] = (uint8_t)(this->ssrc >> 24);
+	p[9] = (uint8_t)(this->ssrc >> 16);
+	p[10] = (uint8_t)(this->ssrc >> 8);
+	p[11] = (uint8_t)this->ssrc;
+	return p + kHeaderSize;
+}
+
+uint8_t* RtpPacketizer::writeAggregationHeader(uint8_t* p, size_t begin, size_t end) const
+{
+	if (this->codec == NVPIPE_HEVC)
+	{
+		// F is set if any unit has it, LayerId and TID are the lowest of the units
+		uint32_t forbidden = 0, layerId = 63, tid = 7;
+		for (size_t n = begin; n < end; ++n)
+		{
+			const uint8_t* h = this->nals[n].data;
+			forbidden |= h[0] & 0x80;
+			layerId = std::min<uint32_t>(layerId, ((h[0] & 1) << 5) | (h[1] >> 3));
+			tid = std::min<uint32_t>(tid, h[1] & 7);
+		}
+		p[0] = (uint8_t)(forbidden | (48 << 1) | (layerId >> 5));	// AP
+		p[1] = (uint8_t)(((layerId & 31) << 3) | tid);
+		return p + 2;
+	}
+
+	// F is set if any unit has it, NRI is the highest of the units
+	uint32_t forbidden = 0, nri = 0;
+	for (size_t n = begin; n < end; ++n)
+	{
+		forbidden |= this->nals[n].data[0] & 0x80;
+		nri = std::max<uint32_t>(nri, this->nals[n].data[0] & 0x60);
+	}
+	p[0] = (uint8_t)(forbidden | nri | 24);	// STAP-A
+	return p + 1;
+}
+
+uint8_t* RtpPacketizer::writeFragmentHeader(uint8_t* p, const Nal& nal, bool start, bool end) const
+{
+	const uint8_t flags = (uint8_t)((start ? 0x80 : 0) | (end ? 0x40 : 0));
+	if (this->codec == NVPIPE_HEVC)
+	{
+		p[0] = (uint8_t)((nal.data[0] & 0x81) | (49 << 1));	// FU, F and LayerId kept
+		p[1] = nal.data[1];
+		p[2] = (uint8_t)(flags | ((nal.data[0] >> 1) & 0x3F));
+		return p + 3;
+	}
+
+	p[0] = (uint8_t)((nal.data[0] & 0xE0) | 28);	// FU-A, F and NRI kept
+	p[1] = (uint8_t)(flags | (nal.data[0] & 0x1F));
+	return p + 2;
+}
+
+const uint32_t RtpReceiver::kSlots;
+const int64_t RtpReceiver::kKeyframeRetryUs;
+const uint32_t RtpReceiver::kClockRate;
+
+RtpReceiver::RtpReceiver(NvPipe_Codec codec, uint32_t payloadType, uint32_t minDelayMs, uint32_t maxDelayMs, bool waitForKeyframe) :
+	codec(codec), payloadType(payloadType), minDelayUs((int64_t)minDelayMs * 1000), maxDelayUs((int64_t)maxDelayMs * 1000),
+	waitForKeyframe(waitForKeyframe), slots(kSlots)
+{
+	if (codec != NVPIPE_H264 && codec != NVPIPE_HEVC)
+		throw Exception("Invalid codec");
+	if (payloadType > 127)
+		throw Exception("RTP payload type must be less than 128");
+	if (minDelayMs > maxDelayMs)
+		throw Exception("Minimum playout delay is larger than the maximum");
+
+	this->waitingForKeyframe = waitForKeyframe;	// Nothing decodes before the first keyframe
+}
+
+void RtpReceiver::push(const uint8_t* packet, uint64_t size, int64_t arrivalUs)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	// Fixed header, CSRCs, extension and padding (RFC 3550 5.1)
+	if (size < 12 || (packet[0] >> 6) != 2 || (packet[1] & 0x7F) != this->payloadType)
+	{
+		this->stats.invalidPackets++;
+		return;
+	}
+	uint64_t begin = 12 + 4 * (uint64_t)(packet[0] & 0x0F);
+	uint64_t end = size;
+	if (packet[0] & 0x10)
+	{
+		// A header extension cut off before its length is as malformed as one running past the end
+		if (begin + 4 > size)
+		{
+			this->stats.invalidPackets++;
+			return;
+		}
+		begin += 4 + 4 * (uint64_t)((packet[begin + 2] << 8) | packet[begin + 3]);
+	}
+	if ((packet[0] & 0x20) && end > 0)
+		end = (packet[end - 1] <= end) ? end - packet[end - 1] : 0;
+	if (begin >= end)
+	{
+		this->stats.invalidPackets++;
+		return;
+	}
+
+	const uint16_t seq = (uint16_t)((packet[2] << 8) | packet[3]);
+	const uint32_t timestamp = ((uint32_t)packet[4] << 24) | ((uint32_t)packet[5] << 16) | ((uint32_t)packet[6] << 8) | packet[7];
+	const uint32_t ssrc = ((uint32_t)packet[8] << 24) | ((uint32_t)packet[9] << 16) | ((uint32_t)packet[10] << 8) | packet[11];
+
+	// A new source starts over, e.g. after the sender restarted
+	if (!this->started || ssrc != this->ssrc)
+		this->reset(ssrc, seq);
+
+	// Unwrap the 16 bit sequence number relative to the highest one seen
+	const uint64_t ext = (uint64_t)((int64_t)this->highestSeq + (int16_t)(seq - (uint16_t)this->highestSeq));
+
+	// Make room by giving up on the oldest packets if the window overflows. Until then, the slot still holds the packet kSlots before.
+	if (ext >= this->nextSeq + kSlots)
+		this->skip(ext - kSlots + 1, arrivalUs);
+
+	Slot& slot = this->slot(ext);
+	if (ext < this->nextSeq || (slot.present && slot.seq == ext))
+	{
+		this->stats.latePackets++;	// Duplicate, or its frame was given up already
+
+		// Waiting this much longer would have saved it
+		if (ext >= this->skippedBegin && ext < this->skippedEnd)
+			this->lateDelayUs = std::min((double)this->maxDelayUs, std::max(this->lateDelayUs, (double)(arrivalUs - this->skippedSinceUs)));
+		return;
+	}
+
+	slot.present = true;
+	slot.seq = ext;
+	slot.timestamp = timestamp;
+	slot.marker = (packet[1] & 0x80) != 0;
+	slot.arrivalUs = arrivalUs;
+	slot.payload.assign(packet + begin, packet + end);
+	slot.startsFrame = this->startsFrame(slot.payload.data(), slot.payload.size());
+	this->highestSeq = std::max(this->highestSeq, ext);
+	this->stats.receivedPackets++;
+
+	// Interarrival jitter, in microseconds instead of timestamp units
+	if (this->hasTransit)
+	{
+		const int64_t sent = (int64_t)(int32_t)(timestamp - this->lastTimestamp) * 1000000 / kClockRate;
+		const int64_t d = (arrivalUs - this->lastArrivalUs) - sent;
+		this->jitterUs += ((double)(d < 0 ? -d : d) - this->jitterUs) / 16.0;
+	}
+	this->hasTransit = true;
+	this->lastTimestamp = timestamp;
+	this->lastArrivalUs = arrivalUs;
+}
+
+uint64_t RtpReceiver::poll(int64_t nowUs, uint8_t* dst, uint64_t dstSize, NvPipe_RtpFrameInfo* info)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	*info = NvPipe_RtpFrameInfo();
+
+	uint64_t size = 0;
+	while (this->started)
+	{
+		uint64_t last;
+		if (this->completeFrame(last))
+		{
+			Slot& first = this->slot(this->nextSeq);
+			bool keyframe = false;
+			size = 0;
+			if (!this->assemble(this->nextSeq, last, nullptr, 0, size, keyframe))
+			{
+				this->dropFrame(last);	// Malformed payload, the frame can't be decoded
+				continue;
+			}
+			if (this->waitingForKeyframe && !keyframe)
+			{
+				this->dropFrame(last);
+				this->requestKeyframe(nowUs, false);
+				continue;
+			}
+
+			info->timestamp = first.timestamp;
+			info->size = size;
+			info->isKeyframe = keyframe ? 1 : 0;
+			if (dst == nullptr || size > dstSize)
+			{
+				size = 0;	// Stays queued for a larger buffer
+				break;
+			}
+
+			this->assemble(this->nextSeq, last, dst, dstSize, size, keyframe);
+			if (keyframe)
+				this->waitingForKeyframe = false;
+			this->release(last + 1);
+			this->boundaryClean = true;
+			this->stats.completeFrames++;
+			this->lateDelayUs -= this->lateDelayUs / 1024.0;
+			break;
+		}
+
+		// Incomplete: wait for late packets until the oldest waiting one is a playout delay old
+		if (this->highestSeq < this->nextSeq)
+			break;
+		uint64_t oldest = this->nextSeq;
+		while (!this->slot(oldest).present)
+			++oldest;
+		if (nowUs < this->slot(oldest).arrivalUs + this->playoutDelayUs())
+			break;
+
+		this->skip(this->nextSeq + 1, nowUs);
+	}
+
+	if (this->keyframeRequestPending)
+	{
+		this->keyframeRequestPending = false;
+		info->requestKeyframe = 1;
+	}
+	info->lostPackets = this->pendingLostPackets;
+	info->droppedFrames = this->pendingDroppedFrames;
+	this->pendingLostPackets = 0;
+	this->pendingDroppedFrames = 0;
+	return size;
+}
+
+void RtpReceiver::getStats(NvPipe_RtpReceiverStats* stats)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	*stats = this->stats;
+	stats->jitterUs = (uint32_t)this->jitterUs;
+	stats->playoutDelayUs = (uint32_t)this->playoutDelayUs();
+	stats->waitingForKeyframe = this->waitingForKeyframe ? 1 : 0;
+}
+
+RtpReceiver::Slot& RtpReceiver::slot(uint64_t seq)
+{
+	return this->slots[seq % kSlots];
+}
+
+int64_t RtpReceiver::playoutDelayUs() const
+{
+	const int64_t delay = (int64_t)std::max(4.0 * this->jitterUs, this->lateDelayUs);
+	return std::min(std::max(delay, this->minDelayUs), this->maxDelayUs);
+}
+
+void RtpReceiver::reset(uint32_t ssrc, uint16_t seq)
+{
+	for (Slot& slot : this->slots)
+		slot.present = false;
+	this->started = true;
+	this->ssrc = ssrc;
+	this->nextSeq = (uint64_t)seq + (1ull << 32);	// Offset, so packets from before the first one don't unwrap below zero
+	this->highestSeq = this->nextSeq;
+	this->boundaryClean = false;
+	this->hasTransit = false;
+	this->hasCutFrame = false;
+	this->skippedBegin = this->skippedEnd = 0;
+	this->waitingForKeyframe = this->waitForKeyframe;
+}
+
+bool RtpReceiver::completeFrame(uint64_t& last)
+{
+	const Slot& first = this->slot(this->nextSeq);
+	if (!first.present || !(this->boundaryClean || first.startsFrame))
+		return false;
+
+	for (uint64_t seq = this->nextSeq; seq <= this->highestSeq; ++seq)
+	{
+		const Slot& slot = this->slot(seq);
+		if (!slot.present)
+			return false;
+		if (slot.timestamp != first.timestamp)
+		{
+			last = seq - 1;	// No packet is missing, the frame just ended without a marker bit set
+			return true;
+		}
+		if (slot.marker)
+		{
+			last = seq;
+			return true;
+		}
+	}
+	return false;
+}
+
+void RtpReceiver::skip(uint64_t seq, int64_t nowUs)
+{
+	// Packets of a frame that was cut by the previous skip may still come in, they don't count as another frame
+	uint32_t lastTimestamp = this->cutTimestamp;
+	bool anyDiscarded = this->hasCutFrame;
+	uint64_t lost = 0;
+	uint64_t frames = 0;
+
+	uint64_t resume = this->nextSeq;
+	for (; resume <= this->highestSeq; ++resume)
+	{
+		const Slot& slot = this->slot(resume);
+		if (resume >= seq && slot.present && slot.startsFrame && !(anyDiscarded && slot.timestamp == lastTimestamp))
+			break;
+		if (!slot.present)
+		{
+			lost++;
+			continue;
+		}
+		if (!anyDiscarded || slot.timestamp != lastTimestamp)
+			frames++;
+		anyDiscarded = true;
+		lastTimestamp = slot.timestamp;
+	}
+	if (resume > this->highestSeq)
+		lost += seq > resume ? seq - resume : 0;	// Room made for a packet beyond the window
+
+	this->skippedBegin = this->nextSeq;
+	this->release(resume);
+	this->nextSeq = std::max(resume, seq);
+	this->highestSeq = std::max(this->highestSeq, this->nextSeq - 1);
+	this->boundaryClean = false;
+	this->skippedEnd = this->nextSeq;
+	this->skippedSinceUs = nowUs - this->playoutDelayUs();
+	this->hasCutFrame = anyDiscarded;
+	this->cutTimestamp = lastTimestamp;
+
+	this->stats.lostPackets += lost;
+	this->stats.droppedFrames += frames;
+	this->pendingLostPackets += (uint32_t)lost;
+	this->pendingDroppedFrames += (uint32_t)std::max<uint64_t>(frames, 1);
+	this->waitingForKeyframe = this->waitForKeyframe;
+	this->requestKeyframe(0, true);
+}
+
+void RtpReceiver::dropFrame(uint64_t last)
+{
+	this->release(last + 1);
+	this->boundaryClean = true;
+	this->stats.droppedFrames++;
+	this->pendingDroppedFrames++;
+}
+
+void RtpReceiver::release(uint64_t end)
+{
+	for (uint64_t seq = this->nextSeq; seq < end && seq <= this->highestSeq; ++seq)
+		this->slot(seq).present = false;
+	this->nextSeq = std::max(this->nextSeq, end);
+}
+
+void RtpReceiver::requestKeyframe(int64_t nowUs, bool loss)
+{
+	if (loss || nowUs - this->lastKeyframeRequestUs >= kKeyframeRetryUs)
+	{
+		if (!loss)
+			this->lastKeyframeRequestUs = nowUs;
+		this->keyframeRequestPending = true;
+		this->stats.keyframeRequests++;
+	}
+}
+
+bool RtpReceiver::isKeyframeType(uint32_t type) const
+{
+	return this->codec == NVPIPE_HEVC ? (type >= 16 && type <= 23) : type == 5;
+}
+
+bool RtpReceiver::startsFrame(const uint8_t* payload, uint64_t size) const
+{
+	const uint32_t headerSize = this->codec == NVPIPE_HEVC ? 2 : 1;
+	if (size < headerSize + 1)
+		return false;
+
+	uint32_t type;
+	const uint8_t* body;
+	if (this->codec == NVPIPE_HEVC)
+	{
+		type = (payload[0] >> 1) & 0x3F;
+		if (type == 48 && size >= 7)	// AP, look at the first unit
+		{
+			type = (payload[4] >> 1) & 0x3F;
+			body = payload + 6;
+		}
+		else if (type == 49 && size >= 4)	// FU, only its first fragment has the slice header
+		{
+			if (!(payload[2] & 0x80))
+				return false;
+			type = payload[2] & 0x3F;
+			body = payload + 3;
+		}
+		else
+		{
+			body = payload + 2;
+		}
+		if (type >= 32 && type <= 35)
+			return true;
+		return type < 32 && body < payload + size && (body[0] & 0x80);	// first_slice_segment_in_pic_flag
+	}
+
+	type = payload[0] & 0x1F;
+	if (type == 24 && size >= 5)	// STAP-A
+	{
+		type = payload[3] & 0x1F;
+		body = payload + 4;
+	}
+	else if (type == 28 && size >= 3)	// FU-A
+	{
+		if (!(payload[1] & 0x80))
+			return false;
+		type = payload[1] & 0x1F;
+		body = payload + 2;
+	}
+	else
+	{
+		body = payload + 1;
+	}
+	if (type >= 6 && type <= 9)
+		return true;
+	return (type == 1 || type == 5) && body < payload + size && (body[0] & 0x80);	// first_mb_in_slice == 0
+}
+
+bool RtpReceiver::assemble(uint64_t first, uint64_t last, uint8_t* dst, uint64_t dstSize, uint64_t& size, bool& keyframe)
+{
+	static const uint8_t startCode[4] = { 0, 0, 0, 1 };
+	const bool hevc = this->codec == NVPIPE_HEVC;
+	const uint32_t headerSize = hevc ? 2 : 1;
+	const uint32_t aggregationType = hevc ? 48 : 24;
+	const uint32_t fragmentType = hevc ? 49 : 28;
+	bool inFragment = false;
+
+	size = 0;
+	keyframe = false;
+	auto put = [&](const uint8_t* data, uint64_t n) {
+		if (dst && size + n <= dstSize)
+			memcpy(dst + size, data, n);
+		size += n;
+	};
+
+	for (uint64_t seq = first; seq <= last; ++seq)
+	{
+		const std::vector<uint8_t>& payload = this->slot(seq).payload;
+		const uint8_t* p = payload.data();
+		const uint64_t n = payload.size();
+		if (n < headerSize)
+			return false;
+		const uint32_t type = hevc ? (p[0] >> 1) & 0x3F : p[0] & 0x1F;
+
+		if (type == aggregationType)
+		{
+			for (uint64_t offset = headerSize; offset < n; )
+			{
+				if (offset + 2 > n)
+					return false;
+				const uint64_t unitSize = ((uint64_t)p[offset] << 8) | p[offset + 1];
+				if (unitSize < headerSize || offset + 2 + unitSize > n)
+					return false;
+				const uint8_t* unit = p + offset + 2;
+				keyframe |= this->isKeyframeType(hevc ? (unit[0] >> 1) & 0x3F : unit[0] & 0x1F);
+				put(startCode, 4);
+				put(unit, unitSize);
+				offset += 2 + unitSize;
+			}
+		}
+		else if (type == fragmentType)
+		{
+			if (n < headerSize + 1u)
+				return false;
+			const uint8_t fuHeader = p[headerSize];
+			const uint32_t unitType = hevc ? fuHeader & 0x3F : fuHeader & 0x1F;
+			if (fuHeader & 0x80)
+			{
+				uint8_t header[2];
+				if (hevc)
+				{
+					header[0] = (uint8_t)((p[0] & 0x81) | (unitType << 1));
+					header[1] = p[1];
+				}
+				else
+				{
+					header[0] = (uint8_t)((p[0] & 0xE0) | unitType);
+				}
+				put(startCode, 4);
+				put(header, headerSize);
+				keyframe |= this->isKeyframeType(unitType);
+				inFragment = true;
+			}
+			else if (!inFragment)
+			{
+				return false;	// Continuation without a start
+			}
+			put(p + headerSize + 1, n - headerSize - 1);
+			if (fuHeader & 0x40)
+				inFragment = false;
+		}
+		else if (hevc ? type < 48 : (type >= 1 && type <= 23))
+		{
+			keyframe |= this->isKeyframeType(type);
+			put(startCode, 4);
+			put(p, n);
+		}
+		else
+		{
+			return false;	// Interleaved mode or PACI, not supported
+		}
+	}
+	return true;
+}
@@ -0,0 +1,201 @@
+/* Copyright (c) 2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef NVPIPE_RTP_H
+#define NVPIPE_RTP_H
+
+#include "NvPipe.h"
+#include "NvPipeException.h"
+#include "NvPipeNalParser.h"
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+/**
+ * @brief Splits Annex-B frames into RTP packets (RFC 6184 for H.264, RFC 7798 for HEVC), non-interleaved mode.
+ * Small NAL units are aggregated (STAP-A / AP), large ones fragmented (FU-A / FU). Packets are written into the caller's buffer.
+ */
+class RtpPacketizer
+{
+public:
+	static const uint32_t kHeaderSize = 12;
+	static const uint32_t kMinMtu = 64;
+	static const uint32_t kMaxMtu = 65507;	// Largest UDP payload
+
+	RtpPacketizer(NvPipe_Codec codec, uint32_t mtu, uint32_t payloadType, uint32_t ssrc);
+	uint32_t getMtu() const;
+
+	/**
+	 * Returns the number of packets for the frame. Only if they all fit into maxPackets, packet i is written to
+	 * buffer + i * mtu and its size to sizes[i]; sequence numbers are consumed only then.
+	 */
+	uint32_t packetize(const uint8_t* frame, uint64_t size, uint32_t timestamp, uint8_t* buffer, uint32_t* sizes, uint32_t maxPackets);
+
+private:
+	struct Nal
+	{
+		const uint8_t* data;
+		uint64_t size;
+	};
+
+	uint32_t nalHeaderSize() const;
+
+	/**
+	 * Counts the packets, or writes them if a buffer is given. The marker bit goes on the last one.
+	 */
+	uint32_t run(uint32_t timestamp, uint8_t* buffer, uint32_t* sizes, uint32_t total);
+
+	uint8_t* writeHeader(uint8_t* buffer, uint32_t index, bool marker, uint32_t timestamp) const;
+	uint8_t* writeAggregationHeader(uint8_t* p, size_t begin, size_t end) const;
+	uint8_t* writeFragmentHeader(uint8_t* p, const Nal& nal, bool start, bool end) const;
+
+	NalParser parser;
+	NvPipe_Codec codec;
+	uint32_t mtu;
+	uint32_t payloadType;
+	uint32_t ssrc;
+	uint16_t sequence = 0;
+
+	std::vector<NvPipe_NalUnit> units;
+	std::vector<Nal> nals;
+};
+
+/**
+ * @brief Reassembles RTP packets from RtpPacketizer (or any RFC 6184 / RFC 7798 sender in non-interleaved mode) into
+ * Annex-B frames. Packets are reordered by sequence number; missing ones are waited for up to a playout delay that
+ * follows the measured interarrival jitter (RFC 3550), then the frame is dropped and the loss reported.
+ * Times are passed in by the caller, so loss and reordering can be simulated.
+ */
+class RtpReceiver
+{
+public:
+	static const uint32_t kSlots = 4096;	// Reorder window in packets
+	static const int64_t kKeyframeRetryUs = 1000000;
+	static const uint32_t kClockRate = 90000;
+
+	RtpReceiver(NvPipe_Codec codec, uint32_t payloadType, uint32_t minDelayMs, uint32_t maxDelayMs, bool waitForKeyframe);
+
+	/**
+	 * Adds a received packet. Packets that aren't RTP or have another payload type are counted and ignored.
+	 */
+	void push(const uint8_t* packet, uint64_t size, int64_t arrivalUs);
+
+	/**
+	 * Returns the size of the next complete frame, written to dst, or 0 if there is none yet.
+	 * info is filled either way, with the losses since the previous poll.
+	 */
+	uint64_t poll(int64_t nowUs, uint8_t* dst, uint64_t dstSize, NvPipe_RtpFrameInfo* info);
+
+	void getStats(NvPipe_RtpReceiverStats* stats);
+
+private:
+	struct Slot
+	{
+		bool present = false;
+		uint64_t seq = 0;
+		uint32_t timestamp = 0;
+		bool marker = false;
+		bool startsFrame = false;
+		int64_t arrivalUs = 0;
+		std::vector<uint8_t> payload;	// Keeps its capacity, so steady state reception doesn't allocate
+	};
+
+	Slot& slot(uint64_t seq);
+
+	/**
+	 * Four times the jitter, or what packets that arrived too late needed recently if that was more.
+	 */
+	int64_t playoutDelayUs() const;
+
+	void reset(uint32_t ssrc, uint16_t seq);
+
+	/**
+	 * True if the frame at nextSeq is there from its first packet to its marker, which is returned in last.
+	 */
+	bool completeFrame(uint64_t& last);
+
+	/**
+	 * Gives up on everything before seq, and on the rest of the frame that was cut. Reception resumes at the next packet that starts a frame.
+	 */
+	void skip(uint64_t seq, int64_t nowUs);
+
+	void dropFrame(uint64_t last);
+	void release(uint64_t end);
+
+	/**
+	 * Raised right after a loss, and again while no keyframe arrives.
+	 */
+	void requestKeyframe(int64_t nowUs, bool loss);
+
+	bool isKeyframeType(uint32_t type) const;
+
+	/**
+	 * Whether a packet begins an access unit: parameter sets, delimiters, SEI or the first slice of a picture.
+	 */
+	bool startsFrame(const uint8_t* payload, uint64_t size) const;
+
+	/**
+	 * Writes the NAL units of packets first..last with start codes, or only measures them if dst is null.
+	 */
+	bool assemble(uint64_t first, uint64_t last, uint8_t* dst, uint64_t dstSize, uint64_t& size, bool& keyframe);
+
+	NvPipe_Codec codec;
+	uint32_t payloadType;
+	int64_t minDelayUs;
+	int64_t maxDelayUs;
+	bool waitForKeyframe;
+
+	std::mutex mutex;
+	std::vector<Slot> slots;
+	bool started = false;
+	uint32_t ssrc = 0;
+	uint64_t nextSeq = 0;	// First packet not released yet
+	uint64_t highestSeq = 0;
+	bool boundaryClean = false;	// nextSeq is known to start a frame
+
+	bool hasTransit = false;
+	uint32_t lastTimestamp = 0;
+	int64_t lastArrivalUs = 0;
+	double jitterUs = 0;
+	double lateDelayUs = 0;
+
+	uint64_t skippedBegin = 0;	// Range given up by the last skip, packets arriving for it were too late
+	uint64_t skippedEnd = 0;
+	int64_t skippedSinceUs = 0;	// When the packets given up on started waiting, at the latest
+	bool hasCutFrame = false;
+	uint32_t cutTimestamp = 0;
+
+	bool waitingForKeyframe = false;
+	bool keyframeRequestPending = false;
+	int64_t lastKeyframeRequestUs = INT64_MIN / 2;
+	uint32_t pendingLostPackets = 0;
+	uint32_t pendingDroppedFrames = 0;
+	NvPipe_RtpReceiverStats stats = {};
+};
+
+#endif
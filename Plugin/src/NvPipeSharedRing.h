@@ -0,0 +1,333 @@
+/* Copyright (c) 2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef NVPIPE_SHARED_RING_H
+#define NVPIPE_SHARED_RING_H
+
+/*
+ * Shared-memory packet ring between an NvPipe encoder (see NvPipe_StartSharedOutput) and one reader process.
+ *
+ * This header is self-contained and doesn't need NvPipe or CUDA, so a networking process can include it on its own
+ * and consume encoded frames in place, without copies or system calls on the fast path:
+ *
+ *     SharedRingReader reader("/nvpipe-0");
+ *     SharedRingPacket packet;
+ *     while (reader.acquire(packet, 100))
+ *     {
+ *         send(socket, packet.data, packet.size, 0);
+ *         reader.release();
+ *     }
+ *
+ * Linux only: the reader sleeps on a futex in the shared mapping, which the writer wakes only if the reader waits.
+ */
+
+#include <atomic>
+#include <cstdint>
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2, "Shared ring needs address-free atomics");
+
+static const uint32_t kSharedRingMagic = 0x5253504e;	// "NPSR"
+static const uint32_t kSharedRingVersion = 2;
+static const uint32_t kSharedRingAlignment = 64;	// Records start on cache lines
+static const uint32_t kSharedRingDataOffset = 4096;	// Data starts on the page after the header
+
+static const uint32_t kSharedRingPadding = 1;	// Record flag: rest of the ring is unused, continue at its start
+static const uint32_t kSharedRingKeyframe = 2;
+
+/**
+ * @brief First page of the mapping. Writer and reader fields are on separate cache lines.
+ * The writer publishes magic last, a reader must not use a mapping before it matches.
+ */
+struct SharedRingHeader
+{
+	std::atomic<uint32_t> magic;
+	uint32_t version;
+	uint64_t capacity;	// Data bytes, a power of two
+	uint32_t codec;	// NvPipe_Codec
+	uint32_t dataOffset;
+
+	alignas(64) std::atomic<uint64_t> writePos;	// Owned by the writer, ever increasing
+	std::atomic<uint32_t> writeSignal;	// Futex word, bumped on every publish
+	std::atomic<uint32_t> closed;	// The writer is gone, nothing follows what is in the ring
+	std::atomic<uint64_t> droppedFrames;	// Didn't fit, the writer resumes at a keyframe
+
+	alignas(64) std::atomic<uint64_t> readPos;	// Owned by the reader
+	std::atomic<uint32_t> readerWaiting;	// Set while the reader may sleep on writeSignal
+	std::atomic<uint32_t> readerPid;	// Process of the attached reader, 0 while nobody reads (the writer doesn't publish then)
+	std::atomic<uint32_t> keyframeRequest;	// Set by the reader, consumed by the writer
+};
+
+/**
+ * @brief Precedes every record in the ring. The payload follows directly, records are padded to kSharedRingAlignment.
+ */
+struct SharedRingRecord
+{
+	uint32_t size;	// Payload bytes
+	uint32_t flags;
+	int64_t timestamp;	// Microseconds, steady clock of the writer (CLOCK_MONOTONIC)
+	uint64_t sequence;	// Frame number, gaps are dropped frames
+	uint32_t width;
+	uint32_t height;
+};
+
+static inline uint64_t SharedRingAlign(uint64_t size)
+{
+	return (size + kSharedRingAlignment - 1) & ~(uint64_t)(kSharedRingAlignment - 1);
+}
+
+#ifdef __linux__
+
+#include <cstring>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <ctime>
+#include <string>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+static inline void SharedRingWake(std::atomic<uint32_t>* word)
+{
+	syscall(SYS_futex, (uint32_t*)word, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+static inline void SharedRingWait(std::atomic<uint32_t>* word, uint32_t expected, int32_t timeoutMs)
+{
+	timespec timeout = { timeoutMs / 1000, (timeoutMs % 1000) * 1000000L };
+	syscall(SYS_futex, (uint32_t*)word, FUTEX_WAIT, expected, timeoutMs < 0 ? nullptr : &timeout, nullptr, 0);
+}
+
+/**
+ * @brief One encoded frame (Annex-B), pointing into the shared mapping until SharedRingReader::release.
+ */
+struct SharedRingPacket
+{
+	const uint8_t* data;
+	uint32_t size;
+	bool keyframe;
+	int64_t timestamp;
+	uint64_t sequence;
+	uint32_t width;
+	uint32_t height;
+};
+
+/**
+ * @brief Consumer side of the ring. Attaching asks the writer for a keyframe, and everything before it is skipped,
+ * so the first packet handed out is decodable. Only one reader can be attached at a time.
+ * The attached reader is known by its process id: if that process died without detaching (kill() reports ESRCH),
+ * the next reader takes the ring over. This needs all readers in the same PID namespace; while the pid of a crashed
+ * reader is reused by another process, the ring stays taken.
+ */
+class SharedRingReader
+{
+public:
+	explicit SharedRingReader(const std::string& name)
+	{
+		int fd = shm_open(name.c_str(), O_RDWR, 0);
+		if (fd < 0)
+			throw std::runtime_error("Failed to open shared ring " + name + ": " + strerror(errno));
+
+		struct stat st;
+		if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < kSharedRingDataOffset)
+		{
+			close(fd);
+			throw std::runtime_error("Not an NvPipe shared ring: " + name);
+		}
+
+		void* mapping = mmap(nullptr, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (mapping == MAP_FAILED)
+			throw std::runtime_error("Failed to map shared ring " + name + ": " + strerror(errno));
+		this->mapping = (uint8_t*)mapping;
+		this->mappingSize = (uint64_t)st.st_size;
+		this->header = (SharedRingHeader*)mapping;
+
+		if (this->header->magic.load(std::memory_order_acquire) != kSharedRingMagic || this->header->version != kSharedRingVersion
+			|| this->header->dataOffset + this->header->capacity != this->mappingSize)
+		{
+			this->unmap();
+			throw std::runtime_error("Not an NvPipe shared ring, or not initialized yet: " + name);
+		}
+
+		// Take the ring over from a reader that crashed, a CAS keeps two new readers from both taking it
+		const uint32_t self = (uint32_t)getpid();
+		uint32_t owner = 0;
+		while (!this->header->readerPid.compare_exchange_strong(owner, self, std::memory_order_acq_rel))
+		{
+			if (kill((pid_t)owner, 0) == 0 || errno != ESRCH)
+			{
+				this->unmap();
+				throw std::runtime_error("Shared ring " + name + " already has a reader (process " + std::to_string(owner) + ")");
+			}
+		}
+		this->header->readerWaiting.store(0, std::memory_order_relaxed);	// May be left over from that reader
+
+		// Start at the head, the requested keyframe will be the first packet
+		this->data = this->mapping + this->header->dataOffset;
+		this->mask = this->header->capacity - 1;
+		this->position = this->header->writePos.load(std::memory_order_acquire);
+		this->header->readPos.store(this->position, std::memory_order_release);
+		this->header->keyframeRequest.store(1, std::memory_order_release);
+	}
+
+	~SharedRingReader()
+	{
+		uint32_t self = (uint32_t)getpid();
+		this->header->readerPid.compare_exchange_strong(self, 0, std::memory_order_release);
+		this->unmap();
+	}
+
+	SharedRingReader(const SharedRingReader&) = delete;
+	SharedRingReader& operator=(const SharedRingReader&) = delete;
+
+	uint32_t codec() const
+	{
+		return this->header->codec;
+	}
+
+	uint64_t droppedFrames() const
+	{
+		return this->header->droppedFrames.load(std::memory_order_relaxed);
+	}
+
+	/**
+	 * Asks the writer to encode the next frame as a keyframe, e.g. after the network lost packets.
+	 */
+	void requestKeyframe()
+	{
+		this->header->keyframeRequest.store(1, std::memory_order_release);
+	}
+
+	/**
+	 * Waits up to timeoutMs (-1 for no limit) for the next packet. The packet stays valid until release().
+	 * Returns false on timeout, or once the writer closed the ring and everything in it was read.
+	 */
+	bool acquire(SharedRingPacket& packet, int32_t timeoutMs)
+	{
+		if (this->pending)
+			this->release();
+
+		// Wakes without data (spurious, EINTR, or a publish that was skipped) wait again for the rest of the time
+		const std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs > 0 ? timeoutMs : 0);
+
+		while (true)
+		{
+			const uint32_t signal = this->header->writeSignal.load(std::memory_order_acquire);
+			const uint64_t writePos = this->header->writePos.load(std::memory_order_acquire);
+			if (this->position == writePos)
+			{
+				if (this->header->closed.load(std::memory_order_acquire) || timeoutMs == 0)
+					return false;
+
+				int32_t waitMs = -1;
+				if (timeoutMs > 0)
+				{
+					const int64_t remainingUs = std::chrono::duration_cast<std::chrono::microseconds>(deadline - std::chrono::steady_clock::now()).count();
+					if (remainingUs <= 0)
+						return false;
+					waitMs = (int32_t)((remainingUs + 999) / 1000);
+				}
+
+				// Announce the wait, then check again: the writer either sees the flag or bumped the signal before
+				this->header->readerWaiting.store(1, std::memory_order_seq_cst);
+				if (this->header->writePos.load(std::memory_order_seq_cst) == this->position && !this->header->closed.load(std::memory_order_acquire))
+					SharedRingWait(&this->header->writeSignal, signal, waitMs);
+				this->header->readerWaiting.store(0, std::memory_order_relaxed);
+				continue;
+			}
+
+			const uint64_t offset = this->position & this->mask;
+			const SharedRingRecord* record = (const SharedRingRecord*)(this->data + offset);
+			if (record->flags & kSharedRingPadding)
+			{
+				this->advance(this->header->capacity - offset);
+				continue;
+			}
+
+			const uint64_t recordSize = SharedRingAlign(sizeof(SharedRingRecord) + record->size);
+			const bool keyframe = (record->flags & kSharedRingKeyframe) != 0;
+			if (this->waitingForKeyframe && !keyframe)
+			{
+				this->advance(recordSize);
+				continue;
+			}
+			this->waitingForKeyframe = false;
+
+			packet.data = (const uint8_t*)(record + 1);
+			packet.size = record->size;
+			packet.keyframe = keyframe;
+			packet.timestamp = record->timestamp;
+			packet.sequence = record->sequence;
+			packet.width = record->width;
+			packet.height = record->height;
+			this->pending = recordSize;
+			return true;
+		}
+	}
+
+	/**
+	 * Hands the space of the last acquired packet back to the writer.
+	 */
+	void release()
+	{
+		this->advance(this->pending);
+		this->pending = 0;
+	}
+
+private:
+	void advance(uint64_t size)
+	{
+		this->position += size;
+		this->header->readPos.store(this->position, std::memory_order_release);
+	}
+
+	void unmap()
+	{
+		munmap(this->mapping, (size_t)this->mappingSize);
+		this->mapping = nullptr;
+	}
+
+	uint8_t* mapping = nullptr;
+	uint64_t mappingSize = 0;
+	SharedRingHeader* header = nullptr;
+	const uint8_t* data = nullptr;
+	uint64_t mask = 0;
+	uint64_t position = 0;	// Local copy of readPos
+	uint64_t pending = 0;	// Size of the acquired record
+	bool waitingForKeyframe = true;
+};
+
+#endif
+
+#endif
@@ -0,0 +1,201 @@
+/* Copyright (c) 2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "NvPipeSharedRingWriter.h"
+
+#include <cerrno>
+#include <cstring>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+const uint64_t SharedRingWriter::kDefaultCapacity;
+const uint64_t SharedRingWriter::kMinCapacity;
+
+SharedRingWriter::SharedRingWriter(const std::string& name, NvPipe_Codec codec, uint64_t capacity) :
+	name(name), parser(codec)
+{
+#ifdef __linux__
+	if (name.size() < 2 || name[0] != '/' || name.find('/', 1) != std::string::npos)
+		throw Exception("Shared ring names start with a slash and contain no other: " + name);
+
+	// Positions wrap with a mask, so the capacity is a power of two
+	uint64_t size = kMinCapacity;
+	while (size < (capacity ? capacity : kDefaultCapacity))
+		size *= 2;
+
+	// A ring left behind by a writer that crashed is replaced
+	int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+	if (fd < 0 && errno == EEXIST)
+	{
+		shm_unlink(name.c_str());
+		fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+	}
+	if (fd < 0)
+		throw Exception("Failed to create shared ring " + name + ": " + strerror(errno));
+
+	// Populated up front, so the first frames don't fault in pages on the encode path
+	this->mappingSize = kSharedRingDataOffset + size;
+	void* mapping = MAP_FAILED;
+	if (ftruncate(fd, (off_t)this->mappingSize) == 0)
+		mapping = mmap(nullptr, (size_t)this->mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+	int error = errno;
+	close(fd);
+	if (mapping == MAP_FAILED)
+	{
+		shm_unlink(name.c_str());
+		throw Exception("Failed to map shared ring " + name + ": " + strerror(error));
+	}
+
+	// The new object is zero filled, which is a valid state for every atomic
+	this->mapping = (uint8_t*)mapping;
+	this->header = (SharedRingHeader*)mapping;
+	this->data = this->mapping + kSharedRingDataOffset;
+	this->header->version = kSharedRingVersion;
+	this->header->capacity = size;
+	this->header->codec = codec;
+	this->header->dataOffset = kSharedRingDataOffset;
+	this->header->magic.store(kSharedRingMagic, std::memory_order_release);
+#else
+	(void)codec;
+	(void)capacity;
+	throw Exception("Shared memory output is only supported on Linux");
+#endif
+}
+
+SharedRingWriter::~SharedRingWriter()
+{
+#ifdef __linux__
+	// Readers keep their mapping, they drain what is left and then see the ring closed
+	this->header->closed.store(1, std::memory_order_seq_cst);
+	this->header->writeSignal.fetch_add(1, std::memory_order_seq_cst);
+	SharedRingWake(&this->header->writeSignal);
+
+	munmap(this->mapping, (size_t)this->mappingSize);
+	shm_unlink(this->name.c_str());
+#endif
+}
+
+void SharedRingWriter::publish(const std::vector<std::vector<uint8_t>>& packets, uint32_t width, uint32_t height, int64_t timeUs)
+{
+#ifdef __linux__
+	const uint64_t sequence = this->sequence++;
+	if (!this->header->readerPid.load(std::memory_order_acquire))
+	{
+		this->dropping = true;	// A reader attaching asks for a keyframe and starts there
+		return;
+	}
+
+	uint64_t size = 0;
+	bool keyframe = false;
+	for (auto& p : packets)
+	{
+		uint32_t count = this->parser.parse(p.data(), p.size(), nullptr, 0);
+		this->units.resize(count);
+		this->parser.parse(p.data(), p.size(), this->units.data(), count);
+		for (const NvPipe_NalUnit& unit : this->units)
+			keyframe |= unit.isKeyframe != 0;
+		size += p.size();
+	}
+	if (size == 0)
+		return;
+
+	// Records don't wrap, a record that would cross the end starts over at the beginning behind a padding record
+	const uint64_t capacity = this->header->capacity;
+	const uint64_t recordSize = SharedRingAlign(sizeof(SharedRingRecord) + size);
+	const uint64_t offset = this->position & (capacity - 1);
+	const uint64_t padding = (offset + recordSize > capacity) ? capacity - offset : 0;
+	const uint64_t used = this->position - this->header->readPos.load(std::memory_order_acquire);
+	const bool fits = recordSize <= capacity / 2 && used + padding + recordSize <= capacity;
+
+	if (!fits || (this->dropping && !keyframe))
+	{
+		this->dropping = true;
+		this->header->droppedFrames.fetch_add(1, std::memory_order_relaxed);
+		if (keyframe)
+			this->keyframePending = false;	// Came, but didn't fit either
+
+		// Asked for once the reader made room, so a stalled reader doesn't turn every frame into a keyframe
+		if (!this->keyframePending && used <= capacity / 2)
+		{
+			this->keyframeRequested = true;
+			this->keyframePending = true;
+		}
+		return;
+	}
+
+	if (padding)
+	{
+		SharedRingRecord* pad = (SharedRingRecord*)(this->data + offset);
+		*pad = SharedRingRecord();
+		pad->flags = kSharedRingPadding;
+	}
+
+	uint8_t* dst = this->data + ((this->position + padding) & (capacity - 1));
+	SharedRingRecord* record = (SharedRingRecord*)dst;
+	record->size = (uint32_t)size;
+	record->flags = keyframe ? kSharedRingKeyframe : 0;
+	record->timestamp = timeUs;
+	record->sequence = sequence;
+	record->width = width;
+	record->height = height;
+	dst += sizeof(SharedRingRecord);
+	for (auto& p : packets)
+	{
+		memcpy(dst, p.data(), p.size());
+		dst += p.size();
+	}
+	this->position += padding + recordSize;
+	this->dropping = false;
+	this->keyframePending = false;
+
+	// Pairs with the reader announcing its wait before it checks writePos again, so a sleeping reader is never missed
+	this->header->writePos.store(this->position, std::memory_order_release);
+	this->header->writeSignal.fetch_add(1, std::memory_order_seq_cst);
+	if (this->header->readerWaiting.load(std::memory_order_seq_cst))
+		SharedRingWake(&this->header->writeSignal);
+#else
+	(void)packets;
+	(void)width;
+	(void)height;
+	(void)timeUs;
+#endif
+}
+
+bool SharedRingWriter::takeKeyframeRequest()
+{
+#ifdef __linux__
+	if (this->header->keyframeRequest.exchange(0))
+		this->keyframeRequested = true;
+#endif
+	bool requested = this->keyframeRequested;
+	this->keyframeRequested = false;
+	return requested;
+}
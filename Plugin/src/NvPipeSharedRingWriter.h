@@ -0,0 +1,79 @@
+/* Copyright (c) 2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef NVPIPE_SHARED_RING_WRITER_H
+#define NVPIPE_SHARED_RING_WRITER_H
+
+#include "NvPipe.h"
+#include "NvPipeException.h"
+#include "NvPipeNalParser.h"
+#include "NvPipeSharedRing.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Producer side of a shared-memory packet ring (layout and reader in NvPipeSharedRing.h), fed by an encoder.
+ * Each frame is copied into the mapping once and published with a release store; the reader is woken through a futex only
+ * when it sleeps. Publishing never blocks the encode: frames that don't fit are dropped until a keyframe, which is requested.
+ */
+class SharedRingWriter
+{
+public:
+	static const uint64_t kDefaultCapacity = 16 * 1024 * 1024;
+	static const uint64_t kMinCapacity = 64 * 1024;
+
+	SharedRingWriter(const std::string& name, NvPipe_Codec codec, uint64_t capacity);
+	~SharedRingWriter();
+
+	/**
+	 * Publishes the packets of one encoded frame as one record. Nothing is copied while no reader is attached.
+	 */
+	void publish(const std::vector<std::vector<uint8_t>>& packets, uint32_t width, uint32_t height, int64_t timeUs);
+
+	/**
+	 * True once after the reader asked for a keyframe, or after frames were dropped because the ring was full.
+	 */
+	bool takeKeyframeRequest();
+
+private:
+	std::string name;
+	NalParser parser;
+	std::vector<NvPipe_NalUnit> units;
+	uint8_t* mapping = nullptr;
+	uint64_t mappingSize = 0;
+	SharedRingHeader* header = nullptr;
+	uint8_t* data = nullptr;
+	uint64_t position = 0;	// Local copy of writePos
+	uint64_t sequence = 0;
+	bool dropping = true;
+	bool keyframeRequested = false;
+	bool keyframePending = false;	// Requested because of a drop, not produced yet
+};
+
+#endif
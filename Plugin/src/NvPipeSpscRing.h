@@ -0,0 +1,114 @@
+/* Copyright (c) 2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef NVPIPE_SPSC_RING_H
+#define NVPIPE_SPSC_RING_H
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief Bounded lock-free queue for exactly one producer thread and one consumer thread.
+ * The producer only moves head and the consumer only moves tail, so no other synchronization is needed.
+ */
+template<typename T>
+class SpscRing
+{
+public:
+	explicit SpscRing(uint32_t capacity) : m_slots(capacity + 1)	// One slot stays empty to tell full from empty
+	{
+	}
+
+	uint32_t capacity() const
+	{
+		return (uint32_t)m_slots.size() - 1;
+	}
+
+	// Producer side.
+	bool push(T&& value)
+	{
+		uint32_t head = m_head.load(std::memory_order_relaxed);
+		uint32_t next = this->advance(head);
+		if (next == m_tail.load(std::memory_order_acquire))
+			return false;
+
+		m_slots[head] = std::move(value);
+		m_head.store(next, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer side. The returned element stays valid until pop().
+	T* front()
+	{
+		uint32_t tail = m_tail.load(std::memory_order_relaxed);
+		if (tail == m_head.load(std::memory_order_acquire))
+			return nullptr;
+
+		return &m_slots[tail];
+	}
+
+	// Consumer side.
+	void pop()
+	{
+		uint32_t tail = m_tail.load(std::memory_order_relaxed);
+		m_slots[tail] = T();	// Release whatever the element holds on to
+		m_tail.store(this->advance(tail), std::memory_order_release);
+	}
+
+	// Consumer side.
+	bool pop(T& value)
+	{
+		T* element = this->front();
+		if (element == nullptr)
+			return false;
+
+		value = std::move(*element);
+		this->pop();
+		return true;
+	}
+
+	// Exact on either side, approximate from other threads.
+	uint32_t size() const
+	{
+		uint32_t head = m_head.load(std::memory_order_acquire);
+		uint32_t tail = m_tail.load(std::memory_order_acquire);
+		return (head + (uint32_t)m_slots.size() - tail) % (uint32_t)m_slots.size();
+	}
+
+private:
+	uint32_t advance(uint32_t index) const
+	{
+		return (index + 1 == m_slots.size()) ? 0 : index + 1;
+	}
+
+	std::vector<T> m_slots;
+	std::atomic<uint32_t> m_head{ 0 };	// Next slot to write, owned by the producer
+	std::atomic<uint32_t> m_tail{ 0 };	// Next slot to read, owned by the consumer
+};
+
+#endif
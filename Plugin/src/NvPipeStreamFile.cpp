@@ -0,0 +1,378 @@
+/* Copyright (c) 2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "NvPipeStreamFile.h"
+
+#include <algorithm>
+#include <cstring>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+StreamWriter::StreamWriter(const std::string& path, NvPipe_Codec codec, uint32_t width, uint32_t height) :
+	parser(codec)
+{
+	if (codec != NVPIPE_H264 && codec != NVPIPE_HEVC)
+		throw Exception("Invalid codec");
+
+	this->file = fopen(path.c_str(), "wb");
+	if (!this->file)
+		throw Exception("Failed to open recording file " + path);
+
+	StreamFileHeader header = {};
+	header.magic = kStreamFileMagic;
+	header.version = kStreamFileVersion;
+	header.codec = (uint32_t)codec;
+	header.width = width;
+	header.height = height;
+	if (fwrite(&header, 1, sizeof(header), this->file) != sizeof(header))
+	{
+		fclose(this->file);
+		throw Exception("Failed to write recording");
+	}
+	this->offset = sizeof(header);
+}
+
+StreamWriter::~StreamWriter()
+{
+	try
+	{
+		this->finish();
+	}
+	catch (const Exception&)
+	{
+	}
+	if (this->file)
+		fclose(this->file);
+}
+
+void StreamWriter::append(const uint8_t* data, uint64_t size, int64_t timestamp)
+{
+	if (this->finished)
+		throw Exception("Recording is already finished");
+	if (!this->entries.empty() && timestamp < this->entries.back().timestamp)
+		throw Exception("Recording timestamps must not decrease");
+
+	uint32_t count = this->parser.parse(data, size, nullptr, 0);
+	this->units.resize(count);
+	this->parser.parse(data, size, this->units.data(), count);
+
+	bool keyframe = false;
+	for (const NvPipe_NalUnit& unit : this->units)
+		keyframe |= unit.isKeyframe != 0;
+
+	StreamRecordHeader record = {};
+	record.type = kStreamRecordFrame;
+	record.flags = keyframe ? kStreamFrameKeyframe : 0;
+	record.size = size;
+	record.timestamp = timestamp;
+
+	StreamIndexEntry entry = {};
+	entry.offset = this->offset + sizeof(record);
+	entry.size = size;
+	entry.timestamp = timestamp;
+	entry.flags = record.flags;
+
+	this->write(&record, sizeof(record));
+	this->write(data, size);
+	this->pad();
+
+	// Readers of an unfinished file recover the frames up to the last flush
+	if (keyframe)
+	{
+		this->keyframes.push_back(this->entries.size());
+		fflush(this->file);
+	}
+	this->entries.push_back(entry);
+}
+
+void StreamWriter::finish()
+{
+	if (this->finished)
+		return;
+	this->finished = true;
+
+	StreamFileFooter footer = {};
+	footer.indexOffset = this->offset;
+	footer.frameCount = this->entries.size();
+	footer.keyframeCount = this->keyframes.size();
+	footer.magic = kStreamFooterMagic;
+
+	StreamRecordHeader record = {};
+	record.type = kStreamRecordIndex;
+	record.size = this->entries.size() * sizeof(StreamIndexEntry) + this->keyframes.size() * sizeof(uint64_t);
+
+	this->write(&record, sizeof(record));
+	this->write(this->entries.data(), this->entries.size() * sizeof(StreamIndexEntry));
+	this->write(this->keyframes.data(), this->keyframes.size() * sizeof(uint64_t));
+	this->write(&footer, sizeof(footer));
+
+	if (fflush(this->file) != 0)
+		throw Exception("Failed to write recording");
+}
+
+void StreamWriter::write(const void* data, uint64_t size)
+{
+	if (size > 0 && fwrite(data, 1, size, this->file) != size)
+		throw Exception("Failed to write recording");
+	this->offset += size;
+}
+
+void StreamWriter::pad()
+{
+	static const uint8_t zeros[8] = {};
+	this->write(zeros, StreamAlign(this->offset) - this->offset);
+}
+
+StreamReader::StreamReader(const std::string& path)
+{
+	this->map(path);
+
+	// The destructor doesn't run for a constructor that throws
+	try
+	{
+		if (this->size < sizeof(StreamFileHeader))
+			throw Exception("Not an NvPipe recording: " + path);
+		memcpy(&this->header, this->data, sizeof(this->header));
+		if (this->header.magic != kStreamFileMagic)
+			throw Exception("Not an NvPipe recording: " + path);
+		if (this->header.version != kStreamFileVersion)
+			throw Exception("Unsupported recording version");
+		if (this->header.codec != NVPIPE_H264 && this->header.codec != NVPIPE_HEVC)
+			throw Exception("Invalid codec in recording");
+
+		if (!this->loadIndex())
+			this->rebuildIndex();
+	}
+	catch (...)
+	{
+		this->unmap();
+		throw;
+	}
+}
+
+StreamReader::~StreamReader()
+{
+	this->unmap();
+}
+
+void StreamReader::getInfo(NvPipe_StreamInfo* info) const
+{
+	info->codec = (NvPipe_Codec)this->header.codec;
+	info->width = this->header.width;
+	info->height = this->header.height;
+	info->frameCount = this->frameCount;
+	info->keyframeCount = this->keyframeCount;
+	info->firstTimestamp = this->frameCount > 0 ? this->entries[0].timestamp : 0;
+	info->lastTimestamp = this->frameCount > 0 ? this->entries[this->frameCount - 1].timestamp : 0;
+	info->complete = this->complete ? 1 : 0;
+}
+
+void StreamReader::getFrame(uint64_t index, NvPipe_StreamFrame* frame) const
+{
+	if (index >= this->frameCount)
+		throw Exception("Frame index out of range");
+
+	const StreamIndexEntry& entry = this->entries[index];
+	frame->data = this->data + entry.offset;
+	frame->size = entry.size;
+	frame->timestamp = entry.timestamp;
+	frame->index = index;
+	frame->isKeyframe = (entry.flags & kStreamFrameKeyframe) ? 1 : 0;
+}
+
+bool StreamReader::findKeyframe(uint64_t index, uint64_t* keyframe) const
+{
+	if (index >= this->frameCount)
+		throw Exception("Frame index out of range");
+
+	const uint64_t* end = this->keyframes + this->keyframeCount;
+	const uint64_t* it = std::upper_bound(this->keyframes, end, index);
+	if (it == this->keyframes)
+		return false;
+	*keyframe = *(it - 1);
+	return true;
+}
+
+bool StreamReader::findFrame(int64_t timestamp, uint64_t* index) const
+{
+	const StreamIndexEntry* end = this->entries + this->frameCount;
+	const StreamIndexEntry* it = std::upper_bound(this->entries, end, timestamp,
+		[](int64_t t, const StreamIndexEntry& e) { return t < e.timestamp; });
+	if (it == this->entries)
+		return false;
+	*index = (uint64_t)(it - 1 - this->entries);
+	return true;
+}
+
+bool StreamReader::loadIndex()
+{
+	if (this->size < sizeof(StreamFileHeader) + sizeof(StreamRecordHeader) + sizeof(StreamFileFooter))
+		return false;
+
+	StreamFileFooter footer;
+	memcpy(&footer, this->data + this->size - sizeof(footer), sizeof(footer));
+	if (footer.magic != kStreamFooterMagic || footer.indexOffset % 8 != 0)
+		return false;
+	if (footer.indexOffset < sizeof(StreamFileHeader) || footer.indexOffset > this->size - sizeof(footer) - sizeof(StreamRecordHeader))
+		return false;
+
+	StreamRecordHeader record;
+	memcpy(&record, this->data + footer.indexOffset, sizeof(record));
+	const uint64_t available = this->size - sizeof(footer) - footer.indexOffset - sizeof(record);
+	if (record.type != kStreamRecordIndex || record.size != available)
+		return false;
+	if (footer.frameCount > available / sizeof(StreamIndexEntry) || footer.keyframeCount > available / sizeof(uint64_t)
+		|| footer.frameCount * sizeof(StreamIndexEntry) + footer.keyframeCount * sizeof(uint64_t) != available)
+		return false;
+
+	// Records are 8 byte aligned and the mapping is page aligned, so the index is used in place
+	this->entries = (const StreamIndexEntry*)(this->data + footer.indexOffset + sizeof(record));
+	this->keyframes = (const uint64_t*)(this->entries + footer.frameCount);
+	this->frameCount = footer.frameCount;
+	this->keyframeCount = footer.keyframeCount;
+
+	for (uint64_t i = 0; i < this->frameCount; ++i)
+		if (this->entries[i].offset > footer.indexOffset || this->entries[i].size > footer.indexOffset - this->entries[i].offset)
+			throw Exception("Corrupt recording index");
+	for (uint64_t i = 0; i < this->keyframeCount; ++i)
+		if (this->keyframes[i] >= this->frameCount || (i > 0 && this->keyframes[i] <= this->keyframes[i - 1]))
+			throw Exception("Corrupt recording index");
+
+	this->complete = true;
+	return true;
+}
+
+void StreamReader::rebuildIndex()
+{
+	uint64_t offset = sizeof(StreamFileHeader);
+	while (offset + sizeof(StreamRecordHeader) <= this->size)
+	{
+		StreamRecordHeader record;
+		memcpy(&record, this->data + offset, sizeof(record));
+		const uint64_t payload = offset + sizeof(record);
+		if (record.type != kStreamRecordFrame || record.size > this->size - payload)
+			break;	// Index or a frame cut off by the end of the file
+
+		if (record.flags & kStreamFrameKeyframe)
+			this->ownedKeyframes.push_back(this->ownedEntries.size());
+
+		StreamIndexEntry entry = {};
+		entry.offset = payload;
+		entry.size = record.size;
+		entry.timestamp = record.timestamp;
+		entry.flags = record.flags;
+		this->ownedEntries.push_back(entry);
+
+		offset = payload + StreamAlign(record.size);
+	}
+
+	this->entries = this->ownedEntries.data();
+	this->keyframes = this->ownedKeyframes.data();
+	this->frameCount = this->ownedEntries.size();
+	this->keyframeCount = this->ownedKeyframes.size();
+	this->complete = false;
+}
+
+#ifdef _WIN32
+void StreamReader::map(const std::string& path)
+{
+	this->fileHandle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (this->fileHandle == INVALID_HANDLE_VALUE)
+		throw Exception("Failed to open recording " + path);
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(this->fileHandle, &fileSize))
+	{
+		this->unmap();
+		throw Exception("Failed to open recording " + path);
+	}
+	this->size = (uint64_t)fileSize.QuadPart;
+	if (this->size == 0)
+		return;
+
+	this->mappingHandle = CreateFileMappingA(this->fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (this->mappingHandle)
+		this->data = (const uint8_t*)MapViewOfFile(this->mappingHandle, FILE_MAP_READ, 0, 0, 0);
+	if (!this->data)
+	{
+		this->unmap();
+		throw Exception("Failed to map recording " + path);
+	}
+}
+
+void StreamReader::unmap()
+{
+	if (this->data)
+		UnmapViewOfFile(this->data);
+	if (this->mappingHandle)
+		CloseHandle(this->mappingHandle);
+	if (this->fileHandle != INVALID_HANDLE_VALUE)
+		CloseHandle(this->fileHandle);
+	this->data = nullptr;
+	this->mappingHandle = NULL;
+	this->fileHandle = INVALID_HANDLE_VALUE;
+}
+
+#else
+void StreamReader::map(const std::string& path)
+{
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		throw Exception("Failed to open recording " + path);
+
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	{
+		close(fd);
+		throw Exception("Failed to open recording " + path);
+	}
+	this->size = (uint64_t)st.st_size;
+
+	// The mapping keeps the file alive, the descriptor isn't needed anymore
+	void* mapped = this->size > 0 ? mmap(nullptr, this->size, PROT_READ, MAP_SHARED, fd, 0) : nullptr;
+	close(fd);
+	if (mapped == MAP_FAILED)
+		throw Exception("Failed to map recording " + path);
+	this->data = (const uint8_t*)mapped;
+
+	// Frames are mostly read front to back while playing
+	if (this->data)
+		madvise((void*)this->data, this->size, MADV_SEQUENTIAL);
+}
+
+void StreamReader::unmap()
+{
+	if (this->data)
+		munmap((void*)this->data, this->size);
+	this->data = nullptr;
+}
+#endif
@@ -0,0 +1,182 @@
+/* Copyright (c) 2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef NVPIPE_STREAM_FILE_H
+#define NVPIPE_STREAM_FILE_H
+
+#include "NvPipe.h"
+#include "NvPipeException.h"
+#include "NvPipeNalParser.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <winsock2.h>
+#include <windows.h>
+#endif
+
+/**
+ * Layout of recording containers written by StreamWriter. All fields are little-endian, records start at 8 byte boundaries.
+ * [StreamFileHeader] then [StreamRecordHeader][payload, padded to 8 bytes] for every frame,
+ * then one index record holding a StreamIndexEntry per frame and the frame index of every keyframe, then [StreamFileFooter].
+ */
+static const uint32_t kStreamFileMagic = 0x5350564e;	// "NVPS"
+static const uint32_t kStreamFooterMagic = 0x4950564e;	// "NVPI"
+static const uint32_t kStreamFileVersion = 1;
+static const uint32_t kStreamRecordFrame = 0x4d415246;	// "FRAM"
+static const uint32_t kStreamRecordIndex = 0x58444e49;	// "INDX"
+static const uint32_t kStreamFrameKeyframe = 1;
+
+struct StreamFileHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t codec;
+	uint32_t width;
+	uint32_t height;
+	uint32_t reserved[3];
+};
+
+struct StreamRecordHeader
+{
+	uint32_t type;
+	uint32_t flags;
+	uint64_t size;		// Payload size without padding
+	int64_t timestamp;
+};
+
+struct StreamIndexEntry
+{
+	uint64_t offset;	// Of the payload
+	uint64_t size;
+	int64_t timestamp;
+	uint32_t flags;
+	uint32_t reserved;
+};
+
+struct StreamFileFooter
+{
+	uint64_t indexOffset;	// Of the index record header
+	uint64_t frameCount;
+	uint64_t keyframeCount;
+	uint32_t reserved;
+	uint32_t magic;
+};
+
+static inline uint64_t StreamAlign(uint64_t size)
+{
+	return (size + 7) & ~(uint64_t)7;
+}
+
+/**
+ * @brief Appends encoded frames to a recording container, the index is written when the writer is finished.
+ */
+class StreamWriter
+{
+public:
+	StreamWriter(const std::string& path, NvPipe_Codec codec, uint32_t width, uint32_t height);
+	~StreamWriter();
+
+	/**
+	 * Appends an Annex-B frame. Keyframes are detected from the NAL unit types.
+	 */
+	void append(const uint8_t* data, uint64_t size, int64_t timestamp);
+
+	/**
+	 * Writes the index and footer. Frames can't be appended afterwards.
+	 */
+	void finish();
+
+private:
+	void write(const void* data, uint64_t size);
+	void pad();
+
+	NalParser parser;
+	FILE* file = nullptr;
+	uint64_t offset = 0;
+	bool finished = false;
+
+	std::vector<NvPipe_NalUnit> units;
+	std::vector<StreamIndexEntry> entries;
+	std::vector<uint64_t> keyframes;
+};
+
+/**
+ * @brief Memory maps a recording container. Frames point into the mapping, so they can be decoded without copies.
+ * The index of a finished file is used in place, the index of an unfinished one is rebuilt by walking the record headers.
+ */
+class StreamReader
+{
+public:
+	StreamReader(const std::string& path);
+	~StreamReader();
+	void getInfo(NvPipe_StreamInfo* info) const;
+	void getFrame(uint64_t index, NvPipe_StreamFrame* frame) const;
+
+	/**
+	 * Returns the last keyframe at or before the frame, decoding has to start there to show it.
+	 */
+	bool findKeyframe(uint64_t index, uint64_t* keyframe) const;
+
+	/**
+	 * Returns the last frame with a timestamp at or before the given one.
+	 */
+	bool findFrame(int64_t timestamp, uint64_t* index) const;
+
+private:
+	bool loadIndex();
+	void rebuildIndex();
+
+	void map(const std::string& path);
+	void unmap();
+
+#ifdef _WIN32
+	HANDLE fileHandle = INVALID_HANDLE_VALUE;
+	HANDLE mappingHandle = NULL;
+#endif
+
+	const uint8_t* data = nullptr;
+	uint64_t size = 0;
+	StreamFileHeader header;
+	bool complete = false;
+
+	const StreamIndexEntry* entries = nullptr;
+	const uint64_t* keyframes = nullptr;
+	uint64_t frameCount = 0;
+	uint64_t keyframeCount = 0;
+
+	std::vector<StreamIndexEntry> ownedEntries;	// Index of an unfinished file
+	std::vector<uint64_t> ownedKeyframes;
+};
+
+#endif
@@ -0,0 +1,815 @@
+/* Copyright (c) 2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "NvPipeStreamServer.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+static void CloseSocket(SocketHandle socket)
+{
+#ifdef _WIN32
+	closesocket(socket);
+#else
+	close(socket);
+#endif
+}
+
+static bool SetNonBlocking(SocketHandle socket)
+{
+#ifdef _WIN32
+	u_long enabled = 1;
+	return ioctlsocket(socket, FIONBIO, &enabled) == 0;
+#else
+	int flags = fcntl(socket, F_GETFL, 0);
+	return flags >= 0 && fcntl(socket, F_SETFL, flags | O_NONBLOCK) == 0;
+#endif
+}
+
+static bool SocketWouldBlock()
+{
+#ifdef _WIN32
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+	return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+static int PollSockets(pollfd* fds, size_t count, int timeoutMs)
+{
+#ifdef _WIN32
+	return WSAPoll(fds, (ULONG)count, timeoutMs);
+#else
+	return poll(fds, (nfds_t)count, timeoutMs);
+#endif
+}
+
+/**
+ * Sends several buffers with one system call. Returns the bytes sent, 0 if the socket is full, -1 on error.
+ */
+static int64_t SendBuffers(SocketHandle socket, const uint8_t* const* data, const uint64_t* sizes, uint32_t count)
+{
+#ifdef _WIN32
+	WSABUF buffers[64];
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		buffers[i].buf = (char*)data[i];
+		buffers[i].len = (ULONG)sizes[i];
+	}
+	DWORD sent = 0;
+	if (WSASend(socket, buffers, count, &sent, 0, nullptr, nullptr) != 0)
+		return SocketWouldBlock() ? 0 : -1;
+	return sent;
+#else
+	iovec buffers[64];
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		buffers[i].iov_base = (void*)data[i];
+		buffers[i].iov_len = sizes[i];
+	}
+	msghdr message = {};
+	message.msg_iov = buffers;
+	message.msg_iovlen = count;
+#ifdef MSG_NOSIGNAL
+	ssize_t sent = sendmsg(socket, &message, MSG_NOSIGNAL);
+#else
+	ssize_t sent = sendmsg(socket, &message, 0);
+#endif
+	if (sent < 0)
+		return SocketWouldBlock() ? 0 : -1;
+	return sent;
+#endif
+}
+
+/**
+ * Sec-WebSocket-Accept for a handshake key (RFC 6455 4.2.2): base64 of the SHA-1 of the key and a fixed GUID.
+ */
+static std::string WebSocketAccept(const std::string& key)
+{
+	std::string message = key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+	uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+
+	const uint64_t bits = (uint64_t)message.size() * 8;
+	message.push_back((char)0x80);
+	while (message.size() % 64 != 56)
+		message.push_back(0);
+	for (int i = 7; i >= 0; --i)
+		message.push_back((char)(bits >> (i * 8)));
+
+	auto rotate = [](uint32_t x, int n) { return (x << n) | (x >> (32 - n)); };
+	for (size_t chunk = 0; chunk < message.size(); chunk += 64)
+	{
+		uint32_t w[80];
+		for (int i = 0; i < 16; ++i)
+			w[i] = ((uint32_t)(uint8_t)message[chunk + 4 * i] << 24) | ((uint32_t)(uint8_t)message[chunk + 4 * i + 1] << 16)
+				| ((uint32_t)(uint8_t)message[chunk + 4 * i + 2] << 8) | (uint32_t)(uint8_t)message[chunk + 4 * i + 3];
+		for (int i = 16; i < 80; ++i)
+			w[i] = rotate(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+		uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+		for (int i = 0; i < 80; ++i)
+		{
+			uint32_t f, k;
+			if (i < 20) { f = (b & c) | (~b & d); k = 0x5A827999; }
+			else if (i < 40) { f = b ^ c ^ d; k = 0x6ED9EBA1; }
+			else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+			else { f = b ^ c ^ d; k = 0xCA62C1D6; }
+			uint32_t t = rotate(a, 5) + f + e + k + w[i];
+			e = d; d = c; c = rotate(b, 30); b = a; a = t;
+		}
+		h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+	}
+
+	uint8_t digest[20];
+	for (int i = 0; i < 20; ++i)
+		digest[i] = (uint8_t)(h[i / 4] >> (24 - 8 * (i % 4)));
+
+	static const char* alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	std::string encoded;
+	for (int i = 0; i < 20; i += 3)
+	{
+		uint32_t v = (uint32_t)digest[i] << 16 | (i + 1 < 20 ? (uint32_t)digest[i + 1] << 8 : 0) | (i + 2 < 20 ? digest[i + 2] : 0);
+		encoded.push_back(alphabet[(v >> 18) & 63]);
+		encoded.push_back(alphabet[(v >> 12) & 63]);
+		encoded.push_back(i + 1 < 20 ? alphabet[(v >> 6) & 63] : '=');
+		encoded.push_back(i + 2 < 20 ? alphabet[v & 63] : '=');
+	}
+	return encoded;
+}
+
+const uint64_t StreamServer::kDefaultClientBuffer;
+const uint32_t StreamServer::kMaxClients;
+const uint32_t StreamServer::kMaxGopFrames;
+const int64_t StreamServer::kMinKeyframeIntervalUs;
+const int64_t StreamServer::kKeyframeTimeoutUs;
+const uint32_t StreamServer::kBatch;
+const uint32_t StreamServer::kMessageKeyframe;
+
+StreamServer::StreamServer(NvPipe_Codec codec, const char* address, uint32_t port, uint64_t clientBufferSize) :
+	codec(codec), clientBufferSize(clientBufferSize ? clientBufferSize : kDefaultClientBuffer), parser(codec)
+{
+	if (port > 65535)
+		throw Exception("Invalid port");
+
+#ifdef _WIN32
+	WSADATA wsaData;
+	if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
+		throw Exception("Failed to initialize Winsock");
+#endif
+
+	sockaddr_in bindAddress = {};
+	bindAddress.sin_family = AF_INET;
+	bindAddress.sin_port = htons((uint16_t)port);
+	bindAddress.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (address && *address && inet_pton(AF_INET, address, &bindAddress.sin_addr) != 1)
+	{
+		this->cleanup();
+		throw Exception("Invalid server address " + std::string(address));
+	}
+
+	this->listenSocket = socket(AF_INET, SOCK_STREAM, 0);
+	int reuse = 1;
+	if (this->listenSocket == kInvalidSocket
+		|| setsockopt(this->listenSocket, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse)) != 0
+		|| bind(this->listenSocket, (sockaddr*)&bindAddress, sizeof(bindAddress)) != 0
+		|| listen(this->listenSocket, 64) != 0
+		|| !SetNonBlocking(this->listenSocket))
+	{
+		this->cleanup();
+		throw Exception("Failed to listen on port " + std::to_string(port));
+	}
+
+	// The encode path wakes the server thread with a datagram to this loopback socket
+	sockaddr_in wakeAddress = {};
+	wakeAddress.sin_family = AF_INET;
+	wakeAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t addressSize = sizeof(wakeAddress);
+	this->wakeSocket = socket(AF_INET, SOCK_DGRAM, 0);
+	if (this->wakeSocket == kInvalidSocket
+		|| bind(this->wakeSocket, (sockaddr*)&wakeAddress, sizeof(wakeAddress)) != 0
+		|| getsockname(this->wakeSocket, (sockaddr*)&wakeAddress, &addressSize) != 0
+		|| connect(this->wakeSocket, (sockaddr*)&wakeAddress, sizeof(wakeAddress)) != 0
+		|| !SetNonBlocking(this->wakeSocket))
+	{
+		this->cleanup();
+		throw Exception("Failed to create server wakeup socket");
+	}
+
+	addressSize = sizeof(bindAddress);
+	getsockname(this->listenSocket, (sockaddr*)&bindAddress, &addressSize);
+	this->stats.port = ntohs(bindAddress.sin_port);
+
+	this->thread = std::thread(&StreamServer::run, this);
+}
+
+StreamServer::~StreamServer()
+{
+	this->stopping = true;
+	this->wake();
+	this->thread.join();
+
+	for (auto& client : this->clients)
+		CloseSocket(client->socket);
+	this->cleanup();
+}
+
+void StreamServer::send(const uint8_t* const* parts, const uint64_t* sizes, uint32_t count, int64_t timestamp)
+{
+	std::lock_guard<std::mutex> producerLock(this->producerMutex);
+
+	// Parameter sets are remembered, so a keyframe without them can still start a late joiner's decoder
+	bool keyframe = false;
+	bool hasParameterSets = false;
+	std::vector<uint8_t> parameterSets;
+	uint64_t size = 0;
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		uint32_t n = this->parser.parse(parts[i], sizes[i], nullptr, 0);
+		this->units.resize(n);
+		this->parser.parse(parts[i], sizes[i], this->units.data(), n);
+		for (const NvPipe_NalUnit& unit : this->units)
+		{
+			keyframe |= unit.isKeyframe != 0;
+			const bool parameterSet = this->codec == NVPIPE_HEVC ? (unit.type >= 32 && unit.type <= 34) : (unit.type == 7 || unit.type == 8);
+			if (parameterSet)
+			{
+				hasParameterSets = true;
+				parameterSets.insert(parameterSets.end(), parts[i] + unit.offset, parts[i] + unit.offset + unit.size);
+			}
+		}
+		size += sizes[i];
+	}
+	if (size == 0)
+		return;
+	if (hasParameterSets)
+		this->parameterSets = std::move(parameterSets);
+
+	std::shared_ptr<Packet> packet = std::make_shared<Packet>();
+	packet->keyframe = keyframe;
+	packet->timestamp = timestamp;
+	packet->data.reserve(size + ((keyframe && !hasParameterSets) ? this->parameterSets.size() : 0));
+	if (keyframe && !hasParameterSets)
+		packet->data.insert(packet->data.end(), this->parameterSets.begin(), this->parameterSets.end());
+	for (uint32_t i = 0; i < count; ++i)
+		packet->data.insert(packet->data.end(), parts[i], parts[i] + sizes[i]);
+
+	std::shared_ptr<const Packet> shared = packet;
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	// The cached GOP lets late joiners start without a keyframe of their own, as long as it isn't too long to send
+	if (keyframe)
+	{
+		this->gop.clear();
+		this->gopBytes = 0;
+		this->gopValid = true;
+		this->keyframeWanted = false;
+		this->keyframeInFlight = false;
+	}
+	if (this->gopValid)
+	{
+		if (this->gop.size() >= kMaxGopFrames || this->gopBytes + shared->data.size() > this->clientBufferSize / 2)
+		{
+			this->gop.clear();
+			this->gopValid = false;
+		}
+		else
+		{
+			this->gop.push_back(shared);
+			this->gopBytes += shared->data.size();
+		}
+	}
+
+	bool queued = false;
+	for (auto& client : this->clients)
+	{
+		if (!client->live || client->overflow)
+			continue;
+		if (client->waitingForKeyframe)
+		{
+			if (!keyframe)
+				continue;
+			client->waitingForKeyframe = false;
+		}
+		if (client->queuedBytes + shared->data.size() > this->clientBufferSize)
+		{
+			client->overflow = true;	// The server thread drops its queue and resyncs it
+			this->stats.droppedFrames++;
+			queued = true;
+			continue;
+		}
+		client->queue.push_back(shared);
+		client->queuedBytes += shared->data.size();
+		queued = true;
+	}
+
+	if (queued && this->sleeping)
+		this->wake();
+}
+
+bool StreamServer::takeKeyframeRequest()
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	const int64_t now = NowUs();
+	if (!this->keyframeWanted || now - this->lastForcedUs < kMinKeyframeIntervalUs)
+		return false;
+	if (this->keyframeInFlight && now - this->lastForcedUs < kKeyframeTimeoutUs)
+		return false;
+
+	this->keyframeInFlight = true;
+	this->lastForcedUs = now;
+	this->stats.forcedKeyframes++;
+	return true;
+}
+
+void StreamServer::getStats(NvPipe_StreamServerStats* stats)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	*stats = this->stats;
+	stats->clients = 0;
+	for (auto& client : this->clients)
+		stats->clients += client->live ? 1 : 0;
+}
+
+int64_t StreamServer::NowUs()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void StreamServer::cleanup()
+{
+	if (this->listenSocket != kInvalidSocket)
+		CloseSocket(this->listenSocket);
+	if (this->wakeSocket != kInvalidSocket)
+		CloseSocket(this->wakeSocket);
+#ifdef _WIN32
+	WSACleanup();
+#endif
+}
+
+void StreamServer::wake()
+{
+	char byte = 0;
+	::send(this->wakeSocket, &byte, 1, 0);
+}
+
+uint32_t StreamServer::messageHeader(const Client& client, const Packet& packet, uint8_t* header) const
+{
+	uint8_t* p = header;
+	const uint64_t size = packet.data.size();
+	if (client.websocket)
+	{
+		const uint64_t payload = 16 + size;
+		*p++ = 0x82;	// FIN, binary
+		if (payload < 126)
+		{
+			*p++ = (uint8_t)payload;
+		}
+		else if (payload < 65536)
+		{
+			*p++ = 126;
+			*p++ = (uint8_t)(payload >> 8);
+			*p++ = (uint8_t)payload;
+		}
+		else
+		{
+			*p++ = 127;
+			for (int i = 7; i >= 0; --i)
+				*p++ = (uint8_t)(payload >> (i * 8));
+		}
+	}
+
+	const uint32_t fields[2] = { (uint32_t)size, packet.keyframe ? kMessageKeyframe : 0 };
+	for (uint32_t field : fields)
+		for (int i = 0; i < 4; ++i)
+			*p++ = (uint8_t)(field >> (i * 8));
+	for (int i = 0; i < 8; ++i)
+		*p++ = (uint8_t)((uint64_t)packet.timestamp >> (i * 8));
+	return (uint32_t)(p - header);
+}
+
+void StreamServer::run()
+{
+	std::vector<pollfd> fds;
+	std::vector<Client*> polled;
+
+	while (!this->stopping)
+	{
+		fds.clear();
+		polled.clear();
+		fds.push_back(pollfd{ this->listenSocket, POLLIN, 0 });
+		fds.push_back(pollfd{ this->wakeSocket, POLLIN, 0 });
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			for (auto& client : this->clients)
+			{
+				short events = POLLIN;
+				if (!client->control.empty() || !client->queue.empty())
+					events |= POLLOUT;
+				fds.push_back(pollfd{ client->socket, events, 0 });
+				polled.push_back(client.get());
+			}
+			this->sleeping = true;	// Set under the lock, so a frame queued after the poll set was built wakes the poll
+		}
+
+		PollSockets(fds.data(), fds.size(), 1000);
+		this->sleeping = false;
+
+		if (fds[1].revents & POLLIN)
+		{
+			char buffer[64];
+			while (recv(this->wakeSocket, buffer, sizeof(buffer), 0) > 0)
+				;
+		}
+		if (fds[0].revents & POLLIN)
+			this->accept();
+
+		for (size_t i = 0; i < polled.size(); ++i)
+		{
+			Client* client = polled[i];
+			const short revents = fds[i + 2].revents;
+			if (revents & POLLIN)
+				this->read(*client);
+			if ((revents & (POLLERR | POLLNVAL)) || ((revents & POLLHUP) && !(revents & POLLIN)))
+				client->closed = true;
+			if (!client->closed)
+				this->write(*client);
+		}
+
+		this->resyncAndRemove();
+	}
+}
+
+void StreamServer::accept()
+{
+	while (true)
+	{
+		SocketHandle socket = ::accept(this->listenSocket, nullptr, nullptr);
+		if (socket == kInvalidSocket)
+			return;
+
+		std::lock_guard<std::mutex> lock(this->mutex);
+		int noDelay = 1;
+		if (this->clients.size() >= kMaxClients || !SetNonBlocking(socket)
+			|| setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay)) != 0)
+		{
+			CloseSocket(socket);
+			continue;
+		}
+
+		std::unique_ptr<Client> client(new Client());
+		client->socket = socket;
+		this->clients.push_back(std::move(client));
+	}
+}
+
+void StreamServer::read(Client& client)
+{
+	uint8_t buffer[4096];
+	while (true)
+	{
+		const int received = (int)recv(client.socket, (char*)buffer, sizeof(buffer), 0);
+		if (received == 0 || (received < 0 && !SocketWouldBlock()))
+		{
+			client.closed = true;
+			return;
+		}
+		if (received < 0)
+			break;
+		client.input.insert(client.input.end(), buffer, buffer + received);
+		if (client.input.size() > 65536)
+		{
+			client.closed = true;	// Nothing legitimate sends this much
+			return;
+		}
+	}
+
+	if (!client.live)
+		this->handshake(client);
+	if (client.live)
+		this->parseRequests(client);
+}
+
+void StreamServer::handshake(Client& client)
+{
+	const std::vector<uint8_t>& input = client.input;
+	if (input.size() >= 4 && memcmp(input.data(), "NVPR", 4) == 0)
+	{
+		client.input.erase(client.input.begin(), client.input.begin() + 4);
+		this->join(client);
+		return;
+	}
+	if (input.size() >= 4 && memcmp(input.data(), "GET ", 4) != 0)
+	{
+		client.closed = true;
+		return;
+	}
+
+	std::string request(input.begin(), input.end());
+	const size_t end = request.find("\r\n\r\n");
+	if (end == std::string::npos)
+		return;
+
+	// A WebSocket upgrade needs these fields (RFC 6455 4.2.1), a version we don't speak is answered with ours (4.4)
+	const std::string head = request.substr(0, end);
+	std::string lower = head;
+	std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+	const std::string key = HeaderField(head, lower, "sec-websocket-key");
+	const std::string upgrade = HeaderField(lower, lower, "upgrade");
+	const std::string version = HeaderField(head, lower, "sec-websocket-version");
+
+	std::string response;
+	if (key.empty() || upgrade != "websocket")
+		response = "HTTP/1.1 400 Bad Request\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+	else if (version != "13")
+		response = "HTTP/1.1 426 Upgrade Required\r\nSec-WebSocket-Version: 13\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+	if (!response.empty())
+	{
+		client.control.assign(response.begin(), response.end());
+		client.closeAfterControl = true;
+		client.input.clear();
+		return;
+	}
+
+	response = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: "
+		+ WebSocketAccept(key) + "\r\n\r\n";
+	client.control.assign(response.begin(), response.end());
+	client.input.erase(client.input.begin(), client.input.begin() + end + 4);
+	client.websocket = true;
+	this->join(client);
+}
+
+std::string StreamServer::HeaderField(const std::string& request, const std::string& lower, const std::string& name)
+{
+	const size_t field = lower.find("\r\n" + name + ":");
+	if (field == std::string::npos)
+		return std::string();
+
+	const size_t begin = field + name.size() + 3;
+	const size_t lineEnd = request.find("\r\n", begin);
+	std::string value = request.substr(begin, lineEnd == std::string::npos ? std::string::npos : lineEnd - begin);
+	value.erase(0, value.find_first_not_of(" \t"));
+	value.erase(value.find_last_not_of(" \t") + 1);
+	return value;
+}
+
+void StreamServer::join(Client& client)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	client.live = true;
+	this->resync(client, nullptr);
+}
+
+void StreamServer::resync(Client& client, const Packet* after)
+{
+	if (this->gopValid && this->gopBytes <= this->clientBufferSize)
+	{
+		auto begin = std::find_if(this->gop.begin(), this->gop.end(), [after](const std::shared_ptr<const Packet>& p) { return p.get() == after; });
+		begin = (begin == this->gop.end()) ? this->gop.begin() : begin + 1;
+		for (auto it = begin; it != this->gop.end(); ++it)
+		{
+			client.queue.push_back(*it);
+			client.queuedBytes += (*it)->data.size();
+		}
+		this->stats.cachedJoins++;
+	}
+	else
+	{
+		client.waitingForKeyframe = true;
+		this->requestKeyframe();
+	}
+}
+
+void StreamServer::requestKeyframe()
+{
+	this->keyframeWanted = true;
+	this->stats.keyframeRequests++;
+}
+
+void StreamServer::parseRequests(Client& client)
+{
+	std::vector<uint8_t>& input = client.input;
+	if (!client.websocket)
+	{
+		if (std::find(input.begin(), input.end(), 'K') != input.end())
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			this->requestKeyframe();
+		}
+		input.clear();
+		return;
+	}
+
+	// Client frames are always masked (RFC 6455 5.3)
+	size_t offset = 0;
+	while (input.size() - offset >= 2)
+	{
+		const uint8_t* p = input.data() + offset;
+		const uint8_t opcode = p[0] & 0x0F;
+		uint64_t length = p[1] & 0x7F;
+		size_t headerSize = 2;
+		if (length == 126)
+		{
+			if (input.size() - offset < 4)
+				break;
+			length = ((uint64_t)p[2] << 8) | p[3];
+			headerSize = 4;
+		}
+		else if (length == 127)
+		{
+			if (input.size() - offset < 10)
+				break;
+			length = 0;
+			for (int i = 0; i < 8; ++i)
+				length = (length << 8) | p[2 + i];
+			headerSize = 10;
+		}
+		if (!(p[1] & 0x80) || length > 65536)
+		{
+			client.closed = true;
+			return;
+		}
+		if (input.size() - offset < headerSize + 4 + length)
+			break;
+
+		const uint8_t* mask = p + headerSize;
+		std::vector<uint8_t> payload(p + headerSize + 4, p + headerSize + 4 + length);
+		for (size_t i = 0; i < payload.size(); ++i)
+			payload[i] ^= mask[i % 4];
+		offset += headerSize + 4 + length;
+
+		if (opcode == 0x8)
+		{
+			const uint8_t closeFrame[2] = { 0x88, 0x00 };
+			client.control.insert(client.control.end(), closeFrame, closeFrame + 2);
+			client.closeAfterControl = true;
+			break;
+		}
+		if (opcode == 0x9 && payload.size() <= 125)
+		{
+			client.control.push_back(0x8A);	// Pong with the ping's payload
+			client.control.push_back((uint8_t)payload.size());
+			client.control.insert(client.control.end(), payload.begin(), payload.end());
+		}
+		else if ((opcode == 0x1 || opcode == 0x2) && !payload.empty() && payload[0] == 'K')
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			this->requestKeyframe();
+		}
+	}
+	input.erase(input.begin(), input.begin() + offset);
+}
+
+void StreamServer::write(Client& client)
+{
+	while (!client.closed)
+	{
+		// Control frames go out between messages
+		if (client.sentOfHead == 0 && !client.control.empty())
+		{
+			const uint8_t* data = client.control.data() + client.controlSent;
+			const uint64_t size = client.control.size() - client.controlSent;
+			const int64_t sent = SendBuffers(client.socket, &data, &size, 1);
+			if (sent < 0)
+			{
+				client.closed = true;
+				return;
+			}
+			client.controlSent += sent;
+			if (client.controlSent < client.control.size())
+				return;
+			client.control.clear();
+			client.controlSent = 0;
+			if (client.closeAfterControl)
+				client.closed = true;
+			continue;
+		}
+
+		// Hold references to the first messages, so they can be sent without the lock
+		std::shared_ptr<const Packet> batch[kBatch];
+		uint32_t count = 0;
+		{
+			std::lock_guard<std::mutex> lock(this->mutex);
+			while (count < kBatch && count < client.queue.size())
+			{
+				batch[count] = client.queue[count];
+				count++;
+			}
+		}
+		if (count == 0)
+			return;
+
+		uint8_t headers[kBatch][32];
+		const uint8_t* data[2 * kBatch];
+		uint64_t sizes[2 * kBatch];
+		uint32_t buffers = 0;
+		uint64_t requested = 0;
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			const uint32_t headerSize = this->messageHeader(client, *batch[i], headers[i]);
+			const uint64_t skip = (i == 0) ? client.sentOfHead : 0;
+			if (skip < headerSize)
+			{
+				data[buffers] = headers[i] + skip;
+				sizes[buffers++] = headerSize - skip;
+			}
+			const uint64_t payloadSkip = skip > headerSize ? skip - headerSize : 0;
+			data[buffers] = batch[i]->data.data() + payloadSkip;
+			sizes[buffers++] = batch[i]->data.size() - payloadSkip;
+			requested += headerSize + batch[i]->data.size() - skip;
+		}
+
+		int64_t sent = SendBuffers(client.socket, data, sizes, buffers);
+		if (sent < 0)
+		{
+			client.closed = true;
+			return;
+		}
+
+		// Pop what went out completely, remember how far the next one got
+		uint64_t remaining = (uint64_t)sent + client.sentOfHead;
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->stats.sentBytes += sent;
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			uint8_t header[32];
+			const uint64_t messageSize = this->messageHeader(client, *batch[i], header) + batch[i]->data.size();
+			if (remaining < messageSize)
+				break;
+			remaining -= messageSize;
+			client.lastSent = client.queue.front();
+			client.queue.pop_front();
+			client.queuedBytes -= batch[i]->data.size();
+			this->stats.sentFrames++;
+		}
+		client.sentOfHead = remaining;
+
+		if ((uint64_t)sent < requested)
+			return;	// Socket buffer full, continue when it is writable
+	}
+}
+
+void StreamServer::resyncAndRemove()
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	for (auto& client : this->clients)
+	{
+		if (!client->overflow || client->closed)
+			continue;
+
+		const size_t keep = client->sentOfHead > 0 ? 1 : 0;
+		const std::shared_ptr<const Packet> last = keep ? client->queue.front() : client->lastSent;
+		while (client->queue.size() > keep)
+		{
+			client->queuedBytes -= client->queue.back()->data.size();
+			client->queue.pop_back();
+			this->stats.droppedFrames++;
+		}
+		client->overflow = false;
+		this->resync(*client, last.get());
+	}
+
+	auto end = std::remove_if(this->clients.begin(), this->clients.end(), [](const std::unique_ptr<Client>& client)
+	{
+		if (client->closed)
+			CloseSocket(client->socket);
+		return client->closed;
+	});
+	this->clients.erase(end, this->clients.end());
+}
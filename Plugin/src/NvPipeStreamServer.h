@@ -0,0 +1,196 @@
+/* Copyright (c) 2018, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef NVPIPE_STREAM_SERVER_H
+#define NVPIPE_STREAM_SERVER_H
+
+#include "NvPipe.h"
+#include "NvPipeException.h"
+#include "NvPipeNalParser.h"
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+
+typedef SOCKET SocketHandle;
+static const SocketHandle kInvalidSocket = INVALID_SOCKET;
+#else
+typedef int SocketHandle;
+static const SocketHandle kInvalidSocket = -1;
+#endif
+
+/**
+ * @brief Serves one encoded stream to many TCP and WebSocket clients from a background thread.
+ * A frame is copied once into a reference-counted packet that every client queue shares; each client sends from it with
+ * vectored writes, behind a small header of its own framing. The encode path never touches a socket.
+ * Late joiners get the cached GOP (the last keyframe with its parameter sets, and the frames since), so they don't need a
+ * new keyframe while it is short. Otherwise, and for clients that fell behind by more than their buffer, a keyframe is
+ * requested; all requests until the next keyframe are coalesced into one.
+ */
+class StreamServer
+{
+public:
+	static const uint64_t kDefaultClientBuffer = 8 * 1024 * 1024;
+	static const uint32_t kMaxClients = 256;
+	static const uint32_t kMaxGopFrames = 300;
+	static const int64_t kMinKeyframeIntervalUs = 250000;
+	static const int64_t kKeyframeTimeoutUs = 1000000;	// A request the encoder didn't answer is repeated
+	static const uint32_t kBatch = 16;	// Messages per send, two buffers each
+	static const uint32_t kMessageKeyframe = 1;
+
+	StreamServer(NvPipe_Codec codec, const char* address, uint32_t port, uint64_t clientBufferSize);
+	~StreamServer();
+
+	/**
+	 * Queues one encoded frame, given in parts, for every client. Copies it once, never blocks on the network.
+	 */
+	void send(const uint8_t* const* parts, const uint64_t* sizes, uint32_t count, int64_t timestamp);
+
+	/**
+	 * True if the encoder should make its next frame a keyframe. Requests are coalesced: once taken, none is returned
+	 * again until a keyframe was sent, and not more often than every kMinKeyframeIntervalUs.
+	 */
+	bool takeKeyframeRequest();
+
+	void getStats(NvPipe_StreamServerStats* stats);
+
+private:
+	struct Packet
+	{
+		std::vector<uint8_t> data;	// Annex-B
+		int64_t timestamp = 0;
+		bool keyframe = false;
+	};
+
+	struct Client
+	{
+		SocketHandle socket = kInvalidSocket;
+		bool websocket = false;
+		bool live = false;	// Handshake done, receives frames
+		bool closed = false;
+		bool closeAfterControl = false;
+		bool waitingForKeyframe = false;
+		bool overflow = false;
+
+		std::deque<std::shared_ptr<const Packet>> queue;	// Shared with the other clients
+		uint64_t queuedBytes = 0;
+		uint64_t sentOfHead = 0;	// Bytes of the first queued message already sent, header included
+		std::shared_ptr<const Packet> lastSent;	// A resync continues after it
+
+		std::vector<uint8_t> input;
+		std::vector<uint8_t> control;	// Handshake response or WebSocket control frames, sent between messages
+		uint64_t controlSent = 0;
+	};
+
+	static int64_t NowUs();
+	void cleanup();
+	void wake();
+
+	/**
+	 * Message framing in front of each frame: [size u32, flags u32, timestamp i64] (little-endian), inside a binary
+	 * WebSocket frame for WebSocket clients. Returns the header size.
+	 */
+	uint32_t messageHeader(const Client& client, const Packet& packet, uint8_t* header) const;
+
+	void run();
+	void accept();
+	void read(Client& client);
+
+	/**
+	 * Raw clients open with "NVPR", WebSocket clients with an HTTP upgrade request. Both then get the stream.
+	 */
+	void handshake(Client& client);
+
+	/**
+	 * Value of a header field, trimmed, taken from request where the field name matched in its lowercase copy.
+	 */
+	static std::string HeaderField(const std::string& request, const std::string& lower, const std::string& name);
+
+	/**
+	 * Starts a client at the cached GOP if there is one, otherwise at the next keyframe, which is requested.
+	 */
+	void join(Client& client);
+
+	/**
+	 * Queues the cached GOP, or the part of it after the last message the client got, so frames are never repeated.
+	 */
+	void resync(Client& client, const Packet* after);
+
+	void requestKeyframe();
+
+	/**
+	 * Clients ask for a keyframe with a 'K' byte, as a raw byte or as the first byte of a WebSocket message.
+	 */
+	void parseRequests(Client& client);
+
+	void write(Client& client);
+
+	/**
+	 * Clients that fell behind lose their queue, except a message that is partly sent, and start over like a late joiner,
+	 * from the cached GOP past the last message they got (the partly sent one included).
+	 */
+	void resyncAndRemove();
+
+	NvPipe_Codec codec;
+	uint64_t clientBufferSize;
+
+	std::mutex producerMutex;	// Serializes send
+	NalParser parser;
+	std::vector<NvPipe_NalUnit> units;
+	std::vector<uint8_t> parameterSets;	// Latest SPS/PPS (and VPS), Annex-B
+
+	std::mutex mutex;	// Clients, their queues, the GOP cache and keyframe requests
+	std::vector<std::unique_ptr<Client>> clients;
+	std::vector<std::shared_ptr<const Packet>> gop;
+	uint64_t gopBytes = 0;
+	bool gopValid = false;
+	bool keyframeWanted = false;
+	bool keyframeInFlight = false;
+	int64_t lastForcedUs = INT64_MIN / 2;
+	NvPipe_StreamServerStats stats = {};
+
+	SocketHandle listenSocket = kInvalidSocket;
+	SocketHandle wakeSocket = kInvalidSocket;
+	std::atomic<bool> sleeping{ false };
+	std::atomic<bool> stopping{ false };
+	std::thread thread;
+};
+
+#endif
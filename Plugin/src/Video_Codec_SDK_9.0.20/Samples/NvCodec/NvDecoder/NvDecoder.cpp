@@ -234,8 +234,20 @@ int NvDecoder::HandleVideoSequence(CUVIDEOFORMAT *pVideoFormat)
     
     if (m_nWidth && m_nLumaHeight && m_nChromaHeight) {
 
-        // cuvidCreateDecoder() has been called before, and now there's possible config change
-        return ReconfigureDecoder(pVideoFormat);
+        // NvPipe: a stream larger than the decoder session supports gets a new session, the parser is kept
+        if (m_eCodec == pVideoFormat->codec && ((pVideoFormat->coded_width <= m_nMaxWidth && pVideoFormat->coded_height <= m_nMaxHeight) || m_eCodec == cudaVideoCodec_VP9)) {
+            // cuvidCreateDecoder() has been called before, and now there's possible config change
+            return ReconfigureDecoder(pVideoFormat);
+        }
+
+        CUDA_DRVAPI_CALL(cuCtxPushCurrent(m_cuContext));
+        if (m_pMutex) m_pMutex->lock();
+        cuvidDestroyDecoder(m_hDecoder);
+        if (m_pMutex) m_pMutex->unlock();
+        CUDA_DRVAPI_CALL(cuCtxPopCurrent(NULL));
+        m_hDecoder = NULL;
+        m_nWidth = m_nLumaHeight = m_nChromaHeight = 0;
+        ReleaseFrames();
     }
 
     // eCodec has been set in the constructor (for parser). Here it's set again for potential correction
@@ -291,8 +303,11 @@ int NvDecoder::HandleVideoSequence(CUVIDEOFORMAT *pVideoFormat)
             videoDecodeCreateInfo.display_area.top = m_cropRect.t;
             videoDecodeCreateInfo.display_area.right = m_cropRect.r;
             videoDecodeCreateInfo.display_area.bottom = m_cropRect.b;
-            m_nWidth = m_cropRect.r - m_cropRect.l;
-            m_nLumaHeight = m_cropRect.b - m_cropRect.t;
+            // NvPipe: crop and resize can be combined, the cropped area is scaled to the resize dimensions
+            if (!(m_resizeDim.w && m_resizeDim.h)) {
+                m_nWidth = m_cropRect.r - m_cropRect.l;
+                m_nLumaHeight = m_cropRect.b - m_cropRect.t;
+            }
         }
         videoDecodeCreateInfo.ulTargetWidth = m_nWidth;
         videoDecodeCreateInfo.ulTargetHeight = m_nLumaHeight;
@@ -359,6 +374,8 @@ int NvDecoder::ReconfigureDecoder(CUVIDEOFORMAT *pVideoFormat)
             m_nLumaHeight = pVideoFormat->display_area.bottom - pVideoFormat->display_area.top;
             m_nChromaHeight = int(m_nLumaHeight * GetChromaHeightFactor(pVideoFormat->chroma_format));
             m_nNumChromaPlanes = GetChromaPlaneCount(pVideoFormat->chroma_format);
+            m_videoFormat.display_area = pVideoFormat->display_area;
+            ReleaseFrames();
         }
 
         // no need for reconfigureDecoder(). Just return
@@ -378,9 +395,12 @@ int NvDecoder::ReconfigureDecoder(CUVIDEOFORMAT *pVideoFormat)
     reconfigParams.ulTargetWidth = m_nSurfaceWidth;
     reconfigParams.ulTargetHeight = m_nSurfaceHeight;
 
+    // NvPipe: without crop/resize the output follows the stream resolution instead of being scaled to the old size
+    bool bFollowStream = !(m_cropRect.r && m_cropRect.b) && !(m_resizeDim.w && m_resizeDim.h);
+
     // If external reconfigure is called along with resolution change even if post processing params is not changed,
     // do full reconfigure params update
-    if ((m_bReconfigExternal && bDecodeResChange) || m_bReconfigExtPPChange) {
+    if ((m_bReconfigExternal && bDecodeResChange) || m_bReconfigExtPPChange || bFollowStream) {
         // update display rect and target resolution if requested explicitely
         m_bReconfigExternal = false;
         m_bReconfigExtPPChange = false;
@@ -388,6 +408,8 @@ int NvDecoder::ReconfigureDecoder(CUVIDEOFORMAT *pVideoFormat)
         if (!(m_cropRect.r && m_cropRect.b) && !(m_resizeDim.w && m_resizeDim.h)) {
             m_nWidth = pVideoFormat->display_area.right - pVideoFormat->display_area.left;
             m_nLumaHeight = pVideoFormat->display_area.bottom - pVideoFormat->display_area.top;
+            reconfigParams.display_area.left = reconfigParams.display_area.top = 0;
+            reconfigParams.display_area.right = reconfigParams.display_area.bottom = 0;
             reconfigParams.ulTargetWidth = pVideoFormat->coded_width;
             reconfigParams.ulTargetHeight = pVideoFormat->coded_height;
         }
@@ -406,8 +428,11 @@ int NvDecoder::ReconfigureDecoder(CUVIDEOFORMAT *pVideoFormat)
                 reconfigParams.display_area.top = m_cropRect.t;
                 reconfigParams.display_area.right = m_cropRect.r;
                 reconfigParams.display_area.bottom = m_cropRect.b;
-                m_nWidth = m_cropRect.r - m_cropRect.l;
-                m_nLumaHeight = m_cropRect.b - m_cropRect.t;
+                // NvPipe: crop and resize can be combined, the cropped area is scaled to the resize dimensions
+                if (!(m_resizeDim.w && m_resizeDim.h)) {
+                    m_nWidth = m_cropRect.r - m_cropRect.l;
+                    m_nLumaHeight = m_cropRect.b - m_cropRect.t;
+                }
             }
             reconfigParams.ulTargetWidth = m_nWidth;
             reconfigParams.ulTargetHeight = m_nLumaHeight;
@@ -421,6 +446,9 @@ int NvDecoder::ReconfigureDecoder(CUVIDEOFORMAT *pVideoFormat)
         m_displayRect.t = reconfigParams.display_area.top;
         m_displayRect.l = reconfigParams.display_area.left;
         m_displayRect.r = reconfigParams.display_area.right;
+
+        // Output frames of the previous size can't be reused
+        ReleaseFrames();
     }
     
     reconfigParams.ulNumDecodeSurfaces = nDecodeSurface;
@@ -457,25 +485,37 @@ int NvDecoder::setReconfigParams(const Rect *pCropRect, const Dim *pResizeDim)
     }
 
     // Clear existing output buffers of different size
-    uint8_t *pFrame = NULL;
-    while (!m_vpFrame.empty())
+    ReleaseFrames();
+
+    return 1;
+}
+
+void NvDecoder::ReleaseFrames()
+{
+    std::lock_guard<std::mutex> lock(m_mtxVPFrame);
+    // NvPipe: frames already output by the current Decode() call are kept and freed by the next one
+    while (m_vpFrame.size() > (size_t)m_nDecodedFrame)
     {
-        pFrame = m_vpFrame.back();
+        FreeFrame(m_vpFrame.back());
         m_vpFrame.pop_back();
-        if (m_bUseDeviceFrame)
-        {
-            CUDA_DRVAPI_CALL(cuCtxPushCurrent(m_cuContext));
-            CUDA_DRVAPI_CALL(cuMemFree((CUdeviceptr)pFrame));
-            CUDA_DRVAPI_CALL(cuCtxPopCurrent(NULL));
-        }
-        else
-        {
-            delete pFrame;
-        }
     }
-    m_vpFrameRet.clear();
+    m_nFrameGeneration++;
+}
 
-    return 1;
+void NvDecoder::FreeFrame(uint8_t *pFrame)
+{
+    if (m_bUseDeviceFrame)
+    {
+        CUDA_DRVAPI_CALL(cuCtxPushCurrent(m_cuContext));
+        CUDA_DRVAPI_CALL(cuMemFree((CUdeviceptr)pFrame));
+        CUDA_DRVAPI_CALL(cuCtxPopCurrent(NULL));
+    }
+    else
+    {
+        delete[] pFrame;
+    }
+    m_mFrameGeneration.erase(pFrame);
+    m_nFrameAlloc--;
 }
 
 /* Return value from HandlePictureDecode() are interpreted as:
@@ -519,6 +559,21 @@ int NvDecoder::HandlePictureDisplay(CUVIDPARSERDISPINFO *pDispInfo) {
     uint8_t *pDecodedFrame = nullptr;
     {
         std::lock_guard<std::mutex> lock(m_mtxVPFrame);
+        if ((unsigned)(m_nDecodedFrame + 1) > m_vpFrame.size() && m_nMaxFrameAlloc > 0 && m_nFrameAlloc >= m_nMaxFrameAlloc)
+        {
+            m_nDroppedFrame++;
+            if (m_nDecodedFrame == 0)
+            {
+                // NvPipe: all frames of the bounded pool are locked by the application, drop this one
+                NVDEC_API_CALL(cuvidUnmapVideoFrame(m_hDecoder, dpSrcFrame));
+                return 1;
+            }
+
+            // NvPipe: drop the oldest frame decoded by this call and reuse it for this one
+            std::rotate(m_vpFrame.begin(), m_vpFrame.begin() + 1, m_vpFrame.begin() + m_nDecodedFrame);
+            std::rotate(m_vTimestamp.begin(), m_vTimestamp.begin() + 1, m_vTimestamp.begin() + m_nDecodedFrame);
+            m_nDecodedFrame--;
+        }
         if ((unsigned)++m_nDecodedFrame > m_vpFrame.size())
         {
             // Not enough frames in stock
@@ -542,6 +597,7 @@ int NvDecoder::HandlePictureDisplay(CUVIDPARSERDISPINFO *pDispInfo) {
                 pFrame = new uint8_t[GetFrameSize()];
             }
             m_vpFrame.push_back(pFrame);
+            m_mFrameGeneration[pFrame] = m_nFrameGeneration;
         }
         pDecodedFrame = m_vpFrame[m_nDecodedFrame - 1];
     }
@@ -654,6 +710,23 @@ bool NvDecoder::Decode(const uint8_t *pData, int nSize, uint8_t ***pppFrame, int
     }
 
     m_nDecodedFrame = 0;
+    {
+        // NvPipe: drop frames of an older size that were still in use during the last call
+        std::lock_guard<std::mutex> lock(m_mtxVPFrame);
+        for (auto it = m_vpFrame.begin(); it != m_vpFrame.end();)
+        {
+            auto gen = m_mFrameGeneration.find(*it);
+            if (gen != m_mFrameGeneration.end() && gen->second != m_nFrameGeneration)
+            {
+                FreeFrame(*it);
+                it = m_vpFrame.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
     CUVIDSOURCEDATAPACKET packet = {0};
     packet.payload = pData;
     packet.payload_size = nSize;
@@ -700,5 +773,15 @@ bool NvDecoder::DecodeLockFrame(const uint8_t *pData, int nSize, uint8_t ***pppF
 void NvDecoder::UnlockFrame(uint8_t **ppFrame, int nFrame)
 {
     std::lock_guard<std::mutex> lock(m_mtxVPFrame);
-    m_vpFrame.insert(m_vpFrame.end(), &ppFrame[0], &ppFrame[nFrame]);
+    for (int i = 0; i < nFrame; i++)
+    {
+        // NvPipe: frames locked across a size change are freed instead of returned to stock
+        auto it = m_mFrameGeneration.find(ppFrame[i]);
+        if (it != m_mFrameGeneration.end() && it->second != m_nFrameGeneration)
+        {
+            FreeFrame(ppFrame[i]);
+            continue;
+        }
+        m_vpFrame.push_back(ppFrame[i]);
+    }
 }
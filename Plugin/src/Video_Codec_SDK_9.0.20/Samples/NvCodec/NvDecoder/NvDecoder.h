@@ -15,6 +15,7 @@
 #include <stdint.h>
 #include <mutex>
 #include <vector>
+#include <unordered_map>
 #include <string>
 #include <iostream>
 #include <sstream>
@@ -196,6 +197,33 @@ public:
     */
     int setReconfigParams(const Rect * pCropRect, const Dim * pResizeDim);
 
+    /**
+    *   @brief  This function limits the number of output frames the decoder allocates (0 = unlimited).
+    *   Frames displayed while all allocated frames are locked are dropped and counted.
+    *   @param  nMaxFrameAlloc - maximum number of output frames
+    */
+    void SetMaxFrameAlloc(int nMaxFrameAlloc) { m_nMaxFrameAlloc = nMaxFrameAlloc; }
+
+    /**
+    *   @brief  This function is used to get the number of currently allocated output frames (locked or not).
+    */
+    int GetFrameAllocCount() { return m_nFrameAlloc; }
+
+    /**
+    *   @brief  This function is used to get the size in bytes of a single allocated output frame.
+    */
+    size_t GetFrameAllocSize() { return m_nWidth ? (size_t)GetDeviceFramePitch() * (m_nLumaHeight + m_nChromaHeight * m_nNumChromaPlanes) : 0; }
+
+    /**
+    *   @brief  This function is used to get the number of frames dropped because the output frame limit was reached.
+    */
+    int GetDroppedFrameCount() { return m_nDroppedFrame; }
+
+    /**
+    *   @brief  This function returns true once a sequence header has been parsed and the output size is known.
+    */
+    bool HasVideoFormat() { return m_nWidth != 0; }
+
 private:
     /**
     *   @brief  Callback function to be registered for getting a callback when decoding of sequence starts
@@ -235,6 +263,16 @@ private:
     */
     int ReconfigureDecoder(CUVIDEOFORMAT *pVideoFormat);
 
+    /**
+    *   @brief  This function frees all unlocked output frames. Frames still locked are freed when unlocked.
+    */
+    void ReleaseFrames();
+
+    /**
+    *   @brief  This function frees a single output frame. Caller must hold m_mtxVPFrame.
+    */
+    void FreeFrame(uint8_t *pFrame);
+
 private:
     CUcontext m_cuContext = NULL;
     CUvideoctxlock m_ctxLock;
@@ -266,6 +304,11 @@ private:
     bool m_bEndDecodeDone = false;
     std::mutex m_mtxVPFrame;
     int m_nFrameAlloc = 0;
+    int m_nMaxFrameAlloc = 0;
+    int m_nDroppedFrame = 0;
+    // output frames of an older size are freed instead of being returned to stock
+    int m_nFrameGeneration = 0;
+    std::unordered_map<uint8_t *, int> m_mFrameGeneration;
     CUstream m_cuvidStream = 0;
     bool m_bDeviceFramePitched = false;
     size_t m_nDeviceFramePitch = 0;
@@ -425,6 +425,52 @@ void NvEncoder::EncodeFrame(std::vector<std::vector<uint8_t>> &vPacket, NV_ENC_P
     }
 }
 
+// NvPipe: application owned input surfaces
+NV_ENC_REGISTERED_PTR NvEncoder::RegisterExternalInput(void *pBuffer, NV_ENC_INPUT_RESOURCE_TYPE eResourceType, int pitch)
+{
+    return RegisterResource(pBuffer, eResourceType, GetEncodeWidth(), GetEncodeHeight(), pitch, GetPixelFormat(), NV_ENC_INPUT_IMAGE);
+}
+
+void NvEncoder::UnregisterExternalInput(NV_ENC_REGISTERED_PTR registeredResource)
+{
+    NVENC_API_CALL(m_nvenc.nvEncUnregisterResource(m_hEncoder, registeredResource));
+}
+
+void NvEncoder::EncodeExternalFrame(NV_ENC_REGISTERED_PTR registeredResource, std::vector<std::vector<uint8_t>> &vPacket, NV_ENC_PIC_PARAMS *pPicParams)
+{
+    vPacket.clear();
+    if (!IsHWEncoderInitialized())
+    {
+        NVENC_THROW_ERROR("Encoder device not found", NV_ENC_ERR_NO_ENCODE_DEVICE);
+    }
+    if (!IsZeroDelay() || m_bMotionEstimationOnly)
+    {
+        NVENC_THROW_ERROR("External input surfaces require a zero delay encoder", NV_ENC_ERR_UNSUPPORTED_PARAM);
+    }
+
+    int bfrIdx = m_iToSend % m_nEncoderBuffer;
+
+    // Mapped like a regular input buffer, so GetEncodedPacket() unmaps it once the frame is output
+    NV_ENC_MAP_INPUT_RESOURCE mapInputResource = { NV_ENC_MAP_INPUT_RESOURCE_VER };
+    mapInputResource.registeredResource = registeredResource;
+    NVENC_API_CALL(m_nvenc.nvEncMapInputResource(m_hEncoder, &mapInputResource));
+    m_vMappedInputBuffers[bfrIdx] = mapInputResource.mappedResource;
+
+    NVENCSTATUS nvStatus = DoEncode(m_vMappedInputBuffers[bfrIdx], m_vBitstreamOutputBuffer[bfrIdx], pPicParams);
+
+    if (nvStatus == NV_ENC_SUCCESS || nvStatus == NV_ENC_ERR_NEED_MORE_INPUT)
+    {
+        m_iToSend++;
+        GetEncodedPacket(m_vBitstreamOutputBuffer, vPacket, true);
+    }
+    else
+    {
+        m_nvenc.nvEncUnmapInputResource(m_hEncoder, m_vMappedInputBuffers[bfrIdx]);
+        m_vMappedInputBuffers[bfrIdx] = nullptr;
+        NVENC_THROW_ERROR("nvEncEncodePicture API failed", nvStatus);
+    }
+}
+
 void NvEncoder::RunMotionEstimation(std::vector<uint8_t> &mvData)
 {
     if (!m_hEncoder)
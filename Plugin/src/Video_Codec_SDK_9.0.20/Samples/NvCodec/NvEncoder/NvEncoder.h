@@ -125,6 +125,25 @@ public:
     */
     void EncodeFrame(std::vector<std::vector<uint8_t>> &vPacket, NV_ENC_PIC_PARAMS *pPicParams = nullptr);
 
+    /**
+    *  @brief  NvPipe: registers an application owned input surface of the current
+    *  encode size and pixel format, to be encoded with EncodeExternalFrame().
+    *  The registration is only valid for this encoder session.
+    */
+    NV_ENC_REGISTERED_PTR RegisterExternalInput(void *pBuffer, NV_ENC_INPUT_RESOURCE_TYPE eResourceType, int pitch);
+
+    /**
+    *  @brief  NvPipe: releases a surface registered with RegisterExternalInput().
+    */
+    void UnregisterExternalInput(NV_ENC_REGISTERED_PTR registeredResource);
+
+    /**
+    *  @brief  NvPipe: encodes an external surface instead of the next input buffer,
+    *  saving the copy into GetNextInputFrame(). Requires a zero delay encoder,
+    *  so the surface is unmapped again and may be reused when this returns.
+    */
+    void EncodeExternalFrame(NV_ENC_REGISTERED_PTR registeredResource, std::vector<std::vector<uint8_t>> &vPacket, NV_ENC_PIC_PARAMS *pPicParams = nullptr);
+
     /**
     *  @brief  This function to flush the encoder queue.
     *  The encoder might be queuing frames for B picture encoding or lookahead;
@@ -12,7 +12,9 @@
 #include <iostream>
 #include "NvEncoder/NvEncoder.h"
 #include <unordered_map>
-#include <GL/glew.h>
+// NvPipe: only core GL 1.1 calls are used here, so NvPipe doesn't need GLEW
+#include <GL/gl.h>
+#include <GL/glext.h>
 
 class NvEncoderGL : public NvEncoder
 {